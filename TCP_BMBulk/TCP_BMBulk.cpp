@@ -0,0 +1,816 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#endif
+
+#include "../TCP_BMCommon/BMProtocol.h"
+#include "../TCP_BMCommon/BMQueue.h"
+#include "../TCP_BMCommon/BMRecords.h"
+
+using namespace std;
+
+// Bulk import and export of the boutique's collections.
+//
+//   TCP_BMBulk import <collection> <file> [options]    CSV or NDJSON records into the server
+//   TCP_BMBulk export <collection> <file|-> [options]  every record out as CSV or NDJSON
+//   TCP_BMBulk generate <collection> <count> <file> [options]  valid test data to import
+//
+// Collections: stitched, unstitched, customers, orders. The input is read in blocks, parsed
+// and validated on several threads and sent as BATCH requests over several connections, so
+// the server checks duplicate IDs and writes each batch with one append. Memory use is set
+// by the number of blocks and batches in flight, not by the size of the file.
+
+const string DEFAULT_HOST = "127.0.0.1";
+const int DEFAULT_PORT = 8080;
+const size_t READ_BLOCK_SIZE = 1024 * 1024;
+const int DEFAULT_BATCH_RECORDS = 1000;
+const int DEFAULT_CONNECTIONS = 4;
+const int DEFAULT_MAX_ERRORS = 20;
+const size_t EXPORT_PAGE = 10000;     // the server's largest VIEW page
+const int BUSY_RETRIES = 50;
+
+struct Collection {
+    string name;
+    int addType;
+    int viewType;
+    const vector<RecordField>& fields;
+
+    // Fields a record sent to the server is made of
+    size_t inputFields() const {
+        return recordInputFields(fields);
+    }
+};
+
+enum class Format {
+    CSV,
+    NDJSON
+};
+
+struct Options {
+    string host = DEFAULT_HOST;
+    int port = DEFAULT_PORT;
+    Format format = Format::CSV;
+    bool formatGiven = false;
+    int batchRecords = DEFAULT_BATCH_RECORDS;
+    int connections = DEFAULT_CONNECTIONS;
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    bool atomic = false;
+    int maxErrors = DEFAULT_MAX_ERRORS;
+    int firstId = 1;
+};
+
+class Collections {
+public:
+    static const vector<Collection>& all() {
+        static const vector<Collection> collections = {
+            { "stitched", ADD_STITCHED_DRESS, VIEW_STITCHED_DRESSES, recordFields(ADD_STITCHED_DRESS) },
+            { "unstitched", ADD_UNSTITCHED_DRESS, VIEW_UNSTITCHED_DRESSES, recordFields(ADD_UNSTITCHED_DRESS) },
+            { "customers", ADD_CUSTOMER, VIEW_CUSTOMERS, recordFields(ADD_CUSTOMER) },
+            { "orders", PROCESS_ORDER, VIEW_ORDERS, recordFields(PROCESS_ORDER) } };
+        return collections;
+    }
+
+    static const Collection* find(const string& name) {
+        for (const Collection& collection : all()) {
+            if (collection.name == name) return &collection;
+        }
+        return nullptr;
+    }
+};
+
+// Turns one input record into the space-separated line the server stores. Fields are checked
+// with the server's own rules (BMRecords.h), so a record passes here exactly when the server
+// would accept it, duplicates and unknown customers or dresses aside.
+class RecordValidator {
+public:
+    // values holds one entry per input field, in schema order; returns "" or why the record
+    // was rejected
+    static string toRecord(const Collection& collection, vector<string>& values, string& record) {
+        record.clear();
+        for (size_t i = 0; i < collection.inputFields(); i++) {
+            const RecordField& field = collection.fields[i];
+            string& value = values[i];
+            while (!value.empty() && isspace(static_cast<unsigned char>(value.back()))) value.pop_back();
+            size_t start = value.find_first_not_of(" \t");
+            value.erase(0, start == string::npos ? value.size() : start);
+            if (value.empty()) {
+                return "missing " + field.name;
+            }
+            if (field.kind == FieldKind::TEXT) {
+                for (char& c : value) {
+                    if (isspace(static_cast<unsigned char>(c))) c = '_';
+                }
+            }
+            string why = checkRecordField(field, value.c_str(), value.size());
+            if (!why.empty()) return why;
+            if (i > 0) record += ' ';
+            record += value;
+        }
+        return "";
+    }
+};
+
+// CSV (RFC 4180 quoting, header row naming the fields) and NDJSON (one JSON object per
+// line). Records never span lines: a quoted CSV field may not contain a line break.
+class RecordParser {
+private:
+    const Collection& collection;
+    Format format;
+    vector<int> columns;              // CSV column -> field index, or -1 for unused columns
+
+    static void appendUtf8(string& out, unsigned code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        }
+        else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    static bool splitCsv(const string& line, vector<string>& cells) {
+        cells.clear();
+        string cell;
+        size_t i = 0;
+        while (true) {
+            cell.clear();
+            if (i < line.size() && line[i] == '"') {
+                i++;
+                while (true) {
+                    if (i >= line.size()) return false;
+                    if (line[i] == '"') {
+                        if (i + 1 < line.size() && line[i + 1] == '"') {
+                            cell += '"';
+                            i += 2;
+                            continue;
+                        }
+                        i++;
+                        break;
+                    }
+                    cell += line[i++];
+                }
+                if (i < line.size() && line[i] != ',') return false;
+            }
+            else {
+                size_t comma = line.find(',', i);
+                cell.assign(line, i, comma == string::npos ? string::npos : comma - i);
+                i = comma == string::npos ? line.size() : comma;
+            }
+            cells.push_back(cell);
+            if (i >= line.size()) return true;
+            i++;
+        }
+    }
+
+    bool parseJsonString(const string& line, size_t& i, string& out) const {
+        out.clear();
+        if (i >= line.size() || line[i] != '"') return false;
+        i++;
+        while (i < line.size() && line[i] != '"') {
+            char c = line[i++];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (i >= line.size()) return false;
+            char escape = line[i++];
+            switch (escape) {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u': {
+                if (i + 4 > line.size()) return false;
+                unsigned code = static_cast<unsigned>(strtoul(line.substr(i, 4).c_str(), nullptr, 16));
+                i += 4;
+                appendUtf8(out, code);
+                break;
+            }
+            default: out += escape; break;
+            }
+        }
+        if (i >= line.size()) return false;
+        i++;
+        return true;
+    }
+
+    string parseJson(const string& line, vector<string>& values) const {
+        auto skipSpace = [&line](size_t& i) {
+            while (i < line.size() && isspace(static_cast<unsigned char>(line[i]))) i++;
+        };
+        size_t i = 0;
+        skipSpace(i);
+        if (i >= line.size() || line[i] != '{') return "expected a JSON object";
+        i++;
+        string key, value;
+        skipSpace(i);
+        if (i < line.size() && line[i] == '}') return "";
+        while (true) {
+            skipSpace(i);
+            if (!parseJsonString(line, i, key)) return "bad JSON key";
+            skipSpace(i);
+            if (i >= line.size() || line[i] != ':') return "expected ':' after \"" + key + "\"";
+            i++;
+            skipSpace(i);
+            if (i < line.size() && line[i] == '"') {
+                if (!parseJsonString(line, i, value)) return "bad JSON string for \"" + key + "\"";
+            }
+            else {
+                size_t end = line.find_first_of(",} \t", i);
+                value.assign(line, i, end == string::npos ? string::npos : end - i);
+                i = end == string::npos ? line.size() : end;
+                if (value == "null" || value == "true" || value == "false" || value.empty()) return "unsupported value for \"" + key + "\"";
+            }
+            for (size_t f = 0; f < collection.inputFields(); f++) {
+                if (collection.fields[f].name == key) values[f] = value;
+            }
+            skipSpace(i);
+            if (i < line.size() && line[i] == ',') {
+                i++;
+                continue;
+            }
+            if (i < line.size() && line[i] == '}') return "";
+            return "expected ',' or '}'";
+        }
+    }
+
+public:
+    RecordParser(const Collection& collection, Format format) : collection(collection), format(format) {}
+
+    // CSV only: maps the header's column names to fields; "" or what is wrong with it
+    string readHeader(const string& line) {
+        vector<string> cells;
+        if (!splitCsv(line, cells)) return "malformed CSV header";
+        columns.assign(cells.size(), -1);
+        vector<bool> seen(collection.fields.size(), false);
+        for (size_t c = 0; c < cells.size(); c++) {
+            string name = cells[c];
+            while (!name.empty() && (name.back() == '\r' || name.back() == ' ')) name.pop_back();
+            if (c == 0 && name.compare(0, 3, "\xEF\xBB\xBF") == 0) name.erase(0, 3);
+            for (size_t f = 0; f < collection.fields.size(); f++) {
+                if (collection.fields[f].name == name) {
+                    columns[c] = static_cast<int>(f);
+                    seen[f] = true;
+                }
+            }
+        }
+        for (size_t f = 0; f < collection.inputFields(); f++) {
+            if (!seen[f]) return "CSV header has no column " + collection.fields[f].name;
+        }
+        return "";
+    }
+
+    // One line of input to a server record; returns "" or why it was rejected
+    string parse(string& line, vector<string>& cells, vector<string>& values, string& record) const {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        values.assign(collection.fields.size(), string());
+        if (format == Format::NDJSON) {
+            string error = parseJson(line, values);
+            if (!error.empty()) return error;
+        }
+        else {
+            if (!splitCsv(line, cells)) return "malformed CSV (unterminated quote)";
+            for (size_t c = 0; c < cells.size() && c < columns.size(); c++) {
+                if (columns[c] >= 0) values[columns[c]].swap(cells[c]);
+            }
+        }
+        return RecordValidator::toRecord(collection, values, record);
+    }
+};
+
+// Writes one record in the output format; fields come from the stored line split on spaces
+class RecordWriter {
+private:
+    const Collection& collection;
+    Format format;
+
+    static bool isNumber(const string& text) {
+        if (text.empty()) return false;
+        char* end = nullptr;
+        strtod(text.c_str(), &end);
+        return end == text.c_str() + text.size() && text.find_first_of("xXnN") == string::npos;
+    }
+
+    static void appendJsonString(string& out, const string& text) {
+        out += '"';
+        for (unsigned char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
+            }
+            else if (c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else {
+                out += static_cast<char>(c);
+            }
+        }
+        out += '"';
+    }
+
+    static void appendCsvCell(string& out, const string& text) {
+        if (text.find_first_of(",\"\r\n") == string::npos) {
+            out += text;
+            return;
+        }
+        out += '"';
+        for (char c : text) {
+            if (c == '"') out += '"';
+            out += c;
+        }
+        out += '"';
+    }
+
+public:
+    RecordWriter(const Collection& collection, Format format) : collection(collection), format(format) {}
+
+    string header() const {
+        if (format == Format::NDJSON) return "";
+        string out;
+        for (size_t f = 0; f < collection.fields.size(); f++) {
+            if (f > 0) out += ',';
+            out += collection.fields[f].name;
+        }
+        return out + "\n";
+    }
+
+    // Lines with more words than fields (typed in by hand with spaces) keep the extra words
+    // in their last field
+    void append(string& out, const string& line) const {
+        vector<string> values;
+        istringstream iss(line);
+        string word;
+        while (iss >> word) {
+            if (values.size() < collection.fields.size()) values.push_back(word);
+            else values.back() += " " + word;
+        }
+        values.resize(collection.fields.size());
+        if (format == Format::CSV) {
+            for (size_t f = 0; f < values.size(); f++) {
+                if (f > 0) out += ',';
+                appendCsvCell(out, values[f]);
+            }
+            out += '\n';
+            return;
+        }
+        out += '{';
+        for (size_t f = 0; f < values.size(); f++) {
+            if (f > 0) out += ',';
+            appendJsonString(out, collection.fields[f].name);
+            out += ':';
+            FieldKind kind = collection.fields[f].kind;
+            bool numeric = kind != FieldKind::TEXT && kind != FieldKind::DRESS_TYPE;
+            if (numeric && isNumber(values[f])) out += values[f];
+            else appendJsonString(out, values[f]);
+        }
+        out += "}\n";
+    }
+};
+
+class Connection {
+private:
+    SOCKET socket = INVALID_SOCKET;
+
+public:
+    ~Connection() {
+        if (socket != INVALID_SOCKET) closesocket(socket);
+    }
+
+    bool open(const string& host, int port) {
+        sockaddr_in serverAddr;
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(static_cast<uint16_t>(port));
+        serverAddr.sin_addr.s_addr = inet_addr(host.c_str());
+        socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        bool connected = socket != INVALID_SOCKET && connect(socket, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) != SOCKET_ERROR;
+        if (connected) {
+            int noDelay = 1;
+            setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        }
+        return connected;
+    }
+
+    bool request(uint16_t type, uint32_t requestId, const string& payload, FrameHeader& header, string& response, uint16_t flags = FRAME_FLAG_NONE) {
+        return sendFrame(socket, type, requestId, payload, flags) && recvFrame(socket, header, response) && header.requestId == requestId;
+    }
+};
+
+class BulkImporter {
+private:
+    struct Block {
+        uint64_t firstLine = 0;
+        string text;
+    };
+
+    struct Batch {
+        string payload;
+        size_t records = 0;
+    };
+
+    struct Rejection {
+        uint64_t line;
+        string reason;
+    };
+
+    const Collection& collection;
+    const Options& options;
+    RecordParser parser;
+    BoundedQueue<Block> blocks;
+    BoundedQueue<Batch> batches;
+    atomic<uint64_t> parsed{ 0 };
+    atomic<uint64_t> imported{ 0 };
+    atomic<uint64_t> invalid{ 0 };
+    atomic<uint64_t> refused{ 0 };
+    atomic<bool> connectionFailed{ false };
+    mutex rejectionMutex;
+    vector<Rejection> rejections;     // the first maxErrors, for the report
+
+    void reject(uint64_t line, const string& reason) {
+        lock_guard<mutex> lock(rejectionMutex);
+        if (rejections.size() < static_cast<size_t>(options.maxErrors)) rejections.push_back({ line, reason });
+    }
+
+    void parseLoop() {
+        Block block;
+        vector<string> cells, values;
+        string line, record;
+        while (blocks.pop(block)) {
+            Batch batch;
+            uint64_t lineNumber = block.firstLine;
+            size_t pos = 0;
+            while (pos < block.text.size()) {
+                size_t end = block.text.find('\n', pos);
+                if (end == string::npos) end = block.text.size();
+                line.assign(block.text, pos, end - pos);
+                pos = end + 1;
+                uint64_t current = lineNumber++;
+                if (line.find_first_not_of(" \t\r") == string::npos) continue;
+                parsed++;
+                string error = parser.parse(line, cells, values, record);
+                if (!error.empty()) {
+                    invalid++;
+                    reject(current, error);
+                    continue;
+                }
+                // The line number is the request id, so the server's answers map back to lines
+                FrameHeader header;
+                header.type = static_cast<uint16_t>(collection.addType);
+                header.requestId = static_cast<uint32_t>(current);
+                header.payloadLength = record.size();
+                size_t offset = batch.payload.size();
+                batch.payload.resize(offset + FRAME_HEADER_SIZE);
+                encodeFrameHeader(header, &batch.payload[offset]);
+                batch.payload += record;
+                if (++batch.records == static_cast<size_t>(options.batchRecords)) {
+                    batches.push(move(batch));
+                    batch = Batch();
+                }
+            }
+            if (batch.records > 0) batches.push(move(batch));
+        }
+    }
+
+    void sendLoop() {
+        Connection connection;
+        if (!connection.open(options.host, options.port)) {
+            cerr << "ERROR: Cannot connect to " << options.host << ":" << options.port << endl;
+            connectionFailed = true;
+            Batch ignored;
+            while (batches.pop(ignored)) refused += ignored.records;
+            return;
+        }
+        Batch batch;
+        uint32_t requestId = 0;
+        FrameHeader header;
+        string response, payload;
+        while (batches.pop(batch)) {
+            bool answered = false;
+            for (int attempt = 0; attempt < BUSY_RETRIES && !answered; attempt++) {
+                if (!connection.request(BATCH, ++requestId, batch.payload, header, response, options.atomic ? FRAME_FLAG_ATOMIC : FRAME_FLAG_NONE)) {
+                    break;
+                }
+                if (header.type == DATA_RESPONSE) {
+                    answered = true;
+                }
+                else if (response.find("busy") != string::npos) {
+                    this_thread::sleep_for(chrono::milliseconds(20 * (attempt + 1)));
+                }
+                else {
+                    reject(0, "batch refused: " + response);
+                    break;
+                }
+            }
+            if (!answered) {
+                refused += batch.records;
+                continue;
+            }
+            size_t pos = 0;
+            FrameHeader result;
+            while (nextBatchFrame(response, pos, result, payload)) {
+                if (result.type == SUCCESS_RESPONSE) {
+                    imported++;
+                }
+                else {
+                    refused++;
+                    reject(result.requestId, payload);
+                }
+            }
+        }
+    }
+
+public:
+    BulkImporter(const Collection& collection, const Options& options)
+        : collection(collection), options(options), parser(collection, options.format),
+          blocks(options.threads * 2), batches(static_cast<size_t>(options.connections) * 2) {}
+
+    bool run(const string& path) {
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) {
+            cerr << "ERROR: Cannot open " << path << endl;
+            return false;
+        }
+        uint64_t nextLine = 1;
+        string carry;
+        if (options.format == Format::CSV) {
+            string header;
+            getline(in, header);
+            string error = parser.readHeader(header);
+            if (!error.empty()) {
+                cerr << "ERROR: " << path << ": " << error << endl;
+                return false;
+            }
+            nextLine = 2;
+        }
+        auto start = chrono::steady_clock::now();
+        vector<thread> senders, parsers;
+        for (int i = 0; i < options.connections; i++) senders.emplace_back(&BulkImporter::sendLoop, this);
+        for (unsigned i = 0; i < options.threads; i++) parsers.emplace_back(&BulkImporter::parseLoop, this);
+
+        // Cut the input into blocks of whole lines
+        vector<char> chunk(READ_BLOCK_SIZE);
+        while (!connectionFailed && (in.read(chunk.data(), chunk.size()) || in.gcount() > 0)) {
+            Block block;
+            block.firstLine = nextLine;
+            block.text.swap(carry);
+            block.text.append(chunk.data(), static_cast<size_t>(in.gcount()));
+            size_t lastNewline = block.text.rfind('\n');
+            if (lastNewline == string::npos) {
+                carry.swap(block.text);
+                continue;
+            }
+            carry.assign(block.text, lastNewline + 1, string::npos);
+            block.text.resize(lastNewline + 1);
+            nextLine += count(block.text.begin(), block.text.end(), '\n');
+            blocks.push(move(block));
+        }
+        if (!carry.empty()) blocks.push(Block{ nextLine, move(carry) });
+        blocks.close();
+        for (auto& worker : parsers) worker.join();
+        batches.close();
+        for (auto& worker : senders) worker.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        sort(rejections.begin(), rejections.end(), [](const Rejection& a, const Rejection& b) { return a.line < b.line; });
+        for (const Rejection& rejection : rejections) {
+            cerr << (rejection.line ? "line " + to_string(rejection.line) + ": " : "") << rejection.reason << "\n";
+        }
+        uint64_t failures = invalid + refused;
+        if (failures > rejections.size()) {
+            cerr << "... " << failures - rejections.size() << " more rejected records not shown\n";
+        }
+        cout << "Imported " << imported << " of " << parsed << " " << collection.name << " records in " << fixed << setprecision(2)
+            << seconds << " s (" << setprecision(0) << imported / max(seconds, 1e-9) << " records/sec); "
+            << invalid << " invalid, " << refused << " refused by the server\n";
+        return failures == 0 && !connectionFailed;
+    }
+};
+
+class BulkExporter {
+public:
+    // Pages through the collection with VIEW cursors, writing each page before the next is
+    // fetched
+    static bool run(const Collection& collection, const string& path, const Options& options) {
+        bool toStdout = path == "-";
+        ofstream file;
+        if (!toStdout) {
+            file.open(path, ios::binary | ios::trunc);
+            if (!file.is_open()) {
+                cerr << "ERROR: Cannot write " << path << endl;
+                return false;
+            }
+        }
+        ostream& out = toStdout ? cout : file;
+        ostream& status = toStdout ? cerr : cout;
+        Connection connection;
+        if (!connection.open(options.host, options.port)) {
+            cerr << "ERROR: Cannot connect to " << options.host << ":" << options.port << endl;
+            return false;
+        }
+        RecordWriter writer(collection, options.format);
+        out << writer.header();
+        auto start = chrono::steady_clock::now();
+        string cursor, response, text;
+        FrameHeader header;
+        uint64_t exported = 0;
+        uint32_t requestId = 0;
+        while (true) {
+            string request = to_string(EXPORT_PAGE) + (cursor.empty() ? "" : " " + cursor);
+            if (!connection.request(static_cast<uint16_t>(collection.viewType), ++requestId, request, header, response)) {
+                cerr << "ERROR: Lost the connection after " << exported << " records" << endl;
+                return false;
+            }
+            if (header.type == ERROR_RESPONSE) {
+                cerr << response << endl;
+                return false;
+            }
+            // Listing lines are "N. <record>"; everything else is heading, footer or cursor
+            text.clear();
+            cursor.clear();
+            size_t pos = 0;
+            while (pos < response.size()) {
+                size_t end = response.find('\n', pos);
+                if (end == string::npos) end = response.size();
+                size_t digits = pos;
+                while (digits < end && isdigit(static_cast<unsigned char>(response[digits]))) digits++;
+                if (digits > pos && response.compare(digits, 2, ". ") == 0) {
+                    writer.append(text, response.substr(digits + 2, end - digits - 2));
+                    exported++;
+                }
+                else if (response.compare(pos, strlen(VIEW_MORE_MARKER), VIEW_MORE_MARKER) == 0) {
+                    cursor = response.substr(pos + strlen(VIEW_MORE_MARKER), end - pos - strlen(VIEW_MORE_MARKER));
+                }
+                pos = end + 1;
+            }
+            out << text;
+            if (!(header.flags & FRAME_FLAG_MORE) || cursor.empty()) break;
+        }
+        out.flush();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        status << "Exported " << exported << " " << collection.name << " records in " << fixed << setprecision(2) << seconds
+            << " s (" << setprecision(0) << exported / max(seconds, 1e-9) << " records/sec)\n";
+        return static_cast<bool>(out);
+    }
+};
+
+// Valid records for trying out or measuring an import. Orders refer to customers and dresses
+// 1 .. 1000 (unstitched), which have to exist already.
+class TestDataGenerator {
+public:
+    static bool run(const Collection& collection, uint64_t count, const string& path, const Options& options) {
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            cerr << "ERROR: Cannot write " << path << endl;
+            return false;
+        }
+        RecordWriter writer(collection, options.format);
+        out << writer.header();
+        mt19937 rng(17);
+        const char* colors[] = { "Red", "Blue", "Green", "Black", "Ivory", "Maroon" };
+        const char* materials[] = { "Cotton", "Silk", "Lawn", "Chiffon", "Linen" };
+        const char* cities[] = { "Lahore", "Karachi", "Islamabad", "Multan" };
+        string text, line;
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t id = options.firstId + i;
+            ostringstream oss;
+            oss << fixed << setprecision(2);
+            if (collection.addType == ADD_CUSTOMER) {
+                oss << id << " Customer_" << id << " " << 18 + rng() % 60 << " 0300" << 1000000 + rng() % 9000000 << " Street_" << rng() % 200
+                    << " " << cities[rng() % 4] << " Punjab Pakistan";
+            }
+            else if (collection.addType == PROCESS_ORDER) {
+                oss << id << " " << 1 + rng() % 1000 << " " << 1 + rng() % 1000 << " U " << 1 + rng() % 5;
+            }
+            else {
+                double price = 1000 + rng() % 9000;
+                oss << id << " Dress_" << id << " " << price << " " << colors[rng() % 6] << " " << materials[rng() % 5] << " Brand_" << rng() % 50
+                    << " S M L " << price * 0.8;
+                if (collection.addType == ADD_STITCHED_DRESS) oss << " Embroidered Sequins Regular Full";
+                else oss << " 44in Good Straight 3m";
+            }
+            writer.append(text, oss.str());
+            if (text.size() >= READ_BLOCK_SIZE) {
+                out << text;
+                text.clear();
+            }
+        }
+        out << text;
+        cout << "Wrote " << count << " " << collection.name << " records to " << path << "\n";
+        return static_cast<bool>(out);
+    }
+};
+
+void printUsage() {
+    cerr << "Usage:\n"
+        << "  TCP_BMBulk import <collection> <file> [--format csv|ndjson] [--batch N] [--connections N] [--threads N] [--atomic] [--max-errors N]\n"
+        << "  TCP_BMBulk export <collection> <file|-> [--format csv|ndjson]\n"
+        << "  TCP_BMBulk generate <collection> <count> <file> [--format csv|ndjson] [--first-id N]\n"
+        << "Collections: stitched, unstitched, customers, orders. Every command takes --host <IPv4 address> --port P.\n"
+        << "The format defaults to the file extension (.ndjson/.jsonl or CSV).\n";
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        printUsage();
+        return 1;
+    }
+    string command = argv[1];
+    const Collection* collection = Collections::find(argv[2]);
+    if (collection == nullptr) {
+        cerr << "Unknown collection " << argv[2] << endl;
+        printUsage();
+        return 1;
+    }
+    vector<string> positional;
+    Options options;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--host" && hasValue) options.host = argv[++i];
+        else if (arg == "--port" && hasValue) options.port = stoi(argv[++i]);
+        else if (arg == "--batch" && hasValue) options.batchRecords = max(1, stoi(argv[++i]));
+        else if (arg == "--connections" && hasValue) options.connections = max(1, stoi(argv[++i]));
+        else if (arg == "--threads" && hasValue) options.threads = max(1, stoi(argv[++i]));
+        else if (arg == "--max-errors" && hasValue) options.maxErrors = max(0, stoi(argv[++i]));
+        else if (arg == "--first-id" && hasValue) options.firstId = max(1, stoi(argv[++i]));
+        else if (arg == "--atomic") options.atomic = true;
+        else if (arg == "--format" && hasValue) {
+            string format = argv[++i];
+            if (format != "csv" && format != "ndjson") {
+                cerr << "Unknown format " << format << " (expected csv or ndjson)" << endl;
+                return 1;
+            }
+            options.format = format == "csv" ? Format::CSV : Format::NDJSON;
+            options.formatGiven = true;
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            cerr << "Unknown option " << arg << endl;
+            printUsage();
+            return 1;
+        }
+        else positional.push_back(arg);
+    }
+    size_t needed = command == "generate" ? 2 : 1;
+    if (positional.size() != needed) {
+        printUsage();
+        return 1;
+    }
+    const string& path = positional.back();
+    if (!options.formatGiven) {
+        size_t dot = path.rfind('.');
+        string extension = dot == string::npos ? "" : path.substr(dot);
+        options.format = extension == ".ndjson" || extension == ".jsonl" ? Format::NDJSON : Format::CSV;
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "WSAStartup failed" << endl;
+        return 1;
+    }
+#endif
+    bool ok = false;
+    if (command == "import") {
+        BulkImporter importer(*collection, options);
+        ok = importer.run(path);
+    }
+    else if (command == "export") {
+        ok = BulkExporter::run(*collection, path, options);
+    }
+    else if (command == "generate") {
+        ok = TestDataGenerator::run(*collection, stoull(positional[0]), path, options);
+    }
+    else {
+        printUsage();
+    }
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return ok ? 0 : 1;
+}
@@ -7,6 +7,12 @@
 #include <fstream>
 #include <vector>
 #include <filesystem>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <future>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -16,116 +22,373 @@
 #error "This program is designed for Windows only!"
 #endif
 
-using namespace std;
+#include "../TCP_BMCommon/BMProtocol.h"
+#include "../TCP_BMCommon/BMChecksum.h"
+#include "../TCP_BMCommon/BMClient.h"
 
-// Base64 encoding/decoding utility
-std::string base64_encode(const std::string& in) {
-    std::string out;
-    int val = 0, valb = -6;
-    for (unsigned char c : in) {
-        val = (val << 8) + c;
-        valb += 8;
-        while (valb >= 0) {
-            out.push_back("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
-    }
-    if (valb > -6) out.push_back("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[((val << 8) >> (valb + 8)) & 0x3F]);
-    while (out.size() % 4) out.push_back('=');
-    return out;
-}
-
-std::string base64_decode(const std::string& in) {
-    std::string out;
-    std::vector<int> T(256, -1);
-    for (int i = 0; i < 64; i++) T["ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[i]] = i;
-    int val = 0, valb = -8;
-    for (unsigned char c : in) {
-        if (T[c] == -1) break;
-        val = (val << 6) + T[c];
-        valb += 6;
-        if (valb >= 0) {
-            out.push_back(char((val >> valb) & 0xFF));
-            valb -= 8;
-        }
-    }
-    return out;
-}
+using namespace std;
 
 // Protocol constants
-const int BUFFER_SIZE = 16384; // Increased to handle 8.05 KB image (~11 KB Base64-encoded)
 const int SERVER_PORT = 8080;
 const string SERVER_IP = "127.0.0.1";
+const int VIEW_PAGE_SIZE = 50;
+const size_t UPLOAD_CHUNK_SIZE = 64 * 1024;
+const uint64_t UPLOAD_PART_SIZE = 4 * 1024 * 1024;
+const int UPLOAD_CONNECTIONS = 4;
+const int UPLOAD_ATTEMPTS = 3;
+const int RECONNECT_ATTEMPTS = 5;
+const chrono::milliseconds RECONNECT_BASE_DELAY(200);
+const chrono::milliseconds RECONNECT_MAX_DELAY(5000);
+const chrono::milliseconds CONNECT_TIMEOUT(3000);
 
-// Message types
-enum MessageType {
-    ADD_STITCHED_DRESS = 1,
-    ADD_UNSTITCHED_DRESS = 2,
-    VIEW_STITCHED_DRESSES = 3,
-    VIEW_UNSTITCHED_DRESSES = 4,
-    SEARCH_STITCHED_DRESS = 5,
-    SEARCH_UNSTITCHED_DRESS = 6,
-    COUNT_STITCHED_DRESSES = 9,
-    COUNT_UNSTITCHED_DRESSES = 10,
-    ADD_CUSTOMER = 11,
-    VIEW_CUSTOMERS = 12,
-    SEARCH_CUSTOMER = 13,
-    COUNT_CUSTOMERS = 15,
-    PROCESS_ORDER = 16,
-    VIEW_ORDERS = 17,
-    SEARCH_ORDER = 18,
-    SEND_IMAGE = 19,
-    CONVERT_TO_UPPERCASE = 20
-};
 
 class TCPClient {
 private:
     SOCKET clientSocket;
     struct sockaddr_in serverAddr;
+    uint32_t nextRequestId;
+    map<pair<string, string>, string> downloadTags; // (image name, local path) -> ETag of the downloaded copy
 
-    string sendRequest(int messageType, const string& data) {
-        string message = to_string(messageType) + "|" + data;
-        int bytesSent = send(clientSocket, message.c_str(), message.length(), 0);
-        if (bytesSent == SOCKET_ERROR) {
-            return "ERROR: Failed to send request to server";
+    string sendRequest(int messageType, const string& data, uint16_t* flags = nullptr) {
+        uint32_t requestId = nextRequestId++;
+        if (!sendFrame(clientSocket, static_cast<uint16_t>(messageType), requestId, data)) {
+            return "ERROR: Failed to send request to server" + reconnect();
         }
-        char buffer[BUFFER_SIZE];
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytesReceived == SOCKET_ERROR) {
-            return "ERROR: Failed to receive response from server";
+        FrameHeader header;
+        string response;
+        if (!recvFrame(clientSocket, header, response) || header.requestId != requestId) {
+            return "ERROR: Failed to receive response from server" + reconnect();
         }
-        return string(buffer);
+        if (flags != nullptr) *flags = header.flags;
+        return response;
     }
 
-    bool sendImage(const string& filepath, const string& imageName) {
+    // Replaces a broken connection, waiting a little longer after each failed attempt. The
+    // request that failed is not resent, since the server may already have applied it.
+    string reconnect() {
+        closesocket(clientSocket);
+        clientSocket = INVALID_SOCKET;
+        Backoff backoff(RECONNECT_BASE_DELAY, RECONNECT_MAX_DELAY);
+        string error;
+        for (int attempt = 0; attempt < RECONNECT_ATTEMPTS; attempt++) {
+            if (attempt > 0) this_thread::sleep_for(backoff.next());
+            clientSocket = connectTo(SERVER_IP, SERVER_PORT, CONNECT_TIMEOUT, error);
+            if (clientSocket != INVALID_SOCKET) {
+                return " (reconnected; please check whether it was applied and retry)";
+            }
+        }
+        return " (" + error + " after " + to_string(RECONNECT_ATTEMPTS) + " attempts)";
+    }
+
+    // Shows a VIEW_* listing, or the matches of a FILTER with the given conditions,
+    // VIEW_PAGE_SIZE records at a time, fetching the next page on request
+    void viewPaged(int messageType, const string& title, const string& conditions = "") {
+        cout << "\n" << title << ":\n";
+        string cursor;
+        while (true) {
+            uint16_t flags = FRAME_FLAG_NONE;
+            string request;
+            if (messageType == FILTER) {
+                request = conditions + " limit=" + to_string(VIEW_PAGE_SIZE);
+                if (!cursor.empty()) request += " cursor=" + cursor;
+            }
+            else {
+                request = to_string(VIEW_PAGE_SIZE);
+                if (!cursor.empty()) request += " " + cursor;
+            }
+            string response = sendRequest(messageType, request, &flags);
+            if (!(flags & FRAME_FLAG_MORE)) {
+                cout << response << endl;
+                return;
+            }
+            size_t marker = response.rfind(VIEW_MORE_MARKER);
+            if (marker == string::npos) {
+                cout << response << endl;
+                return;
+            }
+            cursor = response.substr(marker + strlen(VIEW_MORE_MARKER));
+            while (!cursor.empty() && (cursor.back() == '\n' || cursor.back() == '\r')) cursor.pop_back();
+            cout << response.substr(0, marker);
+            cout << "Press Enter for the next page, or q to stop: ";
+            string answer;
+            getline(cin, answer);
+            if (!answer.empty() && (answer[0] == 'q' || answer[0] == 'Q')) {
+                return;
+            }
+        }
+    }
+
+    // Asks for FILTER conditions (any left empty are not used) and pages through the matches
+    void filterDresses(bool isStitched) {
+        string conditions = isStitched ? "stitched" : "unstitched";
+        const pair<const char*, const char*> prompts[] = {
+            { "color", "Color(s), comma-separated" }, { "material", "Material(s), comma-separated" },
+            { "brand", "Brand(s), comma-separated" }, { "size", "Size(s), comma-separated" },
+            { "minPrice", "Minimum actual price" }, { "maxPrice", "Maximum actual price" },
+            { "minDiscounted", "Minimum discounted price" }, { "maxDiscounted", "Maximum discounted price" }
+        };
+        cout << "\nFilter Dresses (press Enter to skip a condition):\n";
+        bool any = false;
+        for (const auto& prompt : prompts) {
+            cout << prompt.second << ": ";
+            string value;
+            getline(cin, value);
+            for (char& c : value) {
+                if (c == ' ') c = '_';
+            }
+            if (!value.empty()) {
+                conditions += string(" ") + prompt.first + "=" + value;
+                any = true;
+            }
+        }
+        if (!any) {
+            cout << "No conditions given; use View All to list every dress.\n";
+            return;
+        }
+        viewPaged(FILTER, isStitched ? "Matching Stitched Dresses" : "Matching Unstitched Dresses", conditions);
+    }
+
+    // SEARCH_TEXT over collection; the server ranks the closest matches first
+    void searchText(const string& collection, const string& prompt) {
+        cout << prompt << ": ";
+        string words;
+        getline(cin, words);
+        string response = sendRequest(SEARCH_TEXT, collection + " " + words);
+        cout << "\n" << response << endl;
+    }
+
+    // Opens another connection to the server, e.g. for parallel upload parts
+    SOCKET openConnection() {
+        SOCKET connection = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (connection == INVALID_SOCKET) {
+            return INVALID_SOCKET;
+        }
+        if (connect(connection, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+            closesocket(connection);
+            return INVALID_SOCKET;
+        }
+        return connection;
+    }
+
+    // CRC32C (checked by the server before it stores an upload) and SHA-256 (the name of the
+    // contents in the server's image store) in one pass over the file
+    static bool fileChecksums(const string& filepath, uint32_t& crc, string& sha256) {
         ifstream file(filepath, ios::binary);
         if (!file.is_open()) {
+            return false;
+        }
+        vector<char> chunk(UPLOAD_CHUNK_SIZE);
+        Sha256 hash;
+        crc = 0;
+        while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0) {
+            crc = crc32c(crc, chunk.data(), static_cast<size_t>(file.gcount()));
+            hash.update(chunk.data(), static_cast<size_t>(file.gcount()));
+        }
+        sha256 = hash.hexDigest();
+        return file.eof();
+    }
+
+    // Value of "key=value" in an upload reply
+    static string uploadField(const string& response, const string& key) {
+        size_t pos = response.find(" " + key + "=");
+        if (pos == string::npos) {
+            return "";
+        }
+        pos += key.size() + 2;
+        return response.substr(pos, response.find(' ', pos) - pos);
+    }
+
+    // Expands "0-3,7" into part numbers; "none" is empty
+    static vector<uint64_t> parseParts(const string& ranges) {
+        vector<uint64_t> parts;
+        if (ranges == "none") {
+            return parts;
+        }
+        stringstream ss(ranges);
+        string range;
+        while (getline(ss, range, ',')) {
+            size_t dash = range.find('-');
+            uint64_t first = stoull(range.substr(0, dash));
+            uint64_t last = dash == string::npos ? first : stoull(range.substr(dash + 1));
+            for (uint64_t part = first; part <= last; part++) parts.push_back(part);
+        }
+        return parts;
+    }
+
+    // Sends one part on its own connection and waits for the server to confirm it
+    static bool sendPart(SOCKET connection, ifstream& file, const string& uploadId, uint64_t part, uint64_t partSize, uint64_t size) {
+        uint64_t offset = part * partSize;
+        vector<char> body(static_cast<size_t>(min(partSize, size - offset)));
+        file.clear();
+        file.seekg(static_cast<streamoff>(offset));
+        if (!file.read(body.data(), body.size()) && !body.empty()) {
+            return false;
+        }
+        ostringstream prefix;
+        prefix << uploadId << " " << part << " " << hex << crc32c(0, body.data(), body.size()) << "|";
+        FrameHeader header;
+        header.type = UPLOAD_PART;
+        header.requestId = static_cast<uint32_t>(part);
+        header.payloadLength = prefix.str().size() + body.size();
+        char headerBytes[FRAME_HEADER_SIZE];
+        encodeFrameHeader(header, headerBytes);
+        string head = string(headerBytes, FRAME_HEADER_SIZE) + prefix.str();
+        if (!sendAll(connection, head.data(), head.size()) || !sendAll(connection, body.data(), body.size())) {
+            return false;
+        }
+        string response;
+        return recvFrame(connection, header, response) && response.rfind("SUCCESS", 0) == 0;
+    }
+
+    // Asks the server to store the image from contents it already has (LINK_IMAGE); only if
+    // it does not, uploads the file in UPLOAD_PART_SIZE parts over up to UPLOAD_CONNECTIONS connections.
+    // The server keeps the upload, so after a failure (or a restart of either side) only the
+    // parts it does not have are sent again. The image is committed once the server has
+    // checked its CRC32C.
+    bool sendImage(const string& filepath, const string& imageName) {
+        ifstream probe(filepath, ios::binary | ios::ate);
+        if (!probe.is_open()) {
             cout << "ERROR: Cannot open file " << filepath << endl;
             return false;
         }
-        string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-        file.close();
-        cout << "Sending image " << imageName << " (size: " << data.size() << " bytes)" << endl;
-        string encodedData = base64_encode(data);
-        ostringstream oss;
-        oss << imageName << "|" << encodedData;
-        string message = to_string(SEND_IMAGE) + "|" + oss.str();
-        int bytesSent = send(clientSocket, message.c_str(), message.length(), 0);
-        if (bytesSent == SOCKET_ERROR) {
-            cout << "ERROR: Failed to send image" << endl;
+        uint64_t size = static_cast<uint64_t>(probe.tellg());
+        probe.close();
+        uint32_t crc;
+        string sha256;
+        if (!fileChecksums(filepath, crc, sha256)) {
+            cout << "ERROR: Failed to read " << filepath << endl;
             return false;
         }
-        char buffer[BUFFER_SIZE];
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytesReceived == SOCKET_ERROR) {
-            cout << "ERROR: Failed to receive response" << endl;
+        string response = sendRequest(LINK_IMAGE, imageName + " " + sha256);
+        if (response.rfind("SUCCESS", 0) == 0) {
+            cout << "Server Response: " << response << endl;
+            return true;
+        }
+        ostringstream begin;
+        begin << imageName << " " << size << " " << hex << crc << dec << " " << UPLOAD_PART_SIZE;
+        response = sendRequest(UPLOAD_BEGIN, begin.str());
+        if (response.rfind("SUCCESS", 0) != 0) {
+            cout << "Server Response: " << response << endl;
             return false;
         }
-        string response(buffer);
+        string uploadId;
+        istringstream(response.substr(strlen("SUCCESS: Upload "))) >> uploadId;
+        uint64_t partSize = stoull(uploadField(response, "partSize"));
+        cout << "Sending image " << imageName << " (size: " << size << " bytes, resuming at byte "
+             << uploadField(response, "resumeOffset") << ")" << endl;
+        for (int attempt = 0; attempt < UPLOAD_ATTEMPTS; attempt++) {
+            vector<uint64_t> missing = parseParts(uploadField(response, "missing"));
+            if (missing.empty()) {
+                break;
+            }
+            atomic<size_t> next(0);
+            atomic<size_t> sent(0);
+            vector<thread> workers;
+            int connections = static_cast<int>(min<size_t>(UPLOAD_CONNECTIONS, missing.size()));
+            for (int i = 0; i < connections; i++) {
+                workers.emplace_back([&]() {
+                    SOCKET connection = openConnection();
+                    ifstream file(filepath, ios::binary);
+                    if (connection == INVALID_SOCKET || !file.is_open()) {
+                        if (connection != INVALID_SOCKET) closesocket(connection);
+                        return;
+                    }
+                    for (size_t index = next++; index < missing.size(); index = next++) {
+                        if (!sendPart(connection, file, uploadId, missing[index], partSize, size)) {
+                            break;
+                        }
+                        sent++;
+                    }
+                    closesocket(connection);
+                });
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+            cout << "Sent " << sent.load() << " of " << missing.size() << " parts" << endl;
+            response = sendRequest(UPLOAD_STATUS, uploadId);
+            if (response.rfind("SUCCESS", 0) != 0) {
+                cout << "Server Response: " << response << endl;
+                return false;
+            }
+        }
+        if (uploadField(response, "missing") != "none") {
+            cout << "ERROR: Upload incomplete, run it again to resume (" << response << ")" << endl;
+            return false;
+        }
+        response = sendRequest(UPLOAD_COMMIT, uploadId);
         cout << "Server Response: " << response << endl;
-        return response.find("SUCCESS") != string::npos;
+        return response.rfind("SUCCESS", 0) == 0;
+    }
+
+    // Fetches an image (GET_IMAGE) into filepath, streaming it to disk. If this client has
+    // downloaded the image to the same path before, the server is asked for it only if it
+    // has changed since. A thumbnailSize fetches that thumbnail (GET_THUMBNAIL) instead.
+    bool downloadImage(const string& imageName, const string& filepath, int thumbnailSize = 0) {
+        string request = thumbnailSize ? imageName + "|" + to_string(thumbnailSize) : imageName;
+        string tagKey = thumbnailSize ? imageName + "@" + to_string(thumbnailSize) : imageName;
+        auto known = downloadTags.find(make_pair(tagKey, filepath));
+        if (known != downloadTags.end() && filesystem::exists(filepath)) {
+            request += "|" + known->second;
+        }
+        uint32_t requestId = nextRequestId++;
+        char headerBytes[FRAME_HEADER_SIZE];
+        if (!sendFrame(clientSocket, thumbnailSize ? GET_THUMBNAIL : GET_IMAGE, requestId, request) || !recvAll(clientSocket, headerBytes, FRAME_HEADER_SIZE)) {
+            cout << "ERROR: Failed to communicate with server" << endl;
+            return false;
+        }
+        FrameHeader header = decodeFrameHeader(headerBytes);
+        if (header.type != DATA_RESPONSE) {
+            string response(static_cast<size_t>(header.payloadLength), '\0');
+            if (!response.empty() && !recvAll(clientSocket, &response[0], response.size())) {
+                cout << "ERROR: Failed to receive response" << endl;
+                return false;
+            }
+            if (header.flags & FRAME_FLAG_NOT_MODIFIED) {
+                cout << "Image " << imageName << " is unchanged, " << filepath << " is up to date" << endl;
+                return true;
+            }
+            cout << "Server Response: " << response << endl;
+            return false;
+        }
+        // "SUCCESS: Image <name> size=<bytes> etag=<etag>\n", then the image
+        string head;
+        uint64_t remaining = header.payloadLength;
+        char c;
+        while (remaining > 0 && recvAll(clientSocket, &c, 1)) {
+            remaining--;
+            if (c == '\n') break;
+            head += c;
+        }
+        string tempPath = filepath + ".part";
+        ofstream file(tempPath, ios::binary | ios::trunc);
+        vector<char> chunk(UPLOAD_CHUNK_SIZE);
+        bool received = true;
+        while (received && remaining > 0) {
+            size_t take = static_cast<size_t>(min<uint64_t>(remaining, chunk.size()));
+            received = recvAll(clientSocket, chunk.data(), take);
+            file.write(chunk.data(), take);
+            remaining -= take;
+        }
+        file.close();
+        if (!received || !file) {
+            filesystem::remove(tempPath);
+            cout << "ERROR: Failed to download image " << imageName << endl;
+            return false;
+        }
+        error_code ec;
+        filesystem::rename(tempPath, filepath, ec);
+        if (ec) {
+            cout << "ERROR: Cannot write " << filepath << ": " << ec.message() << endl;
+            return false;
+        }
+        size_t tag = head.find(" etag=");
+        if (tag != string::npos) {
+            downloadTags[make_pair(tagKey, filepath)] = head.substr(tag + 6);
+        }
+        cout << "Server Response: " << head << endl;
+        cout << "Saved to " << filepath << endl;
+        return true;
     }
 
     void clearInputBuffer() {
@@ -351,7 +614,8 @@ private:
             cout << "╠═══════════════════════════════════════╣\n";
             cout << "║ 1. Stitched Dress Management           ║\n";
             cout << "║ 2. Unstitched Dress Management         ║\n";
-            cout << "║ 3. Back to Main Menu                   ║\n";
+            cout << "║ 3. Find Dresses by Name or Brand       ║\n";
+            cout << "║ 4. Back to Main Menu                   ║\n";
             cout << "╚═══════════════════════════════════════╝\n";
             cout << "\nEnter your choice: ";
             int dresschoice;
@@ -368,9 +632,13 @@ private:
                 displayUnstitchedDressMenu();
                 break;
             case 3:
+                clearInputBuffer();
+                searchText("dresses", "Dress name or brand");
+                break;
+            case 4:
                 return;
             default:
-                cout << "Invalid choice! Please select 1-3.\n";
+                cout << "Invalid choice! Please select 1-4.\n";
             }
         }
     }
@@ -384,7 +652,8 @@ private:
             cout << "║ 2. View All Stitched Dresses           ║\n";
             cout << "║ 3. Search Stitched Dress               ║\n";
             cout << "║ 4. Count Stitched Dresses              ║\n";
-            cout << "║ 5. Back to Dresses Menu                ║\n";
+            cout << "║ 5. Filter Stitched Dresses             ║\n";
+            cout << "║ 6. Back to Dresses Menu                ║\n";
             cout << "╚═══════════════════════════════════════╝\n";
             cout << "\nEnter your choice: ";
             int choice;
@@ -402,8 +671,8 @@ private:
                 break;
             }
             case 2:
-                response = sendRequest(VIEW_STITCHED_DRESSES, "");
-                cout << "\nStitched Dresses:\n" << response << endl;
+                clearInputBuffer();
+                viewPaged(VIEW_STITCHED_DRESSES, "Stitched Dresses");
                 break;
             case 3: {
                 cout << "Enter Dress ID to search: ";
@@ -418,9 +687,13 @@ private:
                 cout << "\nTotal Stitched Dresses: " << response << endl;
                 break;
             case 5:
+                clearInputBuffer();
+                filterDresses(true);
+                break;
+            case 6:
                 return;
             default:
-                cout << "Invalid choice! Please select 1-5.\n";
+                cout << "Invalid choice! Please select 1-6.\n";
             }
         }
     }
@@ -434,7 +707,8 @@ private:
             cout << "║ 2. View All Unstitched Dresses         ║\n";
             cout << "║ 3. Search Unstitched Dress             ║\n";
             cout << "║ 4. Count Unstitched Dresses            ║\n";
-            cout << "║ 5. Back to Dresses Menu                ║\n";
+            cout << "║ 5. Filter Unstitched Dresses           ║\n";
+            cout << "║ 6. Back to Dresses Menu                ║\n";
             cout << "╚═══════════════════════════════════════╝\n";
             cout << "\nEnter your choice: ";
             int choice;
@@ -452,8 +726,8 @@ private:
                 break;
             }
             case 2:
-                response = sendRequest(VIEW_UNSTITCHED_DRESSES, "");
-                cout << "\nUnstitched Dresses:\n" << response << endl;
+                clearInputBuffer();
+                viewPaged(VIEW_UNSTITCHED_DRESSES, "Unstitched Dresses");
                 break;
             case 3: {
                 cout << "Enter Dress ID to search: ";
@@ -468,9 +742,13 @@ private:
                 cout << "\nTotal Unstitched Dresses: " << response << endl;
                 break;
             case 5:
+                clearInputBuffer();
+                filterDresses(false);
+                break;
+            case 6:
                 return;
             default:
-                cout << "Invalid choice! Please select 1-5.\n";
+                cout << "Invalid choice! Please select 1-6.\n";
             }
         }
     }
@@ -484,7 +762,8 @@ private:
             cout << "║ 2. View All Customers                  ║\n";
             cout << "║ 3. Search Customer                     ║\n";
             cout << "║ 4. Count Customers                     ║\n";
-            cout << "║ 5. Back to Main Menu                   ║\n";
+            cout << "║ 5. Find Customer by Name or Address    ║\n";
+            cout << "║ 6. Back to Main Menu                   ║\n";
             cout << "╚═══════════════════════════════════════╝\n";
             cout << "\nEnter your choice: ";
             int choice;
@@ -502,8 +781,8 @@ private:
                 break;
             }
             case 2:
-                response = sendRequest(VIEW_CUSTOMERS, "");
-                cout << "\nCustomers:\n" << response << endl;
+                clearInputBuffer();
+                viewPaged(VIEW_CUSTOMERS, "Customers");
                 break;
             case 3: {
                 cout << "Enter Customer ID to search: ";
@@ -518,9 +797,13 @@ private:
                 cout << "\nTotal Customers: " << response << endl;
                 break;
             case 5:
+                clearInputBuffer();
+                searchText("customers", "Name or address (spelling need not be exact)");
+                break;
+            case 6:
                 return;
             default:
-                cout << "Invalid choice! Please select 1-5.\n";
+                cout << "Invalid choice! Please select 1-6.\n";
             }
         }
     }
@@ -533,7 +816,8 @@ private:
             cout << "║ 1. Process New Order                   ║\n";
             cout << "║ 2. View All Orders                     ║\n";
             cout << "║ 3. Search Order                        ║\n";
-            cout << "║ 4. Back to Main Menu                   ║\n";
+            cout << "║ 4. Sales Reports                       ║\n";
+            cout << "║ 5. Back to Main Menu                   ║\n";
             cout << "╚═══════════════════════════════════════╝\n";
             cout << "\nEnter your choice: ";
             int choice;
@@ -551,8 +835,8 @@ private:
                 break;
             }
             case 2:
-                response = sendRequest(VIEW_ORDERS, "");
-                cout << "\nOrders:\n" << response << endl;
+                clearInputBuffer();
+                viewPaged(VIEW_ORDERS, "Orders");
                 break;
             case 3: {
                 cout << "Enter Order ID to search: ";
@@ -563,10 +847,91 @@ private:
                 break;
             }
             case 4:
+                displaySalesReportMenu();
+                break;
+            case 5:
                 return;
             default:
-                cout << "Invalid choice! Please select 1-4.\n";
+                cout << "Invalid choice! Please select 1-5.\n";
+            }
+        }
+    }
+
+    // REPORT requests; the server answers them from running totals, so none of them waits on
+    // a scan of the orders
+    void displaySalesReportMenu() {
+        while (true) {
+            cout << "\n╔═══════════════════════════════════════╗\n";
+            cout << "║             SALES REPORTS              ║\n";
+            cout << "╠═══════════════════════════════════════╣\n";
+            cout << "║ 1. Sales Summary                       ║\n";
+            cout << "║ 2. Sales by Dress Type                 ║\n";
+            cout << "║ 3. Top Dresses                         ║\n";
+            cout << "║ 4. Top Customers                       ║\n";
+            cout << "║ 5. Sales of One Dress                  ║\n";
+            cout << "║ 6. Sales to One Customer               ║\n";
+            cout << "║ 7. Verify Sales Totals                 ║\n";
+            cout << "║ 8. Back to Order Menu                  ║\n";
+            cout << "╚═══════════════════════════════════════╝\n";
+            cout << "\nEnter your choice: ";
+            int choice;
+            if (!(cin >> choice)) {
+                cout << "Invalid input! Please enter a number.\n";
+                clearInputBuffer();
+                continue;
+            }
+            string report;
+            switch (choice) {
+            case 1:
+                report = "summary";
+                break;
+            case 2:
+                report = "types";
+                break;
+            case 3: {
+                int count;
+                char byUnits;
+                cout << "How many dresses: ";
+                cin >> count;
+                cout << "Rank by units sold instead of revenue? (y/n): ";
+                cin >> byUnits;
+                report = "top-dresses " + to_string(count) + (byUnits == 'y' || byUnits == 'Y' ? " units" : " revenue");
+                break;
+            }
+            case 4: {
+                int count;
+                cout << "How many customers: ";
+                cin >> count;
+                report = "top-customers " + to_string(count);
+                break;
+            }
+            case 5: {
+                char type;
+                int id;
+                cout << "Dress type (S = stitched, U = unstitched): ";
+                cin >> type;
+                cout << "Dress ID: ";
+                cin >> id;
+                report = string("dress ") + static_cast<char>(toupper(type)) + " " + to_string(id);
+                break;
+            }
+            case 6: {
+                int id;
+                cout << "Customer ID: ";
+                cin >> id;
+                report = "customer " + to_string(id);
+                break;
+            }
+            case 7:
+                report = "verify";
+                break;
+            case 8:
+                return;
+            default:
+                cout << "Invalid choice! Please select 1-8.\n";
+                continue;
             }
+            cout << "\n" << sendRequest(REPORT, report) << endl;
         }
     }
 
@@ -576,7 +941,9 @@ private:
             cout << "║           IMAGE MANAGEMENT             ║\n";
             cout << "╠═══════════════════════════════════════╣\n";
             cout << "║ 1. Upload Image                        ║\n";
-            cout << "║ 2. Back to Main Menu                   ║\n";
+            cout << "║ 2. Download Image                      ║\n";
+            cout << "║ 3. Download Thumbnail                  ║\n";
+            cout << "║ 4. Back to Main Menu                   ║\n";
             cout << "╚═══════════════════════════════════════╝\n";
             cout << "\nEnter your choice: ";
             int choice;
@@ -596,10 +963,38 @@ private:
                 sendImage(filepath, imageName);
                 break;
             }
-            case 2:
+            case 2: {
+                string imageName, filepath;
+                cout << "Enter image name on server (e.g., dress1.jpg): ";
+                cin.ignore();
+                getline(cin, imageName);
+                cout << "Enter file path to save to (e.g., C:/path/to/dress1.jpg): ";
+                getline(cin, filepath);
+                downloadImage(imageName, filepath);
+                break;
+            }
+            case 3: {
+                string imageName, filepath;
+                int size;
+                cout << "Enter image name on server (e.g., dress1.jpg): ";
+                cin.ignore();
+                getline(cin, imageName);
+                cout << "Enter thumbnail size (128 or 512): ";
+                if (!(cin >> size)) {
+                    cout << "Invalid size!\n";
+                    clearInputBuffer();
+                    break;
+                }
+                cout << "Enter file path to save to (e.g., C:/path/to/dress1_thumb.bmp): ";
+                cin.ignore();
+                getline(cin, filepath);
+                downloadImage(imageName, filepath, size);
+                break;
+            }
+            case 4:
                 return;
             default:
-                cout << "Invalid choice! Please select 1-2.\n";
+                cout << "Invalid choice! Please select 1-4.\n";
             }
         }
     }
@@ -638,6 +1033,7 @@ private:
 public:
     TCPClient() {
         clientSocket = INVALID_SOCKET;
+        nextRequestId = 1;
     }
 
     ~TCPClient() {
@@ -653,21 +1049,13 @@ public:
             return false;
         }
 #endif
-        clientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (clientSocket == INVALID_SOCKET) {
-            cout << "Failed to create socket" << endl;
-#ifdef _WIN32
-            WSACleanup();
-#endif
-            return false;
-        }
         memset(&serverAddr, 0, sizeof(serverAddr));
         serverAddr.sin_family = AF_INET;
         serverAddr.sin_port = htons(SERVER_PORT);
         serverAddr.sin_addr.s_addr = inet_addr(SERVER_IP.c_str());
-        if (connect(clientSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+        clientSocket = openConnection();
+        if (clientSocket == INVALID_SOCKET) {
             cout << "Failed to connect to server" << endl;
-            closesocket(clientSocket);
 #ifdef _WIN32
             WSACleanup();
 #endif
@@ -730,10 +1118,57 @@ public:
             }
         }
     }
+
+    // Customer searches per second on one connection: first the blocking send-and-wait loop,
+    // then with 1, 2, 4 ... maxDepth requests in flight through a PipelinedClient
+    bool benchPipeline(int searches, int maxDepth) {
+        if (!initialize()) {
+            return false;
+        }
+        cout << searches << " searches per run against " << SERVER_IP << ":" << SERVER_PORT << "\n";
+        cout << left << setw(12) << "depth" << setw(16) << "searches/sec" << setw(20) << "avg latency (us)" << "speedup\n";
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < searches; i++) {
+            sendRequest(SEARCH_CUSTOMER, to_string(i % 1000 + 1));
+        }
+        double blockingSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << setw(12) << "blocking" << setw(16) << fixed << setprecision(0) << searches / blockingSeconds
+            << setw(20) << setprecision(1) << blockingSeconds * 1e6 / searches << "1.0x\n";
+        for (int depth = 1; depth <= maxDepth; depth *= 2) {
+            SOCKET connection = openConnection();
+            if (connection == INVALID_SOCKET) {
+                cout << "Failed to connect to server" << endl;
+                return false;
+            }
+            PipelinedClient pipeline(connection, static_cast<size_t>(depth));
+            atomic<int> answered{ 0 }, failures{ 0 };
+            promise<void> done;
+            start = chrono::steady_clock::now();
+            for (int i = 0; i < searches; i++) {
+                pipeline.submit(SEARCH_CUSTOMER, to_string(i % 1000 + 1), [&](ClientReply& reply) {
+                    if (!reply.ok) failures++;
+                    if (++answered == searches) done.set_value();
+                });
+            }
+            done.get_future().wait();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << setw(12) << depth << setw(16) << setprecision(0) << searches / seconds
+                << setw(20) << setprecision(1) << seconds * 1e6 * depth / searches
+                << setprecision(1) << blockingSeconds / seconds << "x\n";
+            if (failures > 0) {
+                cout << "  " << failures << " searches failed\n";
+                return false;
+            }
+        }
+        return true;
+    }
 };
 
-int main() {
+int main(int argc, char* argv[]) {
     TCPClient client;
+    if (argc >= 3 && string(argv[1]) == "--bench" && string(argv[2]) == "pipeline") {
+        return client.benchPipeline(argc >= 4 ? stoi(argv[3]) : 20000, argc >= 5 ? stoi(argv[4]) : 128) ? 0 : 1;
+    }
     client.run();
     return 0;
 }
\ No newline at end of file
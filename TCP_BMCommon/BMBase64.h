@@ -0,0 +1,336 @@
+#pragma once
+
+// Base64 codec shared by the boutique server and client.
+//
+// The alphabet is the standard one ("+/", "=" padding). Decoding keeps the behaviour of the
+// original implementation: it stops at the first character outside the alphabet (padding
+// included) and drops leftover bits that do not make a whole byte.
+//
+// On x86 the codec picks the widest vector path the CPU supports at run time:
+//   AVX2    24 bytes <-> 32 characters per step
+//   SSE4.1  12 bytes <-> 16 characters per step
+//   scalar  everything else, and the tails of the vector paths
+// The vector kernels are the pshufb/multiply-add formulation by Wojciech Mula and Daniel
+// Lemire. They are compiled with per-function target attributes, so the file needs no
+// special compiler flags and still runs on CPUs without AVX2.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BM_BASE64_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BM_BASE64_TARGET(isa)
+#else
+#define BM_BASE64_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+enum class Base64Path {
+    SCALAR,
+    SSE41,
+    AVX2
+};
+
+namespace base64_detail {
+
+constexpr char ENCODE_TABLE[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct DecodeTable {
+    int8_t values[256];
+};
+
+constexpr DecodeTable makeDecodeTable() {
+    DecodeTable table = {};
+    for (int i = 0; i < 256; i++) table.values[i] = -1;
+    for (int i = 0; i < 64; i++) table.values[static_cast<unsigned char>(ENCODE_TABLE[i])] = static_cast<int8_t>(i);
+    return table;
+}
+
+constexpr DecodeTable DECODE_TABLE = makeDecodeTable();
+
+inline size_t encodedLength(size_t length) {
+    return (length + 2) / 3 * 4;
+}
+
+// Encodes length bytes (any length) into out, which has room for encodedLength(length)
+inline void encodeScalar(const unsigned char* in, size_t length, char* out) {
+    size_t i = 0;
+    for (; i + 3 <= length; i += 3) {
+        uint32_t triple = (uint32_t(in[i]) << 16) | (uint32_t(in[i + 1]) << 8) | in[i + 2];
+        *out++ = ENCODE_TABLE[(triple >> 18) & 0x3F];
+        *out++ = ENCODE_TABLE[(triple >> 12) & 0x3F];
+        *out++ = ENCODE_TABLE[(triple >> 6) & 0x3F];
+        *out++ = ENCODE_TABLE[triple & 0x3F];
+    }
+    if (i < length) {
+        uint32_t triple = uint32_t(in[i]) << 16;
+        if (i + 1 < length) triple |= uint32_t(in[i + 1]) << 8;
+        *out++ = ENCODE_TABLE[(triple >> 18) & 0x3F];
+        *out++ = ENCODE_TABLE[(triple >> 12) & 0x3F];
+        *out++ = i + 1 < length ? ENCODE_TABLE[(triple >> 6) & 0x3F] : '=';
+        *out++ = '=';
+    }
+}
+
+// Decodes until the first invalid character; returns the number of bytes written
+inline size_t decodeScalar(const unsigned char* in, size_t length, char* out) {
+    char* start = out;
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        int a = DECODE_TABLE.values[in[i]], b = DECODE_TABLE.values[in[i + 1]];
+        int c = DECODE_TABLE.values[in[i + 2]], d = DECODE_TABLE.values[in[i + 3]];
+        if ((a | b | c | d) < 0) break;
+        uint32_t quad = (uint32_t(a) << 18) | (uint32_t(b) << 12) | (uint32_t(c) << 6) | uint32_t(d);
+        *out++ = static_cast<char>(quad >> 16);
+        *out++ = static_cast<char>(quad >> 8);
+        *out++ = static_cast<char>(quad);
+    }
+    // Up to three trailing characters, or the group holding the first invalid one
+    uint32_t bits = 0;
+    int bitCount = 0;
+    for (; i < length; i++) {
+        int value = DECODE_TABLE.values[in[i]];
+        if (value < 0) break;
+        bits = (bits << 6) | uint32_t(value);
+        bitCount += 6;
+        if (bitCount >= 8) {
+            bitCount -= 8;
+            *out++ = static_cast<char>((bits >> bitCount) & 0xFF);
+        }
+    }
+    return static_cast<size_t>(out - start);
+}
+
+#ifdef BM_BASE64_X86
+
+// 12 input bytes (in the low 12 of 16) -> 16 six-bit indices, one per byte
+BM_BASE64_TARGET("sse4.1")
+inline __m128i splitSse(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+BM_BASE64_TARGET("sse4.1")
+inline __m128i indicesToAsciiSse(__m128i indices) {
+    __m128i reduced = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    reduced = _mm_or_si128(reduced, _mm_and_si128(less, _mm_set1_epi8(13)));
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(shift, reduced), indices);
+}
+
+// Translates 16 characters to six-bit values; false if any of them is outside the alphabet
+BM_BASE64_TARGET("sse4.1")
+inline bool asciiToValuesSse(__m128i input, __m128i& values) {
+    const __m128i higherNibble = _mm_and_si128(_mm_srli_epi32(input, 4), _mm_set1_epi8(0x0f));
+    const __m128i lowerNibble = _mm_and_si128(input, _mm_set1_epi8(0x0f));
+    const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i lo = _mm_shuffle_epi8(lutLo, lowerNibble);
+    const __m128i hi = _mm_shuffle_epi8(lutHi, higherNibble);
+    if (!_mm_testz_si128(lo, hi)) {
+        return false;
+    }
+    const __m128i eq2F = _mm_cmpeq_epi8(input, _mm_set1_epi8(0x2F));
+    const __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eq2F, higherNibble));
+    values = _mm_add_epi8(input, roll);
+    return true;
+}
+
+// 16 six-bit values -> 12 bytes in the low 12 bytes of the result
+BM_BASE64_TARGET("sse4.1")
+inline __m128i packSse(__m128i values) {
+    const __m128i mergedPairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    const __m128i merged = _mm_madd_epi16(mergedPairs, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+// Returns the number of input bytes consumed; output is exactly 4/3 of that
+BM_BASE64_TARGET("sse4.1")
+inline size_t encodeSse41(const unsigned char* in, size_t length, char* out) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 12) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), indicesToAsciiSse(splitSse(block)));
+        out += 16;
+    }
+    return i;
+}
+
+// Returns the number of characters consumed (a multiple of 16). out needs 4 bytes of slack.
+BM_BASE64_TARGET("sse4.1")
+inline size_t decodeSse41(const unsigned char* in, size_t length, char* out) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i values;
+        if (!asciiToValuesSse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), values)) break;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), packSse(values));
+        out += 12;
+    }
+    return i;
+}
+
+BM_BASE64_TARGET("avx2")
+inline size_t encodeAvx2(const unsigned char* in, size_t length, char* out) {
+    const __m256i shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+    for (; i + 28 <= length; i += 24) {
+        // Each 128-bit lane gets 12 input bytes
+        const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12));
+        __m256i block = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+        block = _mm256_shuffle_epi8(block, shuffle);
+        const __m256i t0 = _mm256_and_si256(block, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(block, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+        __m256i reduced = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        reduced = _mm256_or_si256(reduced, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_add_epi8(_mm256_shuffle_epi8(shift, reduced), indices));
+        out += 32;
+    }
+    return i;
+}
+
+// Returns the number of characters consumed (a multiple of 32). out needs 8 bytes of slack.
+BM_BASE64_TARGET("avx2")
+inline size_t decodeAvx2(const unsigned char* in, size_t length, char* out) {
+    const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        const __m256i higherNibble = _mm256_and_si256(_mm256_srli_epi32(input, 4), _mm256_set1_epi8(0x0f));
+        const __m256i lowerNibble = _mm256_and_si256(input, _mm256_set1_epi8(0x0f));
+        const __m256i lo = _mm256_shuffle_epi8(lutLo, lowerNibble);
+        const __m256i hi = _mm256_shuffle_epi8(lutHi, higherNibble);
+        if (!_mm256_testz_si256(lo, hi)) break;
+        const __m256i eq2F = _mm256_cmpeq_epi8(input, _mm256_set1_epi8(0x2F));
+        const __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, higherNibble));
+        const __m256i values = _mm256_add_epi8(input, roll);
+        const __m256i mergedPairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        __m256i merged = _mm256_madd_epi16(mergedPairs, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, pack);
+        // Close the 4-byte gap between the two lanes' 12-byte results
+        merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), merged);
+        out += 24;
+    }
+    return i;
+}
+
+inline Base64Path detectPath() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool sse41 = (info[2] & (1 << 19)) != 0;
+    bool osSavesYmm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+    bool avx2 = false;
+    if (maxLeaf >= 7 && osSavesYmm) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    bool sse41 = __builtin_cpu_supports("sse4.1");
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    if (avx2) return Base64Path::AVX2;
+    if (sse41) return Base64Path::SSE41;
+    return Base64Path::SCALAR;
+}
+
+#else
+
+inline Base64Path detectPath() {
+    return Base64Path::SCALAR;
+}
+
+#endif
+
+} // namespace base64_detail
+
+// Fastest path this CPU supports, detected once
+inline Base64Path base64BestPath() {
+    static const Base64Path path = base64_detail::detectPath();
+    return path;
+}
+
+inline bool base64PathSupported(Base64Path path) {
+    return path <= base64BestPath();
+}
+
+inline const char* base64PathName(Base64Path path) {
+    switch (path) {
+    case Base64Path::AVX2: return "avx2";
+    case Base64Path::SSE41: return "sse4.1";
+    default: return "scalar";
+    }
+}
+
+// Encodes length bytes into out, which must have room for (length + 2) / 3 * 4 characters
+inline void base64EncodeTo(const char* data, size_t length, char* out, Base64Path path = base64BestPath()) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+    size_t done = 0;
+#ifdef BM_BASE64_X86
+    if (path == Base64Path::AVX2) {
+        done = base64_detail::encodeAvx2(in, length, out);
+    }
+    if (path >= Base64Path::SSE41) {
+        done += base64_detail::encodeSse41(in + done, length - done, out + done / 3 * 4);
+    }
+#endif
+    base64_detail::encodeScalar(in + done, length - done, out + done / 3 * 4);
+}
+
+// Decodes into out, which must have room for length / 4 * 3 + 32 bytes; returns the bytes written
+inline size_t base64DecodeTo(const char* data, size_t length, char* out, Base64Path path = base64BestPath()) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+    size_t done = 0;
+#ifdef BM_BASE64_X86
+    if (path == Base64Path::AVX2) {
+        done = base64_detail::decodeAvx2(in, length, out);
+    }
+    if (path >= Base64Path::SSE41) {
+        done += base64_detail::decodeSse41(in + done, length - done, out + done / 4 * 3);
+    }
+#endif
+    return done / 4 * 3 + base64_detail::decodeScalar(in + done, length - done, out + done / 4 * 3);
+}
+
+inline std::string base64_encode(const std::string& in, Base64Path path = base64BestPath()) {
+    std::string out(base64_detail::encodedLength(in.size()), '\0');
+    if (!out.empty()) base64EncodeTo(in.data(), in.size(), &out[0], path);
+    return out;
+}
+
+inline std::string base64_decode(const std::string& in, Base64Path path = base64BestPath()) {
+    std::string out(in.size() / 4 * 3 + 32, '\0');
+    out.resize(base64DecodeTo(in.data(), in.size(), &out[0], path));
+    return out;
+}
@@ -0,0 +1,412 @@
+#pragma once
+
+// Checksums shared by the boutique server and client.
+//
+// CRC32C (Castagnoli) guards image uploads: each part carries its own CRC32C, and the whole
+// image is checked again before it is committed. On x86 CPUs with SSE4.2 it runs on the
+// crc32 instruction, three interleaved streams per step; elsewhere a slicing-by-8 table
+// handles eight bytes per step. Checksums are computed incrementally:
+//
+//   uint32_t crc = 0;
+//   crc = crc32c(crc, chunk1, length1);
+//   crc = crc32c(crc, chunk2, length2);
+//
+// SHA-256 names image contents in the deduplicating image store. Sha256 is incremental as
+// well; on x86 CPUs with the SHA extensions it uses the sha256rnds2 instructions, elsewhere
+// portable code.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BM_CRC32C_X64 1
+#include <nmmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BM_CRC32C_TARGET
+#define BM_SHA_TARGET
+#else
+#include <cpuid.h>
+#define BM_CRC32C_TARGET __attribute__((target("sse4.2")))
+#define BM_SHA_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+#endif
+
+namespace checksum_detail {
+
+struct Crc32cTables {
+    uint32_t slices[8][256];
+};
+
+constexpr Crc32cTables makeCrc32cTables() {
+    Crc32cTables tables = {};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        tables.slices[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            uint32_t previous = tables.slices[slice - 1][i];
+            tables.slices[slice][i] = (previous >> 8) ^ tables.slices[0][previous & 0xFF];
+        }
+    }
+    return tables;
+}
+
+constexpr Crc32cTables CRC32C_TABLES = makeCrc32cTables();
+
+// Operates on the inverted CRC register
+inline uint32_t crc32cTable(uint32_t crc, const unsigned char* data, size_t length) {
+    const auto& t = CRC32C_TABLES.slices;
+    while (length >= 8) {
+        // Little-endian loads, whatever the byte order of the machine
+        uint32_t low = static_cast<uint32_t>(data[0]) | (static_cast<uint32_t>(data[1]) << 8)
+            | (static_cast<uint32_t>(data[2]) << 16) | (static_cast<uint32_t>(data[3]) << 24);
+        uint32_t high = static_cast<uint32_t>(data[4]) | (static_cast<uint32_t>(data[5]) << 8)
+            | (static_cast<uint32_t>(data[6]) << 16) | (static_cast<uint32_t>(data[7]) << 24);
+        low ^= crc;
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24]
+            ^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef BM_CRC32C_X64
+
+// Multiplies a CRC register by x^(8 * bytes) mod P, i.e. runs it over that many zero bytes.
+// Square-and-multiply with 32x32 operator matrices over GF(2), as in zlib's crc32_combine.
+inline uint32_t crc32cShift(uint32_t crc, size_t bytes) {
+    uint32_t odd[32], even[32];
+    odd[0] = 0x82F63B78u;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    auto times = [](const uint32_t* matrix, uint32_t vector) {
+        uint32_t sum = 0;
+        for (int i = 0; vector != 0; i++, vector >>= 1) {
+            if (vector & 1) sum ^= matrix[i];
+        }
+        return sum;
+    };
+    auto square = [&](uint32_t* out, const uint32_t* matrix) {
+        for (int n = 0; n < 32; n++) out[n] = times(matrix, matrix[n]);
+    };
+    square(even, odd); // two zero bits
+    square(odd, even); // four zero bits
+    do {
+        square(even, odd);
+        if (bytes & 1) crc = times(even, crc);
+        bytes >>= 1;
+        if (bytes == 0) break;
+        square(odd, even);
+        if (bytes & 1) crc = times(odd, crc);
+        bytes >>= 1;
+    } while (bytes != 0);
+    return crc;
+}
+
+// crc32cShift by a fixed distance as four table lookups. The shift is linear, so each
+// table entry is the XOR of the shifted single bits it is made of.
+struct Crc32cShiftTable {
+    uint32_t bytes[4][256];
+
+    explicit Crc32cShiftTable(size_t distance) {
+        uint32_t bits[32];
+        for (int bit = 0; bit < 32; bit++) bits[bit] = crc32cShift(1u << bit, distance);
+        for (int position = 0; position < 4; position++) {
+            for (int value = 0; value < 256; value++) {
+                uint32_t shifted = 0;
+                for (int bit = 0; bit < 8; bit++) {
+                    if (value & (1 << bit)) shifted ^= bits[position * 8 + bit];
+                }
+                bytes[position][value] = shifted;
+            }
+        }
+    }
+
+    uint32_t apply(uint32_t crc) const {
+        return bytes[0][crc & 0xFF] ^ bytes[1][(crc >> 8) & 0xFF] ^ bytes[2][(crc >> 16) & 0xFF] ^ bytes[3][crc >> 24];
+    }
+};
+
+const size_t CRC32C_STRIPE = 4096;
+
+BM_CRC32C_TARGET
+inline uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t length) {
+    // Three independent streams over adjacent stripes hide the latency of the crc32
+    // instruction; the stripe results are then shifted into place and combined
+    static const Crc32cShiftTable shiftOne(CRC32C_STRIPE);
+    static const Crc32cShiftTable shiftTwo(2 * CRC32C_STRIPE);
+    uint64_t c0 = crc;
+    while (length >= 3 * CRC32C_STRIPE) {
+        uint64_t c1 = 0, c2 = 0;
+        const unsigned char* p1 = data + CRC32C_STRIPE;
+        const unsigned char* p2 = data + 2 * CRC32C_STRIPE;
+        for (size_t i = 0; i < CRC32C_STRIPE; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, data + i, 8);
+            memcpy(&w1, p1 + i, 8);
+            memcpy(&w2, p2 + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c0 = shiftTwo.apply(static_cast<uint32_t>(c0)) ^ shiftOne.apply(static_cast<uint32_t>(c1)) ^ static_cast<uint32_t>(c2);
+        data += 3 * CRC32C_STRIPE;
+        length -= 3 * CRC32C_STRIPE;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c0 = _mm_crc32_u64(c0, word);
+        data += 8;
+        length -= 8;
+    }
+    uint32_t c = static_cast<uint32_t>(c0);
+    while (length-- > 0) {
+        c = _mm_crc32_u8(c, *data++);
+    }
+    return c;
+}
+
+inline bool detectSse42() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#endif
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+inline void sha256BlocksPortable(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    while (blocks-- > 0) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (static_cast<uint32_t>(data[4 * i]) << 24) | (static_cast<uint32_t>(data[4 * i + 1]) << 16)
+                | (static_cast<uint32_t>(data[4 * i + 2]) << 8) | static_cast<uint32_t>(data[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += 64;
+    }
+}
+
+#ifdef BM_CRC32C_X64
+
+// The SHA extensions keep the state as ABEF / CDGH and do two rounds per sha256rnds2;
+// sha256msg1 / sha256msg2 extend the message schedule four words at a time
+BM_SHA_TARGET
+inline void sha256BlocksShaNi(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1B);
+    __m128i abef = _mm_alignr_epi8(dcba, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, dcba, 0xF0);
+    while (blocks-- > 0) {
+        __m128i savedAbef = abef, savedCdgh = cdgh;
+        __m128i w[4];
+        for (int group = 0; group < 16; group++) {
+            __m128i words;
+            if (group < 4) {
+                words = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * group)), byteSwap);
+            }
+            else {
+                // w[t..t+3] from w[t-16..t-1], held in w[group % 4] .. w[(group + 3) % 4]
+                __m128i extended = _mm_add_epi32(_mm_sha256msg1_epu32(w[group % 4], w[(group + 1) % 4]),
+                    _mm_alignr_epi8(w[(group + 3) % 4], w[(group + 2) % 4], 4));
+                words = _mm_sha256msg2_epu32(extended, w[(group + 3) % 4]);
+            }
+            w[group % 4] = words;
+            __m128i message = _mm_add_epi32(words, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&SHA256_K[4 * group])));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, savedAbef);
+        cdgh = _mm_add_epi32(cdgh, savedCdgh);
+        data += 64;
+    }
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+inline bool detectShaNi() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool sse41 = (info[2] & (1 << 19)) != 0;
+    __cpuidex(info, 7, 0);
+    return sse41 && (info[1] & (1 << 29)) != 0;
+#else
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 19))) return false;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+    return (ebx & (1u << 29)) != 0;
+#endif
+}
+
+#endif
+
+} // namespace checksum_detail
+
+inline bool crc32cHardwareAvailable() {
+#ifdef BM_CRC32C_X64
+    static const bool available = checksum_detail::detectSse42();
+    return available;
+#else
+    return false;
+#endif
+}
+
+// Continues a CRC32C over more data; start with crc = 0
+inline uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+#ifdef BM_CRC32C_X64
+    if (crc32cHardwareAvailable()) {
+        return ~checksum_detail::crc32cHardware(~crc, bytes, length);
+    }
+#endif
+    return ~checksum_detail::crc32cTable(~crc, bytes, length);
+}
+
+inline uint32_t crc32c(const std::string& data) {
+    return crc32c(0, data.data(), data.size());
+}
+
+inline bool sha256HardwareAvailable() {
+#ifdef BM_CRC32C_X64
+    static const bool available = checksum_detail::detectShaNi();
+    return available;
+#else
+    return false;
+#endif
+}
+
+// Incremental SHA-256: update() any number of times, then hexDigest() once
+class Sha256 {
+private:
+    uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    unsigned char buffer[64];
+    size_t buffered = 0;
+    uint64_t totalBytes = 0;
+    bool hardware = sha256HardwareAvailable();
+
+    void blocks(const unsigned char* data, size_t count) {
+#ifdef BM_CRC32C_X64
+        if (hardware) {
+            checksum_detail::sha256BlocksShaNi(state, data, count);
+            return;
+        }
+#endif
+        checksum_detail::sha256BlocksPortable(state, data, count);
+    }
+
+public:
+    Sha256() {}
+
+    // Selects the portable code even on CPUs with the SHA extensions, for comparisons
+    explicit Sha256(bool useHardware) : hardware(useHardware && sha256HardwareAvailable()) {}
+
+    void update(const void* data, size_t length) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        totalBytes += length;
+        if (buffered > 0) {
+            size_t take = length < 64 - buffered ? length : 64 - buffered;
+            memcpy(buffer + buffered, bytes, take);
+            buffered += take;
+            bytes += take;
+            length -= take;
+            if (buffered < 64) return;
+            blocks(buffer, 1);
+            buffered = 0;
+        }
+        if (length >= 64) {
+            blocks(bytes, length / 64);
+            bytes += length / 64 * 64;
+            length %= 64;
+        }
+        memcpy(buffer + buffered, bytes, length);
+        buffered += length;
+    }
+
+    // 64 lowercase hex digits
+    std::string hexDigest() {
+        uint64_t bits = totalBytes * 8;
+        unsigned char padding[72] = { 0x80 };
+        size_t padLength = (buffered < 56 ? 56 : 120) - buffered;
+        for (int i = 0; i < 8; i++) padding[padLength + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        update(padding, padLength + 8);
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(64, '0');
+        for (int i = 0; i < 32; i++) {
+            unsigned char byte = static_cast<unsigned char>(state[i / 4] >> (24 - 8 * (i % 4)));
+            hex[2 * i] = digits[byte >> 4];
+            hex[2 * i + 1] = digits[byte & 0x0F];
+        }
+        return hex;
+    }
+};
+
+inline std::string sha256Hex(const void* data, size_t length) {
+    Sha256 hash;
+    hash.update(data, length);
+    return hash.hexDigest();
+}
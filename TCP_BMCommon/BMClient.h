@@ -0,0 +1,547 @@
+#pragma once
+
+// Client library for the boutique server, independent of the interactive menus.
+//
+// PipelinedClient: any number of requests in flight on one socket, each tagged with its own
+// request id. A reader thread matches every reply to its request by id, so the order replies
+// arrive in does not matter.
+//
+//   PipelinedClient client(socket);                       // takes over a connected socket
+//   std::future<ClientReply> a = client.submit(SEARCH_ORDER, "7");
+//   client.submit(SEARCH_CUSTOMER, "3", [](ClientReply& reply) { ... });
+//
+// Callbacks run on the reader thread (or on the thread that noticed a timeout or a closed
+// connection) and must not wait for other replies on the same client. Every request gets
+// exactly one reply; if none arrives, the reply has ok == false and says why. At most
+// maxInFlight requests are outstanding; submit() waits for a slot beyond that.
+//
+// ConnectionPool: a fixed number of persistent PipelinedClients shared by any number of
+// threads. A maintenance thread reconnects lost connections with jittered exponential
+// backoff, PINGs idle ones and drops any that stop answering, and times out requests.
+// Requests are never resent: one cut off by a lost connection fails, since an insert may
+// already have been applied.
+//
+//   PoolOptions options;
+//   options.host = "10.0.0.5";
+//   ConnectionPool pool(options);
+//   ClientReply reply = pool.request(SEARCH_CUSTOMER, "42");
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "BMProtocol.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
+const size_t DEFAULT_PIPELINE_DEPTH = 64;
+
+struct ClientReply {
+    bool ok = false;                // false if no reply arrived
+    bool timedOut = false;          // no reply within the request's timeout
+    FrameHeader header;
+    std::string payload;            // the reply, or why there is none
+};
+
+// Opens a connection to host (an IPv4 address), giving up after timeout. Returns
+// INVALID_SOCKET and sets error on failure.
+inline SOCKET connectTo(const std::string& host, int port, std::chrono::milliseconds timeout, std::string& error) {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    address.sin_addr.s_addr = inet_addr(host.c_str());
+    if (address.sin_addr.s_addr == INADDR_NONE) {
+        error = "ERROR: Invalid server address " + host;
+        return INVALID_SOCKET;
+    }
+    SOCKET connection = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (connection == INVALID_SOCKET) {
+        error = "ERROR: Cannot create socket";
+        return INVALID_SOCKET;
+    }
+#ifdef _WIN32
+    u_long nonBlocking = 1;
+    ioctlsocket(connection, FIONBIO, &nonBlocking);
+#else
+    int socketFlags = fcntl(connection, F_GETFL, 0);
+    fcntl(connection, F_SETFL, socketFlags | O_NONBLOCK);
+#endif
+    bool connected = connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    if (!connected) {
+#ifdef _WIN32
+        bool pending = WSAGetLastError() == WSAEWOULDBLOCK;
+        fd_set writable, failed;
+        FD_ZERO(&writable);
+        FD_ZERO(&failed);
+        FD_SET(connection, &writable);
+        FD_SET(connection, &failed);
+        timeval wait;
+        wait.tv_sec = static_cast<long>(timeout.count() / 1000);
+        wait.tv_usec = static_cast<long>(timeout.count() % 1000 * 1000);
+        bool ready = pending && select(0, nullptr, &writable, &failed, &wait) > 0 && FD_ISSET(connection, &writable);
+#else
+        bool pending = errno == EINPROGRESS;
+        pollfd watch;
+        watch.fd = connection;
+        watch.events = POLLOUT;
+        watch.revents = 0;
+        bool ready = pending && poll(&watch, 1, static_cast<int>(timeout.count())) > 0;
+#endif
+        if (ready) {
+            int socketError = 0;
+            socklen_t length = sizeof(socketError);
+            getsockopt(connection, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&socketError), &length);
+            connected = socketError == 0;
+        }
+        if (!connected) {
+            error = ready || !pending ? "ERROR: Cannot connect to " + host + ":" + std::to_string(port)
+                                      : "ERROR: Timed out connecting to " + host + ":" + std::to_string(port);
+        }
+    }
+    if (!connected) {
+        closesocket(connection);
+        return INVALID_SOCKET;
+    }
+#ifdef _WIN32
+    nonBlocking = 0;
+    ioctlsocket(connection, FIONBIO, &nonBlocking);
+#else
+    fcntl(connection, F_SETFL, socketFlags);
+#endif
+    int noDelay = 1;
+    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+    int noSigpipe = 1;
+    setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &noSigpipe, sizeof(noSigpipe));
+#endif
+    return connection;
+}
+
+// Exponential backoff with jitter: the nth consecutive failure waits between half and all
+// of min(maxDelay, baseDelay * 2^n), so clients that lost the server together do not all
+// come back at the same moment
+class Backoff {
+private:
+    std::chrono::milliseconds baseDelay;
+    std::chrono::milliseconds maxDelay;
+    int failures = 0;
+    std::mt19937 rng{ std::random_device{}() };
+
+public:
+    Backoff(std::chrono::milliseconds baseDelay, std::chrono::milliseconds maxDelay) : baseDelay(baseDelay), maxDelay(maxDelay) {}
+
+    std::chrono::milliseconds next() {
+        long long ceiling = baseDelay.count() << std::min(failures, 20);
+        ceiling = std::max(1LL, std::min(ceiling, static_cast<long long>(maxDelay.count())));
+        failures++;
+        std::uniform_int_distribution<long long> jitter(ceiling / 2, ceiling);
+        return std::chrono::milliseconds(jitter(rng));
+    }
+
+    void reset() {
+        failures = 0;
+    }
+
+    int consecutiveFailures() const {
+        return failures;
+    }
+};
+
+class PipelinedClient {
+public:
+    using Callback = std::function<void(ClientReply&)>;
+    using Clock = std::chrono::steady_clock;
+
+private:
+    struct Pending {
+        Callback callback;
+        Clock::time_point deadline;     // Clock::time_point::max() if the request has no timeout
+    };
+
+    SOCKET socket;
+    size_t maxInFlight;
+    std::mutex stateMutex;          // guards pending, nextRequestId, closed, closeReason
+    std::condition_variable slotFree;
+    std::unordered_map<uint32_t, Pending> pending;
+    uint32_t nextRequestId = 1;
+    bool closed = false;
+    std::string closeReason;
+    std::mutex sendMutex;           // keeps frames from different threads whole on the wire
+    std::thread reader;
+
+    void readLoop() {
+        ClientReply reply;
+        while (recvFrame(socket, reply.header, reply.payload)) {
+            Callback callback;
+            {
+                std::lock_guard<std::mutex> lock(stateMutex);
+                auto it = pending.find(reply.header.requestId);
+                if (it == pending.end()) continue;      // timed out, or not one of ours
+                callback = std::move(it->second.callback);
+                pending.erase(it);
+            }
+            slotFree.notify_one();
+            reply.ok = true;
+            callback(reply);
+        }
+        abort("ERROR: Connection to server lost");
+    }
+
+public:
+    explicit PipelinedClient(SOCKET connected, size_t maxInFlight = DEFAULT_PIPELINE_DEPTH)
+        : socket(connected), maxInFlight(maxInFlight > 0 ? maxInFlight : 1) {
+        reader = std::thread(&PipelinedClient::readLoop, this);
+    }
+
+    ~PipelinedClient() {
+        disconnect();
+    }
+
+    PipelinedClient(const PipelinedClient&) = delete;
+    PipelinedClient& operator=(const PipelinedClient&) = delete;
+
+    // Closes the connection and answers every outstanding request with reason. Unlike
+    // disconnect() it does not wait for the reader thread, so callbacks may call it.
+    void abort(const std::string& reason) {
+        std::unordered_map<uint32_t, Pending> orphaned;
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            if (!closed) {
+                closed = true;
+                closeReason = reason;
+#ifdef _WIN32
+                shutdown(socket, SD_BOTH);
+#else
+                shutdown(socket, SHUT_RDWR);
+#endif
+            }
+            orphaned.swap(pending);
+        }
+        slotFree.notify_all();
+        for (auto& entry : orphaned) {
+            ClientReply reply;
+            reply.header.requestId = entry.first;
+            reply.payload = reason;
+            entry.second.callback(reply);
+        }
+    }
+
+    // Outstanding requests are answered with ok == false
+    void disconnect() {
+        abort("ERROR: Connection closed");
+        if (reader.joinable()) reader.join();
+        if (socket != INVALID_SOCKET) {
+            closesocket(socket);
+            socket = INVALID_SOCKET;
+        }
+    }
+
+    // timeout 0 waits for the reply as long as the connection lasts; otherwise expire()
+    // answers the request once the timeout has passed
+    void submit(uint16_t type, const std::string& payload, Callback callback, uint16_t flags = FRAME_FLAG_NONE,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        uint32_t requestId;
+        {
+            std::unique_lock<std::mutex> lock(stateMutex);
+            slotFree.wait(lock, [this]() { return closed || pending.size() < maxInFlight; });
+            if (closed) {
+                ClientReply reply;
+                reply.payload = closeReason;
+                lock.unlock();
+                callback(reply);
+                return;
+            }
+            requestId = nextRequestId++;
+            if (nextRequestId == 0) nextRequestId = 1;
+            Clock::time_point deadline = timeout.count() > 0 ? Clock::now() + timeout : Clock::time_point::max();
+            pending.emplace(requestId, Pending{ std::move(callback), deadline });
+        }
+        bool sent;
+        {
+            std::lock_guard<std::mutex> lock(sendMutex);
+            sent = sendFrame(socket, type, requestId, payload, flags);
+        }
+        if (!sent) abort("ERROR: Failed to send request to server");
+    }
+
+    std::future<ClientReply> submit(uint16_t type, const std::string& payload, uint16_t flags = FRAME_FLAG_NONE,
+                                    std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        auto promise = std::make_shared<std::promise<ClientReply>>();
+        std::future<ClientReply> reply = promise->get_future();
+        submit(type, payload, [promise](ClientReply& result) { promise->set_value(std::move(result)); }, flags, timeout);
+        return reply;
+    }
+
+    // Sends a request and waits for its reply, like a plain blocking client
+    ClientReply request(uint16_t type, const std::string& payload, uint16_t flags = FRAME_FLAG_NONE,
+                        std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        return submit(type, payload, flags, timeout).get();
+    }
+
+    // Answers requests whose timeout has passed; a reply that turns up later is dropped.
+    // Returns how many timed out.
+    size_t expire() {
+        std::vector<std::pair<uint32_t, Callback>> overdue;
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            Clock::time_point now = Clock::now();
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (it->second.deadline <= now) {
+                    overdue.emplace_back(it->first, std::move(it->second.callback));
+                    it = pending.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+        if (!overdue.empty()) slotFree.notify_all();
+        for (auto& entry : overdue) {
+            ClientReply reply;
+            reply.timedOut = true;
+            reply.header.requestId = entry.first;
+            reply.payload = "ERROR: Request timed out";
+            entry.second(reply);
+        }
+        return overdue.size();
+    }
+
+    size_t inFlight() {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        return pending.size();
+    }
+
+    bool isOpen() {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        return !closed;
+    }
+};
+
+struct PoolOptions {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    size_t connections = 4;
+    size_t maxInFlight = DEFAULT_PIPELINE_DEPTH;                // per connection
+    std::chrono::milliseconds connectTimeout{ 2000 };
+    std::chrono::milliseconds requestTimeout{ 5000 };           // also how long a request waits for a connection
+    std::chrono::milliseconds healthInterval{ 5000 };           // idle connections are PINGed this often
+    std::chrono::milliseconds backoffBase{ 100 };
+    std::chrono::milliseconds backoffMax{ 10000 };
+};
+
+class ConnectionPool {
+public:
+    using Callback = PipelinedClient::Callback;
+    using Clock = PipelinedClient::Clock;
+
+private:
+    // The maintenance thread wakes this often to expire requests and check connections
+    static constexpr std::chrono::milliseconds MAINTENANCE_INTERVAL{ 50 };
+
+    struct Slot {
+        std::shared_ptr<PipelinedClient> client;
+        Backoff backoff;
+        Clock::time_point retryAt;
+        Clock::time_point lastActive;   // last request sent or health check passed
+        bool pingOutstanding = false;
+        bool everConnected = false;
+
+        explicit Slot(const PoolOptions& options) : backoff(options.backoffBase, options.backoffMax) {}
+    };
+
+    PoolOptions options;
+    std::mutex poolMutex;           // guards slots, nextSlot, stopping
+    std::condition_variable changed;
+    std::vector<Slot> slots;
+    size_t nextSlot = 0;
+    bool stopping = false;
+    std::atomic<uint64_t> reconnects{ 0 };
+    std::atomic<uint64_t> connectFailures{ 0 };
+    std::atomic<uint64_t> timeouts{ 0 };
+    std::atomic<uint64_t> failedHealthChecks{ 0 };
+    std::thread maintainer;
+
+    // Round robin over the open connections. Caller holds poolMutex.
+    std::shared_ptr<PipelinedClient> pick(size_t& index) {
+        for (size_t tried = 0; tried < slots.size(); tried++) {
+            index = nextSlot++ % slots.size();
+            if (slots[index].client && slots[index].client->isOpen()) return slots[index].client;
+        }
+        return nullptr;
+    }
+
+    // The reply callback must not hold a shared_ptr to the client: it usually runs on the
+    // client's reader thread, and if that copy were the last one, ~PipelinedClient would join
+    // the thread it is running on. A plain pointer is safe, since the callback only runs while
+    // the client is alive: on its reader thread (which the destructor joins), in a call made
+    // through a shared_ptr, or in the destructor's own disconnect().
+    void checkHealth(size_t index, std::shared_ptr<PipelinedClient> client) {
+        PipelinedClient* watched = client.get();
+        client->submit(PING, "", [this, index, watched](ClientReply& reply) {
+            bool healthy = reply.ok && reply.header.type != ERROR_RESPONSE;
+            if (!healthy) {
+                failedHealthChecks++;
+                watched->abort("ERROR: Health check failed");
+            }
+            std::lock_guard<std::mutex> lock(poolMutex);
+            if (healthy) slots[index].backoff.reset();
+            slots[index].pingOutstanding = false;
+            slots[index].lastActive = Clock::now();
+        }, FRAME_FLAG_NONE, options.requestTimeout);
+    }
+
+    void maintain() {
+        std::unique_lock<std::mutex> lock(poolMutex);
+        while (!stopping) {
+            std::vector<std::shared_ptr<PipelinedClient>> retired, open;
+            std::vector<std::pair<size_t, std::shared_ptr<PipelinedClient>>> needPing;
+            Clock::time_point now = Clock::now();
+            for (size_t i = 0; i < slots.size() && !stopping; i++) {
+                Slot& slot = slots[i];
+                if (slot.client && !slot.client->isOpen()) {
+                    retired.push_back(std::move(slot.client));
+                    slot.client.reset();
+                    slot.pingOutstanding = false;
+                    slot.retryAt = now + slot.backoff.next();
+                }
+                if (!slot.client && now >= slot.retryAt) {
+                    lock.unlock();
+                    std::string error;
+                    SOCKET connection = connectTo(options.host, options.port, options.connectTimeout, error);
+                    lock.lock();
+                    if (stopping) {
+                        if (connection != INVALID_SOCKET) closesocket(connection);
+                        break;
+                    }
+                    if (connection == INVALID_SOCKET) {
+                        connectFailures++;
+                        slot.retryAt = Clock::now() + slot.backoff.next();
+                        continue;
+                    }
+                    // The backoff is only reset once the new connection passes a health
+                    // check, which it gets at once: a server that accepts connections but
+                    // never answers is retried less and less often
+                    slot.client = std::make_shared<PipelinedClient>(connection, options.maxInFlight);
+                    slot.lastActive = Clock::time_point();
+                    if (slot.everConnected) reconnects++;
+                    slot.everConnected = true;
+                    changed.notify_all();
+                }
+                if (!slot.client) continue;
+                open.push_back(slot.client);
+                if (!slot.pingOutstanding && now - slot.lastActive >= options.healthInterval) {
+                    slot.pingOutstanding = true;
+                    needPing.emplace_back(i, slot.client);
+                }
+            }
+            // Callbacks may take poolMutex, so time-outs and pings run without it
+            lock.unlock();
+            retired.clear();
+            for (auto& client : open) timeouts += client->expire();
+            for (auto& entry : needPing) checkHealth(entry.first, entry.second);
+            open.clear();
+            needPing.clear();
+            lock.lock();
+            changed.wait_for(lock, MAINTENANCE_INTERVAL, [this]() { return stopping; });
+        }
+    }
+
+public:
+    explicit ConnectionPool(PoolOptions poolOptions) : options(std::move(poolOptions)) {
+        if (options.connections == 0) options.connections = 1;
+        for (size_t i = 0; i < options.connections; i++) slots.emplace_back(options);
+        maintainer = std::thread(&ConnectionPool::maintain, this);
+    }
+
+    ~ConnectionPool() {
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        if (maintainer.joinable()) maintainer.join();
+        std::vector<std::shared_ptr<PipelinedClient>> clients;
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            for (Slot& slot : slots) clients.push_back(std::move(slot.client));
+        }
+        for (auto& client : clients) {
+            if (client) client->disconnect();
+        }
+    }
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // Waits up to the request timeout for an open connection. timeout 0 uses the pool's
+    // request timeout.
+    void submit(uint16_t type, const std::string& payload, Callback callback, uint16_t flags = FRAME_FLAG_NONE,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        if (timeout.count() <= 0) timeout = options.requestTimeout;
+        std::shared_ptr<PipelinedClient> client;
+        size_t index = 0;
+        {
+            std::unique_lock<std::mutex> lock(poolMutex);
+            changed.wait_for(lock, timeout, [&]() { return stopping || (client = pick(index)) != nullptr; });
+            if (client) slots[index].lastActive = Clock::now();
+        }
+        if (!client) {
+            ClientReply reply;
+            reply.payload = "ERROR: No connection to " + options.host + ":" + std::to_string(options.port);
+            callback(reply);
+            return;
+        }
+        client->submit(type, payload, [this, index, callback](ClientReply& reply) {
+            if (reply.timedOut) {
+                // Check the connection at the next maintenance pass
+                std::lock_guard<std::mutex> lock(poolMutex);
+                slots[index].lastActive = Clock::time_point();
+            }
+            callback(reply);
+        }, flags, timeout);
+    }
+
+    std::future<ClientReply> submit(uint16_t type, const std::string& payload, uint16_t flags = FRAME_FLAG_NONE,
+                                    std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        auto promise = std::make_shared<std::promise<ClientReply>>();
+        std::future<ClientReply> reply = promise->get_future();
+        submit(type, payload, [promise](ClientReply& result) { promise->set_value(std::move(result)); }, flags, timeout);
+        return reply;
+    }
+
+    ClientReply request(uint16_t type, const std::string& payload, uint16_t flags = FRAME_FLAG_NONE,
+                        std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        return submit(type, payload, flags, timeout).get();
+    }
+
+    size_t openConnections() {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        size_t open = 0;
+        for (Slot& slot : slots) {
+            if (slot.client && slot.client->isOpen()) open++;
+        }
+        return open;
+    }
+
+    std::string stats() {
+        return "Connections: " + std::to_string(openConnections()) + "/" + std::to_string(options.connections) + " open"
+            + ", reconnects=" + std::to_string(reconnects.load()) + ", failed connects=" + std::to_string(connectFailures.load())
+            + ", timeouts=" + std::to_string(timeouts.load()) + ", failed health checks=" + std::to_string(failedHealthChecks.load());
+    }
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+// Log-linear latency histogram in the style of HdrHistogram. Values below 128 are counted
+// exactly; above that, each power of two is split into 64 equal buckets, so any percentile
+// read back is within 1/64 (about 1.6%) of the true value. Values up to 2^40 (18 minutes in
+// nanoseconds) fit in a fixed 18 KB of counters; larger ones are counted as 2^40.
+//
+//   LatencyHistogram histogram;
+//   histogram.record(elapsedNanos);
+//   uint64_t p99 = histogram.percentile(99.0);
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+class LatencyHistogram {
+    friend class SingleWriterHistogram;
+
+public:
+    static const int SUB_BUCKET_BITS = 7;
+    static const uint64_t SUB_BUCKETS = 1ull << SUB_BUCKET_BITS;     // 128
+    static const uint64_t HALF_SUB_BUCKETS = SUB_BUCKETS / 2;
+    static const int MAX_VALUE_BITS = 40;
+    static const uint64_t MAX_VALUE = (1ull << MAX_VALUE_BITS) - 1;
+    static const size_t BUCKETS = static_cast<size_t>((MAX_VALUE_BITS - SUB_BUCKET_BITS + 2) * HALF_SUB_BUCKETS);
+
+private:
+    std::array<uint64_t, BUCKETS> counts{};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t minimum = UINT64_MAX;
+    uint64_t maximum = 0;
+
+    static int highestBit(uint64_t value) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return static_cast<int>(index);
+#else
+        return 63 - __builtin_clzll(value);
+#endif
+    }
+
+public:
+    // Bucket 0..127 holds that exact value; after that, bucket (shift + 1) * 64 + k covers
+    // [ (64 + k) << shift, (65 + k) << shift )
+    static size_t bucketOf(uint64_t value) {
+        if (value > MAX_VALUE) value = MAX_VALUE;
+        if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+        int shift = highestBit(value) - SUB_BUCKET_BITS + 1;
+        return static_cast<size_t>((shift + 1) * HALF_SUB_BUCKETS + ((value >> shift) - HALF_SUB_BUCKETS));
+    }
+
+    // Largest value counted in bucket
+    static uint64_t bucketHigh(size_t bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        uint64_t shift = bucket / HALF_SUB_BUCKETS - 1;
+        uint64_t sub = bucket % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t value, uint64_t count = 1) {
+        counts[bucketOf(value)] += count;
+        total += count;
+        sum += value * count;
+        minimum = std::min(minimum, value);
+        maximum = std::max(maximum, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < BUCKETS; i++) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+    }
+
+    void reset() {
+        counts.fill(0);
+        total = 0;
+        sum = 0;
+        minimum = UINT64_MAX;
+        maximum = 0;
+    }
+
+    // Smallest recorded value v such that percent% of the values are <= v (to bucket
+    // precision, and never above the largest value recorded)
+    uint64_t percentile(double percent) const {
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(percent / 100.0 * static_cast<double>(total) + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(bucketHigh(i), maximum);
+        }
+        return maximum;
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t min() const {
+        return total == 0 ? 0 : minimum;
+    }
+
+    uint64_t max() const {
+        return maximum;
+    }
+
+    double mean() const {
+        return total == 0 ? 0.0 : static_cast<double>(sum) / static_cast<double>(total);
+    }
+
+    uint64_t bucketCount(size_t bucket) const {
+        return counts[bucket];
+    }
+};
+
+// LatencyHistogram that one thread records into while any other thread may read it. The
+// counters are atomics, but the owner updates them with a plain load and store rather than
+// a locked read-modify-write, so recording costs about the same as in LatencyHistogram.
+// Only the owning thread may call record().
+class SingleWriterHistogram {
+private:
+    std::array<std::atomic<uint64_t>, LatencyHistogram::BUCKETS> counts{};
+    std::atomic<uint64_t> total{ 0 };
+    std::atomic<uint64_t> sum{ 0 };
+    std::atomic<uint64_t> minimum{ UINT64_MAX };
+    std::atomic<uint64_t> maximum{ 0 };
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+public:
+    void record(uint64_t value) {
+        add(counts[LatencyHistogram::bucketOf(value)], 1);
+        add(total, 1);
+        add(sum, value);
+        if (value < minimum.load(std::memory_order_relaxed)) minimum.store(value, std::memory_order_relaxed);
+        if (value > maximum.load(std::memory_order_relaxed)) maximum.store(value, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    // Adds the values recorded so far to histogram. Records made while this runs may be
+    // partly included (e.g. in a bucket but not yet in the total).
+    void addTo(LatencyHistogram& histogram) const {
+        for (size_t i = 0; i < LatencyHistogram::BUCKETS; i++) {
+            histogram.counts[i] += counts[i].load(std::memory_order_relaxed);
+        }
+        histogram.total += total.load(std::memory_order_relaxed);
+        histogram.sum += sum.load(std::memory_order_relaxed);
+        histogram.minimum = std::min(histogram.minimum, minimum.load(std::memory_order_relaxed));
+        histogram.maximum = std::max(histogram.maximum, maximum.load(std::memory_order_relaxed));
+    }
+};
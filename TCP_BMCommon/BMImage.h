@@ -0,0 +1,430 @@
+#pragma once
+
+// Image decoding, encoding and resampling for server-side thumbnails. Header-only and free of
+// dependencies, so it builds offline with the rest of the tree.
+//
+// Decodes uncompressed BMP (24 or 32 bits per pixel, bottom-up or top-down) and binary PPM
+// (P6); encodes 24-bit BMP. Compressed formats such as JPEG and PNG are reported as
+// unsupported rather than guessed at.
+//
+// resizeImage() is separable: a horizontal pass from the 8-bit source into a float buffer,
+// then a vertical pass back to 8 bits. Both use Catmull-Rom weights stretched by the scale
+// factor, so a downscale averages every source pixel instead of skipping rows. Pixels are
+// RGBA, which puts one pixel in one SSE register for the horizontal pass; the vertical pass
+// is a weighted sum of whole rows and runs 8 floats at a time with AVX2 when the CPU has it.
+
+#include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BM_IMAGE_X64 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BM_IMAGE_AVX2_TARGET
+#else
+#define BM_IMAGE_AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+struct Image {
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> pixels; // RGBA, row by row from the top
+};
+
+enum class ResizePath {
+    SCALAR,
+    SSE2,
+    AVX2
+};
+
+namespace image_detail {
+
+const uint64_t MAX_PIXELS = 100000000; // refuse to allocate for absurd headers
+
+inline uint32_t readLE32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16)
+        | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+inline uint16_t readLE16(const unsigned char* p) {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+inline void writeLE32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out += static_cast<char>(value >> (8 * i));
+}
+
+inline void writeLE16(std::string& out, uint16_t value) {
+    out += static_cast<char>(value);
+    out += static_cast<char>(value >> 8);
+}
+
+inline bool decodeBmp(const unsigned char* data, size_t size, Image& image, std::string& error) {
+    if (size < 54) {
+        error = "truncated BMP header";
+        return false;
+    }
+    uint32_t pixelOffset = readLE32(data + 10);
+    int32_t width = static_cast<int32_t>(readLE32(data + 18));
+    int32_t height = static_cast<int32_t>(readLE32(data + 22));
+    uint16_t bitsPerPixel = readLE16(data + 28);
+    uint32_t compression = readLE32(data + 30);
+    bool topDown = height < 0;
+    if (topDown) height = -height;
+    // BI_RGB, or BI_BITFIELDS with the usual BGRA layout for 32 bits per pixel
+    if ((bitsPerPixel != 24 && bitsPerPixel != 32) || (compression != 0 && !(compression == 3 && bitsPerPixel == 32))) {
+        error = "unsupported BMP variant (" + std::to_string(bitsPerPixel) + " bpp, compression " + std::to_string(compression) + ")";
+        return false;
+    }
+    if (width <= 0 || height <= 0 || static_cast<uint64_t>(width) * height > MAX_PIXELS) {
+        error = "bad BMP dimensions";
+        return false;
+    }
+    size_t bytesPerPixel = bitsPerPixel / 8;
+    size_t stride = (static_cast<size_t>(width) * bytesPerPixel + 3) & ~static_cast<size_t>(3);
+    if (pixelOffset > size || stride * height > size - pixelOffset) {
+        error = "truncated BMP pixel data";
+        return false;
+    }
+    image.width = width;
+    image.height = height;
+    image.pixels.resize(static_cast<size_t>(width) * height * 4);
+    for (int y = 0; y < height; y++) {
+        const unsigned char* row = data + pixelOffset + stride * (topDown ? y : height - 1 - y);
+        uint8_t* out = &image.pixels[static_cast<size_t>(y) * width * 4];
+        for (int x = 0; x < width; x++, row += bytesPerPixel, out += 4) {
+            out[0] = row[2];
+            out[1] = row[1];
+            out[2] = row[0];
+            out[3] = 255;
+        }
+    }
+    return true;
+}
+
+inline bool decodePpm(const unsigned char* data, size_t size, Image& image, std::string& error) {
+    // "P6" width height maxval, separated by whitespace and # comments, then one whitespace byte
+    size_t pos = 2;
+    long values[3];
+    for (long& value : values) {
+        while (pos < size && (isspace(data[pos]) || data[pos] == '#')) {
+            if (data[pos] == '#') {
+                while (pos < size && data[pos] != '\n') pos++;
+            }
+            else {
+                pos++;
+            }
+        }
+        value = 0;
+        size_t digits = 0;
+        while (pos < size && data[pos] >= '0' && data[pos] <= '9' && digits < 9) {
+            value = value * 10 + (data[pos++] - '0');
+            digits++;
+        }
+        if (digits == 0) {
+            error = "bad PPM header";
+            return false;
+        }
+    }
+    pos++;
+    long width = values[0], height = values[1], maxValue = values[2];
+    if (width <= 0 || height <= 0 || static_cast<uint64_t>(width) * height > MAX_PIXELS || maxValue <= 0 || maxValue > 255) {
+        error = "unsupported PPM (" + std::to_string(width) + "x" + std::to_string(height) + ", maxval " + std::to_string(maxValue) + ")";
+        return false;
+    }
+    if (pos > size || static_cast<uint64_t>(width) * height * 3 > size - pos) {
+        error = "truncated PPM pixel data";
+        return false;
+    }
+    image.width = static_cast<int>(width);
+    image.height = static_cast<int>(height);
+    image.pixels.resize(static_cast<size_t>(width) * height * 4);
+    const unsigned char* in = data + pos;
+    uint8_t* out = image.pixels.data();
+    for (size_t i = 0; i < static_cast<size_t>(width) * height; i++, in += 3, out += 4) {
+        for (int c = 0; c < 3; c++) out[c] = static_cast<uint8_t>(in[c] * 255 / maxValue);
+        out[3] = 255;
+    }
+    return true;
+}
+
+// Catmull-Rom cubic
+inline float cubicWeight(float x) {
+    x = std::fabs(x);
+    if (x < 1.0f) return (1.5f * x - 2.5f) * x * x + 1.0f;
+    if (x < 2.0f) return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+    return 0.0f;
+}
+
+// For every output coordinate: the first source coordinate it reads and its weights
+struct Contributions {
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<size_t> offset; // into weights
+    std::vector<float> weights;
+};
+
+inline Contributions contributions(int sourceSize, int targetSize) {
+    Contributions result;
+    float scale = static_cast<float>(sourceSize) / targetSize;
+    float stretch = scale > 1.0f ? scale : 1.0f;
+    float support = 2.0f * stretch;
+    for (int i = 0; i < targetSize; i++) {
+        float center = (i + 0.5f) * scale;
+        int first = static_cast<int>(std::floor(center - support));
+        int last = static_cast<int>(std::ceil(center + support));
+        if (first < 0) first = 0;
+        if (last > sourceSize - 1) last = sourceSize - 1;
+        size_t offset = result.weights.size();
+        float total = 0.0f;
+        for (int j = first; j <= last; j++) {
+            float weight = cubicWeight((j + 0.5f - center) / stretch);
+            result.weights.push_back(weight);
+            total += weight;
+        }
+        for (size_t k = offset; k < result.weights.size(); k++) result.weights[k] /= total;
+        result.first.push_back(first);
+        result.count.push_back(last - first + 1);
+        result.offset.push_back(offset);
+    }
+    return result;
+}
+
+inline uint8_t toByte(float value) {
+    long rounded = std::lround(value);
+    return static_cast<uint8_t>(rounded < 0 ? 0 : rounded > 255 ? 255 : rounded);
+}
+
+inline void horizontalScalar(const uint8_t* row, const Contributions& columns, int targetWidth, float* out) {
+    for (int x = 0; x < targetWidth; x++, out += 4) {
+        const uint8_t* pixel = row + static_cast<size_t>(columns.first[x]) * 4;
+        const float* weights = &columns.weights[columns.offset[x]];
+        float sum[4] = { 0, 0, 0, 0 };
+        for (int k = 0; k < columns.count[x]; k++, pixel += 4) {
+            for (int c = 0; c < 4; c++) sum[c] += weights[k] * pixel[c];
+        }
+        memcpy(out, sum, sizeof(sum));
+    }
+}
+
+// Values begin .. length - 1 of the weighted sum of rows
+inline void verticalScalar(const float* const* rows, const float* weights, int count, size_t begin, size_t length, uint8_t* out) {
+    for (size_t i = begin; i < length; i++) {
+        float sum = 0.0f;
+        for (int k = 0; k < count; k++) sum += weights[k] * rows[k][i];
+        out[i] = toByte(sum);
+    }
+}
+
+#ifdef BM_IMAGE_X64
+
+// SSE2 is part of x86-64, so this path needs no CPU check
+inline void horizontalSse2(const uint8_t* row, const Contributions& columns, int targetWidth, float* out) {
+    const __m128i zero = _mm_setzero_si128();
+    for (int x = 0; x < targetWidth; x++, out += 4) {
+        const uint8_t* pixel = row + static_cast<size_t>(columns.first[x]) * 4;
+        const float* weights = &columns.weights[columns.offset[x]];
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < columns.count[x]; k++, pixel += 4) {
+            int32_t rgba;
+            memcpy(&rgba, pixel, 4);
+            __m128i widened = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(rgba), zero), zero);
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_cvtepi32_ps(widened)));
+        }
+        _mm_storeu_ps(out, sum);
+    }
+}
+
+inline void verticalSse2(const float* const* rows, const float* weights, int count, size_t length, uint8_t* out) {
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < count; k++) sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(rows[k] + i)));
+        __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(sum), _mm_setzero_si128());
+        int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        memcpy(out + i, &bytes, 4);
+    }
+    verticalScalar(rows, weights, count, i, length, out);
+}
+
+BM_IMAGE_AVX2_TARGET
+inline void verticalAvx2(const float* const* rows, const float* weights, int count, size_t length, uint8_t* out) {
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < count; k++) {
+            sum = _mm256_fmadd_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(rows[k] + i), sum);
+        }
+        __m256i rounded = _mm256_cvtps_epi32(sum);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(words, words));
+    }
+    verticalScalar(rows, weights, count, i, length, out);
+}
+
+inline bool detectAvx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool osSaves = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return fma && osSaves && (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+#endif
+
+} // namespace image_detail
+
+inline bool resizePathSupported(ResizePath path) {
+#ifdef BM_IMAGE_X64
+    static const bool avx2 = image_detail::detectAvx2();
+    return path != ResizePath::AVX2 || avx2;
+#else
+    return path == ResizePath::SCALAR;
+#endif
+}
+
+inline ResizePath resizeBestPath() {
+    if (resizePathSupported(ResizePath::AVX2)) return ResizePath::AVX2;
+    if (resizePathSupported(ResizePath::SSE2)) return ResizePath::SSE2;
+    return ResizePath::SCALAR;
+}
+
+inline const char* resizePathName(ResizePath path) {
+    switch (path) {
+    case ResizePath::AVX2: return "avx2";
+    case ResizePath::SSE2: return "sse2";
+    default: return "scalar";
+    }
+}
+
+// Decodes BMP or PPM into RGBA; error says why an image could not be decoded
+inline bool decodeImage(const void* data, size_t size, Image& image, std::string& error) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    if (size >= 2 && bytes[0] == 'B' && bytes[1] == 'M') {
+        return image_detail::decodeBmp(bytes, size, image, error);
+    }
+    if (size >= 2 && bytes[0] == 'P' && bytes[1] == '6') {
+        return image_detail::decodePpm(bytes, size, image, error);
+    }
+    if (size >= 3 && bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF) {
+        error = "JPEG is not supported";
+    }
+    else if (size >= 8 && memcmp(bytes, "\x89PNG", 4) == 0) {
+        error = "PNG is not supported";
+    }
+    else {
+        error = "unknown image format";
+    }
+    return false;
+}
+
+// 24-bit bottom-up BMP
+inline std::string encodeBmp(const Image& image) {
+    using namespace image_detail;
+    size_t stride = (static_cast<size_t>(image.width) * 3 + 3) & ~static_cast<size_t>(3);
+    uint32_t pixelBytes = static_cast<uint32_t>(stride * image.height);
+    std::string out;
+    out.reserve(54 + pixelBytes);
+    out += "BM";
+    writeLE32(out, 54 + pixelBytes);
+    writeLE32(out, 0);
+    writeLE32(out, 54);
+    writeLE32(out, 40);
+    writeLE32(out, static_cast<uint32_t>(image.width));
+    writeLE32(out, static_cast<uint32_t>(image.height));
+    writeLE16(out, 1);
+    writeLE16(out, 24);
+    writeLE32(out, 0);
+    writeLE32(out, pixelBytes);
+    writeLE32(out, 2835); // 72 dpi
+    writeLE32(out, 2835);
+    writeLE32(out, 0);
+    writeLE32(out, 0);
+    for (int y = image.height - 1; y >= 0; y--) {
+        const uint8_t* pixel = &image.pixels[static_cast<size_t>(y) * image.width * 4];
+        size_t rowStart = out.size();
+        for (int x = 0; x < image.width; x++, pixel += 4) {
+            out += static_cast<char>(pixel[2]);
+            out += static_cast<char>(pixel[1]);
+            out += static_cast<char>(pixel[0]);
+        }
+        out.append(stride - (out.size() - rowStart), '\0');
+    }
+    return out;
+}
+
+// The largest size with the same aspect ratio that fits in a box x box square; images that
+// already fit keep their size
+inline void fitWithin(int width, int height, int box, int& fitWidth, int& fitHeight) {
+    if (width <= box && height <= box) {
+        fitWidth = width;
+        fitHeight = height;
+        return;
+    }
+    double scale = static_cast<double>(box) / (width > height ? width : height);
+    fitWidth = static_cast<int>(std::lround(width * scale));
+    fitHeight = static_cast<int>(std::lround(height * scale));
+    if (fitWidth < 1) fitWidth = 1;
+    if (fitHeight < 1) fitHeight = 1;
+}
+
+inline Image resizeImage(const Image& source, int width, int height, ResizePath path = resizeBestPath()) {
+    using namespace image_detail;
+    Image target;
+    target.width = width;
+    target.height = height;
+    target.pixels.resize(static_cast<size_t>(width) * height * 4);
+    Contributions columns = contributions(source.width, width);
+    Contributions rows = contributions(source.height, height);
+
+    // Horizontal pass over every source row the vertical pass will read
+    size_t rowFloats = static_cast<size_t>(width) * 4;
+    std::vector<float> narrowed(static_cast<size_t>(source.height) * rowFloats);
+    for (int y = 0; y < source.height; y++) {
+        const uint8_t* in = &source.pixels[static_cast<size_t>(y) * source.width * 4];
+        float* out = &narrowed[y * rowFloats];
+#ifdef BM_IMAGE_X64
+        if (path != ResizePath::SCALAR) {
+            horizontalSse2(in, columns, width, out);
+            continue;
+        }
+#endif
+        horizontalScalar(in, columns, width, out);
+    }
+
+    std::vector<const float*> taps;
+    for (int y = 0; y < height; y++) {
+        taps.clear();
+        for (int k = 0; k < rows.count[y]; k++) taps.push_back(&narrowed[(rows.first[y] + k) * rowFloats]);
+        const float* weights = &rows.weights[rows.offset[y]];
+        uint8_t* out = &target.pixels[y * rowFloats];
+#ifdef BM_IMAGE_X64
+        if (path == ResizePath::AVX2) {
+            verticalAvx2(taps.data(), weights, rows.count[y], rowFloats, out);
+            continue;
+        }
+        if (path == ResizePath::SSE2) {
+            verticalSse2(taps.data(), weights, rows.count[y], rowFloats, out);
+            continue;
+        }
+#endif
+        verticalScalar(taps.data(), weights, rows.count[y], 0, rowFloats, out);
+    }
+    return target;
+}
@@ -0,0 +1,405 @@
+#pragma once
+
+// Wire protocol shared by the boutique server and client.
+//
+// Every message is a frame: a fixed 20-byte header followed by the payload.
+//
+//   offset  size  field
+//   0       1     magic (0xBF)
+//   1       1     version (1)
+//   2       2     flags
+//   4       2     message type
+//   6       2     reserved (0)
+//   8       4     request id, echoed back in the response
+//   12      8     payload length
+//
+// A client may send further requests without waiting for the replies to earlier ones
+// (pipelining). Each reply echoes its request's id, so clients match replies by id rather
+// than by order. The server runs one connection's requests one at a time in the order they
+// were sent, so a request sees the effects of every request sent before it on that
+// connection (an order pipelined after the ADD_CUSTOMER it depends on finds the customer).
+//
+// All integers are big-endian. The magic byte is never an ASCII digit, so a receiver can
+// still accept the old unframed "type|data" text messages: anything that does not start
+// with the magic byte is treated as one legacy text message and answered in plain text.
+//
+// VIEW_* requests may ask for one page at a time. The payload is "limit", "limit offset" or
+// "limit cursor"; an empty payload returns the whole collection. When more records follow,
+// the reply carries FRAME_FLAG_MORE and ends with a "MORE: <cursor>" line; sending that
+// cursor back continues exactly where the page ended, even if records were added since.
+//
+// FILTER finds dresses by attribute, e.g. "stitched color=red,maroon material=chiffon
+// maxPrice=5000". color, material, brand and size match any of their comma-separated values,
+// ignoring case; minPrice, maxPrice, minDiscounted and maxDiscounted are inclusive bounds. The
+// reply is paged like VIEW: "limit=N" sets the page size and "cursor=<cursor>" continues from
+// a "MORE: <cursor>" line.
+//
+// SEARCH_TEXT finds customers by name or address and dresses by name or brand, tolerating
+// typos, e.g. "customers ayesha kahn karachi". The reply lists the best K matches (10 unless
+// "limit=K" is given, at most 100), best first, each with the share of the query it matched.
+//
+// REPORT answers sales questions from totals the server keeps up to date on every order:
+// "summary", "types" (per dress type), "top-dresses [N] [revenue|units]", "top-customers [N]",
+// "dress S|U <id>" and "customer <id>". "verify" and "rebuild" recompute the totals from the
+// orders and compare them with, or replace, the running ones.
+//
+// Large images can be uploaded in parts. UPLOAD_BEGIN opens (or resumes) an upload and
+// answers "SUCCESS: Upload <id> ... resumeOffset=<bytes> missing=<parts>". Parts are numbered
+// from 0, every part but the last is partSize bytes, each carries its own CRC32C (hex) and
+// they may be sent in any order over any number of connections. UPLOAD_COMMIT checks the
+// CRC32C of the whole image before it is stored. Uploads survive disconnects and restarts.
+//
+// Before uploading, a client can send LINK_IMAGE with the SHA-256 of the image. If the server
+// already stores those contents (under any name) it links the new name to them and answers
+// SUCCESS, and the image bytes never need to be sent.
+//
+// GET_IMAGE answers "SUCCESS: Image <name> size=<bytes> etag=<etag>\n" followed by the image.
+// A client that sends the ETag of the copy it has gets FRAME_FLAG_NOT_MODIFIED and no bytes
+// if the image has not changed since.
+//
+// The server makes thumbnails of every stored image in the background. GET_THUMBNAIL answers
+// like GET_IMAGE with a BMP that fits in a size x size square, for each size the server makes
+// (128 and 512); until it is ready the answer is an ERROR that says to retry.
+//
+// BATCH carries any number of complete request frames back to back as its payload and is
+// answered with one DATA_RESPONSE whose payload is their responses, in the same order and
+// with the same request ids. Inserts that follow each other in a batch are written together.
+// With FRAME_FLAG_ATOMIC the batch may only contain inserts (ADD_*, PROCESS_ORDER) and they
+// are either all applied or, if any of them fails, none are.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+typedef int SOCKET;
+#ifndef INVALID_SOCKET
+#define INVALID_SOCKET (-1)
+#endif
+#ifndef SOCKET_ERROR
+#define SOCKET_ERROR (-1)
+#endif
+#ifndef closesocket
+#define closesocket close
+#endif
+#endif
+
+// Message types
+enum MessageType {
+    ADD_STITCHED_DRESS = 1,
+    ADD_UNSTITCHED_DRESS = 2,
+    VIEW_STITCHED_DRESSES = 3,
+    VIEW_UNSTITCHED_DRESSES = 4,
+    SEARCH_STITCHED_DRESS = 5,
+    SEARCH_UNSTITCHED_DRESS = 6,
+    COUNT_STITCHED_DRESSES = 9,
+    COUNT_UNSTITCHED_DRESSES = 10,
+    ADD_CUSTOMER = 11,
+    VIEW_CUSTOMERS = 12,
+    SEARCH_CUSTOMER = 13,
+    COUNT_CUSTOMERS = 15,
+    PROCESS_ORDER = 16,
+    VIEW_ORDERS = 17,
+    SEARCH_ORDER = 18,
+    SEND_IMAGE = 19,
+    CONVERT_TO_UPPERCASE = 20,
+    UPLOAD_IMAGE = 21,          // payload: "name|" followed by the raw image bytes
+    UPLOAD_BEGIN = 22,          // payload: "name size crc32c [partSize]", replies with the upload state
+    UPLOAD_PART = 23,           // payload: "uploadId part crc32c|" followed by the part's bytes
+    UPLOAD_STATUS = 24,         // payload: "uploadId"
+    UPLOAD_COMMIT = 25,         // payload: "uploadId"
+    UPLOAD_ABORT = 26,          // payload: "uploadId"
+    GET_IMAGE = 27,             // payload: "name" or "name|etag"
+    IMAGE_CACHE_STATS = 28,
+    LINK_IMAGE = 29,            // payload: "name sha256"; stores name if the server has the contents
+    IMAGE_STORE_STATS = 30,
+    GET_THUMBNAIL = 31,         // payload: "name|size" or "name|size|etag"
+    BATCH = 32,                 // payload: request frames back to back
+    PING = 33,                  // health check; answers "SUCCESS: PONG"
+    STATS = 34,                 // payload: "" for a summary, "prometheus" for the text exposition format
+    FILTER = 35,                // payload: "stitched|unstitched key=value ..." (see below)
+    SEARCH_TEXT = 36,           // payload: "customers|stitched|unstitched|dresses [limit=K] words"
+    REPORT = 37,                // payload: report name and arguments (see below)
+    SUCCESS_RESPONSE = 100,
+    ERROR_RESPONSE = 101,
+    DATA_RESPONSE = 102
+};
+
+// Name of a request type as used in logs and metrics; "UNKNOWN" for anything else
+inline const char* messageTypeName(int type) {
+    switch (type) {
+    case ADD_STITCHED_DRESS: return "ADD_STITCHED_DRESS";
+    case ADD_UNSTITCHED_DRESS: return "ADD_UNSTITCHED_DRESS";
+    case VIEW_STITCHED_DRESSES: return "VIEW_STITCHED_DRESSES";
+    case VIEW_UNSTITCHED_DRESSES: return "VIEW_UNSTITCHED_DRESSES";
+    case SEARCH_STITCHED_DRESS: return "SEARCH_STITCHED_DRESS";
+    case SEARCH_UNSTITCHED_DRESS: return "SEARCH_UNSTITCHED_DRESS";
+    case COUNT_STITCHED_DRESSES: return "COUNT_STITCHED_DRESSES";
+    case COUNT_UNSTITCHED_DRESSES: return "COUNT_UNSTITCHED_DRESSES";
+    case ADD_CUSTOMER: return "ADD_CUSTOMER";
+    case VIEW_CUSTOMERS: return "VIEW_CUSTOMERS";
+    case SEARCH_CUSTOMER: return "SEARCH_CUSTOMER";
+    case COUNT_CUSTOMERS: return "COUNT_CUSTOMERS";
+    case PROCESS_ORDER: return "PROCESS_ORDER";
+    case VIEW_ORDERS: return "VIEW_ORDERS";
+    case SEARCH_ORDER: return "SEARCH_ORDER";
+    case SEND_IMAGE: return "SEND_IMAGE";
+    case CONVERT_TO_UPPERCASE: return "CONVERT_TO_UPPERCASE";
+    case UPLOAD_IMAGE: return "UPLOAD_IMAGE";
+    case UPLOAD_BEGIN: return "UPLOAD_BEGIN";
+    case UPLOAD_PART: return "UPLOAD_PART";
+    case UPLOAD_STATUS: return "UPLOAD_STATUS";
+    case UPLOAD_COMMIT: return "UPLOAD_COMMIT";
+    case UPLOAD_ABORT: return "UPLOAD_ABORT";
+    case GET_IMAGE: return "GET_IMAGE";
+    case IMAGE_CACHE_STATS: return "IMAGE_CACHE_STATS";
+    case LINK_IMAGE: return "LINK_IMAGE";
+    case IMAGE_STORE_STATS: return "IMAGE_STORE_STATS";
+    case GET_THUMBNAIL: return "GET_THUMBNAIL";
+    case BATCH: return "BATCH";
+    case PING: return "PING";
+    case STATS: return "STATS";
+    case FILTER: return "FILTER";
+    case SEARCH_TEXT: return "SEARCH_TEXT";
+    case REPORT: return "REPORT";
+    default: return "UNKNOWN";
+    }
+}
+
+const uint8_t FRAME_MAGIC = 0xBF;
+const uint8_t FRAME_VERSION = 1;
+const size_t FRAME_HEADER_SIZE = 20;
+
+enum FrameFlags : uint16_t {
+    FRAME_FLAG_NONE = 0x0000,
+    FRAME_FLAG_MORE = 0x0001,           // paged VIEW reply with more records after it
+    FRAME_FLAG_NOT_MODIFIED = 0x0002,   // GET_IMAGE or GET_THUMBNAIL reply: the client's copy is current
+    FRAME_FLAG_ATOMIC = 0x0004          // BATCH request: apply all of its inserts or none
+};
+
+const char* const VIEW_MORE_MARKER = "MORE: ";
+
+struct FrameHeader {
+    uint16_t flags = FRAME_FLAG_NONE;
+    uint16_t type = 0;
+    uint32_t requestId = 0;
+    uint64_t payloadLength = 0;
+};
+
+inline void encodeFrameHeader(const FrameHeader& header, char* out) {
+    unsigned char* p = reinterpret_cast<unsigned char*>(out);
+    p[0] = FRAME_MAGIC;
+    p[1] = FRAME_VERSION;
+    p[2] = static_cast<unsigned char>(header.flags >> 8);
+    p[3] = static_cast<unsigned char>(header.flags);
+    p[4] = static_cast<unsigned char>(header.type >> 8);
+    p[5] = static_cast<unsigned char>(header.type);
+    p[6] = 0;
+    p[7] = 0;
+    for (int i = 0; i < 4; i++) p[8 + i] = static_cast<unsigned char>(header.requestId >> (24 - 8 * i));
+    for (int i = 0; i < 8; i++) p[12 + i] = static_cast<unsigned char>(header.payloadLength >> (56 - 8 * i));
+}
+
+inline FrameHeader decodeFrameHeader(const char* in) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+    FrameHeader header;
+    header.flags = static_cast<uint16_t>((p[2] << 8) | p[3]);
+    header.type = static_cast<uint16_t>((p[4] << 8) | p[5]);
+    header.requestId = 0;
+    for (int i = 0; i < 4; i++) header.requestId = (header.requestId << 8) | p[8 + i];
+    header.payloadLength = 0;
+    for (int i = 0; i < 8; i++) header.payloadLength = (header.payloadLength << 8) | p[12 + i];
+    return header;
+}
+
+inline std::string encodeFrame(uint16_t type, uint32_t requestId, const std::string& payload, uint16_t flags = FRAME_FLAG_NONE) {
+    FrameHeader header;
+    header.flags = flags;
+    header.type = type;
+    header.requestId = requestId;
+    header.payloadLength = payload.size();
+    std::string frame(FRAME_HEADER_SIZE, '\0');
+    encodeFrameHeader(header, &frame[0]);
+    frame += payload;
+    return frame;
+}
+
+// Walks the frames packed into a BATCH request or reply. Returns false at the end of the
+// batch or at a malformed frame; the batch was well formed if pos reached batch.size().
+inline bool nextBatchFrame(const std::string& batch, size_t& pos, FrameHeader& header, std::string& payload) {
+    if (batch.size() - pos < FRAME_HEADER_SIZE || static_cast<unsigned char>(batch[pos]) != FRAME_MAGIC
+        || static_cast<unsigned char>(batch[pos + 1]) != FRAME_VERSION) {
+        return false;
+    }
+    header = decodeFrameHeader(batch.data() + pos);
+    if (header.payloadLength > batch.size() - pos - FRAME_HEADER_SIZE) {
+        return false;
+    }
+    payload.assign(batch, pos + FRAME_HEADER_SIZE, static_cast<size_t>(header.payloadLength));
+    pos += FRAME_HEADER_SIZE + static_cast<size_t>(header.payloadLength);
+    return true;
+}
+
+// Receives the events produced by FrameParser. Payload bytes are handed over as slices of
+// the caller's receive buffer; they are only valid for the duration of the call.
+class FrameListener {
+public:
+    virtual ~FrameListener() {}
+    virtual void onFrameBegin(const FrameHeader& header) = 0;
+    virtual void onFramePayload(const FrameHeader& header, const char* data, size_t length) = 0;
+    virtual void onFrameEnd(const FrameHeader& header) = 0;
+    virtual void onTextMessage(const char* data, size_t length) = 0;
+    virtual void onProtocolError(const std::string& reason) = 0;
+};
+
+// Incremental frame parser. Feed it whatever recv() returned; it reassembles headers split
+// across reads and streams payloads to the listener without buffering them, so frames of
+// any size pass through in constant memory.
+class FrameParser {
+private:
+    enum State { READ_HEADER, READ_PAYLOAD, FAILED };
+
+    FrameListener& listener;
+    State state = READ_HEADER;
+    char headerBuffer[FRAME_HEADER_SIZE];
+    size_t headerBytes = 0;
+    FrameHeader current;
+    uint64_t remaining = 0;
+
+public:
+    explicit FrameParser(FrameListener& listener) : listener(listener) {}
+
+    bool failed() const {
+        return state == FAILED;
+    }
+
+    // True while a frame has been started but not completed
+    bool midFrame() const {
+        return headerBytes > 0 || state == READ_PAYLOAD;
+    }
+
+    void feed(const char* data, size_t length) {
+        size_t pos = 0;
+        while (pos < length && state != FAILED) {
+            if (state == READ_HEADER) {
+                if (headerBytes == 0 && static_cast<unsigned char>(data[pos]) != FRAME_MAGIC) {
+                    // Legacy client: one unframed message per send, answered before the next one
+                    listener.onTextMessage(data + pos, length - pos);
+                    return;
+                }
+                size_t take = FRAME_HEADER_SIZE - headerBytes;
+                if (take > length - pos) take = length - pos;
+                memcpy(headerBuffer + headerBytes, data + pos, take);
+                headerBytes += take;
+                pos += take;
+                if (headerBytes < FRAME_HEADER_SIZE) {
+                    return;
+                }
+                headerBytes = 0;
+                if (static_cast<unsigned char>(headerBuffer[1]) != FRAME_VERSION) {
+                    state = FAILED;
+                    listener.onProtocolError("Unsupported frame version " + std::to_string(static_cast<unsigned char>(headerBuffer[1])));
+                    return;
+                }
+                current = decodeFrameHeader(headerBuffer);
+                remaining = current.payloadLength;
+                listener.onFrameBegin(current);
+                if (remaining == 0) {
+                    listener.onFrameEnd(current);
+                }
+                else {
+                    state = READ_PAYLOAD;
+                }
+            }
+            else {
+                size_t take = length - pos;
+                if (take > remaining) take = static_cast<size_t>(remaining);
+                listener.onFramePayload(current, data + pos, take);
+                remaining -= take;
+                pos += take;
+                if (remaining == 0) {
+                    state = READ_HEADER;
+                    listener.onFrameEnd(current);
+                }
+            }
+        }
+    }
+};
+
+// Sending to a connection the peer has reset fails instead of raising SIGPIPE, which would
+// end the process before it could reconnect (where there is no MSG_NOSIGNAL, connectTo sets
+// SO_NOSIGPIPE on the socket instead)
+inline bool sendAll(SOCKET socket, const char* data, size_t length) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    while (length > 0) {
+        int chunk = length > 0x40000000 ? 0x40000000 : static_cast<int>(length);
+        int sent = send(socket, data, chunk, flags);
+        if (sent == SOCKET_ERROR || sent == 0) {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+inline bool recvAll(SOCKET socket, char* data, size_t length) {
+    while (length > 0) {
+        int chunk = length > 0x40000000 ? 0x40000000 : static_cast<int>(length);
+        int received = recv(socket, data, chunk, 0);
+        if (received == SOCKET_ERROR || received == 0) {
+            return false;
+        }
+        data += received;
+        length -= received;
+    }
+    return true;
+}
+
+const size_t SMALL_FRAME_PAYLOAD = 64 * 1024;
+
+inline bool sendFrame(SOCKET socket, uint16_t type, uint32_t requestId, const std::string& payload, uint16_t flags = FRAME_FLAG_NONE) {
+    FrameHeader header;
+    header.flags = flags;
+    header.type = type;
+    header.requestId = requestId;
+    header.payloadLength = payload.size();
+    char headerBytes[FRAME_HEADER_SIZE];
+    encodeFrameHeader(header, headerBytes);
+    if (payload.size() <= SMALL_FRAME_PAYLOAD) {
+        // One send: a separate header write makes the payload wait for the peer's delayed
+        // ACK (Nagle), about 40 ms per request/response round trip
+        std::string frame(headerBytes, FRAME_HEADER_SIZE);
+        frame += payload;
+        return sendAll(socket, frame.data(), frame.size());
+    }
+    return sendAll(socket, headerBytes, FRAME_HEADER_SIZE) && sendAll(socket, payload.data(), payload.size());
+}
+
+// Blocking receive of one complete frame, for simple request/response callers
+inline bool recvFrame(SOCKET socket, FrameHeader& header, std::string& payload) {
+    char headerBytes[FRAME_HEADER_SIZE];
+    if (!recvAll(socket, headerBytes, FRAME_HEADER_SIZE)) {
+        return false;
+    }
+    if (static_cast<unsigned char>(headerBytes[0]) != FRAME_MAGIC || static_cast<unsigned char>(headerBytes[1]) != FRAME_VERSION) {
+        return false;
+    }
+    header = decodeFrameHeader(headerBytes);
+    payload.resize(static_cast<size_t>(header.payloadLength));
+    return payload.empty() || recvAll(socket, &payload[0], payload.size());
+}
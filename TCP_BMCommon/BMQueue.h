@@ -0,0 +1,71 @@
+#pragma once
+
+// Shared by the server's worker pools and the bulk tool's import pipeline.
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <queue>
+#include <utility>
+
+// Bounded multi-producer/multi-consumer queue. Producers either block or are told the queue
+// is full; consumers block until an item arrives or the queue is closed.
+template <typename T>
+class BoundedQueue {
+private:
+    std::mutex queueMutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::queue<T> items;
+    size_t capacity;
+    bool closed = false;
+
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    bool tryPush(T&& item) {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (closed || items.size() >= capacity) {
+            return false;
+        }
+        items.push(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool push(T&& item) {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        notFull.wait(lock, [this]() { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and drained
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        notEmpty.wait(lock, [this]() { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        return items.size();
+    }
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+// Field rules for the records the boutique stores. The server checks every insert with them
+// and TCP_BMBulk checks each imported record before sending it, so a bulk import is refused
+// for exactly the reasons the server would refuse it.
+//
+// A record is sent and stored as one line of space-separated fields in schema order:
+//
+//   string why = checkRecordLine(PROCESS_ORDER, "7 1 3 S 2");   // "" when the line is valid
+//
+// Customer lines from the interactive client keep the spaces inside names and addresses (and
+// may leave some of them empty), so past its ID a customer line is only checked when it has
+// exactly the schema's field count.
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "BMProtocol.h"
+
+enum class FieldKind {
+    KEY,            // positive integer ID
+    PRICE,          // non-negative number
+    AGE,            // integer 0-150
+    QUANTITY,       // positive integer
+    DRESS_TYPE,     // S or U
+    TEXT,           // anything without spaces
+    COMPUTED        // written by the server (an order's total); never sent
+};
+
+struct RecordField {
+    std::string name;
+    FieldKind kind;
+};
+
+// The fields of the collection each ADD_* / PROCESS_ORDER message inserts into; empty for
+// any other type
+inline const std::vector<RecordField>& recordFields(int addType) {
+    static const std::vector<RecordField> none;
+    static const std::vector<RecordField> stitched = []() {
+        std::vector<RecordField> fields = { { "id", FieldKind::KEY }, { "name", FieldKind::TEXT }, { "actualPrice", FieldKind::PRICE },
+            { "color", FieldKind::TEXT }, { "material", FieldKind::TEXT }, { "brand", FieldKind::TEXT },
+            { "size1", FieldKind::TEXT }, { "size2", FieldKind::TEXT }, { "size3", FieldKind::TEXT },
+            { "discountedPrice", FieldKind::PRICE } };
+        for (const char* name : { "designType", "embellishments", "fittingPreference", "sleeveStyle" }) {
+            fields.push_back({ name, FieldKind::TEXT });
+        }
+        return fields;
+    }();
+    static const std::vector<RecordField> unstitched = []() {
+        std::vector<RecordField> fields(stitched.begin(), stitched.begin() + 10);
+        for (const char* name : { "fabricWidth", "dyeStability", "fabricCutType", "totalFabricLength" }) {
+            fields.push_back({ name, FieldKind::TEXT });
+        }
+        return fields;
+    }();
+    static const std::vector<RecordField> customers = { { "id", FieldKind::KEY }, { "fullName", FieldKind::TEXT },
+        { "age", FieldKind::AGE }, { "contactNumber", FieldKind::TEXT }, { "street", FieldKind::TEXT },
+        { "city", FieldKind::TEXT }, { "state", FieldKind::TEXT }, { "country", FieldKind::TEXT } };
+    static const std::vector<RecordField> orders = { { "id", FieldKind::KEY }, { "customerID", FieldKind::KEY },
+        { "dressID", FieldKind::KEY }, { "dressType", FieldKind::DRESS_TYPE }, { "quantity", FieldKind::QUANTITY },
+        { "totalPrice", FieldKind::COMPUTED } };
+    switch (addType) {
+    case ADD_STITCHED_DRESS: return stitched;
+    case ADD_UNSTITCHED_DRESS: return unstitched;
+    case ADD_CUSTOMER: return customers;
+    case PROCESS_ORDER: return orders;
+    default: return none;
+    }
+}
+
+// Fields a record sent to the server is made of
+inline size_t recordInputFields(const std::vector<RecordField>& fields) {
+    return !fields.empty() && fields.back().kind == FieldKind::COMPUTED ? fields.size() - 1 : fields.size();
+}
+
+namespace records_detail {
+
+// The whole field must be the number: "5x" and "" are not integers
+inline bool parseInteger(const char* text, size_t length, long long& value) {
+    if (length == 0 || length > 18) return false;
+    size_t i = text[0] == '-' ? 1 : 0;
+    if (i == length) return false;
+    value = 0;
+    for (; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9') return false;
+        value = value * 10 + (text[i] - '0');
+    }
+    if (text[0] == '-') value = -value;
+    return true;
+}
+
+// text[length] must not continue the number (whitespace or the terminating null)
+inline bool parsePrice(const char* text, size_t length, double& value) {
+    if (length == 0) return false;
+    char* end = nullptr;
+    value = strtod(text, &end);
+    return end == text + length && std::isfinite(value);
+}
+
+}
+
+// Checks one field's text against its kind; returns "" or why it is invalid
+inline std::string checkRecordField(const RecordField& field, const char* value, size_t length) {
+    long long integer;
+    double number;
+    auto invalid = [&](const char* expected) {
+        return "invalid " + field.name + " '" + std::string(value, length) + "' (expected " + expected + ")";
+    };
+    switch (field.kind) {
+    case FieldKind::KEY:
+    case FieldKind::QUANTITY:
+        if (!records_detail::parseInteger(value, length, integer) || integer <= 0 || integer > 2147483647) return invalid("a positive integer");
+        break;
+    case FieldKind::PRICE:
+        if (!records_detail::parsePrice(value, length, number) || number < 0) return invalid("a non-negative price");
+        break;
+    case FieldKind::AGE:
+        if (!records_detail::parseInteger(value, length, integer) || integer < 0 || integer > 150) return invalid("0-150");
+        break;
+    case FieldKind::DRESS_TYPE:
+        if (length != 1 || (value[0] != 'S' && value[0] != 'U')) return invalid("S or U");
+        break;
+    case FieldKind::TEXT:
+    case FieldKind::COMPUTED:
+        break;
+    }
+    return "";
+}
+
+// Checks a whole record line; returns "" or why it is invalid. Fields past the schema are
+// ignored, as the server always has.
+inline std::string checkRecordLine(int addType, const std::string& line) {
+    const std::vector<RecordField>& fields = recordFields(addType);
+    size_t inputs = recordInputFields(fields);
+    const char* starts[16];     // no collection has more than 14 input fields
+    size_t lengths[16];
+    size_t count = 0, total = 0;
+    size_t pos = 0;
+    while (true) {
+        while (pos < line.size() && isspace(static_cast<unsigned char>(line[pos]))) pos++;
+        if (pos == line.size()) break;
+        size_t start = pos;
+        while (pos < line.size() && !isspace(static_cast<unsigned char>(line[pos]))) pos++;
+        if (count < inputs) {
+            starts[count] = line.c_str() + start;
+            lengths[count] = pos - start;
+            count++;
+        }
+        total++;
+    }
+    if (addType == ADD_CUSTOMER && total != inputs) {
+        inputs = 1;     // only the ID can be located
+    }
+    if (count < inputs) {
+        return "missing " + fields[count].name;
+    }
+    for (size_t i = 0; i < inputs; i++) {
+        std::string why = checkRecordField(fields[i], starts[i], lengths[i]);
+        if (!why.empty()) return why;
+    }
+    return "";
+}
@@ -0,0 +1,399 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <cstdio>
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#endif
+
+#include "../TCP_BMCommon/BMProtocol.h"
+#include "../TCP_BMCommon/BMClient.h"
+#include "../TCP_BMCommon/BMHistogram.h"
+
+using namespace std;
+
+// Open-loop load generator for the boutique server.
+//
+//   TCP_BMLoadGen [--rate 2000] [--duration 10] [--connections 8] [--mix search=50,add=10,...]
+//                 [--warmup 2] [--json report.json] [--host 127.0.0.1] [--port 8080]
+//
+// Requests are sent on a fixed schedule, rate per second spread evenly over the run, whether
+// or not earlier ones have been answered, over --connections pipelined connections. Each
+// latency is measured from the time the request was due to be sent, not the time it went
+// out, so a stalled server shows up as latency instead of as fewer requests (no coordinated
+// omission). Before the run it seeds its own customers, dresses and one image under IDs no
+// other run uses; after it, it prints throughput and latency percentiles per operation and
+// optionally writes them as JSON.
+
+typedef chrono::steady_clock Clock;
+
+const int DEFAULT_RATE = 2000;
+const double DEFAULT_DURATION = 10.0;
+const double DEFAULT_WARMUP = 2.0;
+const int DEFAULT_CONNECTIONS = 8;
+const size_t CONNECTION_DEPTH = 4096;         // requests in flight per connection
+const int SEED_RECORDS = 1000;                 // customers and unstitched dresses each
+const size_t SEED_IMAGE_BYTES = 64 * 1024;
+const chrono::milliseconds REQUEST_TIMEOUT(10000);
+const chrono::milliseconds CONNECT_TIMEOUT(3000);
+const double PERCENTILES[] = { 50.0, 90.0, 99.0, 99.9 };
+const char* const PERCENTILE_NAMES[] = { "p50", "p90", "p99", "p999" };
+
+enum class Operation {
+    ADD,        // ADD_CUSTOMER with a new ID
+    SEARCH,     // SEARCH_CUSTOMER or SEARCH_UNSTITCHED_DRESS of a seeded record
+    VIEW,       // VIEW_CUSTOMERS, one page of 50
+    ORDER,      // PROCESS_ORDER of a seeded dress by a seeded customer
+    IMAGE,      // GET_IMAGE of the seeded image
+    COUNT,      // COUNT_UNSTITCHED_DRESSES
+    PING,
+    COUNT_OF_OPERATIONS
+};
+
+const char* const OPERATION_NAMES[] = { "add", "search", "view", "order", "image", "count", "ping" };
+const size_t OPERATIONS = static_cast<size_t>(Operation::COUNT_OF_OPERATIONS);
+
+struct Options {
+    string host = "127.0.0.1";
+    int port = 8080;
+    int rate = DEFAULT_RATE;
+    double duration = DEFAULT_DURATION;
+    double warmup = DEFAULT_WARMUP;
+    int connections = DEFAULT_CONNECTIONS;
+    string mix = "search=50,view=10,add=10,order=10,image=10,count=10";
+    string jsonPath;
+};
+
+// Latencies and errors for one operation. Replies arrive on every connection's reader
+// thread, so recording takes a lock; at the rates one generator reaches it is uncontended
+// enough not to matter.
+struct OperationStats {
+    mutex statsMutex;
+    LatencyHistogram latency;       // nanoseconds, from the scheduled send time
+    uint64_t sent = 0;
+    uint64_t errors = 0;
+    uint64_t timeouts = 0;
+    string firstError;
+};
+
+class LoadGenerator {
+private:
+    const Options& options;
+    vector<unique_ptr<PipelinedClient>> clients;
+    double weights[OPERATIONS] = {};
+    OperationStats stats[OPERATIONS];
+    int idBase = 0;                 // this run's records are idBase, idBase + 1, ...
+    atomic<int> nextId{ 0 };
+    string imageName;
+    atomic<uint64_t> outstanding{ 0 };
+    Clock::time_point measureFrom;
+    double maxLagMillis = 0;        // how far the sender fell behind its schedule
+
+    bool parseMix(string& error) {
+        stringstream ss(options.mix);
+        string entry;
+        double total = 0;
+        while (getline(ss, entry, ',')) {
+            size_t equals = entry.find('=');
+            string name = entry.substr(0, equals);
+            double weight = equals == string::npos ? 1.0 : atof(entry.c_str() + equals + 1);
+            size_t op = 0;
+            while (op < OPERATIONS && name != OPERATION_NAMES[op]) op++;
+            if (op == OPERATIONS || weight < 0) {
+                error = "unknown operation '" + name + "' in --mix (expected add, search, view, order, image, count, ping)";
+                return false;
+            }
+            weights[op] = weight;
+            total += weight;
+        }
+        if (total <= 0) {
+            error = "--mix has no operations";
+            return false;
+        }
+        return true;
+    }
+
+    // A frame for op; seeded records are picked at random
+    void makeRequest(Operation op, mt19937& rng, uint16_t& type, string& payload) {
+        int seeded = idBase + static_cast<int>(rng() % SEED_RECORDS);
+        switch (op) {
+        case Operation::ADD: {
+            int id = nextId++;
+            type = ADD_CUSTOMER;
+            payload = to_string(id) + " Load_Customer_" + to_string(id) + " 30 03001234567 Street City State Country";
+            break;
+        }
+        case Operation::SEARCH:
+            type = (rng() & 1) ? SEARCH_CUSTOMER : SEARCH_UNSTITCHED_DRESS;
+            payload = to_string(seeded);
+            break;
+        case Operation::VIEW:
+            type = VIEW_CUSTOMERS;
+            payload = "50";
+            break;
+        case Operation::ORDER:
+            type = PROCESS_ORDER;
+            payload = to_string(nextId++) + " " + to_string(seeded) + " " + to_string(idBase + static_cast<int>(rng() % SEED_RECORDS)) + " U 1";
+            break;
+        case Operation::IMAGE:
+            type = GET_IMAGE;
+            payload = imageName;
+            break;
+        case Operation::COUNT:
+            type = COUNT_UNSTITCHED_DRESSES;
+            payload = "";
+            break;
+        default:
+            type = PING;
+            payload = "";
+            break;
+        }
+    }
+
+    // Customers and dresses for searches and orders, and an image for GET_IMAGE, under IDs
+    // picked at random from a range interactive use never reaches
+    bool seed() {
+        mt19937 rng(random_device{}());
+        idBase = 1000000000 + static_cast<int>(rng() % 1000000) * 1000;
+        nextId = idBase + SEED_RECORDS;
+        string batch;
+        for (int i = 0; i < SEED_RECORDS; i++) {
+            int id = idBase + i;
+            batch += encodeFrame(ADD_CUSTOMER, static_cast<uint32_t>(2 * i), to_string(id) + " Seed_Customer 40 03000000000 Street City State Country");
+            batch += encodeFrame(ADD_UNSTITCHED_DRESS, static_cast<uint32_t>(2 * i + 1),
+                to_string(id) + " Seed_Dress 2500.00 Red Lawn Brand S M L 2000.00 44in Good Straight 3m");
+        }
+        ClientReply reply = clients[0]->request(BATCH, batch, FRAME_FLAG_ATOMIC, REQUEST_TIMEOUT);
+        if (!reply.ok || reply.header.type != DATA_RESPONSE) {
+            cerr << "ERROR: Seeding records failed: " << reply.payload << endl;
+            return false;
+        }
+        size_t pos = 0;
+        FrameHeader header;
+        string payload;
+        while (nextBatchFrame(reply.payload, pos, header, payload)) {
+            if (header.type != SUCCESS_RESPONSE) {
+                cerr << "ERROR: Seeding records failed: " << payload << endl;
+                return false;
+            }
+        }
+        imageName = "loadgen_" + to_string(idBase) + ".bin";
+        string image(SEED_IMAGE_BYTES, '\0');
+        for (char& c : image) c = static_cast<char>(rng());
+        reply = clients[0]->request(UPLOAD_IMAGE, imageName + "|" + image, FRAME_FLAG_NONE, REQUEST_TIMEOUT);
+        if (!reply.ok || reply.header.type == ERROR_RESPONSE) {
+            cerr << "ERROR: Seeding the image failed: " << reply.payload << endl;
+            return false;
+        }
+        return true;
+    }
+
+    void finish(size_t op, Clock::time_point due, ClientReply& reply) {
+        Clock::time_point now = Clock::now();
+        OperationStats& entry = stats[op];
+        bool failed = !reply.ok || reply.header.type == ERROR_RESPONSE;
+        if (due >= measureFrom) {
+            lock_guard<mutex> lock(entry.statsMutex);
+            entry.latency.record(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(now - due).count()));
+            if (failed) {
+                entry.errors++;
+                if (reply.timedOut) entry.timeouts++;
+                if (entry.firstError.empty()) entry.firstError = reply.payload.substr(0, 200);
+            }
+        }
+        outstanding--;
+    }
+
+    static string formatMicros(uint64_t nanos) {
+        ostringstream oss;
+        oss << fixed << setprecision(nanos < 10000 ? 1 : 0) << nanos / 1000.0;
+        return oss.str();
+    }
+
+    void appendJsonStats(ostringstream& json, const LatencyHistogram& latency, uint64_t sent, uint64_t errors, uint64_t timeouts, double seconds) {
+        json << "{\"sent\":" << sent << ",\"completed\":" << latency.count() << ",\"errors\":" << errors << ",\"timeouts\":" << timeouts
+            << ",\"throughput\":" << fixed << setprecision(1) << latency.count() / seconds << ",\"latency_us\":{";
+        for (size_t p = 0; p < 4; p++) {
+            json << "\"" << PERCENTILE_NAMES[p] << "\":" << setprecision(1) << latency.percentile(PERCENTILES[p]) / 1000.0 << ",";
+        }
+        json << "\"min\":" << latency.min() / 1000.0 << ",\"mean\":" << latency.mean() / 1000.0 << ",\"max\":" << latency.max() / 1000.0 << "}}";
+    }
+
+    void report(double seconds, double offeredRate) {
+        LatencyHistogram overall;
+        uint64_t sent = 0, errors = 0, timeouts = 0;
+        cout << "\nTarget " << options.rate << " req/s, offered " << fixed << setprecision(0) << offeredRate << " req/s over "
+            << setprecision(1) << seconds << " s measured (" << options.warmup << " s warm-up), " << options.connections
+            << " connections; sender fell behind by up to " << setprecision(1) << maxLagMillis << " ms\n";
+        cout << left << setw(10) << "operation" << right << setw(10) << "requests" << setw(8) << "errors" << setw(11) << "req/s"
+            << setw(10) << "p50 us" << setw(10) << "p90 us" << setw(10) << "p99 us" << setw(10) << "p999 us" << setw(11) << "max us" << "\n";
+        auto row = [&](const string& name, const LatencyHistogram& latency, uint64_t rowErrors) {
+            cout << left << setw(10) << name << right << setw(10) << latency.count() << setw(8) << rowErrors << setw(11) << setprecision(0)
+                << latency.count() / seconds;
+            for (double percent : PERCENTILES) cout << setw(10) << formatMicros(latency.percentile(percent));
+            cout << setw(11) << formatMicros(latency.max()) << "\n";
+        };
+        ostringstream json;
+        json << fixed << "{\"config\":{\"host\":\"" << options.host << "\",\"port\":" << options.port << ",\"rate\":" << options.rate
+            << ",\"duration_s\":" << options.duration << ",\"warmup_s\":" << options.warmup << ",\"connections\":" << options.connections
+            << ",\"mix\":\"" << options.mix << "\"},\"measured_s\":" << setprecision(3) << seconds
+            << ",\"offered_rate\":" << setprecision(1) << offeredRate << ",\"max_send_lag_ms\":" << maxLagMillis << ",\"operations\":{";
+        bool first = true;
+        for (size_t op = 0; op < OPERATIONS; op++) {
+            OperationStats& entry = stats[op];
+            if (weights[op] <= 0) continue;
+            row(OPERATION_NAMES[op], entry.latency, entry.errors);
+            overall.merge(entry.latency);
+            sent += entry.sent;
+            errors += entry.errors;
+            timeouts += entry.timeouts;
+            json << (first ? "" : ",") << "\"" << OPERATION_NAMES[op] << "\":";
+            appendJsonStats(json, entry.latency, entry.sent, entry.errors, entry.timeouts, seconds);
+            first = false;
+        }
+        row("total", overall, errors);
+        json << "},\"total\":";
+        appendJsonStats(json, overall, sent, errors, timeouts, seconds);
+        json << "}\n";
+        for (size_t op = 0; op < OPERATIONS; op++) {
+            if (!stats[op].firstError.empty()) {
+                cout << "  first " << OPERATION_NAMES[op] << " error: " << stats[op].firstError << "\n";
+            }
+        }
+        if (!options.jsonPath.empty()) {
+            if (options.jsonPath == "-") {
+                cout << json.str();
+            }
+            else {
+                ofstream out(options.jsonPath, ios::trunc);
+                out << json.str();
+                cout << (out ? "Wrote " : "ERROR: Cannot write ") << options.jsonPath << "\n";
+            }
+        }
+    }
+
+public:
+    explicit LoadGenerator(const Options& options) : options(options) {}
+
+    bool run() {
+        string error;
+        if (!parseMix(error)) {
+            cerr << "ERROR: " << error << endl;
+            return false;
+        }
+        for (int i = 0; i < options.connections; i++) {
+            SOCKET connection = connectTo(options.host, options.port, CONNECT_TIMEOUT, error);
+            if (connection == INVALID_SOCKET) {
+                cerr << error << endl;
+                return false;
+            }
+            clients.push_back(unique_ptr<PipelinedClient>(new PipelinedClient(connection, CONNECTION_DEPTH)));
+        }
+        if (!seed()) {
+            return false;
+        }
+        cout << "Seeded " << SEED_RECORDS << " customers and dresses from ID " << idBase << " and image " << imageName << "\n";
+
+        vector<double> cumulative(OPERATIONS);
+        double totalWeight = 0;
+        for (size_t op = 0; op < OPERATIONS; op++) cumulative[op] = (totalWeight += weights[op]);
+        mt19937 rng(random_device{}());
+        uniform_real_distribution<double> pick(0.0, totalWeight);
+
+        // The schedule: request i is due at start + i / rate
+        uint64_t total = static_cast<uint64_t>((options.warmup + options.duration) * options.rate);
+        chrono::nanoseconds interval(static_cast<long long>(1e9 / max(1, options.rate)));
+        Clock::time_point start = Clock::now() + chrono::milliseconds(10);
+        measureFrom = start + chrono::nanoseconds(static_cast<long long>(options.warmup * 1e9));
+        Clock::time_point lastExpire = start;
+        uint16_t type;
+        string payload;
+        for (uint64_t i = 0; i < total; i++) {
+            Clock::time_point due = start + interval * i;
+            Clock::time_point now = Clock::now();
+            if (now < due) {
+                this_thread::sleep_until(due);
+            }
+            else {
+                maxLagMillis = max(maxLagMillis, chrono::duration<double, milli>(now - due).count());
+            }
+            double choice = pick(rng);
+            size_t op = 0;
+            while (op + 1 < OPERATIONS && choice >= cumulative[op]) op++;
+            makeRequest(static_cast<Operation>(op), rng, type, payload);
+            if (due >= measureFrom) {
+                lock_guard<mutex> lock(stats[op].statsMutex);
+                stats[op].sent++;
+            }
+            outstanding++;
+            clients[i % clients.size()]->submit(type, payload, [this, op, due](ClientReply& reply) { finish(op, due, reply); },
+                FRAME_FLAG_NONE, REQUEST_TIMEOUT);
+            if (now - lastExpire > chrono::milliseconds(50)) {
+                for (auto& client : clients) client->expire();
+                lastExpire = now;
+            }
+        }
+        Clock::time_point end = start + interval * total;
+        double offeredRate = static_cast<double>(total) / chrono::duration<double>(max(end, Clock::now()) - start).count();
+        // Every request either gets its reply or times out
+        while (outstanding > 0) {
+            this_thread::sleep_for(chrono::milliseconds(20));
+            for (auto& client : clients) client->expire();
+        }
+        for (auto& client : clients) client->disconnect();
+        report(chrono::duration<double>(end - measureFrom).count(), offeredRate);
+        return true;
+    }
+};
+
+void printUsage() {
+    cerr << "Usage: TCP_BMLoadGen [--rate N] [--duration S] [--warmup S] [--connections N] [--mix op=weight,...]\n"
+        << "                     [--json FILE|-] [--host <IPv4 address>] [--port P]\n"
+        << "Operations: add, search, view, order, image, count, ping (default mix "
+        << Options().mix << ")\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--host" && hasValue) options.host = argv[++i];
+        else if (arg == "--port" && hasValue) options.port = stoi(argv[++i]);
+        else if (arg == "--rate" && hasValue) options.rate = max(1, stoi(argv[++i]));
+        else if (arg == "--duration" && hasValue) options.duration = max(0.1, stod(argv[++i]));
+        else if (arg == "--warmup" && hasValue) options.warmup = max(0.0, stod(argv[++i]));
+        else if (arg == "--connections" && hasValue) options.connections = max(1, stoi(argv[++i]));
+        else if (arg == "--mix" && hasValue) options.mix = argv[++i];
+        else if (arg == "--json" && hasValue) options.jsonPath = argv[++i];
+        else {
+            printUsage();
+            return 1;
+        }
+    }
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "WSAStartup failed" << endl;
+        return 1;
+    }
+#endif
+    LoadGenerator generator(options);
+    bool ok = generator.run();
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return ok ? 0 : 1;
+}
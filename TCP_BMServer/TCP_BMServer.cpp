@@ -12,598 +12,8129 @@
 #include <mutex>
 #include <queue>
 #include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <shared_mutex>
+#include <cstdio>
+#include <list>
+#include <array>
+#include <cerrno>
+#include <climits>
+#include <set>
+#include <limits>
+#include <cmath>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #pragma comment(lib, "ws2_32.lib")
 #else
-#error "This program is designed for Windows only!"
+#include <csignal>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #endif
+#endif
+
+#include "../TCP_BMCommon/BMProtocol.h"
+#include "../TCP_BMCommon/BMBase64.h"
+#include "../TCP_BMCommon/BMChecksum.h"
+#include "../TCP_BMCommon/BMImage.h"
+#include "../TCP_BMCommon/BMQueue.h"
+#include "../TCP_BMCommon/BMHistogram.h"
+#include "../TCP_BMCommon/BMRecords.h"
 
 using namespace std;
 namespace fs = std::filesystem;
 
 // Protocol constants
-const int BUFFER_SIZE = 16384; // Increased to handle 8.05 KB image (~11 KB Base64-encoded)
+const int BUFFER_SIZE = 16384; // Size of each recv() chunk; messages may span any number of chunks
+const uint64_t MAX_BUFFERED_PAYLOAD = 256ull * 1024 * 1024;
+const size_t MAX_INITIAL_RESERVE = 64 * 1024; // Larger payloads grow as their bytes actually arrive
+const uint64_t MAX_IMAGE_BYTES = 1024ull * 1024 * 1024; // UPLOAD_IMAGE bodies go straight to disk, not to memory
+const size_t MAX_IMAGE_NAME = 255;
+const uint64_t DEFAULT_UPLOAD_PART = 4ull * 1024 * 1024;
+const uint64_t MIN_UPLOAD_PART = 64 * 1024;
+const uint64_t MAX_UPLOAD_PART = 64ull * 1024 * 1024;
+const size_t MAX_PART_HEADER = 128;       // "uploadId part crc32c" before the '|' of UPLOAD_PART
 const int SERVER_PORT = 8080;
+const int DEFAULT_ADMIN_PORT = 8081;    // metrics over HTTP, bound to 127.0.0.1; --admin-port 0 turns it off
 const string IMAGE_DIR = "images/";
+const size_t REQUEST_QUEUE_CAPACITY = 1024;
+const size_t MAX_IN_FLIGHT_PER_CONNECTION = 32; // stop reading a client once this many of its requests are queued
+const string WAL_FILE = "boutique.wal";
+const uint64_t WAL_CHECKPOINT_BYTES = 64ull * 1024 * 1024;
+const size_t MAX_FAILED_BATCHES = 1024;
+const size_t RECORD_BLOCK_SIZE = 4096;
+const size_t MAX_VIEW_PAGE = 10000;
+const int MAX_SEND_SLICES = 1024; // iovecs per writev call (Linux IOV_MAX)
+const size_t DEFAULT_IMAGE_CACHE_BYTES = 64 * 1024 * 1024;
+const size_t MAX_SENDFILE_CHUNK = 4 * 1024 * 1024; // per sendfile() call, so one download cannot hog an I/O thread
+const int THUMBNAIL_SIZES[] = { 128, 512 };          // longest side in pixels
+const size_t THUMBNAIL_QUEUE_CAPACITY = 256;
+const size_t MAX_BATCH_REQUESTS = 100000;
 
-// Message types
-enum MessageType {
-    ADD_STITCHED_DRESS = 1,
-    ADD_UNSTITCHED_DRESS = 2,
-    VIEW_STITCHED_DRESSES = 3,
-    VIEW_UNSTITCHED_DRESSES = 4,
-    SEARCH_STITCHED_DRESS = 5,
-    SEARCH_UNSTITCHED_DRESS = 6,
-    COUNT_STITCHED_DRESSES = 9,
-    COUNT_UNSTITCHED_DRESSES = 10,
-    ADD_CUSTOMER = 11,
-    VIEW_CUSTOMERS = 12,
-    SEARCH_CUSTOMER = 13,
-    PROCESS_ORDER = 16,
-    VIEW_ORDERS = 17,
-    SEARCH_ORDER = 18,
-    SEND_IMAGE = 19,
-    CONVERT_TO_UPPERCASE = 20,
-    SUCCESS_RESPONSE = 100,
-    ERROR_RESPONSE = 101,
-    DATA_RESPONSE = 102
-};
-
-// Global mutex for file operations
-mutex fileMutex;
-
-// Base64 encoding/decoding
-std::string base64_encode(const std::string& in) {
-    std::string out;
-    int val = 0, valb = -6;
-    for (unsigned char c : in) {
-        val = (val << 8) + c;
-        valb += 8;
-        while (valb >= 0) {
-            out.push_back("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
-    }
-    if (valb > -6) out.push_back("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[((val << 8) >> (valb + 8)) & 0x3F]);
-    while (out.size() % 4) out.push_back('=');
-    return out;
-}
-
-std::string base64_decode(const std::string& in) {
-    std::string out;
-    std::vector<int> T(256, -1);
-    for (int i = 0; i < 64; i++) T["ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[i]] = i;
-    int val = 0, valb = -8;
-    for (unsigned char c : in) {
-        if (T[c] == -1) break;
-        val = (val << 6) + T[c];
-        valb += 6;
-        if (valb >= 0) {
-            out.push_back(char((val >> valb) & 0xFF));
-            valb -= 8;
-        }
-    }
-    return out;
-}
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF };
 
-class FileHandler {
+// Asynchronous JSON-lines log. Each thread writes fixed-size records into a ring buffer of
+// its own (single producer, single consumer, no lock), and one background thread drains all
+// rings every few milliseconds, formats the records and writes them in one go. Logging a
+// request costs a copy of a few fields, never a flush or the stdout lock.
+//
+// When a ring is full the record is dropped and counted; the drain thread reports the count
+// as a "log_dropped" record and STATS shows the running total. Successful requests can be
+// sampled (--log-sample N keeps one in N); failed requests and other events are always kept.
+class Logger {
 public:
-    static string readFile(const string& filename) {
-        lock_guard<mutex> lock(fileMutex);
-        ifstream file(filename);
-        if (!file.is_open()) {
-            return "";
-        }
-        string content, line;
-        while (getline(file, line)) {
-            if (!line.empty()) {
-                content += line + "\n";
-            }
-        }
-        file.close();
-        return content;
-    }
+    static const size_t RING_SLOTS = 1024;
 
-    static bool writeToFile(const string& filename, const string& data, bool append = true) {
-        lock_guard<mutex> lock(fileMutex);
-        ofstream file;
-        if (append) {
-            file.open(filename, ios::app);
-        }
-        else {
-            file.open(filename, ios::trunc);
-        }
-        if (!file.is_open()) {
-            cerr << "ERROR: Failed to open file " << filename << " for writing" << endl;
-            return false;
-        }
-        file << data;
-        file.close();
-        return true;
-    }
+private:
+    struct LogRecord {
+        chrono::steady_clock::time_point time;
+        LogLevel level;
+        const char* event;          // string literal
+        int messageType;            // 0 unless the record is about a request
+        bool failed;
+        uint64_t latencyNanos;
+        uint64_t bytes;
+        char client[48];
+        char message[160];          // longer messages are cut short
+    };
 
-    static int countLines(const string& filename) {
-        lock_guard<mutex> lock(fileMutex);
-        ifstream file(filename);
-        if (!file.is_open()) {
-            return 0;
-        }
-        int count = 0;
-        string line;
-        while (getline(file, line)) {
-            if (!line.empty()) {
-                count++;
-            }
-        }
-        file.close();
-        return count;
-    }
+    struct Ring {
+        array<LogRecord, RING_SLOTS> slots;
+        alignas(64) atomic<uint64_t> head{ 0 };     // next slot the owner writes
+        alignas(64) atomic<uint64_t> tail{ 0 };     // next slot the drain thread reads
+        atomic<uint64_t> dropped{ 0 };
+        uint64_t sampled = 0;                       // owner only
+        bool leased = false;                        // guarded by the registry mutex
+    };
 
-    static bool validateID(int id, const string& filename) {
-        lock_guard<mutex> lock(fileMutex);
-        ifstream file(filename);
-        if (!file.is_open()) {
-            return true;
-        }
-        string line;
-        while (getline(file, line)) {
-            if (!line.empty()) {
-                istringstream iss(line);
-                int existingId;
-                if (iss >> existingId && existingId == id) {
-                    file.close();
-                    return false;
+    struct State {
+        mutex registryMutex;
+        vector<unique_ptr<Ring>> rings;
+        atomic<int> level{ LOG_INFO };
+        atomic<uint64_t> sampleEvery{ 1 };
+        mutex outputMutex;                          // one drain at a time; guards the fields below
+        FILE* output = stdout;
+        vector<LogRecord> batch;
+        string text;
+        uint64_t reportedDrops = 0;
+        chrono::steady_clock::time_point steadyStart = chrono::steady_clock::now();
+        chrono::system_clock::time_point wallStart = chrono::system_clock::now();
+    };
+
+    // Ties a ring to the current thread; a ring left by a finished thread goes to the next one
+    struct RingLease {
+        Ring* ring;
+
+        RingLease() {
+            State& logger = state();
+            lock_guard<mutex> lock(logger.registryMutex);
+            for (auto& candidate : logger.rings) {
+                if (!candidate->leased) {
+                    ring = candidate.get();
+                    ring->leased = true;
+                    return;
                 }
             }
+            logger.rings.push_back(make_unique<Ring>());
+            ring = logger.rings.back().get();
+            ring->leased = true;
         }
-        file.close();
-        return true;
-    }
 
-    static string searchById(int id, const string& filename) {
-        lock_guard<mutex> lock(fileMutex);
-        ifstream file(filename);
-        if (!file.is_open()) {
-            return "ERROR: File not found or cannot be opened";
-        }
-        string line;
-        while (getline(file, line)) {
-            if (!line.empty()) {
-                istringstream iss(line);
-                int existingId;
-                if (iss >> existingId && existingId == id) {
-                    file.close();
-                    return "FOUND: " + line;
-                }
-            }
+        ~RingLease() {
+            lock_guard<mutex> lock(state().registryMutex);
+            ring->leased = false;
         }
-        file.close();
-        return "ERROR: Record not found";
+    };
+
+    // Never destroyed, so threads can log until the process ends; whatever is left is
+    // written by the atexit handler
+    static State& state() {
+        static State* logger = []() {
+            State* created = new State();
+            thread(drainLoop, ref(*created)).detach();
+            atexit(flush);
+            return created;
+        }();
+        return *logger;
     }
 
-    static float getDressPrice(int dressID, const string& filename) {
-        lock_guard<mutex> lock(fileMutex);
-        ifstream file(filename);
-        if (!file.is_open()) {
-            return -1.0f;
-        }
-        string line;
-        while (getline(file, line)) {
-            if (!line.empty()) {
-                istringstream iss(line);
-                int id;
-                string name;
-                float price;
-                if (iss >> id >> name >> price) {
-                    if (id == dressID) {
-                        file.close();
-                        return price;
-                    }
-                }
-            }
-        }
-        file.close();
-        return -1.0f;
+    static Ring& local() {
+        thread_local RingLease lease;
+        return *lease.ring;
     }
 
-    static bool saveImage(const string& imageName, const string& data) {
-        lock_guard<mutex> lock(fileMutex);
-        string filepath = IMAGE_DIR + imageName;
-        ofstream file(filepath, ios::binary); // Overwrite mode, no append
-        if (!file.is_open()) {
-            cerr << "ERROR: Failed to open image file " << filepath << " for writing" << endl;
-            return false;
-        }
-        string decodedData = base64_decode(data);
-        file.write(decodedData.c_str(), decodedData.size());
-        file.close();
-        return true;
+    static void copyText(char* out, size_t capacity, const string& text) {
+        size_t length = min(text.size(), capacity - 1);
+        memcpy(out, text.data(), length);
+        out[length] = '\0';
     }
-};
 
-class DataFormatter {
-public:
-    static string formatDataForDisplay(const string& content, const string& title) {
-        if (content.empty()) {
-            return "No " + title + " found";
-        }
-        string result = "\n========== " + title + " ==========\n";
-        istringstream iss(content);
-        string line;
-        int count = 1;
-        while (getline(iss, line)) {
-            if (!line.empty()) {
-                result += to_string(count++) + ". " + line + "\n";
-            }
+    static void push(LogLevel level, const char* event, const string& client, const string& message, int messageType,
+        bool failed, uint64_t latencyNanos, uint64_t bytes, chrono::steady_clock::time_point time) {
+        Ring& ring = local();
+        uint64_t head = ring.head.load(memory_order_relaxed);
+        if (head - ring.tail.load(memory_order_acquire) == RING_SLOTS) {
+            ring.dropped.store(ring.dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            return;
         }
-        result += "================================\n";
-        return result;
+        LogRecord& record = ring.slots[head % RING_SLOTS];
+        record.time = time;
+        record.level = level;
+        record.event = event;
+        record.messageType = messageType;
+        record.failed = failed;
+        record.latencyNanos = latencyNanos;
+        record.bytes = bytes;
+        copyText(record.client, sizeof(record.client), client);
+        copyText(record.message, sizeof(record.message), message);
+        ring.head.store(head + 1, memory_order_release);
     }
-};
 
-class ImageManager {
-public:
-    static string handleImage(int operation, const string& data, SOCKET clientSocket) {
-        switch (operation) {
-        case SEND_IMAGE: {
-            size_t pos = data.find('|');
-            if (pos == string::npos) {
-                return "ERROR: Invalid image data format";
+    static const char* levelName(LogLevel level) {
+        static const char* const names[] = { "debug", "info", "warn", "error", "off" };
+        return names[level];
+    }
+
+    static void appendEscaped(string& out, const char* text) {
+        for (; *text != '\0'; text++) {
+            unsigned char c = static_cast<unsigned char>(*text);
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += static_cast<char>(c);
             }
-            string imageName = data.substr(0, pos);
-            string imageData = data.substr(pos + 1);
-            fs::create_directories(IMAGE_DIR);
-            if (FileHandler::saveImage(imageName, imageData)) {
-                string response = "SUCCESS: Image " + imageName + " received";
-                send(clientSocket, response.c_str(), response.length(), 0);
-                return response;
+            else if (c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
             }
             else {
-                string error = "ERROR: Failed to save image " + imageName;
-                send(clientSocket, error.c_str(), error.length(), 0);
-                return error;
+                out += static_cast<char>(c);
             }
         }
-        default:
-            return "ERROR: Unknown image operation";
-        }
     }
-};
 
-class TextManager {
-public:
-    static string handleText(int operation, const string& data) {
-        switch (operation) {
-        case CONVERT_TO_UPPERCASE: {
-            if (data.empty()) {
-                return "ERROR: No text provided";
-            }
-            string uppercase = data;
-            transform(uppercase.begin(), uppercase.end(), uppercase.begin(), ::toupper);
-            return "SUCCESS: " + uppercase;
-        }
-        default:
-            return "ERROR: Unknown text operation";
-        }
+    static void appendTimestamp(string& out, const State& logger, chrono::steady_clock::time_point time) {
+        auto wall = logger.wallStart + chrono::duration_cast<chrono::system_clock::duration>(time - logger.steadyStart);
+        int64_t micros = chrono::duration_cast<chrono::microseconds>(wall.time_since_epoch()).count();
+        time_t seconds = static_cast<time_t>(micros / 1000000);
+        struct tm utc;
+#ifdef _WIN32
+        gmtime_s(&utc, &seconds);
+#else
+        gmtime_r(&seconds, &utc);
+#endif
+        char buffer[96];
+        snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ", utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+            utc.tm_hour, utc.tm_min, utc.tm_sec, static_cast<int>(micros % 1000000));
+        out += buffer;
     }
-};
 
-class DressManager {
-public:
-    static string handleStitchedDress(int operation, const string& data) {
-        switch (operation) {
-        case ADD_STITCHED_DRESS: {
-            istringstream iss(data);
-            int dressID;
-            if (!(iss >> dressID)) {
-                return "ERROR: Invalid dress data format";
-            }
-            if (!FileHandler::validateID(dressID, "stitched_dresses.txt")) {
-                return "ERROR: Duplicate Dress ID " + to_string(dressID);
-            }
-            if (FileHandler::writeToFile("stitched_dresses.txt", data + "\n", true)) {
-                return "SUCCESS: Stitched dress added successfully (ID: " + to_string(dressID) + ")";
-            }
-            return "ERROR: Failed to add stitched dress";
+    static void format(string& out, const State& logger, const LogRecord& record) {
+        out += "{\"ts\":\"";
+        appendTimestamp(out, logger, record.time);
+        out += "\",\"level\":\"";
+        out += levelName(record.level);
+        out += "\",\"event\":\"";
+        out += record.event;
+        out += "\"";
+        if (record.client[0] != '\0') {
+            out += ",\"client\":\"";
+            appendEscaped(out, record.client);
+            out += "\"";
         }
-        case VIEW_STITCHED_DRESSES: {
-            string content = FileHandler::readFile("stitched_dresses.txt");
-            return DataFormatter::formatDataForDisplay(content, "STITCHED DRESSES");
-        }
-        case SEARCH_STITCHED_DRESS: {
-            int dressID = stoi(data);
-            return FileHandler::searchById(dressID, "stitched_dresses.txt");
-        }
-        case COUNT_STITCHED_DRESSES: {
-            int count = FileHandler::countLines("stitched_dresses.txt");
-            return "Total Stitched Dresses: " + to_string(count);
+        if (record.messageType != 0) {
+            char fields[128];
+            snprintf(fields, sizeof(fields), ",\"type\":\"%s\",\"status\":\"%s\",\"latency_us\":%.1f,\"bytes\":%llu",
+                messageTypeName(record.messageType), record.failed ? "error" : "ok", record.latencyNanos / 1000.0,
+                static_cast<unsigned long long>(record.bytes));
+            out += fields;
         }
-        default:
-            return "ERROR: Unknown stitched dress operation";
+        if (record.message[0] != '\0') {
+            out += ",\"msg\":\"";
+            appendEscaped(out, record.message);
+            out += "\"";
         }
+        out += "}\n";
     }
-    static string handleUnstitchedDress(int operation, const string& data) {
-        switch (operation) {
-        case ADD_UNSTITCHED_DRESS: {
-            istringstream iss(data);
-            int dressID;
-            string dressName, color, material, brand, size1, size2, size3, fabricWidth, dyeStability, fabricCutType, totalFabricLength;
-            float actualPrice, discountedPrice;
-            if (!(iss >> dressID >> dressName >> actualPrice >> color >> material >> brand >> size1 >> size2 >> size3 >> discountedPrice >> fabricWidth >> dyeStability >> fabricCutType >> totalFabricLength)) {
-                return "ERROR: Invalid unstitched dress data format";
-            }
-            if (!FileHandler::validateID(dressID, "unstitched_dresses.txt")) {
-                return "ERROR: Duplicate Dress ID " + to_string(dressID);
-            }
-            if (actualPrice < 0 || discountedPrice < 0) {
-                return "ERROR: Prices must be non-negative";
-            }
-            if (FileHandler::writeToFile("unstitched_dresses.txt", data + "\n", true)) {
-                return "SUCCESS: Unstitched dress added successfully (ID: " + to_string(dressID) + ")";
-            }
-            return "ERROR: Failed to add unstitched dress";
+
+    // Moves everything the rings hold to the output, oldest first
+    static void drain(State& logger) {
+        lock_guard<mutex> lock(logger.outputMutex);
+        vector<Ring*> rings;
+        {
+            lock_guard<mutex> registry(logger.registryMutex);
+            for (auto& ring : logger.rings) rings.push_back(ring.get());
         }
-        case VIEW_UNSTITCHED_DRESSES: {
-            string content = FileHandler::readFile("unstitched_dresses.txt");
-            return DataFormatter::formatDataForDisplay(content, "UNSTITCHED DRESSES");
+        logger.batch.clear();
+        uint64_t drops = 0;
+        for (Ring* ring : rings) {
+            uint64_t tail = ring->tail.load(memory_order_relaxed);
+            uint64_t head = ring->head.load(memory_order_acquire);
+            for (; tail != head; tail++) logger.batch.push_back(ring->slots[tail % RING_SLOTS]);
+            ring->tail.store(tail, memory_order_release);
+            drops += ring->dropped.load(memory_order_relaxed);
         }
-        case SEARCH_UNSTITCHED_DRESS: {
-            int dressID;
-            try {
-                dressID = stoi(data);
-            }
-            catch (const exception& e) {
-                return "ERROR: Invalid Dress ID format";
-            }
-            return FileHandler::searchById(dressID, "unstitched_dresses.txt");
+        if (logger.batch.empty() && drops == logger.reportedDrops) {
+            return;
         }
-        case COUNT_UNSTITCHED_DRESSES: {
-            int count = FileHandler::countLines("unstitched_dresses.txt");
-            return "Total Unstitched Dresses: " + to_string(count);
+        stable_sort(logger.batch.begin(), logger.batch.end(), [](const LogRecord& a, const LogRecord& b) { return a.time < b.time; });
+        logger.text.clear();
+        for (const LogRecord& record : logger.batch) format(logger.text, logger, record);
+        if (drops > logger.reportedDrops) {
+            LogRecord notice{};
+            notice.time = chrono::steady_clock::now();
+            notice.level = LOG_WARN;
+            notice.event = "log_dropped";
+            snprintf(notice.message, sizeof(notice.message), "%llu records dropped (%llu in total): log rings full",
+                static_cast<unsigned long long>(drops - logger.reportedDrops), static_cast<unsigned long long>(drops));
+            format(logger.text, logger, notice);
+            logger.reportedDrops = drops;
         }
-        default:
-            return "ERROR: Unknown unstitched dress operation";
+        fwrite(logger.text.data(), 1, logger.text.size(), logger.output);
+        fflush(logger.output);
+    }
+
+    static void drainLoop(State& logger) {
+        while (true) {
+            this_thread::sleep_for(chrono::milliseconds(10));
+            drain(logger);
         }
     }
-};
 
-class CustomerManager {
 public:
-    static string handleCustomer(int operation, const string& data) {
-        switch (operation) {
-        case ADD_CUSTOMER: {
-            istringstream iss(data);
-            int customerID;
-            if (!(iss >> customerID)) {
-                return "ERROR: Invalid customer data format";
+    static bool parseLevel(const string& name, LogLevel& level) {
+        static const char* const names[] = { "debug", "info", "warn", "error", "off" };
+        for (int i = LOG_DEBUG; i <= LOG_OFF; i++) {
+            if (name == names[i]) {
+                level = static_cast<LogLevel>(i);
+                return true;
             }
-            if (!FileHandler::validateID(customerID, "customers.txt")) {
-                return "ERROR: Duplicate Customer ID " + to_string(customerID);
-            }
-            if (FileHandler::writeToFile("customers.txt", data + "\n", true)) {
-                return "SUCCESS: Customer added successfully (ID: " + to_string(customerID) + ")";
-            }
-            return "ERROR: Failed to add customer";
         }
-        case VIEW_CUSTOMERS: {
-            string content = FileHandler::readFile("customers.txt");
-            return DataFormatter::formatDataForDisplay(content, "CUSTOMERS");
+        return false;
+    }
+
+    static void configure(LogLevel level, uint64_t sampleEvery) {
+        state().level = level;
+        state().sampleEvery = max<uint64_t>(1, sampleEvery);
+    }
+
+    // Appends to path instead of writing to stdout
+    static bool openFile(const string& path) {
+        FILE* file = fopen(path.c_str(), "ab");
+        if (file == nullptr) {
+            return false;
         }
-        case SEARCH_CUSTOMER: {
-            int customerID = stoi(data);
-            return FileHandler::searchById(customerID, "customers.txt");
+        State& logger = state();
+        lock_guard<mutex> lock(logger.outputMutex);
+        if (logger.output != stdout) fclose(logger.output);
+        logger.output = file;
+        return true;
+    }
+
+    static bool enabled(LogLevel level) {
+        return level >= state().level.load(memory_order_relaxed);
+    }
+
+    static void log(LogLevel level, const char* event, const string& message, const string& client = "") {
+        if (enabled(level)) push(level, event, client, message, 0, false, 0, 0, chrono::steady_clock::now());
+    }
+
+    // One served request, timed by the caller. Logged at info level; failed requests are
+    // never sampled out.
+    static void request(const string& client, int messageType, chrono::steady_clock::time_point end, uint64_t latencyNanos,
+        uint64_t bytes, bool failed) {
+        if (!enabled(LOG_INFO)) {
+            return;
         }
-        default:
-            return "ERROR: Unknown customer operation";
+        if (!failed) {
+            Ring& ring = local();
+            uint64_t every = state().sampleEvery.load(memory_order_relaxed);
+            if (every > 1 && ring.sampled++ % every != 0) return;
         }
+        push(LOG_INFO, "request", client, "", messageType == 0 ? -1 : messageType, failed, latencyNanos, bytes, end);
+    }
+
+    static uint64_t dropped() {
+        State& logger = state();
+        lock_guard<mutex> lock(logger.registryMutex);
+        uint64_t total = 0;
+        for (auto& ring : logger.rings) total += ring->dropped.load(memory_order_relaxed);
+        return total;
+    }
+
+    // Writes out everything logged so far
+    static void flush() {
+        drain(state());
     }
 };
 
-class OrderManager {
+// Flushes stdio buffers and forces the data to stable storage
+bool syncFile(FILE* file) {
+    if (fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#elif defined(__linux__)
+    return fdatasync(fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+    const char* mappedData = nullptr;
+    size_t mappedSize = 0;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mappingHandle = nullptr;
+#endif
+
 public:
-    static string handleOrder(int operation, const string& data) {
-        switch (operation) {
-        case PROCESS_ORDER: {
-            istringstream iss(data);
-            int orderID, customerID, dressID, quantity;
-            string dressType;
-            if (!(iss >> orderID >> customerID >> dressID >> dressType >> quantity)) {
-                return "ERROR: Invalid order data format";
-            }
-            if (!FileHandler::validateID(orderID, "orders.txt")) {
-                return "ERROR: Duplicate Order ID " + to_string(orderID);
-            }
-            if (FileHandler::searchById(customerID, "customers.txt").find("FOUND:") == string::npos) {
-                return "ERROR: Customer ID " + to_string(customerID) + " not found";
-            }
-            string dressFile = (dressType == "S") ? "stitched_dresses.txt" : "unstitched_dresses.txt";
-            if (FileHandler::searchById(dressID, dressFile).find("FOUND:") == string::npos) {
-                return "ERROR: Dress ID " + to_string(dressID) + " not found in " + dressFile;
-            }
-            float price = FileHandler::getDressPrice(dressID, dressFile);
-            if (price < 0) {
-                return "ERROR: Unable to retrieve price for Dress ID " + to_string(dressID);
-            }
-            float totalPrice = price * quantity;
-            ostringstream oss;
-            oss << orderID << " " << customerID << " " << dressID << " " << dressType << " "
-                << quantity << " " << fixed << setprecision(2) << totalPrice;
-            if (FileHandler::writeToFile("orders.txt", oss.str() + "\n", true)) {
-                return "SUCCESS: Successfully processed order (Total: $" + to_string(totalPrice) + ")";
-            }
-            return "ERROR: Failed to process order";
+    MappedFile() {}
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& path) {
+        close();
+#ifdef _WIN32
+        fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(fileHandle, &size)) {
+            close();
+            return false;
         }
-        case VIEW_ORDERS: {
-            string content = FileHandler::readFile("orders.txt");
-            return DataFormatter::formatDataForDisplay(content, "ORDERS");
+        mappedSize = static_cast<size_t>(size.QuadPart);
+        if (mappedSize == 0) return true;
+        mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mappingHandle == nullptr) {
+            close();
+            return false;
         }
-        case SEARCH_ORDER: {
-            int orderID = stoi(data);
-            return FileHandler::searchById(orderID, "orders.txt");
+        mappedData = static_cast<const char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) return false;
+        struct stat info;
+        if (fstat(fd, &info) == -1) {
+            ::close(fd);
+            return false;
         }
-        default:
-            return "ERROR: Unknown order operation";
+        mappedSize = static_cast<size_t>(info.st_size);
+        if (mappedSize == 0) {
+            ::close(fd);
+            return true;
         }
+        void* address = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        mappedData = address == MAP_FAILED ? nullptr : static_cast<const char*>(address);
+#endif
+        if (mappedData == nullptr) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (mappedData != nullptr) UnmapViewOfFile(mappedData);
+        if (mappingHandle != nullptr) CloseHandle(mappingHandle);
+        if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+        mappingHandle = nullptr;
+        fileHandle = INVALID_HANDLE_VALUE;
+#else
+        if (mappedData != nullptr) munmap(const_cast<char*>(mappedData), mappedSize);
+#endif
+        mappedData = nullptr;
+        mappedSize = 0;
+    }
+
+    const char* data() const {
+        return mappedData;
+    }
+
+    size_t size() const {
+        return mappedSize;
     }
 };
 
-class RequestProcessor {
+// An image opened for sending. The open descriptor pins the file, so a reply keeps sending
+// the bytes it started with even if the image is replaced in the meantime. The ETag is
+// derived from the size and modification time of that same file.
+class ImageFile {
+private:
+    int fd = -1;
+    uint64_t length = 0;
+    string tag;
+
 public:
-    static string processRequest(int messageType, const string& data, SOCKET clientSocket) {
-        try {
-            switch (messageType) {
-            case ADD_STITCHED_DRESS:
-            case VIEW_STITCHED_DRESSES:
-            case SEARCH_STITCHED_DRESS:
-            case COUNT_STITCHED_DRESSES:
-                return DressManager::handleStitchedDress(messageType, data);
-            case ADD_UNSTITCHED_DRESS:
-            case VIEW_UNSTITCHED_DRESSES:
-            case SEARCH_UNSTITCHED_DRESS:
-            case COUNT_UNSTITCHED_DRESSES:
-                return DressManager::handleUnstitchedDress(messageType, data);
-            case ADD_CUSTOMER:
-            case VIEW_CUSTOMERS:
-            case SEARCH_CUSTOMER:
-                return CustomerManager::handleCustomer(messageType, data);
-            case PROCESS_ORDER:
-            case VIEW_ORDERS:
-            case SEARCH_ORDER:
-                return OrderManager::handleOrder(messageType, data);
-            case SEND_IMAGE:
-                return ImageManager::handleImage(messageType, data, clientSocket);
-            case CONVERT_TO_UPPERCASE:
-                return TextManager::handleText(messageType, data);
-            default:
-                return "ERROR: Unknown request type (" + to_string(messageType) + ")";
-            }
+    ImageFile() {}
+
+    ~ImageFile() {
+#ifdef _WIN32
+        if (fd != -1) _close(fd);
+#else
+        if (fd != -1) ::close(fd);
+#endif
+    }
+
+    ImageFile(const ImageFile&) = delete;
+    ImageFile& operator=(const ImageFile&) = delete;
+
+    static shared_ptr<ImageFile> open(const string& path) {
+        auto image = make_shared<ImageFile>();
+        uint64_t modified;
+#ifdef _WIN32
+        image->fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+        struct _stat64 info;
+        if (image->fd == -1 || _fstat64(image->fd, &info) == -1) return nullptr;
+        modified = static_cast<uint64_t>(info.st_mtime) * 1000000000ull;
+#else
+        image->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (image->fd == -1 || fstat(image->fd, &info) == -1 || !S_ISREG(info.st_mode)) return nullptr;
+#ifdef __linux__
+        modified = static_cast<uint64_t>(info.st_mtim.tv_sec) * 1000000000ull + info.st_mtim.tv_nsec;
+#else
+        modified = static_cast<uint64_t>(info.st_mtime) * 1000000000ull;
+#endif
+#endif
+        image->length = static_cast<uint64_t>(info.st_size);
+        ostringstream oss;
+        oss << hex << image->length << "-" << modified;
+        image->tag = oss.str();
+        return image;
+    }
+
+    uint64_t size() const {
+        return length;
+    }
+
+    const string& etag() const {
+        return tag;
+    }
+
+    // Reads the whole file, e.g. to put it in the cache
+    bool read(string& out) const {
+        out.resize(static_cast<size_t>(length));
+        size_t done = 0;
+        while (done < out.size()) {
+#ifdef _WIN32
+            _lseeki64(fd, static_cast<__int64>(done), SEEK_SET);
+            int got = _read(fd, &out[done], static_cast<unsigned>(min<size_t>(out.size() - done, 1 << 30)));
+#else
+            ssize_t got = pread(fd, &out[done], out.size() - done, static_cast<off_t>(done));
+            if (got == -1 && errno == EINTR) continue;
+#endif
+            if (got <= 0) return false;
+            done += static_cast<size_t>(got);
         }
-        catch (const exception& e) {
-            return "ERROR: " + string(e.what());
+        return true;
+    }
+
+    // Sends up to count bytes starting at offset straight from the file: sendfile() on Linux,
+    // so the bytes never pass through user space. Returns what send() would.
+    long long sendTo(SOCKET socket, uint64_t offset, size_t count) const {
+#ifdef __linux__
+        off_t position = static_cast<off_t>(offset);
+        return sendfile(socket, fd, &position, count);
+#else
+        char buffer[64 * 1024];
+        count = min(count, sizeof(buffer));
+#ifdef _WIN32
+        _lseeki64(fd, static_cast<__int64>(offset), SEEK_SET);
+        int got = _read(fd, buffer, static_cast<unsigned>(count));
+#else
+        ssize_t got = pread(fd, buffer, count, static_cast<off_t>(offset));
+#endif
+        if (got <= 0) return -1;
+        return send(socket, buffer, static_cast<int>(got), 0);
+#endif
+    }
+};
+
+// Identifies a file independently of its name, so hard links to it compare equal
+struct FileIdentity {
+    uint64_t device = 0;
+    uint64_t file = 0;
+
+    bool operator<(const FileIdentity& other) const {
+        return device != other.device ? device < other.device : file < other.file;
+    }
+};
+
+bool fileIdentity(const string& path, FileIdentity& identity) {
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+    BY_HANDLE_FILE_INFORMATION info;
+    bool ok = GetFileInformationByHandle(handle, &info) != 0;
+    CloseHandle(handle);
+    identity.device = info.dwVolumeSerialNumber;
+    identity.file = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    return ok;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) == -1) return false;
+    identity.device = static_cast<uint64_t>(info.st_dev);
+    identity.file = static_cast<uint64_t>(info.st_ino);
+    return true;
+#endif
+}
+
+// Slicing-by-8: eight bytes per step through eight derived tables, same result as the
+// byte-at-a-time loop (the log's record format is unchanged)
+uint32_t crc32(const char* data, size_t length) {
+    static const auto table = []() {
+        vector<array<uint32_t, 256>> tables(8);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            tables[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int t = 1; t < 8; t++) tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
         }
+        return tables;
+    }();
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    uint32_t crc = 0xFFFFFFFFu;
+    for (; length >= 8; bytes += 8, length -= 8) {
+        uint32_t low = crc ^ (uint32_t(bytes[0]) | (uint32_t(bytes[1]) << 8) | (uint32_t(bytes[2]) << 16) | (uint32_t(bytes[3]) << 24));
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+            ^ table[3][bytes[4]] ^ table[2][bytes[5]] ^ table[1][bytes[6]] ^ table[0][bytes[7]];
     }
+    for (; length > 0; bytes++, length--) {
+        crc = table[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+enum class DurabilityMode {
+    SYNC,   // every insert writes and syncs its own log record before it is acknowledged
+    GROUP,  // inserts wait for a shared write + sync; batches collect for groupMillis (0: while the previous sync runs)
+    ASYNC   // inserts are acknowledged at once; the log is synced every groupMillis
 };
 
-class TCPServer {
+// Append-only write-ahead log for inserts into the record files. A record is
+// [payload length][crc32][payload], where the payload is "<record file>\t<line>".
+// An insert is logged first and reaches its record file and memory only once its log
+// record is durable (per DurabilityMode), so an acknowledged order survives a crash even if
+// its record file line did not, and a failed log write leaves no trace. At startup the log
+// is replayed into the record files, which are then synced, and the log is reset.
+class WriteAheadLog {
 private:
-    SOCKET serverSocket;
-    struct sockaddr_in serverAddr;
-    vector<thread> clientThreads;
-    bool running;
+    string path;
+    FILE* file = nullptr;
+    DurabilityMode mode = DurabilityMode::GROUP;
+    int groupMillis = 0;
 
-    void initializeSocket() {
-#ifdef _WIN32
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            cerr << "WSAStartup failed" << endl;
-            exit(1);
+    mutex logMutex;                 // guards pending, nextLsn, durableLsn, failedBatches
+    condition_variable workReady;
+    condition_variable durableChanged;
+    string pending;                 // encoded records not yet written
+    uint64_t nextLsn = 1;
+    uint64_t durableLsn = 0;
+    deque<pair<uint64_t, uint64_t>> failedBatches;     // LSN ranges whose write failed, newest last
+    bool stopping = false;
+    thread flusher;
+
+    mutex ioMutex;                  // serializes writes, syncs and truncation of the log file
+    uint64_t writtenLsn = 0;        // last LSN handed to a write
+    uint64_t fileBytes = 0;         // length of the log file up to its last good write
+    uint64_t bytesSinceCheckpoint = 0;
+    function<bool()> checkpointHook;
+
+    static void encodeRecord(string& out, const string& payload) {
+        uint32_t length = static_cast<uint32_t>(payload.size());
+        uint32_t checksum = crc32(payload.data(), payload.size());
+        for (int i = 0; i < 4; i++) out.push_back(static_cast<char>(length >> (24 - 8 * i)));
+        for (int i = 0; i < 4; i++) out.push_back(static_cast<char>(checksum >> (24 - 8 * i)));
+        out += payload;
+    }
+
+    // Caller holds ioMutex. A failed write is cut off the file again, so only its own records
+    // are lost and the ones written after it still replay.
+    bool writeBatch(const string& batch) {
+        if (file == nullptr) return false;
+        if (fwrite(batch.data(), 1, batch.size(), file) != batch.size() || !syncFile(file)) {
+            Logger::log(LOG_ERROR, "write_failed", "Failed to write " + path);
+            fclose(file);
+            error_code ec;
+            fs::resize_file(path, fileBytes, ec);
+            file = fopen(path.c_str(), "ab");
+            return false;
         }
-#endif
-        serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (serverSocket == INVALID_SOCKET) {
-            cerr << "Socket creation failed" << endl;
-            exit(1);
+        fileBytes += batch.size();
+        bytesSinceCheckpoint += batch.size();
+        return true;
+    }
+
+    // Writes and syncs everything queued so far. Holding ioMutex across the hand-off keeps
+    // batches on disk in log-sequence order, so a durable LSN implies all earlier ones are.
+    void flushPending() {
+        lock_guard<mutex> io(ioMutex);
+        string batch;
+        uint64_t batchLsn;
+        {
+            lock_guard<mutex> lock(logMutex);
+            batch.swap(pending);
+            batchLsn = nextLsn - 1;
         }
-        int optval = 1;
-        setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&optval, sizeof(optval));
-        memset(&serverAddr, 0, sizeof(serverAddr));
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_addr.s_addr = INADDR_ANY;
-        serverAddr.sin_port = htons(SERVER_PORT);
-        if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-            cerr << "Bind failed on port " << SERVER_PORT << endl;
-            closesocket(serverSocket);
-            exit(1);
+        bool ok = batch.empty() || writeBatch(batch);
+        markDurable(batchLsn, ok);
+    }
+
+    // Caller holds ioMutex: batches are marked in the order they were written
+    void markDurable(uint64_t lsn, bool ok) {
+        lock_guard<mutex> lock(logMutex);
+        if (!ok && lsn > writtenLsn) {
+            failedBatches.emplace_back(writtenLsn + 1, lsn);
+            // Waiters look as soon as they wake, so only recent failures are kept
+            if (failedBatches.size() > MAX_FAILED_BATCHES) failedBatches.pop_front();
         }
-        if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
-            cerr << "Listen failed" << endl;
-            closesocket(serverSocket);
-            exit(1);
+        writtenLsn = max(writtenLsn, lsn);
+        if (lsn > durableLsn) durableLsn = lsn;
+        durableChanged.notify_all();
+    }
+
+    // Caller holds logMutex
+    bool loggedLocked(uint64_t lsn) const {
+        if (lsn > durableLsn) return false;
+        for (const auto& batch : failedBatches) {
+            if (lsn >= batch.first && lsn <= batch.second) return false;
         }
+        return true;
     }
 
-    void handleClient(SOCKET clientSocket, struct sockaddr_in clientAddr) {
-        char clientIP[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
-        int clientPort = ntohs(clientAddr.sin_port);
-        cout << "[" << clientIP << ":" << clientPort << "] Connected" << endl;
+    void flusherLoop() {
+        unique_lock<mutex> lock(logMutex);
+        while (true) {
+            workReady.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (pending.empty() && stopping) break;
+            if (groupMillis > 0 && !stopping) {
+                // Give concurrent writers a moment to join this batch
+                lock.unlock();
+                this_thread::sleep_for(chrono::milliseconds(groupMillis));
+                lock.lock();
+            }
+            lock.unlock();
+            flushPending();
+            maybeCheckpoint();
+            lock.lock();
+        }
+    }
 
-        char buffer[BUFFER_SIZE];
-        while (running) {
-            memset(buffer, 0, BUFFER_SIZE);
-            int bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
-            if (bytesReceived <= 0) {
-                cout << "[" << clientIP << ":" << clientPort << "] Disconnected" << endl;
+    void startFlusher() {
+        stopping = false;
+        if (mode != DurabilityMode::SYNC) {
+            flusher = thread(&WriteAheadLog::flusherLoop, this);
+        }
+    }
+
+    void stopFlusher() {
+        {
+            lock_guard<mutex> lock(logMutex);
+            stopping = true;
+            workReady.notify_all();
+        }
+        if (flusher.joinable()) flusher.join();
+    }
+
+public:
+    explicit WriteAheadLog(const string& path) : path(path) {
+        startFlusher();
+    }
+
+    ~WriteAheadLog() {
+        close();
+    }
+
+    void close() {
+        stopFlusher();
+        lock_guard<mutex> lock(ioMutex);
+        if (file != nullptr) {
+            syncFile(file);
+            fclose(file);
+            file = nullptr;
+        }
+    }
+
+    static bool parseMode(const string& name, DurabilityMode& mode) {
+        if (name == "sync") mode = DurabilityMode::SYNC;
+        else if (name == "group") mode = DurabilityMode::GROUP;
+        else if (name == "async") mode = DurabilityMode::ASYNC;
+        else return false;
+        return true;
+    }
+
+    static string modeName(DurabilityMode mode) {
+        return mode == DurabilityMode::SYNC ? "sync" : mode == DurabilityMode::GROUP ? "group" : "async";
+    }
+
+    void configure(DurabilityMode newMode, int newGroupMillis) {
+        stopFlusher();
+        mode = newMode;
+        groupMillis = max(0, newGroupMillis);
+        startFlusher();
+    }
+
+    DurabilityMode getMode() const {
+        return mode;
+    }
+
+    int getGroupMillis() const {
+        return groupMillis;
+    }
+
+    // Called after each batch once the log has grown past WAL_CHECKPOINT_BYTES; it must make
+    // every record file durable and return true, after which the log is emptied
+    void setCheckpointHook(function<bool()> hook) {
+        checkpointHook = move(hook);
+    }
+
+    // Feeds every intact record to apply(), stopping at the first torn or corrupt one
+    size_t replay(const function<void(const string& filename, const string& line)>& apply) {
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) return 0;
+        size_t replayed = 0;
+        unsigned char header[8];
+        while (in.read(reinterpret_cast<char*>(header), 8)) {
+            uint32_t length = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) | (uint32_t(header[2]) << 8) | header[3];
+            uint32_t checksum = (uint32_t(header[4]) << 24) | (uint32_t(header[5]) << 16) | (uint32_t(header[6]) << 8) | header[7];
+            string payload(length, '\0');
+            if (!in.read(&payload[0], length) || crc32(payload.data(), payload.size()) != checksum) {
+                cerr << "WAL: ignoring torn record at the end of " << path << endl;
                 break;
             }
-            string message(buffer);
-            size_t pos = message.find('|');
-            if (pos == string::npos) {
-                string errorResponse = "ERROR: Invalid message format. Expected: MessageType|Data";
-                send(clientSocket, errorResponse.c_str(), errorResponse.length(), 0);
-                continue;
+            size_t tab = payload.find('\t');
+            if (tab == string::npos) break;
+            apply(payload.substr(0, tab), payload.substr(tab + 1));
+            replayed++;
+        }
+        return replayed;
+    }
+
+    bool open() {
+        lock_guard<mutex> lock(ioMutex);
+        file = fopen(path.c_str(), "ab");
+        if (file == nullptr) {
+            cerr << "ERROR: Failed to open " << path << endl;
+            return false;
+        }
+        error_code ec;
+        fileBytes = fs::file_size(path, ec);
+        if (ec) fileBytes = 0;
+        return true;
+    }
+
+    // Empties the log once flushFiles() has made everything it holds durable in the record
+    // files. No log write runs meanwhile, so every record flushFiles() sees as logged (see
+    // isLogged) is one it can apply; records still queued are written to the emptied log.
+    bool truncate(const function<bool()>& flushFiles) {
+        lock_guard<mutex> lock(ioMutex);
+        if (!flushFiles()) return false;
+        if (file != nullptr) fclose(file);
+        file = fopen(path.c_str(), "wb");
+        fileBytes = 0;
+        bytesSinceCheckpoint = 0;
+        return file != nullptr && syncFile(file);
+    }
+
+    void maybeCheckpoint() {
+        {
+            lock_guard<mutex> lock(ioMutex);
+            if (bytesSinceCheckpoint < WAL_CHECKPOINT_BYTES || !checkpointHook) return;
+        }
+        if (!checkpointHook()) {
+            Logger::log(LOG_ERROR, "checkpoint_failed", "WAL checkpoint failed, log keeps growing");
+        }
+    }
+
+    // Queues (record file, line) records and returns the log sequence number of the last one.
+    // They always go out in one write, so they are durable or lost together. In SYNC mode the
+    // write and sync happen right here.
+    uint64_t append(const vector<pair<string, string>>& records) {
+        if (mode == DurabilityMode::SYNC) {
+            string batch;
+            for (const auto& record : records) encodeRecord(batch, record.first + "\t" + record.second);
+            lock_guard<mutex> io(ioMutex);
+            uint64_t lsn;
+            {
+                lock_guard<mutex> lock(logMutex);
+                nextLsn += records.size();
+                lsn = nextLsn - 1;
             }
-            int messageType = stoi(message.substr(0, pos));
-            string data = message.substr(pos + 1);
-            cout << "[" << clientIP << ":" << clientPort << "] Request Type: " << messageType << endl;
-            string response = RequestProcessor::processRequest(messageType, data, clientSocket);
-            if (messageType != SEND_IMAGE) {
-                int bytesSent = send(clientSocket, response.c_str(), response.length(), 0);
-                if (bytesSent == SOCKET_ERROR) {
-                    cerr << "[" << clientIP << ":" << clientPort << "] Failed to send response" << endl;
-                }
-                else {
-                    cout << "[" << clientIP << ":" << clientPort << "] Response sent (" << bytesSent << " bytes)" << endl;
+            markDurable(lsn, writeBatch(batch));
+            return lsn;
+        }
+        lock_guard<mutex> lock(logMutex);
+        for (const auto& record : records) encodeRecord(pending, record.first + "\t" + record.second);
+        nextLsn += records.size();
+        workReady.notify_one();
+        return nextLsn - 1;
+    }
+
+    // True once the record is durable in the log
+    bool isLogged(uint64_t lsn) {
+        lock_guard<mutex> lock(logMutex);
+        return loggedLocked(lsn);
+    }
+
+    // Blocks until the record is durable as the mode requires; false if its log write failed.
+    // In ASYNC mode the record is only queued.
+    bool waitDurable(uint64_t lsn) {
+        if (mode == DurabilityMode::ASYNC) {
+            return true;
+        }
+        if (mode == DurabilityMode::SYNC) {
+            maybeCheckpoint();
+        }
+        unique_lock<mutex> lock(logMutex);
+        durableChanged.wait(lock, [this, lsn]() { return durableLsn >= lsn; });
+        return loggedLocked(lsn);
+    }
+};
+
+// Server telemetry: request counts, errors and latency per message type, wait time on the
+// storage locks, bytes in and out, and connections. Every thread records into a shard of its
+// own, with plain stores to atomics that no other thread writes, so recording takes no lock
+// and never bounces a cache line between cores. snapshot() adds the shards together.
+//
+// A shard outlives its thread: when the thread exits the shard is handed to the next new
+// thread, so totals never go backwards and thread-per-connection servers do not pile them up.
+class ServerMetrics {
+public:
+    static const int TYPE_SLOTS = 64;   // one per MessageType value; others are counted in slot 0
+    static const int MAX_LOCKS = 16;
+
+    struct Snapshot {
+        map<int, LatencyHistogram> latency;     // by message type, nanoseconds
+        map<int, uint64_t> errors;
+        vector<string> lockNames;
+        vector<uint64_t> lockAcquisitions;
+        vector<LatencyHistogram> lockWaits;     // contended acquisitions only, nanoseconds
+        uint64_t bytesIn = 0;
+        uint64_t bytesOut = 0;
+        uint64_t connectionsActive = 0;
+        uint64_t connectionsTotal = 0;
+        double uptimeSeconds = 0;
+    };
+
+private:
+    struct Shard {
+        array<atomic<SingleWriterHistogram*>, TYPE_SLOTS> latency{};
+        array<atomic<uint64_t>, TYPE_SLOTS> errors{};
+        array<atomic<SingleWriterHistogram*>, MAX_LOCKS> lockWaits{};
+        array<atomic<uint64_t>, MAX_LOCKS> lockAcquisitions{};
+        atomic<uint64_t> bytesIn{ 0 };
+        atomic<uint64_t> bytesOut{ 0 };
+        bool leased = false;            // guarded by the registry mutex
+    };
+
+    struct Registry {
+        mutex registryMutex;
+        vector<unique_ptr<Shard>> shards;
+        vector<string> lockNames;
+        atomic<uint64_t> connectionsActive{ 0 };
+        atomic<uint64_t> connectionsTotal{ 0 };
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+    };
+
+    // Ties a shard to the current thread for as long as the thread runs
+    struct ShardLease {
+        Shard* shard;
+
+        ShardLease() {
+            Registry& metrics = registry();
+            lock_guard<mutex> lock(metrics.registryMutex);
+            for (auto& candidate : metrics.shards) {
+                if (!candidate->leased) {
+                    shard = candidate.get();
+                    shard->leased = true;
+                    return;
                 }
             }
-            cout << "----------------------------\n";
+            metrics.shards.push_back(make_unique<Shard>());
+            shard = metrics.shards.back().get();
+            shard->leased = true;
         }
-        closesocket(clientSocket);
+
+        ~ShardLease() {
+            lock_guard<mutex> lock(registry().registryMutex);
+            shard->leased = false;
+        }
+    };
+
+    // Never destroyed: detached threads may still record while statics are torn down at exit
+    static Registry& registry() {
+        static Registry* metrics = new Registry();
+        return *metrics;
+    }
+
+    static Shard& local() {
+        thread_local ShardLease lease;
+        return *lease.shard;
+    }
+
+    // Only the owning thread writes a shard, so a load and a store make a safe increment
+    static void add(atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+    static SingleWriterHistogram& histogram(atomic<SingleWriterHistogram*>& slot) {
+        SingleWriterHistogram* owned = slot.load(memory_order_relaxed);
+        if (owned == nullptr) {
+            owned = new SingleWriterHistogram();
+            slot.store(owned, memory_order_release);
+        }
+        return *owned;
     }
 
 public:
-    TCPServer() : running(true) {
-        fs::create_directories(IMAGE_DIR);
-        initializeSocket();
-        cout << "=================================\n";
-        cout << "  BOUTIQUE MANAGEMENT SERVER SIDE  \n";
-        cout << "=================================\n";
-        cout << "Server started on port " << SERVER_PORT << "\n";
-        cout << "Waiting for client connections...\n";
-        cout << "=================================\n";
+    static int typeSlot(int messageType) {
+        return messageType > 0 && messageType < TYPE_SLOTS ? messageType : 0;
     }
 
-    ~TCPServer() {
-        running = false;
-        closesocket(serverSocket);
-        for (auto& t : clientThreads) {
-            if (t.joinable()) t.join();
+    // Id under which a lock's waits are recorded; the same name always gets the same id
+    static int lockId(const string& name) {
+        Registry& metrics = registry();
+        lock_guard<mutex> lock(metrics.registryMutex);
+        auto it = find(metrics.lockNames.begin(), metrics.lockNames.end(), name);
+        if (it != metrics.lockNames.end()) {
+            return static_cast<int>(it - metrics.lockNames.begin());
         }
-#ifdef _WIN32
-        WSACleanup();
-#endif
+        if (metrics.lockNames.size() == MAX_LOCKS) {
+            return MAX_LOCKS - 1;
+        }
+        metrics.lockNames.push_back(name);
+        return static_cast<int>(metrics.lockNames.size() - 1);
     }
 
-    void start() {
-        while (running) {
-            struct sockaddr_in clientAddr;
-            socklen_t clientAddrLen = sizeof(clientAddr);
-            SOCKET clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
-            if (clientSocket == INVALID_SOCKET) {
-                if (running) cerr << "Accept failed" << endl;
-                continue;
+    static void recordRequest(int messageType, uint64_t nanos, bool error) {
+        Shard& shard = local();
+        int slot = typeSlot(messageType);
+        histogram(shard.latency[slot]).record(nanos);
+        if (error) add(shard.errors[slot], 1);
+    }
+
+    // waitNanos is 0 when the lock was free
+    static void recordLock(int lockId, uint64_t waitNanos) {
+        Shard& shard = local();
+        add(shard.lockAcquisitions[lockId], 1);
+        if (waitNanos > 0) histogram(shard.lockWaits[lockId]).record(waitNanos);
+    }
+
+    static void recordBytesIn(uint64_t bytes) {
+        add(local().bytesIn, bytes);
+    }
+
+    static void recordBytesOut(uint64_t bytes) {
+        add(local().bytesOut, bytes);
+    }
+
+    static void connectionOpened() {
+        registry().connectionsActive.fetch_add(1, memory_order_relaxed);
+        registry().connectionsTotal.fetch_add(1, memory_order_relaxed);
+    }
+
+    static void connectionClosed() {
+        registry().connectionsActive.fetch_sub(1, memory_order_relaxed);
+    }
+
+    static Snapshot snapshot() {
+        Registry& metrics = registry();
+        Snapshot result;
+        lock_guard<mutex> lock(metrics.registryMutex);
+        result.lockNames = metrics.lockNames;
+        result.lockAcquisitions.assign(metrics.lockNames.size(), 0);
+        result.lockWaits.resize(metrics.lockNames.size());
+        for (const auto& shard : metrics.shards) {
+            for (int slot = 0; slot < TYPE_SLOTS; slot++) {
+                const SingleWriterHistogram* recorded = shard->latency[slot].load(memory_order_acquire);
+                if (recorded != nullptr) recorded->addTo(result.latency[slot]);
+                uint64_t errors = shard->errors[slot].load(memory_order_relaxed);
+                if (errors > 0) result.errors[slot] += errors;
+            }
+            for (size_t id = 0; id < metrics.lockNames.size(); id++) {
+                result.lockAcquisitions[id] += shard->lockAcquisitions[id].load(memory_order_relaxed);
+                const SingleWriterHistogram* waits = shard->lockWaits[id].load(memory_order_acquire);
+                if (waits != nullptr) waits->addTo(result.lockWaits[id]);
             }
-            clientThreads.emplace_back(&TCPServer::handleClient, this, clientSocket, clientAddr);
+            result.bytesIn += shard->bytesIn.load(memory_order_relaxed);
+            result.bytesOut += shard->bytesOut.load(memory_order_relaxed);
         }
+        result.connectionsActive = metrics.connectionsActive.load(memory_order_relaxed);
+        result.connectionsTotal = metrics.connectionsTotal.load(memory_order_relaxed);
+        result.uptimeSeconds = chrono::duration<double>(chrono::steady_clock::now() - metrics.started).count();
+        return result;
     }
 };
 
-int main() {
-    try {
-        TCPServer server;
+// shared_mutex that records how often it is taken and how long callers waited for it. The
+// free case costs one try_lock and a counter; the clock is only read when the lock is busy.
+class MeteredSharedMutex {
+private:
+    shared_mutex inner;
+    int lockId;
+
+    static uint64_t nanosSince(chrono::steady_clock::time_point start) {
+        return max<uint64_t>(1, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+
+public:
+    explicit MeteredSharedMutex(const string& name) : lockId(ServerMetrics::lockId(name)) {}
+
+    MeteredSharedMutex(const MeteredSharedMutex&) = delete;
+    MeteredSharedMutex& operator=(const MeteredSharedMutex&) = delete;
+
+    void lock() {
+        if (inner.try_lock()) {
+            ServerMetrics::recordLock(lockId, 0);
+            return;
+        }
+        auto start = chrono::steady_clock::now();
+        inner.lock();
+        ServerMetrics::recordLock(lockId, nanosSince(start));
+    }
+
+    void lock_shared() {
+        if (inner.try_lock_shared()) {
+            ServerMetrics::recordLock(lockId, 0);
+            return;
+        }
+        auto start = chrono::steady_clock::now();
+        inner.lock_shared();
+        ServerMetrics::recordLock(lockId, nanosSince(start));
+    }
+
+    bool try_lock() {
+        return inner.try_lock();
+    }
+
+    bool try_lock_shared() {
+        return inner.try_lock_shared();
+    }
+
+    void unlock() {
+        inner.unlock();
+    }
+
+    void unlock_shared() {
+        inner.unlock_shared();
+    }
+};
+
+// Secondary indexes over a dress collection, kept up to date by its RecordStore. Records are
+// known by their position in the store, which never changes while the store generation is the
+// same. Color, material, brand and size each map a lower-cased value to the ascending list of
+// positions that have it (a posting list); both prices are also kept in price order for range
+// lookups. A 32-byte row per position holds the prices and value codes, so checking a record
+// against a query reads one cache line. Lines that do not parse as a dress match nothing.
+class DressIndex {
+public:
+    // Every listed condition must hold; within one attribute any of the values may match
+    struct Query {
+        vector<string> colors, materials, brands, sizes;
+        float minPrice = -numeric_limits<float>::infinity();
+        float maxPrice = numeric_limits<float>::infinity();
+        float minDiscounted = -numeric_limits<float>::infinity();
+        float maxDiscounted = numeric_limits<float>::infinity();
+
+        bool pricesBounded() const {
+            return minPrice != -numeric_limits<float>::infinity() || maxPrice != numeric_limits<float>::infinity();
+        }
+
+        bool discountedBounded() const {
+            return minDiscounted != -numeric_limits<float>::infinity() || maxDiscounted != numeric_limits<float>::infinity();
+        }
+
+        bool empty() const {
+            return colors.empty() && materials.empty() && brands.empty() && sizes.empty()
+                && !pricesBounded() && !discountedBounded();
+        }
+    };
+
+private:
+    // Value -> code -> posting list. Codes start at 1; appends come in position order, so
+    // the lists stay sorted.
+    struct Attribute {
+        unordered_map<string, uint32_t> codes;
+        vector<vector<uint32_t>> postings = vector<vector<uint32_t>>(1);
+
+        uint32_t add(const string& value, uint32_t position) {
+            auto it = codes.find(value);
+            if (it == codes.end()) {
+                it = codes.emplace(value, static_cast<uint32_t>(postings.size())).first;
+                postings.emplace_back();
+            }
+            vector<uint32_t>& list = postings[it->second];
+            if (list.empty() || list.back() != position) list.push_back(position);
+            return it->second;
+        }
+
+        // Codes of the values that occur, and how many records have one of them
+        vector<uint32_t> lookup(const vector<string>& values, size_t& records) const {
+            vector<uint32_t> found;
+            records = 0;
+            for (const string& value : values) {
+                auto it = codes.find(value);
+                if (it == codes.end() || find(found.begin(), found.end(), it->second) != found.end()) continue;
+                found.push_back(it->second);
+                records += postings[it->second].size();
+            }
+            return found;
+        }
+    };
+
+    // (price, position) pairs: a sorted run plus recent additions that are merged into it once
+    // they reach 1/32 of its size, so appends stay cheap and a lookup scans few unsorted pairs
+    struct PriceIndex {
+        vector<pair<float, uint32_t>> sorted;
+        vector<pair<float, uint32_t>> recent;
+
+        void add(float price, uint32_t position) {
+            recent.emplace_back(price, position);
+            if (recent.size() >= max<size_t>(PRICE_MERGE_MIN, sorted.size() / 32)) {
+                sort(recent.begin(), recent.end());
+                size_t middle = sorted.size();
+                sorted.insert(sorted.end(), recent.begin(), recent.end());
+                inplace_merge(sorted.begin(), sorted.begin() + middle, sorted.end());
+                recent.clear();
+            }
+        }
+
+        template <typename Visit>
+        void range(float low, float high, Visit visit) const {
+            auto first = lower_bound(sorted.begin(), sorted.end(), make_pair(low, uint32_t(0)));
+            for (auto it = first; it != sorted.end() && it->first <= high; ++it) visit(it->second);
+            for (const auto& entry : recent) {
+                if (entry.first >= low && entry.first <= high) visit(entry.second);
+            }
+        }
+
+        size_t countRange(float low, float high) const {
+            auto first = lower_bound(sorted.begin(), sorted.end(), make_pair(low, uint32_t(0)));
+            auto last = upper_bound(sorted.begin(), sorted.end(), make_pair(high, UINT32_MAX));
+            size_t found = first < last ? static_cast<size_t>(last - first) : 0;
+            for (const auto& entry : recent) {
+                if (entry.first >= low && entry.first <= high) found++;
+            }
+            return found;
+        }
+    };
+
+    struct Row {
+        float actualPrice = numeric_limits<float>::quiet_NaN();
+        float discountedPrice = numeric_limits<float>::quiet_NaN();
+        uint32_t color = 0, material = 0, brand = 0;    // 0 where the line did not parse
+        uint32_t sizes[3] = { 0, 0, 0 };
+    };
+
+    // A query with its values turned into codes
+    struct Plan {
+        vector<uint32_t> colors, materials, brands, sizes;
+        bool actualBounded = false, discountedBounded = false;
+        const Query* query = nullptr;
+    };
+
+    static constexpr size_t PRICE_MERGE_MIN = 1024;
+
+    Attribute colors, materials, brands, sizes;
+    vector<Row> rows;
+    PriceIndex actualIndex, discountedIndex;
+
+    static string lowered(const char* field, size_t length) {
+        string value(field, length);
+        for (char& c : value) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        return value;
+    }
+
+    static int lowestBit(uint64_t word) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, word);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctzll(word);
+#endif
+    }
+
+    // Puts the positions produce() passes to its visitor (about expected of them, possibly
+    // repeated) into out, ascending and without repeats: sorted when they are few, through a
+    // bitmap over the collection when they are many
+    template <typename Produce>
+    void gather(size_t expected, Produce produce, vector<uint32_t>& out) const {
+        if (expected < size() / 64) {
+            produce([&out](uint32_t position) { out.push_back(position); });
+            sort(out.begin(), out.end());
+            out.erase(unique(out.begin(), out.end()), out.end());
+            return;
+        }
+        vector<uint64_t> marked((size() + 63) / 64);
+        produce([&marked](uint32_t position) { marked[position / 64] |= 1ull << (position % 64); });
+        out.reserve(expected);
+        for (size_t word = 0; word < marked.size(); word++) {
+            for (uint64_t bits = marked[word]; bits != 0; bits &= bits - 1) {
+                out.push_back(static_cast<uint32_t>(word * 64 + lowestBit(bits)));
+            }
+        }
+    }
+
+    // Keeps the candidates that are also in list; both ascending. Written without branches on
+    // the comparisons, which the CPU could not predict.
+    static void intersect(vector<uint32_t>& candidates, const vector<uint32_t>& list) {
+        size_t kept = 0, i = 0, j = 0;
+        while (i < candidates.size() && j < list.size()) {
+            uint32_t candidate = candidates[i], listed = list[j];
+            candidates[kept] = candidate;
+            kept += candidate == listed;
+            i += candidate <= listed;
+            j += listed <= candidate;
+        }
+        candidates.resize(kept);
+    }
+
+    static bool anyOf(const vector<uint32_t>& codes, uint32_t code) {
+        return codes.empty() || find(codes.begin(), codes.end(), code) != codes.end();
+    }
+
+    static bool matches(const Plan& plan, const Row& row) {
+        const Query& query = *plan.query;
+        return (!plan.actualBounded || (row.actualPrice >= query.minPrice && row.actualPrice <= query.maxPrice))
+            && (!plan.discountedBounded || (row.discountedPrice >= query.minDiscounted && row.discountedPrice <= query.maxDiscounted))
+            && anyOf(plan.colors, row.color) && anyOf(plan.materials, row.material) && anyOf(plan.brands, row.brand)
+            && (plan.sizes.empty() || anyOf(plan.sizes, row.sizes[0]) || anyOf(plan.sizes, row.sizes[1]) || anyOf(plan.sizes, row.sizes[2]));
+    }
+
+public:
+    size_t size() const {
+        return rows.size();
+    }
+
+    void clear() {
+        *this = DressIndex();
+    }
+
+    // Indexes the record at the next position:
+    // id name actualPrice color material brand size1 size2 size3 discountedPrice ...
+    void add(const string& line) {
+        uint32_t position = static_cast<uint32_t>(rows.size());
+        const char* fields[10];
+        size_t lengths[10];
+        size_t found = 0, pos = 0;
+        while (found < 10) {
+            while (pos < line.size() && isspace(static_cast<unsigned char>(line[pos]))) pos++;
+            size_t start = pos;
+            while (pos < line.size() && !isspace(static_cast<unsigned char>(line[pos]))) pos++;
+            if (pos == start) break;
+            fields[found] = line.c_str() + start;
+            lengths[found++] = pos - start;
+        }
+        char* end = nullptr;
+        float actual = found == 10 ? strtof(fields[2], &end) : 0;
+        bool parsed = found == 10 && end != fields[2];
+        float discounted = parsed ? strtof(fields[9], &end) : 0;
+        // "nan" would break the ordering the price index is sorted by; such rows never match
+        parsed = parsed && end != fields[9] && isfinite(actual) && isfinite(discounted);
+        Row row;
+        if (!parsed) {
+            rows.push_back(row);
+            return;
+        }
+        row.actualPrice = actual;
+        row.discountedPrice = discounted;
+        row.color = colors.add(lowered(fields[3], lengths[3]), position);
+        row.material = materials.add(lowered(fields[4], lengths[4]), position);
+        row.brand = brands.add(lowered(fields[5], lengths[5]), position);
+        for (int i = 0; i < 3; i++) row.sizes[i] = sizes.add(lowered(fields[6 + i], lengths[6 + i]), position);
+        rows.push_back(row);
+        actualIndex.add(actual, position);
+        discountedIndex.add(discounted, position);
+    }
+
+    // Positions of the records that satisfy query, ascending. The most selective condition
+    // supplies the candidates, from its posting lists or its price range. Single-valued
+    // conditions whose posting lists are at most 8 times longer are intersected with them by
+    // merging, shortest first; any condition left is checked in the candidates' rows, one row
+    // read per candidate however long the other lists are. If even the best condition matches
+    // half the collection, a straight pass over the rows is cheaper.
+    vector<uint32_t> match(const Query& query) const {
+        vector<uint32_t> result;
+        Plan plan;
+        plan.query = &query;
+        plan.actualBounded = query.pricesBounded();
+        plan.discountedBounded = query.discountedBounded();
+        vector<uint32_t>* bestCodes = nullptr;
+        const Attribute* bestAttribute = nullptr;
+        const PriceIndex* bestPrices = nullptr;
+        size_t best = SIZE_MAX;
+        int conditions = (plan.actualBounded ? 1 : 0) + (plan.discountedBounded ? 1 : 0);
+        const tuple<const Attribute*, const vector<string>*, vector<uint32_t>*> attributes[] = {
+            make_tuple(&colors, &query.colors, &plan.colors), make_tuple(&materials, &query.materials, &plan.materials),
+            make_tuple(&brands, &query.brands, &plan.brands), make_tuple(&sizes, &query.sizes, &plan.sizes)
+        };
+        for (const auto& attribute : attributes) {
+            if (get<1>(attribute)->empty()) continue;
+            size_t records;
+            *get<2>(attribute) = get<0>(attribute)->lookup(*get<1>(attribute), records);
+            if (get<2>(attribute)->empty()) {
+                return result;
+            }
+            conditions++;
+            if (records < best) {
+                best = records;
+                bestAttribute = get<0>(attribute);
+                bestCodes = get<2>(attribute);
+            }
+        }
+        float low = 0, high = 0;
+        if (plan.actualBounded) {
+            size_t records = actualIndex.countRange(query.minPrice, query.maxPrice);
+            if (records < best) {
+                best = records;
+                bestPrices = &actualIndex;
+                low = query.minPrice;
+                high = query.maxPrice;
+            }
+        }
+        if (plan.discountedBounded) {
+            size_t records = discountedIndex.countRange(query.minDiscounted, query.maxDiscounted);
+            if (records < best) {
+                best = records;
+                bestPrices = &discountedIndex;
+                low = query.minDiscounted;
+                high = query.maxDiscounted;
+            }
+        }
+        if (best == 0) {
+            return result;
+        }
+        if (best >= size() / 2) {
+            for (uint32_t position = 0; position < size(); position++) {
+                if (matches(plan, rows[position])) result.push_back(position);
+            }
+            return result;
+        }
+        // Candidates in position order, so the rows are read front to back
+        if (bestPrices != nullptr) {
+            gather(best, [&](auto visit) { bestPrices->range(low, high, visit); }, result);
+            if (bestPrices == &actualIndex) plan.actualBounded = false;
+            else plan.discountedBounded = false;
+        }
+        else if (bestCodes->size() == 1) {
+            result = bestAttribute->postings[bestCodes->front()];
+            bestCodes->clear();
+        }
+        else {
+            gather(best, [&](auto visit) {
+                for (uint32_t code : *bestCodes) {
+                    for (uint32_t position : bestAttribute->postings[code]) visit(position);
+                }
+            }, result);
+            bestCodes->clear();
+        }
+        conditions--;
+        vector<pair<const vector<uint32_t>*, vector<uint32_t>*>> lists;
+        for (const auto& attribute : attributes) {
+            if (get<2>(attribute)->size() == 1) lists.emplace_back(&get<0>(attribute)->postings[get<2>(attribute)->front()], get<2>(attribute));
+        }
+        sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) { return a.first->size() < b.first->size(); });
+        for (const auto& list : lists) {
+            if (result.empty() || list.first->size() > 8 * result.size()) break;
+            intersect(result, *list.first);
+            list.second->clear();
+            conditions--;
+        }
+        if (conditions > 0) {
+            result.erase(remove_if(result.begin(), result.end(), [&](uint32_t position) {
+                return !matches(plan, rows[position]);
+            }), result.end());
+        }
+        return result;
+    }
+};
+
+// Trigram index for typo-tolerant text search over one collection. A record's words (runs of
+// letters and digits, lower-cased, words without a letter left out) are padded with a space
+// on each side and cut into trigrams: "khan" gives " kh", "kha", "han", "an ". A query matches
+// the records that share enough of its trigrams, so a misspelt word still shares most of them.
+//
+// Posting lists hold ascending record positions as varint gaps (usually one byte each), in
+// blocks of BLOCK_POSTINGS with the first position and offset of each block kept aside, so a
+// reader can jump over blocks without decoding them.
+class TextIndex {
+public:
+    // Text of the record that is indexed
+    using Extract = string (*)(const string& line);
+
+    struct Hit {
+        uint32_t position;
+        uint16_t shared;        // query trigrams the record has
+        uint16_t grams;         // trigrams of the record
+    };
+
+private:
+    static const uint32_t BLOCK_POSTINGS = 64;
+    // Space, a-z, 0-9, and one symbol for every byte outside ASCII
+    static const uint32_t SYMBOLS = 38;
+
+    struct PostingList {
+        vector<uint8_t> bytes;
+        vector<pair<uint32_t, uint32_t>> blocks;    // first position and byte offset of each block
+        uint32_t count = 0;
+        uint32_t last = 0;
+
+        void add(uint32_t position) {
+            if (count > 0 && position == last) {
+                return;
+            }
+            if (count % BLOCK_POSTINGS == 0) {
+                blocks.emplace_back(position, static_cast<uint32_t>(bytes.size()));
+            }
+            else {
+                for (uint32_t gap = position - last; ; gap >>= 7) {
+                    if (gap < 0x80) {
+                        bytes.push_back(static_cast<uint8_t>(gap));
+                        break;
+                    }
+                    bytes.push_back(static_cast<uint8_t>(gap | 0x80));
+                }
+            }
+            last = position;
+            count++;
+        }
+    };
+
+    // Reads one posting list in order; seek() skips whole blocks when it can
+    class Cursor {
+    private:
+        const PostingList* list;
+        size_t block = 0;
+        uint32_t inBlock = 0;
+        uint32_t offset = 0;
+        uint32_t current = 0;
+        bool finished = false;
+
+        void load(size_t index) {
+            block = index;
+            inBlock = 0;
+            current = list->blocks[index].first;
+            offset = list->blocks[index].second;
+        }
+
+    public:
+        explicit Cursor(const PostingList* list) : list(list) {
+            if (list->count == 0) finished = true;
+            else load(0);
+        }
+
+        bool done() const {
+            return finished;
+        }
+
+        uint32_t position() const {
+            return current;
+        }
+
+        uint32_t size() const {
+            return list->count;
+        }
+
+        void next() {
+            if (block * BLOCK_POSTINGS + inBlock + 1 >= list->count) {
+                finished = true;
+                return;
+            }
+            if (inBlock + 1 == BLOCK_POSTINGS) {
+                load(block + 1);
+                return;
+            }
+            uint32_t gap = 0;
+            for (int shift = 0; ; shift += 7) {
+                uint8_t byte = list->bytes[offset++];
+                gap |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                if (byte < 0x80) break;
+            }
+            current += gap;
+            inBlock++;
+        }
+
+        // Moves to the first position >= target; true if that is target itself
+        bool seek(uint32_t target) {
+            if (finished || current >= target) {
+                return !finished && current == target;
+            }
+            size_t skipTo = block;
+            while (skipTo + 1 < list->blocks.size() && list->blocks[skipTo + 1].first <= target) skipTo++;
+            if (skipTo != block) load(skipTo);
+            while (!finished && current < target) next();
+            return !finished && current == target;
+        }
+    };
+
+    Extract extract;
+    vector<PostingList> lists = vector<PostingList>(SYMBOLS * SYMBOLS * SYMBOLS);
+    vector<uint16_t> recordGrams;       // trigrams per record, by position
+
+    static uint32_t symbol(unsigned char c) {
+        if (c >= 'a' && c <= 'z') return 1 + (c - 'a');
+        if (c >= 'A' && c <= 'Z') return 1 + (c - 'A');
+        if (c >= '0' && c <= '9') return 27 + (c - '0');
+        return c >= 0x80 ? 37 : 0;
+    }
+
+public:
+    // The distinct trigrams of text, ascending
+    static vector<uint32_t> trigrams(const string& text) {
+        vector<uint32_t> grams;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            while (pos < text.size() && symbol(static_cast<unsigned char>(text[pos])) == 0) pos++;
+            size_t start = pos;
+            bool letter = false;
+            while (pos < text.size() && symbol(static_cast<unsigned char>(text[pos])) != 0) {
+                uint32_t s = symbol(static_cast<unsigned char>(text[pos++]));
+                letter = letter || s <= 26 || s == 37;
+            }
+            if (!letter) continue;
+            uint32_t previous = 0, current = 0;
+            for (size_t i = start; i <= pos; i++) {
+                uint32_t next = i < pos ? symbol(static_cast<unsigned char>(text[i])) : 0;
+                if (i > start) grams.push_back((previous * SYMBOLS + current) * SYMBOLS + next);
+                previous = current;
+                current = next;
+            }
+        }
+        sort(grams.begin(), grams.end());
+        grams.erase(unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+
+    // Everything after the ID: name, address and the rest of a customer line
+    static string customerText(const string& line) {
+        size_t space = line.find(' ');
+        return space == string::npos ? string() : line.substr(space + 1);
+    }
+
+    // Name and brand of a dress line: fields 2 and 6
+    static string dressText(const string& line) {
+        string text;
+        size_t pos = 0;
+        for (int field = 0; field < 6 && pos < line.size(); field++) {
+            while (pos < line.size() && line[pos] == ' ') pos++;
+            size_t start = pos;
+            while (pos < line.size() && line[pos] != ' ') pos++;
+            if (field == 1 || field == 5) text.append(line, start, pos - start).push_back(' ');
+        }
+        return text;
+    }
+
+    explicit TextIndex(Extract extract) : extract(extract) {}
+
+    size_t size() const {
+        return recordGrams.size();
+    }
+
+    void clear() {
+        *this = TextIndex(extract);
+    }
+
+    // Indexes the record at the next position
+    void add(const string& line) {
+        uint32_t position = static_cast<uint32_t>(recordGrams.size());
+        vector<uint32_t> grams = trigrams(extract(line));
+        for (uint32_t gram : grams) lists[gram].add(position);
+        recordGrams.push_back(static_cast<uint16_t>(min<size_t>(grams.size(), UINT16_MAX)));
+    }
+
+    // Posting bytes, and what the same postings take as plain 32-bit positions
+    void memory(size_t& compressed, size_t& plain) const {
+        compressed = plain = 0;
+        for (const PostingList& list : lists) {
+            compressed += list.bytes.size() + list.blocks.size() * sizeof(list.blocks[0]);
+            plain += list.count * sizeof(uint32_t);
+        }
+    }
+
+    // The limit best matches for query, best first: most query trigrams shared, then the
+    // shortest record (the closest match), then the earliest. A record must share at least a
+    // third of the query's trigrams.
+    //
+    // Lists are read rarest first. A record with `need` shared trigrams appears in at least
+    // one of the (lists - need + 1) rarest lists, so only those produce candidates and the
+    // others are probed for each candidate. Once the top results are full, need rises to what
+    // it takes to beat the worst of them and fewer lists produce candidates; a common word in
+    // the query then costs a few probes per candidate instead of a pass over its postings.
+    vector<Hit> search(const string& query, size_t limit) const {
+        vector<Hit> best;
+        vector<uint32_t> grams = trigrams(query);
+        if (grams.empty() || limit == 0) {
+            return best;
+        }
+        vector<Cursor> cursors;
+        for (uint32_t gram : grams) {
+            if (lists[gram].count > 0) cursors.emplace_back(&lists[gram]);
+        }
+        sort(cursors.begin(), cursors.end(), [](const Cursor& a, const Cursor& b) { return a.size() < b.size(); });
+        const size_t minimum = max<size_t>(1, (grams.size() + 2) / 3);
+        if (cursors.size() < minimum) {
+            return best;
+        }
+        // Worst of the kept hits at the front
+        auto better = [](const Hit& a, const Hit& b) {
+            if (a.shared != b.shared) return a.shared > b.shared;
+            if (a.grams != b.grams) return a.grams < b.grams;
+            return a.position < b.position;
+        };
+        size_t need = minimum;
+        size_t producing = cursors.size() - need + 1;
+        while (true) {
+            uint32_t position = UINT32_MAX;
+            for (size_t i = 0; i < producing; i++) {
+                if (!cursors[i].done()) position = min(position, cursors[i].position());
+            }
+            if (position == UINT32_MAX) break;
+            size_t shared = 0;
+            for (size_t i = 0; i < producing; i++) {
+                if (!cursors[i].done() && cursors[i].position() == position) {
+                    shared++;
+                    cursors[i].next();
+                }
+            }
+            // Probing stops once the record can no longer make the top results: too few
+            // trigrams left to reach need, or at most a tie with the worst kept hit and no
+            // shorter than it (a tie on length goes to the earlier record, which was kept)
+            const bool full = best.size() == limit;
+            auto hopeless = [&](size_t reachable) {
+                return reachable < need || (full && reachable == best.front().shared && recordGrams[position] >= best.front().grams);
+            };
+            size_t i = producing;
+            while (!hopeless(shared + (cursors.size() - i)) && i < cursors.size()) {
+                if (cursors[i++].seek(position)) shared++;
+            }
+            if (hopeless(shared)) continue;
+            Hit hit{ position, static_cast<uint16_t>(shared), recordGrams[position] };
+            if (full) {
+                pop_heap(best.begin(), best.end(), better);
+                best.pop_back();
+            }
+            best.push_back(hit);
+            push_heap(best.begin(), best.end(), better);
+            if (best.size() == limit && best.front().shared > need) {
+                // Ties with the worst kept hit can still win on length, so need stops at its count
+                need = best.front().shared;
+                producing = cursors.size() - need + 1;
+            }
+        }
+        sort_heap(best.begin(), best.end(), better);
+        return best;
+    }
+};
+
+// Fixed-size slab of records; a store's blocks never move once allocated
+struct RecordBlock {
+    string records[RECORD_BLOCK_SIZE];
+};
+
+// The first count() records of a store as they were when the snapshot was taken
+class RecordSnapshot {
+private:
+    vector<shared_ptr<RecordBlock>> blocks;
+    size_t recordCount = 0;
+    size_t textBytes = 0;
+    uint64_t storeGeneration = 0;
+
+public:
+    RecordSnapshot() {}
+
+    RecordSnapshot(const vector<shared_ptr<RecordBlock>>& blocks, size_t recordCount, size_t textBytes, uint64_t storeGeneration)
+        : blocks(blocks), recordCount(recordCount), textBytes(textBytes), storeGeneration(storeGeneration) {}
+
+    size_t count() const {
+        return recordCount;
+    }
+
+    // Positions stay valid for as long as the generation is unchanged: inserts only append
+    uint64_t generation() const {
+        return storeGeneration;
+    }
+
+    // Total length of records begin .. end - 1, without line terminators
+    size_t bytes(size_t begin, size_t end) const {
+        if (begin == 0 && end == recordCount) {
+            return textBytes;
+        }
+        size_t total = 0;
+        for (size_t position = begin; position < end; position++) {
+            total += (*this)[position].size();
+        }
+        return total;
+    }
+
+    const string& operator[](size_t position) const {
+        return blocks[position / RECORD_BLOCK_SIZE]->records[position % RECORD_BLOCK_SIZE];
+    }
+};
+
+// Running sales totals over the orders collection, kept up to date by its RecordStore like the
+// dress and text indexes: every order line that is loaded, replayed from the log or appended
+// is added once, so a report reads the totals instead of rescanning orders.txt. Money is kept
+// in cents, so the totals come out the same however many orders are added and in what order.
+// Dresses and customers are also kept ranked by revenue (dresses by units too), so a top-N
+// report costs N steps.
+//
+// Order lines: id customerID dressID dressType quantity totalPrice
+class OrderAggregates {
+public:
+    // Largest order total in dollars, so that the cents of 90,000 such orders still add up
+    // in an int64_t
+    static constexpr double MAX_ORDER_TOTAL = 1e12;
+
+    struct Totals {
+        uint64_t orders = 0;
+        uint64_t units = 0;
+        int64_t cents = 0;
+
+        void add(const Totals& other) {
+            orders += other.orders;
+            units += other.units;
+            cents += other.cents;
+        }
+
+        bool operator==(const Totals& other) const {
+            return orders == other.orders && units == other.units && cents == other.cents;
+        }
+    };
+
+    // 'S' (stitched) or 'U' (unstitched) and the dress ID in one key
+    static uint64_t dressKey(char type, int dressID) {
+        return (static_cast<uint64_t>(static_cast<unsigned char>(type)) << 32) | static_cast<uint32_t>(dressID);
+    }
+
+    static char dressType(uint64_t key) {
+        return static_cast<char>(key >> 32);
+    }
+
+    static int dressId(uint64_t key) {
+        return static_cast<int>(static_cast<uint32_t>(key));
+    }
+
+    // Highest value first, then lowest key
+    template <typename Key>
+    struct Ranking {
+        bool operator()(const pair<int64_t, Key>& a, const pair<int64_t, Key>& b) const {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        }
+    };
+
+    template <typename Key>
+    using Ranked = set<pair<int64_t, Key>, Ranking<Key>>;
+
+private:
+    Totals overall;
+    Totals stitched, unstitched;
+    unordered_map<uint64_t, Totals> dresses;
+    unordered_map<int, Totals> customers;
+    size_t unreadable = 0;
+    bool rankingsKept = true;
+    Ranked<uint64_t> dressRevenue, dressUnits;
+    Ranked<int> customerRevenue;
+
+    template <typename Key>
+    static void rerank(Ranked<Key>& ranking, Key key, int64_t before, int64_t after, bool existed) {
+        if (existed) ranking.erase({ before, key });
+        ranking.insert({ after, key });
+    }
+
+    static bool parse(const string& line, int& customerID, uint64_t& key, Totals& order) {
+        const char* text = line.c_str();
+        char* end = nullptr;
+        strtol(text, &end, 10);
+        if (end == text) return false;
+        text = end;
+        long customer = strtol(text, &end, 10);
+        if (end == text) return false;
+        text = end;
+        long dress = strtol(text, &end, 10);
+        if (end == text) return false;
+        text = end;
+        while (*text == ' ') text++;
+        if (*text == '\0' || *text == ' ') return false;
+        // Orders for anything but "S" go to the unstitched collection; see InsertManager
+        char type = (text[0] == 'S' && (text[1] == ' ' || text[1] == '\0')) ? 'S' : 'U';
+        while (*text != ' ' && *text != '\0') text++;
+        long quantity = strtol(text, &end, 10);
+        // Inserts reject quantities below 1; an older line with one is reported as unreadable
+        // rather than counted with units and revenue that disagree
+        if (end == text || quantity <= 0) return false;
+        text = end;
+        double total = strtod(text, &end);
+        // llround of nan, inf or anything past int64_t is unspecified, and one such order would
+        // spoil every total
+        if (end == text || !(fabs(total) <= MAX_ORDER_TOTAL)) return false;
+        customerID = static_cast<int>(customer);
+        key = dressKey(type, static_cast<int>(dress));
+        order.orders = 1;
+        order.units = static_cast<uint64_t>(quantity);
+        order.cents = llround(total * 100.0);
+        return true;
+    }
+
+    void add(int customerID, uint64_t key, const Totals& order) {
+        overall.add(order);
+        (dressType(key) == 'S' ? stitched : unstitched).add(order);
+        Totals& dress = dresses[key];
+        Totals& customer = customers[customerID];
+        if (rankingsKept) {
+            rerank(dressRevenue, key, dress.cents, dress.cents + order.cents, dress.orders > 0);
+            rerank(dressUnits, key, static_cast<int64_t>(dress.units), static_cast<int64_t>(dress.units + order.units), dress.orders > 0);
+            rerank(customerRevenue, customerID, customer.cents, customer.cents + order.cents, customer.orders > 0);
+        }
+        dress.add(order);
+        customer.add(order);
+    }
+
+public:
+    // Stops re-ranking on every order until buildRankings(): for loads and rescans, where
+    // ranking once at the end is several times cheaper
+    void deferRankings() {
+        rankingsKept = false;
+    }
+
+    // Ranks every dress and customer from their totals, and re-ranks per order again
+    void buildRankings() {
+        dressRevenue.clear();
+        dressUnits.clear();
+        customerRevenue.clear();
+        for (const auto& dress : dresses) {
+            dressRevenue.insert({ dress.second.cents, dress.first });
+            dressUnits.insert({ static_cast<int64_t>(dress.second.units), dress.first });
+        }
+        for (const auto& customer : customers) customerRevenue.insert({ customer.second.cents, customer.first });
+        rankingsKept = true;
+    }
+
+    void clear() {
+        *this = OrderAggregates();
+    }
+
+    // Adds the order at the next position of the collection
+    void add(const string& line) {
+        int customerID;
+        uint64_t key;
+        Totals order;
+        if (!parse(line, customerID, key, order)) {
+            unreadable++;
+            return;
+        }
+        add(customerID, key, order);
+    }
+
+    // Totals of the first count orders of records, rebuilt from scratch by threads scanning
+    // equal slices of them in parallel. The snapshot needs no lock.
+    static OrderAggregates rescan(const RecordSnapshot& records, size_t count, unsigned threads) {
+        threads = max(1u, min<unsigned>(threads, static_cast<unsigned>(count / 10000 + 1)));
+        vector<OrderAggregates> parts(threads);
+        vector<thread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                OrderAggregates& part = parts[t];
+                part.deferRankings();
+                for (size_t position = count * t / threads; position < count * (t + 1) / threads; position++) {
+                    part.add(records[position]);
+                }
+            });
+        }
+        for (thread& worker : workers) worker.join();
+        OrderAggregates result = move(parts[0]);
+        for (unsigned t = 1; t < threads; t++) {
+            const OrderAggregates& part = parts[t];
+            result.overall.add(part.overall);
+            result.stitched.add(part.stitched);
+            result.unstitched.add(part.unstitched);
+            result.unreadable += part.unreadable;
+            for (const auto& dress : part.dresses) result.dresses[dress.first].add(dress.second);
+            for (const auto& customer : part.customers) result.customers[customer.first].add(customer.second);
+        }
+        result.buildRankings();
+        return result;
+    }
+
+    // Same totals for every order, dress and customer
+    bool operator==(const OrderAggregates& other) const {
+        return overall == other.overall && stitched == other.stitched && unstitched == other.unstitched
+            && unreadable == other.unreadable && dresses == other.dresses && customers == other.customers;
+    }
+
+    const Totals& all() const {
+        return overall;
+    }
+
+    const Totals& byType(char type) const {
+        return type == 'S' ? stitched : unstitched;
+    }
+
+    // Null if the dress or customer has no orders
+    const Totals* dress(char type, int dressID) const {
+        auto it = dresses.find(dressKey(type, dressID));
+        return it == dresses.end() ? nullptr : &it->second;
+    }
+
+    const Totals* customer(int customerID) const {
+        auto it = customers.find(customerID);
+        return it == customers.end() ? nullptr : &it->second;
+    }
+
+    size_t dressCount() const {
+        return dresses.size();
+    }
+
+    size_t customerCount() const {
+        return customers.size();
+    }
+
+    size_t unreadableLines() const {
+        return unreadable;
+    }
+
+    const Ranked<uint64_t>& dressesByRevenue() const {
+        return dressRevenue;
+    }
+
+    const Ranked<uint64_t>& dressesByUnits() const {
+        return dressUnits;
+    }
+
+    const Ranked<int>& customersByRevenue() const {
+        return customerRevenue;
+    }
+};
+
+// Resident copy of one record file. Every non-empty line is kept in memory and indexed
+// by its leading numeric ID, so lookups, duplicate checks and counts never touch the disk.
+// Appends go to both the in-memory copy and the file.
+//
+// Each store is its own lock domain: readers take the lock shared, writers exclusive, so
+// writers only block their own collection. The methods below do not lock; callers go
+// through FileHandler or hold a CollectionLock.
+//
+// Records are kept in fixed-size blocks that never move once allocated. Appends only fill
+// slots past the current count, so a snapshot holding the block pointers can keep reading
+// its records after the store lock is released.
+class RecordStore {
+private:
+    string filename;
+    int lockRank;
+    vector<shared_ptr<RecordBlock>> blocks;
+    size_t recordCount = 0;
+    size_t textBytes = 0;
+    uint64_t generation = 0;        // bumped whenever the records are reloaded
+    unordered_map<int, size_t> index;
+    unique_ptr<DressIndex> dresses;  // dress collections only
+    unique_ptr<TextIndex> text;
+    unique_ptr<OrderAggregates> sales;  // orders only
+    mutable MeteredSharedMutex storeMutex;
+    FILE* appendFile = nullptr;
+    unordered_map<int, pair<string, uint64_t>> held;   // logged inserts (line, LSN) not yet in the file or memory
+    bool fileBehind = false;        // a logged insert failed to reach the file; the log must be kept
+    uint64_t tailOffset = 0;        // byte offset of the last line in the file
+    bool tailTerminated = true;     // false if the last line has no newline (e.g. torn by a crash)
+
+    static bool parseId(const string& line, int& id) {
+        istringstream iss(line);
+        return static_cast<bool>(iss >> id);
+    }
+
+    string& record(size_t position) {
+        return blocks[position / RECORD_BLOCK_SIZE]->records[position % RECORD_BLOCK_SIZE];
+    }
+
+    void pushRecord(const string& line) {
+        if (recordCount % RECORD_BLOCK_SIZE == 0) {
+            blocks.push_back(make_shared<RecordBlock>());
+        }
+        record(recordCount++) = line;
+        textBytes += line.size();
+        if (dresses) dresses->add(line);
+        if (text) text->add(line);
+        if (sales) sales->add(line);
+    }
+
+    bool writeLines(const vector<string>& lines) {
+        if (appendFile == nullptr) {
+            appendFile = fopen(filename.c_str(), "ab");
+            if (appendFile == nullptr) {
+                Logger::log(LOG_ERROR, "write_failed", "Failed to open file " + filename + " for writing");
+                return false;
+            }
+        }
+        string text;
+        for (const string& line : lines) {
+            text += line;
+            text += '\n';
+        }
+        if (fwrite(text.data(), 1, text.size(), appendFile) != text.size() || fflush(appendFile) != 0) {
+            Logger::log(LOG_ERROR, "write_failed", "Failed to write file " + filename);
+            return false;
+        }
+        return true;
+    }
+
+    // Logged inserts are committed: one that cannot be written to the file still goes to
+    // memory, and the log keeps it until the server restarts and replays it into the file
+    void commit(const vector<int>& ids, const vector<string>& lines) {
+        if (ids.empty()) return;
+        if (!writeLines(lines)) fileBehind = true;
+        for (size_t i = 0; i < lines.size(); i++) {
+            index.emplace(ids[i], recordCount);
+            pushRecord(lines[i]);
+        }
+    }
+
+    void reindex() {
+        if (dresses) dresses->clear();
+        if (text) text->clear();
+        if (sales) {
+            sales->clear();
+            sales->deferRankings();
+        }
+        for (size_t position = 0; position < recordCount; position++) {
+            if (dresses) dresses->add(record(position));
+            if (text) text->add(record(position));
+            if (sales) sales->add(record(position));
+        }
+        if (sales) sales->buildRankings();
+    }
+
+public:
+    RecordStore(const string& filename, int lockRank)
+        : filename(filename), lockRank(lockRank), storeMutex(fs::path(filename).stem().string()) {}
+
+    ~RecordStore() {
+        if (appendFile != nullptr) fclose(appendFile);
+    }
+
+    RecordStore(const RecordStore&) = delete;
+    RecordStore& operator=(const RecordStore&) = delete;
+
+    // Keeps a DressIndex over the records from now on
+    void indexDresses() {
+        dresses = make_unique<DressIndex>();
+        reindex();
+    }
+
+    // Keeps a TextIndex over the text extract picks out of each record from now on
+    void indexText(TextIndex::Extract extract) {
+        text = make_unique<TextIndex>(extract);
+        reindex();
+    }
+
+    // Keeps OrderAggregates over the records from now on
+    void aggregateOrders() {
+        sales = make_unique<OrderAggregates>();
+        reindex();
+    }
+
+    // Swaps in totals rebuilt from the first count() records; caller holds the lock exclusively
+    void replaceOrderAggregates(OrderAggregates rebuilt) {
+        *sales = move(rebuilt);
+    }
+
+    // Null unless indexDresses() was called; read it under the store lock
+    const DressIndex* dressIndex() const {
+        return dresses.get();
+    }
+
+    // Null unless indexText() was called; read it under the store lock
+    const TextIndex* textIndex() const {
+        return text.get();
+    }
+
+    // Null unless aggregateOrders() was called; read it under the store lock
+    const OrderAggregates* orderAggregates() const {
+        return sales.get();
+    }
+
+    // Starts over with fresh blocks; snapshots taken earlier keep the old ones alive
+    bool load() {
+        blocks.clear();
+        recordCount = 0;
+        textBytes = 0;
+        generation++;
+        index.clear();
+        if (dresses) dresses->clear();
+        if (text) text->clear();
+        if (sales) sales->clear();
+        tailOffset = 0;
+        tailTerminated = true;
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        if (sales) sales->deferRankings();
+        string line;
+        uint64_t offset = 0;
+        while (getline(file, line)) {
+            uint64_t lineStart = offset;
+            offset += line.size() + 1;
+            tailTerminated = !file.eof();
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) {
+                int id;
+                if (parseId(line, id)) {
+                    // Keep the first occurrence, matching the old top-to-bottom file scan
+                    index.emplace(id, recordCount);
+                }
+                pushRecord(line);
+                tailOffset = lineStart;
+            }
+        }
+        file.close();
+        if (sales) sales->buildRankings();
+        return true;
+    }
+
+    bool contains(int id) const {
+        return index.find(id) != index.end();
+    }
+
+    // An insert for the ID is waiting for its log record; no other insert may take it
+    bool isHeld(int id) const {
+        return held.find(id) != held.end();
+    }
+
+    const string* find(int id) const {
+        auto it = index.find(id);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        return &blocks[it->second / RECORD_BLOCK_SIZE]->records[it->second % RECORD_BLOCK_SIZE];
+    }
+
+    size_t count() const {
+        return recordCount;
+    }
+
+    // Caller holds the store lock (shared is enough) while taking the snapshot, not while using it
+    RecordSnapshot snapshot() const {
+        return RecordSnapshot(blocks, recordCount, textBytes, generation);
+    }
+
+    // Appends to the file (kept open between inserts) and to memory
+    bool append(int id, const string& line) {
+        return appendAll({ id }, { line });
+    }
+
+    // Several records with one file write
+    bool appendAll(const vector<int>& ids, const vector<string>& lines) {
+        if (!writeLines(lines)) return false;
+        for (size_t i = 0; i < lines.size(); i++) {
+            index.emplace(ids[i], recordCount);
+            pushRecord(lines[i]);
+        }
+        return true;
+    }
+
+    // Holds checked inserts while their log record (lsn) is written. Caller holds the store
+    // lock exclusively, as for the calls below.
+    void hold(const vector<int>& ids, const vector<string>& lines, uint64_t lsn) {
+        for (size_t i = 0; i < ids.size(); i++) held.emplace(ids[i], make_pair(lines[i], lsn));
+    }
+
+    // Moves held inserts into the file and memory once logged, or drops them if their log
+    // write failed. Inserts a checkpoint has applied meanwhile count as applied.
+    bool applyHeld(const vector<int>& ids, bool logged) {
+        bool applied = true;
+        vector<int> applyIds;
+        vector<string> applyLines;
+        for (int id : ids) {
+            auto it = held.find(id);
+            if (it == held.end()) continue;
+            if (logged) {
+                applyIds.push_back(id);
+                applyLines.push_back(move(it->second.first));
+            }
+            applied = applied && logged;
+            held.erase(it);
+        }
+        commit(applyIds, applyLines);
+        return applied;
+    }
+
+    // Applies every held insert whose log record is durable; see FileHandler::checkpoint
+    void applyLogged(WriteAheadLog& log) {
+        vector<pair<uint64_t, int>> ready;
+        for (const auto& entry : held) {
+            if (log.isLogged(entry.second.second)) ready.emplace_back(entry.second.second, entry.first);
+        }
+        sort(ready.begin(), ready.end());
+        vector<int> ids;
+        vector<string> lines;
+        for (const auto& entry : ready) {
+            ids.push_back(entry.second);
+            lines.push_back(move(held[entry.second].first));
+            held.erase(entry.second);
+        }
+        commit(ids, lines);
+    }
+
+    // False while a logged insert is missing from the file, so the log is not emptied
+    bool sync() {
+        return !fileBehind && (appendFile == nullptr || syncFile(appendFile));
+    }
+
+    // Recovery: if the last line lost its newline (cut short by a crash) and the logged
+    // line starts with it, the logged line replaces it. Returns true if it did.
+    bool replaceTornTail(int id, const string& line) {
+        if (tailTerminated || recordCount == 0 || line.compare(0, record(recordCount - 1).size(), record(recordCount - 1)) != 0) {
+            return false;
+        }
+        string& tail = record(recordCount - 1);
+        int oldId;
+        if (parseId(tail, oldId)) {
+            auto it = index.find(oldId);
+            if (it != index.end() && it->second + 1 == recordCount) index.erase(it);
+        }
+        if (appendFile != nullptr) {
+            fclose(appendFile);
+            appendFile = nullptr;
+        }
+        fs::resize_file(filename, tailOffset);
+        textBytes += line.size() - tail.size();
+        tail = line;
+        index.emplace(id, recordCount - 1);
+        if (dresses || text || sales) reindex();
+        tailTerminated = false;
+        terminateTail(line);
+        return true;
+    }
+
+    // Ends an unterminated last line so later appends do not run into it
+    void terminateTail(const string& rewrite = "") {
+        if (tailTerminated) {
+            return;
+        }
+        if (appendFile != nullptr) {
+            fclose(appendFile);
+            appendFile = nullptr;
+        }
+        FILE* file = fopen(filename.c_str(), "ab");
+        if (file != nullptr) {
+            string text = rewrite + "\n";
+            fwrite(text.data(), 1, text.size(), file);
+            syncFile(file);
+            fclose(file);
+        }
+        tailTerminated = true;
+    }
+
+    const string& getFilename() const {
+        return filename;
+    }
+
+    // Position in the global lock order used when several collections are locked together
+    int getLockRank() const {
+        return lockRank;
+    }
+
+    MeteredSharedMutex& getMutex() const {
+        return storeMutex;
+    }
+};
+
+// Locks several collections at once, shared or exclusive per collection. The locks are
+// always taken in lock-rank order, so two multi-collection operations can never deadlock.
+class CollectionLock {
+public:
+    struct Entry {
+        RecordStore* store;
+        bool exclusive;
+    };
+
+private:
+    vector<Entry> entries;
+
+public:
+    CollectionLock(initializer_list<Entry> requested) : CollectionLock(vector<Entry>(requested)) {}
+
+    explicit CollectionLock(vector<Entry> requested) : entries(move(requested)) {
+        sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.store->getLockRank() < b.store->getLockRank();
+        });
+        // The same store may be named twice; lock it once, exclusively if either asks for it
+        vector<Entry> unique;
+        for (const Entry& entry : entries) {
+            if (!unique.empty() && unique.back().store == entry.store) {
+                unique.back().exclusive = unique.back().exclusive || entry.exclusive;
+            }
+            else {
+                unique.push_back(entry);
+            }
+        }
+        entries.swap(unique);
+        for (const Entry& entry : entries) {
+            if (entry.exclusive) entry.store->getMutex().lock();
+            else entry.store->getMutex().lock_shared();
+        }
+    }
+
+    ~CollectionLock() {
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            if (it->exclusive) it->store->getMutex().unlock();
+            else it->store->getMutex().unlock_shared();
+        }
+    }
+
+    CollectionLock(const CollectionLock&) = delete;
+    CollectionLock& operator=(const CollectionLock&) = delete;
+};
+
+// Fixed set of worker threads fed by a bounded queue, with depth and wait-time metrics
+class WorkerPool {
+public:
+    struct Stats {
+        string name;
+        size_t depth;
+        size_t maxDepth;
+        uint64_t submitted;
+        uint64_t rejected;
+        uint64_t completed;
+        uint64_t totalWaitMicros;
+        uint64_t maxWaitMicros;
+    };
+
+private:
+    struct Job {
+        function<void()> task;
+        chrono::steady_clock::time_point enqueuedAt;
+    };
+
+    string name;
+    BoundedQueue<Job> jobs;
+    vector<thread> workers;
+    atomic<size_t> depth{ 0 };
+    atomic<size_t> maxDepth{ 0 };
+    atomic<uint64_t> submitted{ 0 };
+    atomic<uint64_t> rejected{ 0 };
+    atomic<uint64_t> completed{ 0 };
+    atomic<uint64_t> totalWaitMicros{ 0 };
+    atomic<uint64_t> maxWaitMicros{ 0 };
+
+    static void raiseTo(atomic<uint64_t>& target, uint64_t value) {
+        uint64_t current = target.load(memory_order_relaxed);
+        while (value > current && !target.compare_exchange_weak(current, value, memory_order_relaxed)) {}
+    }
+
+    void noteEnqueued() {
+        size_t now = depth.fetch_add(1, memory_order_relaxed) + 1;
+        size_t highest = maxDepth.load(memory_order_relaxed);
+        while (now > highest && !maxDepth.compare_exchange_weak(highest, now, memory_order_relaxed)) {}
+    }
+
+    // Every live pool, for the metrics report
+    static mutex& registryMutex() {
+        static mutex poolsMutex;
+        return poolsMutex;
+    }
+
+    static vector<const WorkerPool*>& pools() {
+        static vector<const WorkerPool*> live;
+        return live;
+    }
+
+    static chrono::steady_clock::time_point& jobStart() {
+        thread_local chrono::steady_clock::time_point started;
+        return started;
+    }
+
+    void workerLoop() {
+        Job job;
+        while (jobs.pop(job)) {
+            depth.fetch_sub(1, memory_order_relaxed);
+            jobStart() = chrono::steady_clock::now();
+            uint64_t waited = chrono::duration_cast<chrono::microseconds>(jobStart() - job.enqueuedAt).count();
+            totalWaitMicros.fetch_add(waited, memory_order_relaxed);
+            raiseTo(maxWaitMicros, waited);
+            job.task();
+            completed.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+public:
+    WorkerPool(const string& name, unsigned threadCount, size_t capacity) : name(name), jobs(capacity) {
+        if (threadCount == 0) threadCount = 1;
+        for (unsigned i = 0; i < threadCount; i++) {
+            workers.emplace_back(&WorkerPool::workerLoop, this);
+        }
+        lock_guard<mutex> lock(registryMutex());
+        pools().push_back(this);
+    }
+
+    ~WorkerPool() {
+        shutdown();
+        lock_guard<mutex> lock(registryMutex());
+        pools().erase(remove(pools().begin(), pools().end(), this), pools().end());
+    }
+
+    // Finishes the queued jobs, then stops the workers
+    void shutdown() {
+        jobs.close();
+        for (auto& worker : workers) {
+            if (worker.joinable()) worker.join();
+        }
+    }
+
+    // Non-blocking submit; false when the queue is full
+    bool trySubmit(function<void()> task) {
+        // Count the job first so a worker never sees the depth go below zero
+        noteEnqueued();
+        if (!jobs.tryPush(Job{ move(task), chrono::steady_clock::now() })) {
+            depth.fetch_sub(1, memory_order_relaxed);
+            rejected.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        submitted.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    // Blocks the caller until there is room in the queue
+    bool submit(function<void()> task) {
+        noteEnqueued();
+        if (!jobs.push(Job{ move(task), chrono::steady_clock::now() })) {
+            depth.fetch_sub(1, memory_order_relaxed);
+            return false;
+        }
+        submitted.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    size_t threadCount() const {
+        return workers.size();
+    }
+
+    // When the calling worker took its current job off the queue; the epoch on other threads
+    static chrono::steady_clock::time_point currentJobStart() {
+        return jobStart();
+    }
+
+    // For a job that runs several requests in turn: the next one is timed from now
+    static void restartJobClock(chrono::steady_clock::time_point now) {
+        jobStart() = now;
+    }
+
+    Stats stats() const {
+        return { name, depth.load(memory_order_relaxed), maxDepth.load(memory_order_relaxed), submitted.load(memory_order_relaxed),
+            rejected.load(memory_order_relaxed), completed.load(memory_order_relaxed), totalWaitMicros.load(memory_order_relaxed),
+            maxWaitMicros.load(memory_order_relaxed) };
+    }
+
+    static vector<Stats> allStats() {
+        lock_guard<mutex> lock(registryMutex());
+        vector<Stats> result;
+        for (const WorkerPool* pool : pools()) result.push_back(pool->stats());
+        return result;
+    }
+
+    static string metricsReport(const Stats& stats) {
+        ostringstream oss;
+        oss << "Queue " << stats.name << ": depth " << stats.depth << " (max " << stats.maxDepth << "), submitted " << stats.submitted
+            << ", completed " << stats.completed << ", rejected " << stats.rejected
+            << ", wait avg " << (stats.completed ? stats.totalWaitMicros / stats.completed : 0) << " us (max " << stats.maxWaitMicros << " us)";
+        return oss.str();
+    }
+
+    string metricsReport() const {
+        return metricsReport(stats());
+    }
+};
+
+// Hot images kept in memory up to a byte budget, least recently used out first. An entry
+// remembers the ETag it was read with and is only returned for that ETag, so a replaced
+// image is never served stale. Images larger than an eighth of the budget are not cached;
+// they are sent from the file with sendfile() instead.
+class ImageCache {
+private:
+    struct Entry {
+        string name;
+        string etag;
+        shared_ptr<const string> bytes;
+    };
+
+    struct State {
+        mutex cacheMutex;
+        list<Entry> entries; // most recently used first
+        unordered_map<string, list<Entry>::iterator> index;
+        size_t usedBytes = 0;
+        size_t budgetBytes = DEFAULT_IMAGE_CACHE_BYTES;
+        atomic<uint64_t> hits{ 0 };
+        atomic<uint64_t> misses{ 0 };
+        atomic<uint64_t> notModified{ 0 };
+        atomic<uint64_t> memoryBytes{ 0 };   // bytes served from the cache instead of the disk
+        atomic<uint64_t> savedBytes{ 0 };    // bytes not sent at all thanks to a matching ETag
+    };
+
+    static State& state() {
+        static State cacheState;
+        return cacheState;
+    }
+
+    static void erase(State& cache, unordered_map<string, list<Entry>::iterator>::iterator it) {
+        cache.usedBytes -= it->second->bytes->size();
+        cache.entries.erase(it->second);
+        cache.index.erase(it);
+    }
+
+public:
+    static void configure(size_t budgetBytes) {
+        State& cache = state();
+        lock_guard<mutex> lock(cache.cacheMutex);
+        cache.budgetBytes = budgetBytes;
+        while (cache.usedBytes > cache.budgetBytes) {
+            erase(cache, cache.index.find(cache.entries.back().name));
+        }
+    }
+
+    static bool cacheable(uint64_t size) {
+        State& cache = state();
+        lock_guard<mutex> lock(cache.cacheMutex);
+        return size <= cache.budgetBytes / 8;
+    }
+
+    // The cached bytes of this version of the image, or nullptr
+    static shared_ptr<const string> lookup(const string& name, const string& etag) {
+        State& cache = state();
+        lock_guard<mutex> lock(cache.cacheMutex);
+        auto it = cache.index.find(name);
+        if (it == cache.index.end() || it->second->etag != etag) {
+            cache.misses.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+        cache.entries.splice(cache.entries.begin(), cache.entries, it->second);
+        cache.hits.fetch_add(1, memory_order_relaxed);
+        cache.memoryBytes.fetch_add(it->second->bytes->size(), memory_order_relaxed);
+        return it->second->bytes;
+    }
+
+    static void insert(const string& name, const string& etag, shared_ptr<const string> bytes) {
+        State& cache = state();
+        lock_guard<mutex> lock(cache.cacheMutex);
+        if (bytes->size() > cache.budgetBytes / 8) {
+            return;
+        }
+        auto it = cache.index.find(name);
+        if (it != cache.index.end()) {
+            erase(cache, it);
+        }
+        while (cache.usedBytes + bytes->size() > cache.budgetBytes) {
+            erase(cache, cache.index.find(cache.entries.back().name));
+        }
+        cache.usedBytes += bytes->size();
+        cache.entries.push_front(Entry{ name, etag, move(bytes) });
+        cache.index[name] = cache.entries.begin();
+    }
+
+    // Called whenever an image is written
+    static void invalidate(const string& name) {
+        State& cache = state();
+        lock_guard<mutex> lock(cache.cacheMutex);
+        auto it = cache.index.find(name);
+        if (it != cache.index.end()) {
+            erase(cache, it);
+        }
+    }
+
+    static void recordNotModified(uint64_t size) {
+        state().notModified.fetch_add(1, memory_order_relaxed);
+        state().savedBytes.fetch_add(size, memory_order_relaxed);
+    }
+
+    static string stats() {
+        State& cache = state();
+        uint64_t hits = cache.hits.load(memory_order_relaxed);
+        uint64_t misses = cache.misses.load(memory_order_relaxed);
+        size_t images, used, budget;
+        {
+            lock_guard<mutex> lock(cache.cacheMutex);
+            images = cache.entries.size();
+            used = cache.usedBytes;
+            budget = cache.budgetBytes;
+        }
+        ostringstream oss;
+        oss << "Image cache: hits=" << hits << " misses=" << misses << " hitRatio=" << fixed << setprecision(1)
+            << (hits + misses ? 100.0 * hits / (hits + misses) : 0.0) << "% notModified=" << cache.notModified.load(memory_order_relaxed)
+            << " bytesSaved=" << cache.savedBytes.load(memory_order_relaxed) << " bytesFromMemory=" << cache.memoryBytes.load(memory_order_relaxed)
+            << " images=" << images << " used=" << used << " budget=" << budget;
+        return oss.str();
+    }
+};
+
+// In-memory side of the content-addressed image store: the blob (SHA-256 of the contents)
+// every image name links to, and how many names share each blob. Rebuilt from the files at
+// startup; FileHandler guards it with its image mutex.
+class BlobIndex {
+private:
+    struct Blob {
+        uint64_t size = 0;
+        size_t references = 0;
+    };
+
+    unordered_map<string, string> names; // image name -> hash
+    unordered_map<string, Blob> blobs;
+    uint64_t duplicates = 0;
+    uint64_t probeHits = 0;
+    uint64_t duplicateBytes = 0;
+
+public:
+    bool hasBlob(const string& hash) const {
+        return blobs.count(hash) > 0;
+    }
+
+    uint64_t blobSize(const string& hash) const {
+        auto it = blobs.find(hash);
+        return it == blobs.end() ? 0 : it->second.size;
+    }
+
+    const string* hashOf(const string& imageName) const {
+        auto it = names.find(imageName);
+        return it == names.end() ? nullptr : &it->second;
+    }
+
+    void addBlob(const string& hash, uint64_t size) {
+        blobs[hash].size = size;
+    }
+
+    void removeBlob(const string& hash) {
+        blobs.erase(hash);
+    }
+
+    // Points imageName at hash. Returns the hash that lost its last reference, if any.
+    string link(const string& imageName, const string& hash) {
+        blobs[hash].references++;
+        auto it = names.find(imageName);
+        if (it == names.end()) {
+            names.emplace(imageName, hash);
+            return "";
+        }
+        string previous = it->second;
+        it->second = hash;
+        auto old = blobs.find(previous);
+        if (old != blobs.end() && --old->second.references == 0) {
+            return previous;
+        }
+        return "";
+    }
+
+    vector<string> unreferenced() const {
+        vector<string> hashes;
+        for (const auto& blob : blobs) {
+            if (blob.second.references == 0) hashes.push_back(blob.first);
+        }
+        return hashes;
+    }
+
+    // An upload whose contents were already stored; beforePayload if the client asked first
+    void recordDuplicate(uint64_t size, bool beforePayload) {
+        duplicates++;
+        duplicateBytes += size;
+        if (beforePayload) probeHits++;
+    }
+
+    string describe() const {
+        uint64_t logicalBytes = 0, storedBytes = 0;
+        for (const auto& blob : blobs) {
+            logicalBytes += blob.second.size * blob.second.references;
+            storedBytes += blob.second.size;
+        }
+        ostringstream oss;
+        oss << "Image store: images=" << names.size() << " blobs=" << blobs.size() << " logicalBytes=" << logicalBytes
+            << " storedBytes=" << storedBytes << " savedBytes=" << logicalBytes - storedBytes << " duplicates=" << duplicates
+            << " (" << probeHits << " before upload, " << duplicateBytes << " bytes)";
+        return oss.str();
+    }
+};
+
+enum class AddResult {
+    ADDED,
+    DUPLICATE,
+    WRITE_FAILED
+};
+
+class FileHandler {
+private:
+    // Built once on first use and never modified afterwards, so looking a store up needs no lock
+    static const unordered_map<string, unique_ptr<RecordStore>>& stores() {
+        static const unordered_map<string, unique_ptr<RecordStore>> storeMap = []() {
+            unordered_map<string, unique_ptr<RecordStore>> created;
+            int rank = 0;
+            for (const string filename : { "customers.txt", "stitched_dresses.txt", "unstitched_dresses.txt", "orders.txt" }) {
+                created.emplace(filename, make_unique<RecordStore>(filename, rank++));
+            }
+            created.at("stitched_dresses.txt")->indexDresses();
+            created.at("unstitched_dresses.txt")->indexDresses();
+            created.at("stitched_dresses.txt")->indexText(&TextIndex::dressText);
+            created.at("unstitched_dresses.txt")->indexText(&TextIndex::dressText);
+            created.at("customers.txt")->indexText(&TextIndex::customerText);
+            created.at("orders.txt")->aggregateOrders();
+            return created;
+        }();
+        return storeMap;
+    }
+
+    static MeteredSharedMutex& imageMutex() {
+        static MeteredSharedMutex imagesMutex("images");
+        return imagesMutex;
+    }
+
+    static BlobIndex& blobIndex() {
+        static BlobIndex index;
+        return index;
+    }
+
+    static atomic<uint64_t>& linkCounter() {
+        static atomic<uint64_t> counter(0);
+        return counter;
+    }
+
+    static string blobPath(const string& hash) {
+        return IMAGE_DIR + ".blobs/" + hash.substr(0, 2) + "/" + hash;
+    }
+
+    // Thumbnails belong to the contents, not to a name: every name linked to a blob shares them
+    static string thumbnailPath(const string& hash, int size) {
+        return IMAGE_DIR + ".thumbs/" + hash + "-" + to_string(size) + ".bmp";
+    }
+
+    // Points imageName at a stored blob. The new hard link is made under a temporary name and
+    // renamed over the old one, so readers see either the previous image or the new one.
+    // A blob is deleted together with its last name. The image mutex must be held.
+    static bool linkImage(const string& imageName, const string& hash) {
+        BlobIndex& index = blobIndex();
+        const string* current = index.hashOf(imageName);
+        if (current != nullptr && *current == hash) {
+            return true;
+        }
+        string linkPath = IMAGE_DIR + ".link-" + to_string(linkCounter()++) + ".tmp";
+        error_code ec;
+        fs::create_hard_link(blobPath(hash), linkPath, ec);
+        if (!ec) {
+            fs::rename(linkPath, IMAGE_DIR + imageName, ec);
+        }
+        if (ec) {
+            Logger::log(LOG_ERROR, "image_store_failed", "Failed to store image " + imageName + ": " + ec.message());
+            error_code ignored;
+            fs::remove(linkPath, ignored);
+            return false;
+        }
+        string released = index.link(imageName, hash);
+        if (!released.empty()) {
+            fs::remove(blobPath(released), ec);
+            for (int size : THUMBNAIL_SIZES) fs::remove(thumbnailPath(released, size), ec);
+            index.removeBlob(released);
+        }
+        ImageCache::invalidate(imageName);
+        return true;
+    }
+
+    // Rebuilds the blob index: names that are hard links to a blob are matched by file
+    // identity, any other image (e.g. from before the store existed) is hashed and adopted,
+    // and blobs no name refers to any more are deleted
+    static void loadImageStore() {
+        blobIndex() = BlobIndex();
+        BlobIndex& index = blobIndex();
+        error_code ec;
+        fs::create_directories(IMAGE_DIR + ".blobs", ec);
+        map<FileIdentity, string> blobFiles;
+        for (const auto& entry : fs::recursive_directory_iterator(IMAGE_DIR + ".blobs", ec)) {
+            FileIdentity identity;
+            if (entry.is_regular_file(ec) && fileIdentity(entry.path().string(), identity)) {
+                string hash = entry.path().filename().string();
+                blobFiles[identity] = hash;
+                index.addBlob(hash, entry.file_size(ec));
+            }
+        }
+        size_t adopted = 0;
+        for (const auto& entry : fs::directory_iterator(IMAGE_DIR, ec)) {
+            string imageName = entry.path().filename().string();
+            FileIdentity identity;
+            if (!entry.is_regular_file(ec) || !validImageName(imageName) || !fileIdentity(entry.path().string(), identity)) {
+                continue;
+            }
+            auto blob = blobFiles.find(identity);
+            if (blob != blobFiles.end()) {
+                index.link(imageName, blob->second);
+                continue;
+            }
+            MappedFile image;
+            if (!image.open(entry.path().string())) {
+                continue;
+            }
+            string hash = sha256Hex(image.data(), image.size());
+            if (!index.hasBlob(hash)) {
+                // The image itself becomes the blob; the name is a link to it already
+                fs::create_directories(fs::path(blobPath(hash)).parent_path(), ec);
+                fs::create_hard_link(entry.path(), blobPath(hash), ec);
+                if (ec) {
+                    continue;
+                }
+                index.addBlob(hash, image.size());
+                index.link(imageName, hash);
+                adopted++;
+                continue;
+            }
+            image.close();
+            if (linkImage(imageName, hash)) {
+                adopted++;
+            }
+        }
+        for (const string& hash : index.unreferenced()) {
+            fs::remove(blobPath(hash), ec);
+            index.removeBlob(hash);
+        }
+        // Thumbnails of blobs that are gone, and ones a previous run did not finish writing
+        fs::create_directories(IMAGE_DIR + ".thumbs", ec);
+        for (const auto& entry : fs::directory_iterator(IMAGE_DIR + ".thumbs", ec)) {
+            string thumbnail = entry.path().filename().string();
+            if (thumbnail.rfind(".tmp") != string::npos || !index.hasBlob(thumbnail.substr(0, thumbnail.find('-')))) {
+                fs::remove(entry.path(), ec);
+            }
+        }
+        if (adopted > 0 || !blobFiles.empty()) {
+            cout << index.describe() << (adopted ? ", " + to_string(adopted) + " images adopted" : "") << "\n";
+        }
+    }
+
+    static WriteAheadLog& wal() {
+        static WriteAheadLog log(WAL_FILE);
+        return log;
+    }
+
+    // Makes every record file durable and empties the log. All collections are locked so no
+    // insert can slip between the file sync and the truncation, and inserts whose log record
+    // is durable but that are still waiting to reach their file are applied here first.
+    static bool checkpoint() {
+        RecordStore& customers = store("customers.txt");
+        RecordStore& stitched = store("stitched_dresses.txt");
+        RecordStore& unstitched = store("unstitched_dresses.txt");
+        RecordStore& orders = store("orders.txt");
+        CollectionLock locks({ { &customers, true }, { &stitched, true }, { &unstitched, true }, { &orders, true } });
+        return wal().truncate([&]() {
+            for (RecordStore* recordStore : { &customers, &stitched, &unstitched, &orders }) {
+                recordStore->applyLogged(wal());
+            }
+            return customers.sync() && stitched.sync() && unstitched.sync() && orders.sync();
+        });
+    }
+
+    // Replays the write-ahead log into the freshly loaded record files
+    static void recoverFromLog() {
+        size_t restored = 0;
+        size_t logged = wal().replay([&restored](const string& filename, const string& line) {
+            auto it = stores().find(filename);
+            int id;
+            istringstream iss(line);
+            if (it == stores().end() || !(iss >> id)) return;
+            RecordStore& recordStore = *it->second;
+            if (recordStore.replaceTornTail(id, line) || (!recordStore.contains(id) && recordStore.append(id, line))) {
+                restored++;
+            }
+        });
+        for (auto& entry : stores()) {
+            entry.second->terminateTail();
+        }
+        if (logged > 0) {
+            cout << "WAL: " << logged << " logged inserts, " << restored << " restored into record files\n";
+        }
+    }
+
+public:
+    static RecordStore& store(const string& filename) {
+        auto it = stores().find(filename);
+        if (it == stores().end()) {
+            throw runtime_error("Unknown record file " + filename);
+        }
+        return *it->second;
+    }
+
+    static void configureDurability(DurabilityMode mode, int groupMillis) {
+        wal().configure(mode, groupMillis);
+    }
+
+    // Loads every record file into memory once, before any client is accepted, and brings
+    // them up to date from the write-ahead log
+    static void loadStores() {
+        for (const string filename : { "stitched_dresses.txt", "unstitched_dresses.txt", "customers.txt", "orders.txt" }) {
+            RecordStore& recordStore = store(filename);
+            unique_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+            recordStore.load();
+        }
+        recoverFromLog();
+        if (!checkpoint()) {
+            cerr << "ERROR: Failed to reset " << WAL_FILE << endl;
+        }
+        for (auto& entry : stores()) {
+            cout << "Loaded " << entry.second->count() << " records from " << entry.first << "\n";
+        }
+        wal().setCheckpointHook(&FileHandler::checkpoint);
+        cout << "Durability: " << WriteAheadLog::modeName(wal().getMode());
+        if (wal().getMode() != DurabilityMode::SYNC) cout << " (" << wal().getGroupMillis() << " ms)";
+        cout << "\n";
+    }
+
+    // Logs checked (record file, line) inserts in one write and returns the LSN to wait on.
+    // The caller holds the collection locks and holds the inserts in their stores.
+    static uint64_t logInserts(const vector<pair<string, string>>& records) {
+        return records.empty() ? 0 : wal().append(records);
+    }
+
+    // Blocks until logged inserts are durable; false if their log write failed
+    static bool waitDurable(uint64_t lsn) {
+        return lsn == 0 || wal().waitDurable(lsn);
+    }
+
+    static RecordSnapshot snapshot(const string& filename) {
+        RecordStore& recordStore = store(filename);
+        shared_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+        return recordStore.snapshot();
+    }
+
+    // Positions of the dresses that match query, and a snapshot to read them from taken
+    // under the same lock. False if filename is not an indexed dress collection.
+    static bool filterDresses(const string& filename, const DressIndex::Query& query, RecordSnapshot& records, vector<uint32_t>& matches) {
+        RecordStore& recordStore = store(filename);
+        shared_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+        const DressIndex* dresses = recordStore.dressIndex();
+        if (dresses == nullptr) {
+            return false;
+        }
+        matches = dresses->match(query);
+        records = recordStore.snapshot();
+        return true;
+    }
+
+    // The best text matches in filename, and a snapshot to read them from taken under the same
+    // lock. False if the collection has no text index.
+    static bool searchText(const string& filename, const string& query, size_t limit, RecordSnapshot& records, vector<TextIndex::Hit>& hits) {
+        RecordStore& recordStore = store(filename);
+        shared_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+        const TextIndex* index = recordStore.textIndex();
+        if (index == nullptr) {
+            return false;
+        }
+        hits = index->search(query, limit);
+        records = recordStore.snapshot();
+        return true;
+    }
+
+    // Runs report over the running order totals with the orders lock held shared
+    static string orderReport(const function<string(const OrderAggregates&)>& report) {
+        RecordStore& orders = store("orders.txt");
+        shared_lock<MeteredSharedMutex> lock(orders.getMutex());
+        return report(*orders.orderAggregates());
+    }
+
+    // Recomputes the order totals with a parallel rescan of the orders. The scan reads a
+    // snapshot, so inserts carry on while it runs; orders added meanwhile are added to the
+    // result under the exclusive lock, which is then compared with the running totals
+    // (matched) and, if replace, takes their place. False if the orders were reloaded.
+    static bool rescanOrders(unsigned threads, bool replace, bool& matched, size_t& scanned) {
+        RecordStore& orders = store("orders.txt");
+        RecordSnapshot records = snapshot("orders.txt");
+        OrderAggregates rebuilt = OrderAggregates::rescan(records, records.count(), threads);
+        unique_lock<MeteredSharedMutex> lock(orders.getMutex());
+        RecordSnapshot latest = orders.snapshot();
+        if (latest.generation() != records.generation()) {
+            return false;
+        }
+        for (size_t position = records.count(); position < latest.count(); position++) rebuilt.add(latest[position]);
+        matched = rebuilt == *orders.orderAggregates();
+        scanned = latest.count();
+        if (replace) orders.replaceOrderAggregates(move(rebuilt));
+        return true;
+    }
+
+    // Duplicate check and log append done under one lock, so two clients cannot both add the
+    // same ID. The lock is released while waiting for the log, so concurrent inserts into the
+    // same collection can share one log sync, and taken again to apply the insert.
+    static AddResult addRecord(int id, const string& filename, const string& line) {
+        RecordStore& recordStore = store(filename);
+        uint64_t lsn;
+        {
+            unique_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+            if (recordStore.contains(id) || recordStore.isHeld(id)) {
+                return AddResult::DUPLICATE;
+            }
+            lsn = logInserts({ { filename, line } });
+            recordStore.hold({ id }, { line }, lsn);
+        }
+        bool logged = waitDurable(lsn);
+        unique_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+        return recordStore.applyHeld({ id }, logged) ? AddResult::ADDED : AddResult::WRITE_FAILED;
+    }
+
+    static int countLines(const string& filename) {
+        RecordStore& recordStore = store(filename);
+        shared_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+        return static_cast<int>(recordStore.count());
+    }
+
+    static bool validateID(int id, const string& filename) {
+        return !recordExists(id, filename);
+    }
+
+    static bool recordExists(int id, const string& filename) {
+        RecordStore& recordStore = store(filename);
+        shared_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+        return recordStore.contains(id);
+    }
+
+    static string searchById(int id, const string& filename) {
+        RecordStore& recordStore = store(filename);
+        shared_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+        const string* line = recordStore.find(id);
+        if (line == nullptr) {
+            return "ERROR: Record not found";
+        }
+        return "FOUND: " + *line;
+    }
+
+    // Price is the third field of a dress line: "id name actualPrice ..."
+    static float parseDressPrice(const string& line) {
+        istringstream iss(line);
+        int id;
+        string name;
+        float price;
+        if (iss >> id >> name >> price) {
+            return price;
+        }
+        return -1.0f;
+    }
+
+    static float getDressPrice(int dressID, const string& filename) {
+        RecordStore& recordStore = store(filename);
+        shared_lock<MeteredSharedMutex> lock(recordStore.getMutex());
+        const string* line = recordStore.find(dressID);
+        return line == nullptr ? -1.0f : parseDressPrice(*line);
+    }
+
+    // Image names are used as file names directly under IMAGE_DIR. Names starting with a dot
+    // are reserved for in-progress uploads and the blob store.
+    static bool validImageName(const string& imageName) {
+        return !imageName.empty() && imageName.size() <= MAX_IMAGE_NAME && imageName[0] != '.'
+            && imageName.find_first_of("/\\:") == string::npos;
+    }
+
+    // Creates IMAGE_DIR, deletes uploads left unfinished by a previous run and loads the
+    // image store.
+    //
+    // Images are stored by content: every distinct image once, as
+    // IMAGE_DIR/.blobs/<2 hex digits>/<sha256>, and every image name is a hard link to its
+    // blob. Reading IMAGE_DIR/<name> works exactly as before, and identical images uploaded
+    // under different names share one copy on disk.
+    static void prepareImageDir() {
+        unique_lock<MeteredSharedMutex> lock(imageMutex());
+        fs::create_directories(IMAGE_DIR);
+        error_code ec;
+        for (const auto& entry : fs::directory_iterator(IMAGE_DIR, ec)) {
+            string name = entry.path().filename().string();
+            if (name.rfind(".upload-", 0) == 0 || name.rfind(".link-", 0) == 0) {
+                fs::remove(entry.path(), ec);
+            }
+        }
+        loadImageStore();
+    }
+
+    // Stores a completely written upload under imageName. If the same contents are stored
+    // already, the file is dropped and the name linked to the existing blob; otherwise the
+    // file becomes the blob. Readers see either the previous image or the new one, never a
+    // partly written file.
+    static bool storeImage(const string& tempPath, const string& imageName, const string& hash, uint64_t size) {
+        unique_lock<MeteredSharedMutex> lock(imageMutex());
+        BlobIndex& index = blobIndex();
+        error_code ec;
+        if (index.hasBlob(hash)) {
+            fs::remove(tempPath, ec);
+            index.recordDuplicate(size, false);
+            return linkImage(imageName, hash);
+        }
+        fs::create_directories(fs::path(blobPath(hash)).parent_path(), ec);
+        fs::rename(tempPath, blobPath(hash), ec);
+        if (ec) {
+            Logger::log(LOG_ERROR, "image_store_failed", "Failed to store image " + imageName + ": " + ec.message());
+            return false;
+        }
+        index.addBlob(hash, size);
+        if (!linkImage(imageName, hash)) {
+            fs::remove(blobPath(hash), ec);
+            index.removeBlob(hash);
+            return false;
+        }
+        return true;
+    }
+
+    // LINK_IMAGE: stores imageName without any image bytes if the server already has a blob
+    // with this hash. False if it does not; the client then uploads the image.
+    static bool linkExistingImage(const string& imageName, const string& hash, uint64_t& size) {
+        unique_lock<MeteredSharedMutex> lock(imageMutex());
+        BlobIndex& index = blobIndex();
+        if (!index.hasBlob(hash)) {
+            return false;
+        }
+        size = index.blobSize(hash);
+        if (!linkImage(imageName, hash)) {
+            return false;
+        }
+        index.recordDuplicate(size, true);
+        return true;
+    }
+
+    static string imageStoreStats() {
+        shared_lock<MeteredSharedMutex> lock(imageMutex());
+        return blobIndex().describe();
+    }
+
+    // Opens an image for GET_IMAGE; nullptr if there is no such image
+    static shared_ptr<ImageFile> openImage(const string& imageName) {
+        shared_lock<MeteredSharedMutex> lock(imageMutex());
+        return ImageFile::open(IMAGE_DIR + imageName);
+    }
+
+    // SHA-256 of the image stored under imageName; empty if there is no such image
+    static string imageHash(const string& imageName) {
+        shared_lock<MeteredSharedMutex> lock(imageMutex());
+        const string* hash = blobIndex().hashOf(imageName);
+        return hash == nullptr ? "" : *hash;
+    }
+
+    // Maps a blob for reading. The mapping stays valid even if the blob is deleted meanwhile.
+    static bool mapBlob(const string& hash, MappedFile& file) {
+        shared_lock<MeteredSharedMutex> lock(imageMutex());
+        return blobIndex().hasBlob(hash) && file.open(blobPath(hash));
+    }
+
+    static bool hasThumbnail(const string& hash, int size) {
+        error_code ec;
+        return fs::exists(thumbnailPath(hash, size), ec);
+    }
+
+    static shared_ptr<ImageFile> openThumbnail(const string& hash, int size) {
+        shared_lock<MeteredSharedMutex> lock(imageMutex());
+        return ImageFile::open(thumbnailPath(hash, size));
+    }
+
+    // Writes an encoded thumbnail next to the blob. Thumbnails are written under a temporary
+    // name and renamed into place, and only while the blob still exists, so a blob deleted
+    // while its thumbnails were being made does not leave them behind.
+    static bool storeThumbnail(const string& hash, int size, const string& encoded) {
+        string tempPath = thumbnailPath(hash, size) + "." + to_string(linkCounter()++) + ".tmp";
+        FILE* file = fopen(tempPath.c_str(), "wb");
+        if (file == nullptr) {
+            Logger::log(LOG_ERROR, "write_failed", "Failed to open thumbnail file " + tempPath + " for writing");
+            return false;
+        }
+        bool written = fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+        fclose(file);
+        error_code ec;
+        shared_lock<MeteredSharedMutex> lock(imageMutex());
+        if (!written || !blobIndex().hasBlob(hash)) {
+            fs::remove(tempPath, ec);
+            return false;
+        }
+        fs::rename(tempPath, thumbnailPath(hash, size), ec);
+        return !ec;
+    }
+
+    static bool saveImage(const string& imageName, const string& data) {
+        string decodedData = base64_decode(data);
+        string hash = sha256Hex(decodedData.data(), decodedData.size());
+        {
+            // A duplicate is only linked, nothing is written
+            unique_lock<MeteredSharedMutex> lock(imageMutex());
+            BlobIndex& index = blobIndex();
+            if (index.hasBlob(hash)) {
+                index.recordDuplicate(decodedData.size(), false);
+                return linkImage(imageName, hash);
+            }
+        }
+        string tempPath = IMAGE_DIR + ".upload-save-" + to_string(linkCounter()++) + ".tmp";
+        FILE* file = fopen(tempPath.c_str(), "wb");
+        if (file == nullptr) {
+            Logger::log(LOG_ERROR, "write_failed", "Failed to open image file " + tempPath + " for writing");
+            return false;
+        }
+        bool written = fwrite(decodedData.data(), 1, decodedData.size(), file) == decodedData.size() && syncFile(file);
+        fclose(file);
+        if (!written) {
+            error_code ec;
+            fs::remove(tempPath, ec);
+            return false;
+        }
+        return storeImage(tempPath, imageName, hash, decodedData.size());
+    }
+};
+
+// Payload of a frame that is consumed as it arrives instead of being collected in
+// Request::data. RequestAssembler feeds it slice by slice on the connection's I/O thread.
+class StreamedBody {
+public:
+    virtual ~StreamedBody() {}
+    virtual void write(const char* data, size_t length) = 0;
+    // Called once the whole payload has arrived; false if it was rejected (see getError)
+    virtual bool finish() = 0;
+    virtual const string& getError() const = 0;
+};
+
+// The body of one UPLOAD_IMAGE frame, written to a temporary file in IMAGE_DIR as it comes
+// off the socket. Memory use is independent of the image size. commit() moves the file into
+// place; an upload that is never committed is deleted.
+class ImageUpload : public StreamedBody {
+private:
+    static atomic<uint64_t>& uploadCounter() {
+        static atomic<uint64_t> counter(0);
+        return counter;
+    }
+
+    string imageName;
+    bool nameComplete = false;
+    string tempPath;
+    FILE* file = nullptr;
+    uint64_t bytesWritten = 0;
+    Sha256 hash;
+    string error;
+
+public:
+    ImageUpload() {}
+
+    ~ImageUpload() {
+        discard();
+    }
+
+    ImageUpload(const ImageUpload&) = delete;
+    ImageUpload& operator=(const ImageUpload&) = delete;
+
+    // Takes the next slice of the payload: first the "name|" prefix, then image bytes
+    void write(const char* data, size_t length) override {
+        if (!error.empty()) {
+            return;
+        }
+        if (!nameComplete) {
+            const char* separator = static_cast<const char*>(memchr(data, '|', length));
+            size_t take = separator != nullptr ? static_cast<size_t>(separator - data) : length;
+            imageName.append(data, take);
+            if (imageName.size() > MAX_IMAGE_NAME) {
+                error = "ERROR: Invalid image name";
+                return;
+            }
+            if (separator == nullptr) {
+                return;
+            }
+            nameComplete = true;
+            if (!FileHandler::validImageName(imageName)) {
+                error = "ERROR: Invalid image name " + imageName;
+                return;
+            }
+            tempPath = IMAGE_DIR + ".upload-" + to_string(uploadCounter()++) + ".tmp";
+            file = fopen(tempPath.c_str(), "wb");
+            if (file == nullptr) {
+                Logger::log(LOG_ERROR, "write_failed", "Failed to open " + tempPath + " for writing");
+                error = "ERROR: Failed to save image " + imageName;
+                tempPath.clear();
+                return;
+            }
+            data += take + 1;
+            length -= take + 1;
+        }
+        if (length > 0 && fwrite(data, 1, length, file) != length) {
+            error = "ERROR: Failed to save image " + imageName;
+            return;
+        }
+        hash.update(data, length);
+        bytesWritten += length;
+    }
+
+    // Called once the whole payload has arrived. Makes the file durable so the rename in
+    // commit() can never expose an incomplete image after a crash.
+    bool finish() override {
+        if (error.empty() && !nameComplete) {
+            error = "ERROR: Invalid image data format";
+        }
+        if (file != nullptr) {
+            bool synced = syncFile(file);
+            if (fclose(file) != 0 || !synced) {
+                if (error.empty()) error = "ERROR: Failed to save image " + imageName;
+            }
+            file = nullptr;
+        }
+        return error.empty();
+    }
+
+    bool commit() {
+        if (!error.empty() || tempPath.empty() || !FileHandler::storeImage(tempPath, imageName, hash.hexDigest(), bytesWritten)) {
+            return false;
+        }
+        tempPath.clear();
+        return true;
+    }
+
+    void discard() {
+        if (file != nullptr) {
+            fclose(file);
+            file = nullptr;
+        }
+        if (!tempPath.empty()) {
+            error_code ec;
+            fs::remove(tempPath, ec);
+            tempPath.clear();
+        }
+    }
+
+    const string& name() const {
+        return imageName;
+    }
+
+    uint64_t size() const {
+        return bytesWritten;
+    }
+
+    const string& getError() const override {
+        return error;
+    }
+};
+
+// A resumable upload, persisted under IMAGE_DIR/.uploads/<id>/ so it survives disconnects
+// and server restarts:
+//   session   "name size crc32c partSize"
+//   data      the image, each part written at part * partSize
+//   parts     one byte per part, '1' once the part is on disk and its checksum matched
+// Parts may arrive in any order and over any number of connections.
+class UploadSession {
+private:
+    string sessionId;
+    string imageName;
+    uint64_t totalSize = 0;
+    uint32_t expectedCrc = 0;
+    uint64_t partBytes = 0;
+    vector<char> received;
+    int writers = 0;            // parts being written right now
+    bool closed = false;        // committed or aborted
+    mutable mutex sessionMutex;
+
+    string path(const string& file) const {
+        return IMAGE_DIR + ".uploads/" + sessionId + "/" + file;
+    }
+
+    // Ranges of parts matching want, e.g. "0-3,7"
+    string partRanges(char want) const {
+        string ranges;
+        size_t part = 0;
+        while (part < received.size()) {
+            if ((received[part] == '1') != (want == '1')) {
+                part++;
+                continue;
+            }
+            size_t first = part;
+            while (part < received.size() && (received[part] == '1') == (want == '1')) part++;
+            if (!ranges.empty()) ranges += ",";
+            ranges += to_string(first);
+            if (part - 1 > first) ranges += "-" + to_string(part - 1);
+        }
+        return ranges.empty() ? "none" : ranges;
+    }
+
+public:
+    UploadSession(const string& sessionId, const string& imageName, uint64_t totalSize, uint32_t expectedCrc, uint64_t partBytes)
+        : sessionId(sessionId), imageName(imageName), totalSize(totalSize), expectedCrc(expectedCrc), partBytes(partBytes) {
+        received.assign(static_cast<size_t>(partCount()), '0');
+    }
+
+    // Writes the session files of a new upload
+    bool create() {
+        error_code ec;
+        fs::create_directories(IMAGE_DIR + ".uploads/" + sessionId, ec);
+        ofstream session(path("session"), ios::trunc);
+        session << imageName << " " << totalSize << " " << hex << expectedCrc << dec << " " << partBytes << "\n";
+        ofstream parts(path("parts"), ios::binary | ios::trunc);
+        parts.write(received.data(), received.size());
+        FILE* data = fopen(path("data").c_str(), "wb");
+        if (data == nullptr || !session || !parts) {
+            if (data != nullptr) fclose(data);
+            return false;
+        }
+        fclose(data);
+        fs::resize_file(path("data"), totalSize, ec);
+        return !ec;
+    }
+
+    // Reads a session left by an earlier run; nullptr if its files are damaged
+    static shared_ptr<UploadSession> load(const string& sessionId) {
+        ifstream session(IMAGE_DIR + ".uploads/" + sessionId + "/session");
+        string imageName;
+        uint64_t totalSize, partBytes;
+        uint32_t expectedCrc;
+        if (!(session >> imageName >> totalSize >> hex >> expectedCrc >> dec >> partBytes) || partBytes == 0) {
+            return nullptr;
+        }
+        auto loaded = make_shared<UploadSession>(sessionId, imageName, totalSize, expectedCrc, partBytes);
+        ifstream parts(loaded->path("parts"), ios::binary);
+        string marks((istreambuf_iterator<char>(parts)), istreambuf_iterator<char>());
+        if (marks.size() != loaded->received.size()) {
+            return nullptr;
+        }
+        loaded->received.assign(marks.begin(), marks.end());
+        return loaded;
+    }
+
+    const string& id() const {
+        return sessionId;
+    }
+
+    const string& name() const {
+        return imageName;
+    }
+
+    uint64_t size() const {
+        return totalSize;
+    }
+
+    uint32_t crc() const {
+        return expectedCrc;
+    }
+
+    uint64_t partSize() const {
+        return partBytes;
+    }
+
+    uint64_t partCount() const {
+        return totalSize == 0 ? 1 : (totalSize + partBytes - 1) / partBytes;
+    }
+
+    uint64_t partLength(uint64_t part) const {
+        return min(partBytes, totalSize - part * partBytes);
+    }
+
+    string dataPath() const {
+        return path("data");
+    }
+
+    // "received/total" counters, the offset to resume from and the missing parts
+    string describe() const {
+        lock_guard<mutex> lock(sessionMutex);
+        size_t have = static_cast<size_t>(count(received.begin(), received.end(), '1'));
+        size_t firstMissing = static_cast<size_t>(find(received.begin(), received.end(), '0') - received.begin());
+        ostringstream oss;
+        oss << "Upload " << sessionId << " name=" << imageName << " size=" << totalSize << " partSize=" << partBytes
+            << " parts=" << received.size() << " received=" << have
+            << " resumeOffset=" << min<uint64_t>(totalSize, firstMissing * partBytes) << " missing=" << partRanges('0');
+        return oss.str();
+    }
+
+    // Claims a part for writing. Returns false if the upload is closed; sets alreadyReceived
+    // instead of claiming when the part is on disk already.
+    bool startPart(uint64_t part, bool& alreadyReceived) {
+        lock_guard<mutex> lock(sessionMutex);
+        if (closed) return false;
+        alreadyReceived = received[part] == '1';
+        if (!alreadyReceived) writers++;
+        return true;
+    }
+
+    void endPart() {
+        lock_guard<mutex> lock(sessionMutex);
+        writers--;
+    }
+
+    // Records a verified part, durably, so a restarted server does not ask for it again
+    bool markReceived(uint64_t part) {
+        lock_guard<mutex> lock(sessionMutex);
+        if (received[part] == '1') return true;
+        FILE* parts = fopen(path("parts").c_str(), "r+b");
+        if (parts == nullptr) return false;
+        bool ok = fseek(parts, static_cast<long>(part), SEEK_SET) == 0 && fputc('1', parts) != EOF && syncFile(parts);
+        fclose(parts);
+        if (ok) received[part] = '1';
+        return ok;
+    }
+
+    // Verifies the whole image and moves it into IMAGE_DIR; error explains a refusal
+    bool commit(string& error) {
+        lock_guard<mutex> lock(sessionMutex);
+        if (closed) {
+            error = "ERROR: Upload " + sessionId + " is closed";
+            return false;
+        }
+        if (writers > 0) {
+            error = "ERROR: Upload " + sessionId + " still has parts in flight, retry";
+            return false;
+        }
+        if (find(received.begin(), received.end(), '0') != received.end()) {
+            error = "ERROR: Upload " + sessionId + " is missing parts " + partRanges('0');
+            return false;
+        }
+        uint32_t actual = 0;
+        string contentHash;
+        {
+            MappedFile data;
+            if (!data.open(dataPath())) {
+                error = "ERROR: Failed to read upload " + sessionId;
+                return false;
+            }
+            actual = crc32c(0, data.data(), data.size());
+            if (actual == expectedCrc) {
+                contentHash = sha256Hex(data.data(), data.size());
+            }
+        }
+        if (actual != expectedCrc) {
+            ostringstream oss;
+            oss << "ERROR: Checksum mismatch for upload " << sessionId << " (expected " << hex << expectedCrc << ", got " << actual << ")";
+            error = oss.str();
+            return false;
+        }
+        if (!FileHandler::storeImage(dataPath(), imageName, contentHash, totalSize)) {
+            error = "ERROR: Failed to save image " + imageName;
+            return false;
+        }
+        closed = true;
+        return true;
+    }
+
+    // Closes the session (unless parts are being written) and deletes its files
+    bool remove() {
+        lock_guard<mutex> lock(sessionMutex);
+        if (writers > 0) return false;
+        closed = true;
+        error_code ec;
+        fs::remove_all(IMAGE_DIR + ".uploads/" + sessionId, ec);
+        return true;
+    }
+};
+
+// All open upload sessions, loaded from disk at startup
+class UploadSessions {
+private:
+    static mutex& registryMutex() {
+        static mutex sessionsMutex;
+        return sessionsMutex;
+    }
+
+    static unordered_map<string, shared_ptr<UploadSession>>& sessions() {
+        static unordered_map<string, shared_ptr<UploadSession>> openSessions;
+        return openSessions;
+    }
+
+    static string newId() {
+        static mt19937_64 generator(random_device{}());
+        ostringstream oss;
+        oss << hex << setw(16) << setfill('0') << generator();
+        return oss.str();
+    }
+
+public:
+    static void load() {
+        lock_guard<mutex> lock(registryMutex());
+        error_code ec;
+        fs::create_directories(IMAGE_DIR + ".uploads", ec);
+        for (const auto& entry : fs::directory_iterator(IMAGE_DIR + ".uploads", ec)) {
+            string sessionId = entry.path().filename().string();
+            auto session = UploadSession::load(sessionId);
+            if (session == nullptr) {
+                fs::remove_all(entry.path(), ec);
+                continue;
+            }
+            sessions()[sessionId] = session;
+        }
+        if (!sessions().empty()) {
+            cout << "Resumable uploads: " << sessions().size() << " open\n";
+        }
+    }
+
+    // Returns the open session for this exact image (same name, size and checksum) so a
+    // client that lost its upload id can resume, or starts a new one
+    static shared_ptr<UploadSession> open(const string& imageName, uint64_t size, uint32_t crc, uint64_t partSize) {
+        lock_guard<mutex> lock(registryMutex());
+        for (auto& entry : sessions()) {
+            UploadSession& session = *entry.second;
+            if (session.name() == imageName && session.size() == size && session.crc() == crc) {
+                return entry.second;
+            }
+        }
+        string sessionId = newId();
+        while (sessions().count(sessionId)) sessionId = newId();
+        auto session = make_shared<UploadSession>(sessionId, imageName, size, crc, partSize);
+        if (!session->create()) {
+            session->remove();
+            return nullptr;
+        }
+        sessions()[sessionId] = session;
+        return session;
+    }
+
+    static shared_ptr<UploadSession> find(const string& sessionId) {
+        lock_guard<mutex> lock(registryMutex());
+        auto it = sessions().find(sessionId);
+        return it == sessions().end() ? nullptr : it->second;
+    }
+
+    static void forget(const string& sessionId) {
+        lock_guard<mutex> lock(registryMutex());
+        sessions().erase(sessionId);
+    }
+};
+
+// The body of one UPLOAD_PART frame: "id part crc32c|" followed by the part's bytes, which
+// go straight into the session's data file at the part's offset while the CRC32C is
+// computed on the fly. A part whose checksum does not match is not recorded.
+class PartUpload : public StreamedBody {
+private:
+    uint64_t payloadLength;
+    string prefix;
+    bool prefixComplete = false;
+    shared_ptr<UploadSession> session;
+    uint64_t partNumber = 0;
+    uint32_t expectedCrc = 0;
+    uint32_t actualCrc = 0;
+    bool duplicate = false;
+    bool claimed = false;
+    FILE* file = nullptr;
+    string error;
+
+    void release() {
+        if (file != nullptr) {
+            fclose(file);
+            file = nullptr;
+        }
+        if (claimed) {
+            session->endPart();
+            claimed = false;
+        }
+    }
+
+    // Parses the prefix and opens the data file at the part's offset
+    void start() {
+        istringstream iss(prefix);
+        string sessionId;
+        if (!(iss >> sessionId >> partNumber >> hex >> expectedCrc)) {
+            error = "ERROR: Invalid part header. Expected: uploadId part crc32c|data";
+            return;
+        }
+        session = UploadSessions::find(sessionId);
+        if (session == nullptr) {
+            error = "ERROR: Unknown upload " + sessionId;
+            return;
+        }
+        uint64_t bodyLength = payloadLength - prefix.size() - 1;
+        if (partNumber >= session->partCount() || bodyLength != session->partLength(partNumber)) {
+            error = "ERROR: Part " + to_string(partNumber) + " does not fit upload " + sessionId;
+            return;
+        }
+        if (!session->startPart(partNumber, duplicate)) {
+            error = "ERROR: Upload " + sessionId + " is closed";
+            return;
+        }
+        if (duplicate) {
+            return;
+        }
+        claimed = true;
+        file = fopen(session->dataPath().c_str(), "r+b");
+        if (file == nullptr || fseek(file, static_cast<long>(partNumber * session->partSize()), SEEK_SET) != 0) {
+            error = "ERROR: Failed to store part " + to_string(partNumber);
+        }
+    }
+
+public:
+    explicit PartUpload(uint64_t payloadLength) : payloadLength(payloadLength) {}
+
+    ~PartUpload() {
+        release();
+    }
+
+    void write(const char* data, size_t length) override {
+        if (!error.empty()) {
+            return;
+        }
+        if (!prefixComplete) {
+            const char* separator = static_cast<const char*>(memchr(data, '|', length));
+            size_t take = separator != nullptr ? static_cast<size_t>(separator - data) : length;
+            prefix.append(data, take);
+            if (prefix.size() > MAX_PART_HEADER) {
+                error = "ERROR: Invalid part header";
+                return;
+            }
+            if (separator == nullptr) {
+                return;
+            }
+            prefixComplete = true;
+            start();
+            if (!error.empty()) {
+                return;
+            }
+            data += take + 1;
+            length -= take + 1;
+        }
+        if (duplicate || length == 0) {
+            return;
+        }
+        actualCrc = crc32c(actualCrc, data, length);
+        if (fwrite(data, 1, length, file) != length) {
+            error = "ERROR: Failed to store part " + to_string(partNumber);
+        }
+    }
+
+    bool finish() override {
+        if (error.empty() && !prefixComplete) {
+            error = "ERROR: Invalid part header. Expected: uploadId part crc32c|data";
+        }
+        if (file != nullptr && !syncFile(file) && error.empty()) {
+            error = "ERROR: Failed to store part " + to_string(partNumber);
+        }
+        release();
+        if (error.empty() && !duplicate && actualCrc != expectedCrc) {
+            ostringstream oss;
+            oss << "ERROR: Part " << partNumber << " checksum mismatch (expected " << hex << expectedCrc << ", got " << actualCrc << ")";
+            error = oss.str();
+        }
+        return error.empty();
+    }
+
+    const string& getError() const override {
+        return error;
+    }
+
+    UploadSession& getSession() {
+        return *session;
+    }
+
+    uint64_t part() const {
+        return partNumber;
+    }
+
+    bool alreadyReceived() const {
+        return duplicate;
+    }
+};
+
+// Binary columnar format for the dress catalog files (.bmcat).
+//
+// Both dress files hold 14 space-separated fields per line: id, name, actualPrice, color,
+// material, brand, size1, size2, size3, discountedPrice and four type-specific fields.
+// The binary file stores id and the two prices as fixed-width columns. The 11 text fields
+// are dictionary-encoded: every distinct value is stored once in a shared string pool, and
+// each column holds per-row codes into its own small dictionary, 1, 2 or 4 bytes wide
+// depending on how many distinct values the column has. Colors, materials, brands and
+// sizes therefore cost one byte per row. Every section is 8-byte aligned and the file is
+// read in place through a memory mapping, without any parsing.
+//
+//   CatalogHeader
+//   CatalogColumn           columns[CATALOG_STRING_COLUMNS]
+//   int32                   ids[rows]
+//   float                   actualPrices[rows]
+//   float                   discountedPrices[rows]
+//   per column: uint32      dictionary[dictionaryCount]   pool codes; entry 0 means "no value"
+//   per column: uint8/16/32 codes[rows]
+//   CatalogVerbatim         verbatim[verbatimCount]      sorted by row
+//   uint32                  poolOffsets[poolCount + 1]
+//   char                    poolBytes[...]
+//
+// A line that does not round-trip exactly through the columns (wrong field count, a price
+// written as "1500" rather than "1500.00", extra spaces) is kept verbatim in the pool and
+// its column values are zero / "no value", so converting back to text always reproduces
+// the original file.
+const uint32_t CATALOG_VERSION = 1;
+const int CATALOG_FIELDS = 14;
+const int CATALOG_STRING_COLUMNS = 11;
+const int CATALOG_STRING_FIELDS[CATALOG_STRING_COLUMNS] = { 1, 3, 4, 5, 6, 7, 8, 10, 11, 12, 13 };
+const uint64_t CATALOG_FLAG_NO_FINAL_NEWLINE = 1;
+
+struct CatalogHeader {
+    char magic[8];             // "BMCATLG\0"
+    uint32_t version;
+    uint32_t endianCheck;      // 0x01020304 as written by the producing machine
+    uint64_t rowCount;
+    uint64_t poolCount;
+    uint64_t verbatimCount;
+    uint64_t flags;
+    uint64_t idOffset;
+    uint64_t actualPriceOffset;
+    uint64_t discountedPriceOffset;
+    uint64_t verbatimOffset;
+    uint64_t poolOffsetsOffset;
+    uint64_t poolBytesOffset;
+    uint64_t fileSize;
+};
+
+struct CatalogColumn {
+    uint64_t dictionaryOffset;
+    uint64_t codesOffset;
+    uint32_t dictionaryCount;
+    uint32_t codeWidth;
+};
+
+struct CatalogVerbatim {
+    uint32_t row;
+    uint32_t poolCode;
+};
+
+class CatalogFormat {
+private:
+    static bool parsePrice(const string& text, float& price) {
+        char* end = nullptr;
+        price = strtof(text.c_str(), &end);
+        return !text.empty() && end == text.c_str() + text.size();
+    }
+
+    static void splitFields(const string& line, vector<string>& fields) {
+        fields.clear();
+        size_t start = 0;
+        while (start <= line.size()) {
+            size_t space = line.find(' ', start);
+            if (space == string::npos) space = line.size();
+            fields.push_back(line.substr(start, space - start));
+            start = space + 1;
+        }
+    }
+
+    static void align(string& out) {
+        while (out.size() % 8) out.push_back('\0');
+    }
+
+    template <typename T>
+    static uint64_t appendArray(string& out, const vector<T>& values) {
+        align(out);
+        uint64_t offset = out.size();
+        if (!values.empty()) out.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+        return offset;
+    }
+
+    template <typename T>
+    static uint64_t appendCodes(string& out, const vector<uint32_t>& codes) {
+        vector<T> narrow(codes.begin(), codes.end());
+        return appendArray(out, narrow);
+    }
+
+public:
+    static string formatPrice(float price) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%.2f", price);
+        return buffer;
+    }
+
+    // Rebuilds the text line of a row from its columns
+    static string joinFields(int id, float actualPrice, float discountedPrice, const string* strings) {
+        string line = to_string(id);
+        int next = 0;
+        for (int field = 1; field < CATALOG_FIELDS; field++) {
+            line += ' ';
+            if (field == 2) line += formatPrice(actualPrice);
+            else if (field == 9) line += formatPrice(discountedPrice);
+            else line += strings[next++];
+        }
+        return line;
+    }
+
+    static bool textToBinary(const string& textPath, const string& binaryPath, string& error) {
+        ifstream in(textPath, ios::binary);
+        if (!in.is_open()) {
+            error = "cannot open " + textPath;
+            return false;
+        }
+        vector<int32_t> ids;
+        vector<float> actualPrices, discountedPrices;
+        vector<vector<uint32_t>> codes(CATALOG_STRING_COLUMNS);
+        vector<vector<uint32_t>> dictionaries(CATALOG_STRING_COLUMNS, vector<uint32_t>(1, 0));
+        vector<unordered_map<uint32_t, uint32_t>> localCodes(CATALOG_STRING_COLUMNS);
+        vector<CatalogVerbatim> verbatim;
+        unordered_map<string, uint32_t> poolIndex;
+        vector<string> pool;
+        auto intern = [&](const string& value) {
+            auto it = poolIndex.find(value);
+            if (it != poolIndex.end()) return it->second;
+            uint32_t code = static_cast<uint32_t>(pool.size());
+            poolIndex.emplace(value, code);
+            pool.push_back(value);
+            return code;
+        };
+
+        string line;
+        vector<string> fields;
+        bool lastTerminated = true;
+        while (getline(in, line)) {
+            lastTerminated = !in.eof();
+            splitFields(line, fields);
+            int id = 0;
+            float actualPrice = 0, discountedPrice = 0;
+            bool columnar = fields.size() == CATALOG_FIELDS && parsePrice(fields[2], actualPrice) && parsePrice(fields[9], discountedPrice);
+            if (columnar) {
+                try {
+                    size_t used = 0;
+                    id = stoi(fields[0], &used);
+                    columnar = used == fields[0].size();
+                }
+                catch (const exception&) {
+                    columnar = false;
+                }
+            }
+            string strings[CATALOG_STRING_COLUMNS];
+            if (columnar) {
+                for (int c = 0; c < CATALOG_STRING_COLUMNS; c++) strings[c] = fields[CATALOG_STRING_FIELDS[c]];
+                columnar = joinFields(id, actualPrice, discountedPrice, strings) == line;
+            }
+            uint32_t row = static_cast<uint32_t>(ids.size());
+            ids.push_back(columnar ? id : 0);
+            actualPrices.push_back(columnar ? actualPrice : 0.0f);
+            discountedPrices.push_back(columnar ? discountedPrice : 0.0f);
+            for (int c = 0; c < CATALOG_STRING_COLUMNS; c++) {
+                uint32_t local = 0;
+                if (columnar) {
+                    uint32_t poolCode = intern(strings[c]);
+                    auto it = localCodes[c].find(poolCode);
+                    if (it == localCodes[c].end()) {
+                        it = localCodes[c].emplace(poolCode, static_cast<uint32_t>(dictionaries[c].size())).first;
+                        dictionaries[c].push_back(poolCode);
+                    }
+                    local = it->second;
+                }
+                codes[c].push_back(local);
+            }
+            if (!columnar) {
+                verbatim.push_back({ row, intern(line) });
+            }
+        }
+
+        CatalogHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "BMCATLG", 8);
+        header.version = CATALOG_VERSION;
+        header.endianCheck = 0x01020304;
+        header.rowCount = ids.size();
+        header.poolCount = pool.size();
+        header.verbatimCount = verbatim.size();
+        header.flags = lastTerminated ? 0 : CATALOG_FLAG_NO_FINAL_NEWLINE;
+        CatalogColumn columns[CATALOG_STRING_COLUMNS];
+        string out(sizeof(header) + sizeof(columns), '\0');
+        header.idOffset = appendArray(out, ids);
+        header.actualPriceOffset = appendArray(out, actualPrices);
+        header.discountedPriceOffset = appendArray(out, discountedPrices);
+        for (int c = 0; c < CATALOG_STRING_COLUMNS; c++) {
+            size_t entries = dictionaries[c].size();
+            columns[c].dictionaryCount = static_cast<uint32_t>(entries);
+            columns[c].codeWidth = entries <= 0x100 ? 1 : entries <= 0x10000 ? 2 : 4;
+            columns[c].dictionaryOffset = appendArray(out, dictionaries[c]);
+            if (columns[c].codeWidth == 1) columns[c].codesOffset = appendCodes<uint8_t>(out, codes[c]);
+            else if (columns[c].codeWidth == 2) columns[c].codesOffset = appendCodes<uint16_t>(out, codes[c]);
+            else columns[c].codesOffset = appendArray(out, codes[c]);
+        }
+        header.verbatimOffset = appendArray(out, verbatim);
+        vector<uint32_t> poolOffsets;
+        uint32_t position = 0;
+        for (const string& value : pool) {
+            poolOffsets.push_back(position);
+            position += static_cast<uint32_t>(value.size());
+        }
+        poolOffsets.push_back(position);
+        header.poolOffsetsOffset = appendArray(out, poolOffsets);
+        header.poolBytesOffset = out.size();
+        for (const string& value : pool) out += value;
+        align(out);
+        header.fileSize = out.size();
+        memcpy(&out[0], &header, sizeof(header));
+        memcpy(&out[sizeof(header)], columns, sizeof(columns));
+
+        string temporary = binaryPath + ".tmp";
+        ofstream file(temporary, ios::binary | ios::trunc);
+        if (!file.is_open() || !file.write(out.data(), out.size())) {
+            error = "cannot write " + temporary;
+            return false;
+        }
+        file.close();
+        error_code ec;
+        fs::rename(temporary, binaryPath, ec);
+        if (ec) {
+            error = "cannot rename " + temporary + " to " + binaryPath + ": " + ec.message();
+            fs::remove(temporary, ec);
+            return false;
+        }
+        return true;
+    }
+};
+
+// Zero-parse reader over a memory-mapped .bmcat file
+class CatalogView {
+private:
+    MappedFile file;
+    const CatalogHeader* header = nullptr;
+    const CatalogColumn* columns = nullptr;
+    const int32_t* ids = nullptr;
+    const float* actualPrices = nullptr;
+    const float* discountedPrices = nullptr;
+    const CatalogVerbatim* verbatim = nullptr;
+    const uint32_t* poolOffsets = nullptr;
+    const char* poolBytes = nullptr;
+
+    // True if count elements of width bytes at offset lie inside the file, aligned for reading
+    bool fits(uint64_t offset, uint64_t count, uint64_t width) const {
+        uint64_t size = file.size();
+        return offset % width == 0 && offset <= size && count <= (size - offset) / width;
+    }
+
+    // Every offset, count and pool code the readers below index with, so a damaged or
+    // hostile file is refused here instead of read out of bounds
+    bool sectionsValid() const {
+        uint64_t rowCount = header->rowCount;
+        uint64_t poolCount = header->poolCount;
+        if (!fits(header->idOffset, rowCount, sizeof(int32_t)) || !fits(header->actualPriceOffset, rowCount, sizeof(float))
+            || !fits(header->discountedPriceOffset, rowCount, sizeof(float))
+            || !fits(header->verbatimOffset, header->verbatimCount, sizeof(CatalogVerbatim))
+            || poolCount >= UINT32_MAX || !fits(header->poolOffsetsOffset, poolCount + 1, sizeof(uint32_t))
+            || header->poolBytesOffset > file.size()) {
+            return false;
+        }
+        const char* base = file.data();
+        for (int c = 0; c < CATALOG_STRING_COLUMNS; c++) {
+            const CatalogColumn& column = columns[c];
+            uint32_t width = column.codeWidth;
+            if ((width != 1 && width != 2 && width != 4) || column.dictionaryCount == 0
+                || !fits(column.dictionaryOffset, column.dictionaryCount, sizeof(uint32_t)) || !fits(column.codesOffset, rowCount, width)) {
+                return false;
+            }
+            const uint32_t* dictionary = reinterpret_cast<const uint32_t*>(base + column.dictionaryOffset);
+            for (uint32_t local = 1; local < column.dictionaryCount; local++) {
+                if (dictionary[local] >= poolCount) return false;
+            }
+        }
+        const CatalogVerbatim* entries = reinterpret_cast<const CatalogVerbatim*>(base + header->verbatimOffset);
+        for (uint64_t i = 0; i < header->verbatimCount; i++) {
+            if (entries[i].row >= rowCount || entries[i].poolCode >= poolCount || (i > 0 && entries[i].row <= entries[i - 1].row)) return false;
+        }
+        const uint32_t* offsets = reinterpret_cast<const uint32_t*>(base + header->poolOffsetsOffset);
+        uint64_t poolSize = file.size() - header->poolBytesOffset;
+        for (uint64_t i = 0; i < poolCount; i++) {
+            if (offsets[i] > offsets[i + 1]) return false;
+        }
+        return offsets[poolCount] <= poolSize;
+    }
+
+public:
+    bool open(const string& path, string& error) {
+        if (!file.open(path) || file.size() < sizeof(CatalogHeader) + sizeof(CatalogColumn) * CATALOG_STRING_COLUMNS) {
+            error = "cannot map " + path;
+            return false;
+        }
+        header = reinterpret_cast<const CatalogHeader*>(file.data());
+        if (memcmp(header->magic, "BMCATLG", 8) != 0 || header->version != CATALOG_VERSION
+            || header->endianCheck != 0x01020304 || header->fileSize != file.size()) {
+            error = path + " is not a version " + to_string(CATALOG_VERSION) + " catalog for this machine";
+            header = nullptr;
+            return false;
+        }
+        const char* base = file.data();
+        columns = reinterpret_cast<const CatalogColumn*>(base + sizeof(CatalogHeader));
+        if (!sectionsValid()) {
+            error = path + " is damaged: an offset, count or pool code is out of range";
+            header = nullptr;
+            return false;
+        }
+        ids = reinterpret_cast<const int32_t*>(base + header->idOffset);
+        actualPrices = reinterpret_cast<const float*>(base + header->actualPriceOffset);
+        discountedPrices = reinterpret_cast<const float*>(base + header->discountedPriceOffset);
+        verbatim = reinterpret_cast<const CatalogVerbatim*>(base + header->verbatimOffset);
+        poolOffsets = reinterpret_cast<const uint32_t*>(base + header->poolOffsetsOffset);
+        poolBytes = base + header->poolBytesOffset;
+        return true;
+    }
+
+    void close() {
+        file.close();
+        header = nullptr;
+    }
+
+    size_t rows() const {
+        return static_cast<size_t>(header->rowCount);
+    }
+
+    const int32_t* idColumn() const {
+        return ids;
+    }
+
+    const float* actualPriceColumn() const {
+        return actualPrices;
+    }
+
+    const float* discountedPriceColumn() const {
+        return discountedPrices;
+    }
+
+    // Column metadata and raw codes of one string column (0 = name ... 10 = last type-specific field)
+    const CatalogColumn& column(int index) const {
+        return columns[index];
+    }
+
+    const void* codeColumn(int index) const {
+        return file.data() + columns[index].codesOffset;
+    }
+
+    uint32_t code(int index, size_t row) const {
+        const void* codes = codeColumn(index);
+        switch (columns[index].codeWidth) {
+        case 1: return static_cast<const uint8_t*>(codes)[row];
+        case 2: return static_cast<const uint16_t*>(codes)[row];
+        default: return static_cast<const uint32_t*>(codes)[row];
+        }
+    }
+
+    // Column-local code of a value, or 0 if no row of that column holds it
+    uint32_t lookupCode(int index, const string& value) const {
+        const uint32_t* dictionary = reinterpret_cast<const uint32_t*>(file.data() + columns[index].dictionaryOffset);
+        for (uint32_t local = 1; local < columns[index].dictionaryCount; local++) {
+            if (poolString(dictionary[local]) == value) return local;
+        }
+        return 0;
+    }
+
+    string poolString(uint32_t poolCode) const {
+        return string(poolBytes + poolOffsets[poolCode], poolOffsets[poolCode + 1] - poolOffsets[poolCode]);
+    }
+
+    string value(int index, size_t row) const {
+        const uint32_t* dictionary = reinterpret_cast<const uint32_t*>(file.data() + columns[index].dictionaryOffset);
+        uint32_t local = code(index, row);
+        // Row codes are not checked by open(); one past the dictionary reads as no value
+        return local == 0 || local >= columns[index].dictionaryCount ? "" : poolString(dictionary[local]);
+    }
+
+    string line(size_t row) const {
+        const CatalogVerbatim* end = verbatim + header->verbatimCount;
+        const CatalogVerbatim* it = lower_bound(verbatim, end, row, [](const CatalogVerbatim& entry, size_t r) { return entry.row < r; });
+        if (it != end && it->row == row) {
+            return poolString(it->poolCode);
+        }
+        string strings[CATALOG_STRING_COLUMNS];
+        for (int c = 0; c < CATALOG_STRING_COLUMNS; c++) strings[c] = value(c, row);
+        return CatalogFormat::joinFields(ids[row], actualPrices[row], discountedPrices[row], strings);
+    }
+
+    bool toText(const string& textPath, string& error) const {
+        ofstream out(textPath, ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            error = "cannot write " + textPath;
+            return false;
+        }
+        for (size_t row = 0; row < rows(); row++) {
+            out << line(row);
+            if (row + 1 < rows() || !(header->flags & CATALOG_FLAG_NO_FINAL_NEWLINE)) out << '\n';
+        }
+        return static_cast<bool>(out);
+    }
+};
+
+// Listing layout of the VIEW_* replies:
+//
+//   \n========== TITLE ==========\n
+//   1. <record>\n
+//   2. <record>\n
+//   ================================\n
+//
+// The records themselves are not copied here; Reply streams them between header and footer.
+class DataFormatter {
+public:
+    static string emptyListing(const string& title) {
+        return "No " + title + " found";
+    }
+
+    static string listingHeader(const string& title) {
+        return "\n========== " + title + " ==========\n";
+    }
+
+    static string listingFooter() {
+        return "================================\n";
+    }
+
+    // Writes "N. " into out (at least 24 bytes) and returns its length
+    static size_t formatItemNumber(size_t number, char* out) {
+        return static_cast<size_t>(snprintf(out, 24, "%zu. ", number));
+    }
+
+    static size_t itemNumberLength(size_t number) {
+        size_t digits = 1;
+        while (number >= 10) {
+            number /= 10;
+            digits++;
+        }
+        return digits + 2;
+    }
+
+    // Combined length of the "N. " prefixes of items first .. first + count - 1
+    static size_t itemNumbersLength(size_t first, size_t count) {
+        size_t total = 0;
+        size_t last = first + count;
+        for (size_t low = first, power = 10, digits = 1; low < last; power *= 10, digits++) {
+            if (low >= power) continue;
+            size_t high = min(last, power);
+            total += (high - low) * (digits + 2);
+            low = high;
+        }
+        return total;
+    }
+};
+
+// Makes the thumbnails of every stored image (THUMBNAIL_SIZES, longest side) on a pool of
+// its own, after the upload has been answered, so ingest latency does not include decoding
+// and resizing. Work is keyed by content hash: an image stored under several names is
+// processed once, and a format that cannot be decoded is remembered instead of retried.
+class ThumbnailPipeline {
+private:
+    struct State {
+        mutex stateMutex;
+        set<string> pending;
+        map<string, string> failed; // hash -> why no thumbnails can be made
+        unsigned threads = max(1u, thread::hardware_concurrency() / 2);
+        atomic<uint64_t> generated{ 0 };
+        atomic<uint64_t> totalMicros{ 0 };
+    };
+
+    static State& state() {
+        static State pipeline;
+        return pipeline;
+    }
+
+    static WorkerPool& pool() {
+        // Created after State, so it is destroyed (and its workers joined) first
+        static WorkerPool workers("thumbnails", state().threads, THUMBNAIL_QUEUE_CAPACITY);
+        return workers;
+    }
+
+    static bool complete(const string& hash) {
+        for (int size : THUMBNAIL_SIZES) {
+            if (!FileHandler::hasThumbnail(hash, size)) return false;
+        }
+        return true;
+    }
+
+    static void generate(const string& hash) {
+        State& pipeline = state();
+        auto start = chrono::steady_clock::now();
+        string error;
+        MappedFile blob;
+        Image image;
+        if (complete(hash)) {
+            // Made by an earlier job for the same contents
+        }
+        else if (!FileHandler::mapBlob(hash, blob)) {
+            error = "image no longer stored";
+        }
+        else if (decodeImage(blob.data(), blob.size(), image, error)) {
+            blob.close();
+            vector<string> thumbnails = render(image, resizeBestPath());
+            for (size_t i = 0; i < thumbnails.size(); i++) {
+                if (!FileHandler::storeThumbnail(hash, THUMBNAIL_SIZES[i], thumbnails[i])) {
+                    error = "failed to write thumbnail";
+                    break;
+                }
+            }
+        }
+        lock_guard<mutex> lock(pipeline.stateMutex);
+        pipeline.pending.erase(hash);
+        if (!error.empty()) {
+            pipeline.failed[hash] = error;
+            return;
+        }
+        pipeline.generated.fetch_add(1, memory_order_relaxed);
+        pipeline.totalMicros.fetch_add(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count(), memory_order_relaxed);
+    }
+
+public:
+    // Before the first schedule() only
+    static void configure(unsigned threads) {
+        state().threads = max(1u, threads);
+    }
+
+    // Every thumbnail of image as BMP, in THUMBNAIL_SIZES order. Each size is scaled from the
+    // next larger thumbnail rather than from the original, which halves the work for a photo
+    // without a visible difference: the filter still averages every pixel it drops.
+    static vector<string> render(const Image& image, ResizePath path) {
+        vector<int> sizes(begin(THUMBNAIL_SIZES), end(THUMBNAIL_SIZES));
+        sort(sizes.rbegin(), sizes.rend());
+        map<int, string> encoded;
+        Image scaled;
+        const Image* source = &image;
+        for (int size : sizes) {
+            int width, height;
+            fitWithin(source->width, source->height, size, width, height);
+            if (width != source->width || height != source->height) {
+                scaled = resizeImage(*source, width, height, path);
+                source = &scaled;
+            }
+            encoded[size] = encodeBmp(*source);
+        }
+        vector<string> thumbnails;
+        for (int size : THUMBNAIL_SIZES) thumbnails.push_back(move(encoded[size]));
+        return thumbnails;
+    }
+
+    // Queues the thumbnails of imageName's contents unless they exist or are being made.
+    // A full queue only delays them: GET_THUMBNAIL schedules again when they are missing.
+    static void schedule(const string& imageName) {
+        string hash = FileHandler::imageHash(imageName);
+        if (hash.empty() || complete(hash)) {
+            return;
+        }
+        State& pipeline = state();
+        {
+            lock_guard<mutex> lock(pipeline.stateMutex);
+            if (pipeline.failed.count(hash) || !pipeline.pending.insert(hash).second) {
+                return;
+            }
+        }
+        if (!pool().trySubmit([hash]() { generate(hash); })) {
+            lock_guard<mutex> lock(pipeline.stateMutex);
+            pipeline.pending.erase(hash);
+        }
+    }
+
+    // Why the thumbnails of hash cannot be made; empty if they can (and are being made)
+    static string failure(const string& hash) {
+        State& pipeline = state();
+        lock_guard<mutex> lock(pipeline.stateMutex);
+        auto it = pipeline.failed.find(hash);
+        return it == pipeline.failed.end() ? "" : it->second;
+    }
+
+    static string stats() {
+        State& pipeline = state();
+        uint64_t generated = pipeline.generated.load(memory_order_relaxed);
+        ostringstream oss;
+        {
+            lock_guard<mutex> lock(pipeline.stateMutex);
+            oss << "Thumbnails: generated=" << generated << " pending=" << pipeline.pending.size()
+                << " unsupported=" << pipeline.failed.size() << " avgMicros="
+                << (generated ? pipeline.totalMicros.load(memory_order_relaxed) / generated : 0)
+                << " path=" << resizePathName(resizeBestPath()) << "\n";
+        }
+        oss << pool().metricsReport();
+        return oss.str();
+    }
+};
+
+class ImageManager {
+public:
+    static string handleImage(int operation, const string& data) {
+        switch (operation) {
+        case SEND_IMAGE: {
+            size_t pos = data.find('|');
+            if (pos == string::npos) {
+                return "ERROR: Invalid image data format";
+            }
+            string imageName = data.substr(0, pos);
+            string imageData = data.substr(pos + 1);
+            if (!FileHandler::validImageName(imageName)) {
+                return "ERROR: Invalid image name " + imageName;
+            }
+            if (FileHandler::saveImage(imageName, imageData)) {
+                ThumbnailPipeline::schedule(imageName);
+                return "SUCCESS: Image " + imageName + " received";
+            }
+            return "ERROR: Failed to save image " + imageName;
+        }
+        case UPLOAD_BEGIN: {
+            istringstream iss(data);
+            string imageName;
+            uint64_t size;
+            uint32_t crc;
+            uint64_t partSize = DEFAULT_UPLOAD_PART;
+            if (!(iss >> imageName >> size >> hex >> crc)) {
+                return "ERROR: Invalid upload format. Expected: name size crc32c [partSize]";
+            }
+            iss >> dec >> partSize;
+            if (!FileHandler::validImageName(imageName)) {
+                return "ERROR: Invalid image name " + imageName;
+            }
+            if (size > MAX_IMAGE_BYTES) {
+                return "ERROR: Image too large (" + to_string(size) + " bytes)";
+            }
+            if (partSize < MIN_UPLOAD_PART || partSize > MAX_UPLOAD_PART) {
+                return "ERROR: Part size must be between " + to_string(MIN_UPLOAD_PART) + " and " + to_string(MAX_UPLOAD_PART) + " bytes";
+            }
+            auto session = UploadSessions::open(imageName, size, crc, partSize);
+            if (session == nullptr) {
+                return "ERROR: Failed to start upload of " + imageName;
+            }
+            return "SUCCESS: " + session->describe();
+        }
+        case UPLOAD_STATUS:
+        case UPLOAD_COMMIT:
+        case UPLOAD_ABORT: {
+            auto session = UploadSessions::find(data);
+            if (session == nullptr) {
+                return "ERROR: Unknown upload " + data;
+            }
+            if (operation == UPLOAD_STATUS) {
+                return "SUCCESS: " + session->describe();
+            }
+            if (operation == UPLOAD_ABORT) {
+                if (!session->remove()) {
+                    return "ERROR: Upload " + data + " still has parts in flight, retry";
+                }
+                UploadSessions::forget(data);
+                return "SUCCESS: Upload " + data + " aborted";
+            }
+            string error;
+            if (!session->commit(error)) {
+                return error;
+            }
+            session->remove();
+            UploadSessions::forget(data);
+            ThumbnailPipeline::schedule(session->name());
+            return "SUCCESS: Image " + session->name() + " received (" + to_string(session->size()) + " bytes)";
+        }
+        case LINK_IMAGE: {
+            istringstream iss(data);
+            string imageName, hash;
+            if (!(iss >> imageName >> hash) || hash.size() != 64 || hash.find_first_not_of("0123456789abcdef") != string::npos) {
+                return "ERROR: Invalid link format. Expected: name sha256";
+            }
+            if (!FileHandler::validImageName(imageName)) {
+                return "ERROR: Invalid image name " + imageName;
+            }
+            uint64_t size = 0;
+            if (!FileHandler::linkExistingImage(imageName, hash, size)) {
+                return "ERROR: Content " + hash + " not stored, upload the image";
+            }
+            ThumbnailPipeline::schedule(imageName);
+            return "SUCCESS: Image " + imageName + " stored (" + to_string(size) + " bytes already on server)";
+        }
+        case IMAGE_CACHE_STATS:
+            return "SUCCESS: " + ImageCache::stats();
+        case IMAGE_STORE_STATS:
+            return "SUCCESS: " + FileHandler::imageStoreStats() + "\n" + ThumbnailPipeline::stats();
+        default:
+            return "ERROR: Unknown image operation";
+        }
+    }
+
+    // UPLOAD_IMAGE and UPLOAD_PART: the body is already on disk, it only has to be recorded
+    static string handleStreamed(int operation, StreamedBody& body) {
+        if (operation == UPLOAD_PART) {
+            PartUpload& part = static_cast<PartUpload&>(body);
+            UploadSession& session = part.getSession();
+            if (!part.alreadyReceived() && !session.markReceived(part.part())) {
+                return "ERROR: Failed to record part " + to_string(part.part());
+            }
+            return "SUCCESS: Part " + to_string(part.part()) + (part.alreadyReceived() ? " already received" : " received");
+        }
+        ImageUpload& upload = static_cast<ImageUpload&>(body);
+        if (upload.commit()) {
+            ThumbnailPipeline::schedule(upload.name());
+            return "SUCCESS: Image " + upload.name() + " received (" + to_string(upload.size()) + " bytes)";
+        }
+        return "ERROR: Failed to save image " + upload.name();
+    }
+};
+
+class TextManager {
+public:
+    static string handleText(int operation, const string& data) {
+        switch (operation) {
+        case CONVERT_TO_UPPERCASE: {
+            if (data.empty()) {
+                return "ERROR: No text provided";
+            }
+            string uppercase = data;
+            transform(uppercase.begin(), uppercase.end(), uppercase.begin(), ::toupper);
+            return "SUCCESS: " + uppercase;
+        }
+        default:
+            return "ERROR: Unknown text operation";
+        }
+    }
+};
+
+// Record inserts: ADD_STITCHED_DRESS, ADD_UNSTITCHED_DRESS, ADD_CUSTOMER and PROCESS_ORDER.
+// insertAll() checks a run of them under one acquisition of the collection locks and writes
+// the new records of each collection with one append, so N inserts cost one file write and
+// one log sync instead of N. Each insert is checked in order against the stored records and
+// the ones before it in the run, so the replies are the ones the same requests sent one at
+// a time would have got.
+class InsertManager {
+private:
+    struct Insert {
+        int type = 0;
+        string filename;
+        int id = 0;
+        string line;
+        string success;
+        string failure;             // the reply if the record cannot be written
+        string error;               // set once the insert is rejected
+        // PROCESS_ORDER
+        int customerID = 0, dressID = 0, quantity = 0;
+        string dressType, dressFile;
+    };
+
+    // Reads the leading whitespace-separated fields the way operator>> would, without a
+    // stream per record (bulk imports parse millions of lines). Numbers are read from the
+    // start of their field, which is still null-terminated by the line.
+    class Fields {
+    private:
+        const string& data;
+        size_t pos = 0;
+
+        const char* next(size_t& length) {
+            while (pos < data.size() && isspace(static_cast<unsigned char>(data[pos]))) pos++;
+            size_t start = pos;
+            while (pos < data.size() && !isspace(static_cast<unsigned char>(data[pos]))) pos++;
+            length = pos - start;
+            return length == 0 ? nullptr : data.c_str() + start;
+        }
+
+    public:
+        explicit Fields(const string& data) : data(data) {}
+
+        bool read(int& value) {
+            size_t length;
+            const char* field = next(length);
+            if (field == nullptr) return false;
+            errno = 0;
+            char* end = nullptr;
+            long parsed = strtol(field, &end, 10);
+            if (end == field || errno == ERANGE || parsed < INT_MIN || parsed > INT_MAX) return false;
+            value = static_cast<int>(parsed);
+            return true;
+        }
+
+        bool read(string& value) {
+            size_t length;
+            const char* field = next(length);
+            if (field == nullptr) return false;
+            value.assign(field, length);
+            return true;
+        }
+    };
+
+    // Everything that can be checked without looking at the stored records
+    static void parse(int type, const string& data, Insert& insert) {
+        insert.type = type;
+        insert.line = data;
+        Fields fields(data);
+        switch (type) {
+        case ADD_STITCHED_DRESS:
+            insert.filename = "stitched_dresses.txt";
+            if (!fields.read(insert.id)) {
+                insert.error = "ERROR: Invalid dress data format";
+            }
+            insert.success = "SUCCESS: Stitched dress added successfully (ID: " + to_string(insert.id) + ")";
+            insert.failure = "ERROR: Failed to add stitched dress";
+            break;
+        case ADD_UNSTITCHED_DRESS:
+            insert.filename = "unstitched_dresses.txt";
+            if (!fields.read(insert.id)) {
+                insert.error = "ERROR: Invalid unstitched dress data format";
+            }
+            insert.success = "SUCCESS: Unstitched dress added successfully (ID: " + to_string(insert.id) + ")";
+            insert.failure = "ERROR: Failed to add unstitched dress";
+            break;
+        case ADD_CUSTOMER:
+            insert.filename = "customers.txt";
+            if (!fields.read(insert.id)) {
+                insert.error = "ERROR: Invalid customer data format";
+            }
+            insert.success = "SUCCESS: Customer added successfully (ID: " + to_string(insert.id) + ")";
+            insert.failure = "ERROR: Failed to add customer";
+            break;
+        default:
+            insert.filename = "orders.txt";
+            if (!(fields.read(insert.id) && fields.read(insert.customerID) && fields.read(insert.dressID)
+                && fields.read(insert.dressType) && fields.read(insert.quantity))) {
+                insert.error = "ERROR: Invalid order data format";
+            }
+            insert.dressFile = (insert.dressType == "S") ? "stitched_dresses.txt" : "unstitched_dresses.txt";
+            insert.failure = "ERROR: Failed to process order";
+            break;
+        }
+        // The field rules TCP_BMBulk applies as well: positive IDs and quantities, finite
+        // non-negative prices (the FILTER index sorts by price), ages 0-150, dress type S or U
+        if (insert.error.empty()) {
+            string why = checkRecordLine(type, data);
+            if (!why.empty()) {
+                why[0] = static_cast<char>(toupper(static_cast<unsigned char>(why[0])));
+                insert.error = "ERROR: " + why;
+            }
+        }
+    }
+
+    // Checks an insert against the stored records and the ones added earlier in the run and
+    // fills in its final line. Caller holds the collection locks.
+    static void check(Insert& insert, map<string, unordered_map<int, string>>& added) {
+        auto find = [&added](const string& filename, int id) -> const string* {
+            const string* line = FileHandler::store(filename).find(id);
+            if (line != nullptr) return line;
+            auto& run = added[filename];
+            auto it = run.find(id);
+            return it == run.end() ? nullptr : &it->second;
+        };
+        if (find(insert.filename, insert.id) != nullptr || FileHandler::store(insert.filename).isHeld(insert.id)) {
+            string what = insert.type == ADD_CUSTOMER ? "Customer" : insert.type == PROCESS_ORDER ? "Order" : "Dress";
+            insert.error = "ERROR: Duplicate " + what + " ID " + to_string(insert.id);
+            return;
+        }
+        if (insert.type == PROCESS_ORDER) {
+            if (find("customers.txt", insert.customerID) == nullptr) {
+                insert.error = "ERROR: Customer ID " + to_string(insert.customerID) + " not found";
+                return;
+            }
+            const string* dress = find(insert.dressFile, insert.dressID);
+            if (dress == nullptr) {
+                insert.error = "ERROR: Dress ID " + to_string(insert.dressID) + " not found in " + insert.dressFile;
+                return;
+            }
+            float price = FileHandler::parseDressPrice(*dress);
+            if (price < 0) {
+                insert.error = "ERROR: Unable to retrieve price for Dress ID " + to_string(insert.dressID);
+                return;
+            }
+            float totalPrice = price * insert.quantity;
+            if (!(fabs(totalPrice) <= OrderAggregates::MAX_ORDER_TOTAL)) {
+                insert.error = "ERROR: Order total for Dress ID " + to_string(insert.dressID) + " is out of range";
+                return;
+            }
+            ostringstream oss;
+            oss << insert.id << " " << insert.customerID << " " << insert.dressID << " " << insert.dressType << " "
+                << insert.quantity << " " << fixed << setprecision(2) << totalPrice;
+            insert.line = oss.str();
+            insert.success = "SUCCESS: Successfully processed order (Total: $" + to_string(totalPrice) + ")";
+        }
+        added[insert.filename].emplace(insert.id, insert.line);
+    }
+
+public:
+    static bool isInsert(int type) {
+        return type == ADD_STITCHED_DRESS || type == ADD_UNSTITCHED_DRESS || type == ADD_CUSTOMER || type == PROCESS_ORDER;
+    }
+
+    // Applies a run of inserts and returns one reply per request. If atomic, a single
+    // rejected insert means none of them are written. The run is logged in one write, so a
+    // failed log write fails all of it and nothing else.
+    static vector<string> insertAll(const vector<pair<int, string>>& requests, bool atomic) {
+        vector<Insert> inserts(requests.size());
+        vector<CollectionLock::Entry> lockEntries;
+        for (size_t i = 0; i < requests.size(); i++) {
+            Insert& insert = inserts[i];
+            parse(requests[i].first, requests[i].second, insert);
+            if (!insert.error.empty()) continue;
+            lockEntries.push_back({ &FileHandler::store(insert.filename), true });
+            if (insert.type == PROCESS_ORDER) {
+                // Customer and dress are read under the same locks the order is written under,
+                // so the order is checked and priced against one consistent snapshot
+                lockEntries.push_back({ &FileHandler::store("customers.txt"), false });
+                lockEntries.push_back({ &FileHandler::store(insert.dressFile), false });
+            }
+        }
+        bool rejected = false;
+        uint64_t lsn = 0;
+        map<string, pair<vector<int>, vector<string>>> writes;
+        {
+            CollectionLock locks(move(lockEntries));
+            map<string, unordered_map<int, string>> added;
+            for (Insert& insert : inserts) {
+                if (insert.error.empty()) check(insert, added);
+                rejected = rejected || !insert.error.empty();
+            }
+            if (!atomic || !rejected) {
+                vector<pair<string, string>> records;
+                for (const Insert& insert : inserts) {
+                    if (!insert.error.empty()) continue;
+                    writes[insert.filename].first.push_back(insert.id);
+                    writes[insert.filename].second.push_back(insert.line);
+                    records.emplace_back(insert.filename, insert.line);
+                }
+                // Logged first and held meanwhile: the record files and memory only see the
+                // inserts once the log has them
+                lsn = FileHandler::logInserts(records);
+                for (auto& write : writes) {
+                    FileHandler::store(write.first).hold(write.second.first, write.second.second, lsn);
+                }
+            }
+        }
+        bool durable = FileHandler::waitDurable(lsn);
+        if (!writes.empty()) {
+            vector<CollectionLock::Entry> applyEntries;
+            for (auto& write : writes) applyEntries.push_back({ &FileHandler::store(write.first), true });
+            CollectionLock locks(move(applyEntries));
+            for (auto& write : writes) {
+                if (FileHandler::store(write.first).applyHeld(write.second.first, durable)) continue;
+                for (Insert& insert : inserts) {
+                    if (insert.error.empty() && insert.filename == write.first) insert.error = insert.failure;
+                }
+            }
+        }
+        vector<string> replies;
+        for (const Insert& insert : inserts) {
+            if (!insert.error.empty()) replies.push_back(insert.error);
+            else if (atomic && rejected) replies.push_back("ERROR: Not applied, another insert in the atomic batch failed");
+            else replies.push_back(insert.success);
+        }
+        return replies;
+    }
+
+    static string insertOne(int type, const string& data) {
+        return insertAll({ { type, data } }, false)[0];
+    }
+};
+
+class DressManager {
+public:
+    static string handleStitchedDress(int operation, const string& data) {
+        switch (operation) {
+        case ADD_STITCHED_DRESS:
+            return InsertManager::insertOne(operation, data);
+        case SEARCH_STITCHED_DRESS: {
+            int dressID = stoi(data);
+            return FileHandler::searchById(dressID, "stitched_dresses.txt");
+        }
+        case COUNT_STITCHED_DRESSES: {
+            int count = FileHandler::countLines("stitched_dresses.txt");
+            return "Total Stitched Dresses: " + to_string(count);
+        }
+        default:
+            return "ERROR: Unknown stitched dress operation";
+        }
+    }
+    static string handleUnstitchedDress(int operation, const string& data) {
+        switch (operation) {
+        case ADD_UNSTITCHED_DRESS:
+            return InsertManager::insertOne(operation, data);
+        case SEARCH_UNSTITCHED_DRESS: {
+            int dressID;
+            try {
+                dressID = stoi(data);
+            }
+            catch (const exception& e) {
+                return "ERROR: Invalid Dress ID format";
+            }
+            return FileHandler::searchById(dressID, "unstitched_dresses.txt");
+        }
+        case COUNT_UNSTITCHED_DRESSES: {
+            int count = FileHandler::countLines("unstitched_dresses.txt");
+            return "Total Unstitched Dresses: " + to_string(count);
+        }
+        default:
+            return "ERROR: Unknown unstitched dress operation";
+        }
+    }
+};
+
+class CustomerManager {
+public:
+    static string handleCustomer(int operation, const string& data) {
+        switch (operation) {
+        case ADD_CUSTOMER:
+            return InsertManager::insertOne(operation, data);
+        case SEARCH_CUSTOMER: {
+            int customerID = stoi(data);
+            return FileHandler::searchById(customerID, "customers.txt");
+        }
+        default:
+            return "ERROR: Unknown customer operation";
+        }
+    }
+};
+
+class OrderManager {
+public:
+    static string handleOrder(int operation, const string& data) {
+        switch (operation) {
+        case PROCESS_ORDER:
+            return InsertManager::insertOne(operation, data);
+        case SEARCH_ORDER: {
+            int orderID = stoi(data);
+            return FileHandler::searchById(orderID, "orders.txt");
+        }
+        default:
+            return "ERROR: Unknown order operation";
+        }
+    }
+};
+
+// REPORT: sales figures read from the running order totals (OrderAggregates), so a report
+// never rescans orders.txt and costs about as much as the rows it returns. Payloads:
+//   summary                           orders, units and revenue overall
+//   types                             the same per dress type
+//   top-dresses [N] [revenue|units]   best-selling dresses, by revenue unless "units"
+//   top-customers [N]                 best customers by revenue
+//   dress S|U <id>, customer <id>     one dress or customer
+//   verify, rebuild                   rescan the orders in parallel and compare the result
+//                                     with the running totals, or replace them with it
+// Orders carry no date, so there are no per-period figures.
+class ReportManager {
+private:
+    static constexpr size_t DEFAULT_ROWS = 10;
+    static constexpr size_t MAX_ROWS = 1000;
+
+    static string money(int64_t cents) {
+        char text[32];
+        snprintf(text, sizeof(text), "%s$%lld.%02lld", cents < 0 ? "-" : "", static_cast<long long>(llabs(cents) / 100),
+            static_cast<long long>(llabs(cents) % 100));
+        return text;
+    }
+
+    static string describe(const OrderAggregates::Totals& totals) {
+        return to_string(totals.orders) + " orders, " + to_string(totals.units) + " units, " + money(totals.cents);
+    }
+
+    static string dressLabel(uint64_t key) {
+        return string(OrderAggregates::dressType(key) == 'S' ? "Stitched" : "Unstitched") + " dress "
+            + to_string(OrderAggregates::dressId(key));
+    }
+
+    // "N" as the next word, or the default; false if it is there but not a count
+    static bool readRows(istringstream& iss, size_t& rows) {
+        rows = DEFAULT_ROWS;
+        string word;
+        streampos start = iss.tellg();
+        if (!(iss >> word)) {
+            return true;
+        }
+        if (!all_of(word.begin(), word.end(), ::isdigit)) {
+            iss.clear();
+            iss.seekg(start);
+            return true;
+        }
+        if (word.size() > 9 || stoul(word) == 0) {
+            return false;
+        }
+        rows = min(static_cast<size_t>(stoul(word)), MAX_ROWS);
+        return true;
+    }
+
+    static string rescan(bool replace) {
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        bool matched = false;
+        size_t scanned = 0;
+        auto start = chrono::steady_clock::now();
+        if (!FileHandler::rescanOrders(threads, replace, matched, scanned)) {
+            return "ERROR: The orders were reloaded during the rescan; try again";
+        }
+        double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        ostringstream oss;
+        oss << fixed << setprecision(1) << " from " << scanned << " orders (" << threads << " threads, " << millis << " ms)";
+        if (replace) {
+            return "SUCCESS: Rebuilt the totals" + oss.str() + (matched ? "; they were already correct" : "; they had drifted");
+        }
+        if (!matched) {
+            return "ERROR: The running totals differ from a rescan" + oss.str() + "; run REPORT rebuild";
+        }
+        return "SUCCESS: The running totals match a rescan" + oss.str();
+    }
+
+public:
+    static string handleReport(const string& data) {
+        istringstream iss(data);
+        string report;
+        iss >> report;
+        if (report == "verify" || report == "rebuild") {
+            return rescan(report == "rebuild");
+        }
+        if (report == "summary") {
+            return FileHandler::orderReport([](const OrderAggregates& sales) {
+                string reply = DataFormatter::listingHeader("SALES SUMMARY");
+                reply += "All orders: " + describe(sales.all()) + "\n";
+                reply += "Customers with orders: " + to_string(sales.customerCount()) + "\n";
+                reply += "Dresses sold: " + to_string(sales.dressCount()) + "\n";
+                if (sales.unreadableLines() > 0) reply += "Unreadable order lines: " + to_string(sales.unreadableLines()) + "\n";
+                return reply + DataFormatter::listingFooter();
+            });
+        }
+        if (report == "types") {
+            return FileHandler::orderReport([](const OrderAggregates& sales) {
+                return DataFormatter::listingHeader("SALES BY DRESS TYPE") + "Stitched: " + describe(sales.byType('S')) + "\n"
+                    + "Unstitched: " + describe(sales.byType('U')) + "\n" + DataFormatter::listingFooter();
+            });
+        }
+        if (report == "top-dresses" || report == "top-customers") {
+            size_t rows;
+            string order;
+            if (!readRows(iss, rows)) {
+                return "ERROR: Invalid row count";
+            }
+            iss >> order;
+            if (!order.empty() && order != "revenue" && (order != "units" || report != "top-dresses")) {
+                return "ERROR: Unknown ranking " + order;
+            }
+            bool byUnits = order == "units";
+            return FileHandler::orderReport([&](const OrderAggregates& sales) {
+                string reply;
+                size_t rank = 0;
+                if (report == "top-customers") {
+                    reply = DataFormatter::listingHeader("TOP " + to_string(rows) + " CUSTOMERS BY REVENUE");
+                    for (auto it = sales.customersByRevenue().begin(); it != sales.customersByRevenue().end() && rank < rows; ++it) {
+                        reply += to_string(++rank) + ". Customer " + to_string(it->second) + ": " + describe(*sales.customer(it->second)) + "\n";
+                    }
+                }
+                else {
+                    const auto& ranking = byUnits ? sales.dressesByUnits() : sales.dressesByRevenue();
+                    reply = DataFormatter::listingHeader("TOP " + to_string(rows) + " DRESSES BY " + (byUnits ? "UNITS" : "REVENUE"));
+                    for (auto it = ranking.begin(); it != ranking.end() && rank < rows; ++it) {
+                        uint64_t key = it->second;
+                        reply += to_string(++rank) + ". " + dressLabel(key) + ": "
+                            + describe(*sales.dress(OrderAggregates::dressType(key), OrderAggregates::dressId(key))) + "\n";
+                    }
+                }
+                if (rank == 0) reply += "No orders yet\n";
+                return reply + DataFormatter::listingFooter();
+            });
+        }
+        if (report == "dress" || report == "customer") {
+            string type;
+            int id;
+            if (report == "dress" && !(iss >> type && (type == "S" || type == "U"))) {
+                return "ERROR: Invalid dress report. Expected: dress S|U <id>";
+            }
+            if (!(iss >> id)) {
+                return "ERROR: Invalid " + report + " ID";
+            }
+            return FileHandler::orderReport([&](const OrderAggregates& sales) {
+                const OrderAggregates::Totals* totals = report == "dress" ? sales.dress(type[0], id) : sales.customer(id);
+                string label = report == "dress" ? dressLabel(OrderAggregates::dressKey(type[0], id)) : "Customer " + to_string(id);
+                return label + ": " + (totals == nullptr ? "no orders" : describe(*totals));
+            });
+        }
+        return "ERROR: Unknown report. Expected: summary, types, top-dresses [N] [revenue|units], top-customers [N], "
+            "dress S|U <id>, customer <id>, verify or rebuild";
+    }
+};
+
+// SEARCH_TEXT: "customers|stitched|unstitched|dresses [limit=K] words". Customers are found by
+// name and address, dresses by name and brand, through the collections' TextIndex; "dresses"
+// searches both dress collections and merges the results. The reply lists the K best matches
+// (default 10, at most 100), best first, each with the share of the query's trigrams it has.
+class TextSearchManager {
+private:
+    static constexpr size_t DEFAULT_LIMIT = 10;
+    static constexpr size_t MAX_LIMIT = 100;
+
+    struct Source {
+        const char* filename;
+        const char* label;
+    };
+
+public:
+    static string handleSearch(const string& data) {
+        istringstream iss(data);
+        string collection, word, query;
+        iss >> collection;
+        vector<Source> sources;
+        string title;
+        if (collection == "customers") {
+            sources = { { "customers.txt", "" } };
+            title = "CUSTOMERS";
+        }
+        else if (collection == "stitched") {
+            sources = { { "stitched_dresses.txt", "" } };
+            title = "STITCHED DRESSES";
+        }
+        else if (collection == "unstitched") {
+            sources = { { "unstitched_dresses.txt", "" } };
+            title = "UNSTITCHED DRESSES";
+        }
+        else if (collection == "dresses") {
+            sources = { { "stitched_dresses.txt", "stitched: " }, { "unstitched_dresses.txt", "unstitched: " } };
+            title = "DRESSES";
+        }
+        else {
+            return "ERROR: Invalid search. Expected: customers|stitched|unstitched|dresses [limit=K] words";
+        }
+        size_t limit = DEFAULT_LIMIT;
+        while (iss >> word) {
+            if (word.compare(0, 6, "limit=") == 0) {
+                string value = word.substr(6);
+                if (value.empty() || value.size() > 9 || !all_of(value.begin(), value.end(), ::isdigit) || stoul(value) == 0) {
+                    return "ERROR: Invalid search limit " + value;
+                }
+                limit = min(static_cast<size_t>(stoul(value)), MAX_LIMIT);
+                continue;
+            }
+            if (!query.empty()) query += ' ';
+            query += word;
+        }
+        size_t queryGrams = TextIndex::trigrams(query).size();
+        if (queryGrams == 0) {
+            return "ERROR: Nothing to search for; give at least one word with a letter in it";
+        }
+        struct Found {
+            TextIndex::Hit hit;
+            size_t source;
+        };
+        vector<Found> found;
+        vector<RecordSnapshot> records(sources.size());
+        for (size_t i = 0; i < sources.size(); i++) {
+            vector<TextIndex::Hit> hits;
+            if (!FileHandler::searchText(sources[i].filename, query, limit, records[i], hits)) {
+                return "ERROR: " + title + " are not indexed for text search";
+            }
+            for (const TextIndex::Hit& hit : hits) found.push_back({ hit, i });
+        }
+        stable_sort(found.begin(), found.end(), [](const Found& a, const Found& b) {
+            if (a.hit.shared != b.hit.shared) return a.hit.shared > b.hit.shared;
+            return a.hit.grams < b.hit.grams;
+        });
+        if (found.size() > limit) found.resize(limit);
+        if (found.empty()) {
+            return "No " + title + " match \"" + query + "\"";
+        }
+        string reply = DataFormatter::listingHeader(title + " MATCHING \"" + query + "\": TOP " + to_string(found.size()));
+        for (size_t rank = 0; rank < found.size(); rank++) {
+            const Found& match = found[rank];
+            reply += to_string(rank + 1) + ". [" + to_string(match.hit.shared * 100 / queryGrams) + "%] " + sources[match.source].label
+                + records[match.source][match.hit.position] + "\n";
+        }
+        reply += DataFormatter::listingFooter();
+        return reply;
+    }
+};
+
+// STATS requests and the admin port: the ServerMetrics snapshot and the worker queues as a
+// readable summary or in the Prometheus text exposition format
+class StatsManager {
+private:
+    static double micros(uint64_t nanos) {
+        return nanos / 1000.0;
+    }
+
+    static double seconds(uint64_t nanos) {
+        return nanos / 1e9;
+    }
+
+    static void summaryLine(ostringstream& out, const LatencyHistogram& latency) {
+        out << setw(10) << fixed << setprecision(1) << micros(latency.percentile(50.0)) << setw(10) << micros(latency.percentile(99.0))
+            << setw(10) << micros(latency.percentile(99.9)) << setw(12) << micros(latency.max()) << "\n";
+    }
+
+    // name{labels,quantile="q"} lines plus name_sum and name_count, in seconds
+    static void promSummary(ostringstream& out, const string& name, const string& labels, const LatencyHistogram& latency) {
+        for (double quantile : { 0.5, 0.9, 0.99, 0.999 }) {
+            out << name << "{" << labels << ",quantile=\"" << quantile << "\"} " << seconds(latency.percentile(quantile * 100.0)) << "\n";
+        }
+        out << name << "_sum{" << labels << "} " << latency.mean() * latency.count() / 1e9 << "\n";
+        out << name << "_count{" << labels << "} " << latency.count() << "\n";
+    }
+
+    static void promHeader(ostringstream& out, const string& name, const string& type, const string& help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    }
+
+public:
+    static string summary() {
+        ServerMetrics::Snapshot metrics = ServerMetrics::snapshot();
+        ostringstream out;
+        out << "Uptime " << fixed << setprecision(0) << metrics.uptimeSeconds << " s, connections " << metrics.connectionsActive
+            << " open (" << metrics.connectionsTotal << " total), bytes in " << metrics.bytesIn << ", bytes out " << metrics.bytesOut
+            << ", log records dropped " << Logger::dropped() << "\n";
+        out << left << setw(26) << "request" << right << setw(10) << "count" << setw(8) << "errors"
+            << setw(10) << "p50 us" << setw(10) << "p99 us" << setw(10) << "p99.9 us" << setw(12) << "max us" << "\n";
+        for (const auto& entry : metrics.latency) {
+            out << left << setw(26) << messageTypeName(entry.first) << right << setw(10) << entry.second.count()
+                << setw(8) << metrics.errors[entry.first];
+            summaryLine(out, entry.second);
+        }
+        out << left << setw(26) << "lock" << right << setw(10) << "taken" << setw(8) << "waited"
+            << setw(10) << "p50 us" << setw(10) << "p99 us" << setw(10) << "p99.9 us" << setw(12) << "max us" << "\n";
+        for (size_t id = 0; id < metrics.lockNames.size(); id++) {
+            out << left << setw(26) << metrics.lockNames[id] << right << setw(10) << metrics.lockAcquisitions[id]
+                << setw(8) << metrics.lockWaits[id].count();
+            summaryLine(out, metrics.lockWaits[id]);
+        }
+        for (const WorkerPool::Stats& pool : WorkerPool::allStats()) {
+            out << WorkerPool::metricsReport(pool) << "\n";
+        }
+        return out.str();
+    }
+
+    static string prometheus() {
+        ServerMetrics::Snapshot metrics = ServerMetrics::snapshot();
+        ostringstream out;
+        out << setprecision(9);
+        promHeader(out, "boutique_uptime_seconds", "gauge", "Seconds since the server started.");
+        out << "boutique_uptime_seconds " << metrics.uptimeSeconds << "\n";
+        promHeader(out, "boutique_requests_total", "counter", "Requests served, by message type.");
+        for (const auto& entry : metrics.latency) {
+            out << "boutique_requests_total{type=\"" << messageTypeName(entry.first) << "\"} " << entry.second.count() << "\n";
+        }
+        promHeader(out, "boutique_request_errors_total", "counter", "Requests answered with an ERROR, by message type.");
+        for (const auto& entry : metrics.latency) {
+            out << "boutique_request_errors_total{type=\"" << messageTypeName(entry.first) << "\"} " << metrics.errors[entry.first] << "\n";
+        }
+        promHeader(out, "boutique_request_duration_seconds", "summary", "Time to execute a request and build its reply, by message type.");
+        for (const auto& entry : metrics.latency) {
+            promSummary(out, "boutique_request_duration_seconds", "type=\"" + string(messageTypeName(entry.first)) + "\"", entry.second);
+        }
+        promHeader(out, "boutique_lock_acquisitions_total", "counter", "Times each storage lock was taken.");
+        for (size_t id = 0; id < metrics.lockNames.size(); id++) {
+            out << "boutique_lock_acquisitions_total{lock=\"" << metrics.lockNames[id] << "\"} " << metrics.lockAcquisitions[id] << "\n";
+        }
+        promHeader(out, "boutique_lock_wait_seconds", "summary", "Time spent waiting for a storage lock that was held, per contended acquisition.");
+        for (size_t id = 0; id < metrics.lockNames.size(); id++) {
+            promSummary(out, "boutique_lock_wait_seconds", "lock=\"" + metrics.lockNames[id] + "\"", metrics.lockWaits[id]);
+        }
+        promHeader(out, "boutique_received_bytes_total", "counter", "Bytes read from client connections.");
+        out << "boutique_received_bytes_total " << metrics.bytesIn << "\n";
+        promHeader(out, "boutique_sent_bytes_total", "counter", "Bytes written to client connections.");
+        out << "boutique_sent_bytes_total " << metrics.bytesOut << "\n";
+        promHeader(out, "boutique_connections_active", "gauge", "Open client connections.");
+        out << "boutique_connections_active " << metrics.connectionsActive << "\n";
+        promHeader(out, "boutique_connections_total", "counter", "Client connections accepted.");
+        out << "boutique_connections_total " << metrics.connectionsTotal << "\n";
+        promHeader(out, "boutique_log_dropped_total", "counter", "Log records dropped because a thread's log ring was full.");
+        out << "boutique_log_dropped_total " << Logger::dropped() << "\n";
+        vector<WorkerPool::Stats> pools = WorkerPool::allStats();
+        promHeader(out, "boutique_queue_depth", "gauge", "Jobs waiting in a worker queue.");
+        for (const auto& pool : pools) out << "boutique_queue_depth{queue=\"" << pool.name << "\"} " << pool.depth << "\n";
+        promHeader(out, "boutique_queue_max_depth", "gauge", "Deepest a worker queue has been.");
+        for (const auto& pool : pools) out << "boutique_queue_max_depth{queue=\"" << pool.name << "\"} " << pool.maxDepth << "\n";
+        promHeader(out, "boutique_queue_completed_total", "counter", "Jobs a worker queue has run.");
+        for (const auto& pool : pools) out << "boutique_queue_completed_total{queue=\"" << pool.name << "\"} " << pool.completed << "\n";
+        promHeader(out, "boutique_queue_rejected_total", "counter", "Jobs turned away because a worker queue was full.");
+        for (const auto& pool : pools) out << "boutique_queue_rejected_total{queue=\"" << pool.name << "\"} " << pool.rejected << "\n";
+        promHeader(out, "boutique_queue_wait_seconds_total", "counter", "Time jobs spent queued before a worker took them.");
+        for (const auto& pool : pools) out << "boutique_queue_wait_seconds_total{queue=\"" << pool.name << "\"} " << pool.totalWaitMicros / 1e6 << "\n";
+        return out.str();
+    }
+
+    static string handleStats(const string& data) {
+        if (data == "prometheus") {
+            return "SUCCESS: Metrics\n" + prometheus();
+        }
+        if (!data.empty()) {
+            return "ERROR: Unknown stats format (expected nothing or prometheus)";
+        }
+        return "SUCCESS: Stats\n" + summary();
+    }
+};
+
+class RequestProcessor {
+public:
+    static string processRequest(int messageType, const string& data) {
+        try {
+            switch (messageType) {
+            case ADD_STITCHED_DRESS:
+            case SEARCH_STITCHED_DRESS:
+            case COUNT_STITCHED_DRESSES:
+                return DressManager::handleStitchedDress(messageType, data);
+            case ADD_UNSTITCHED_DRESS:
+            case SEARCH_UNSTITCHED_DRESS:
+            case COUNT_UNSTITCHED_DRESSES:
+                return DressManager::handleUnstitchedDress(messageType, data);
+            case ADD_CUSTOMER:
+            case SEARCH_CUSTOMER:
+                return CustomerManager::handleCustomer(messageType, data);
+            case PROCESS_ORDER:
+            case SEARCH_ORDER:
+                return OrderManager::handleOrder(messageType, data);
+            case SEND_IMAGE:
+            case UPLOAD_BEGIN:
+            case UPLOAD_STATUS:
+            case UPLOAD_COMMIT:
+            case UPLOAD_ABORT:
+            case IMAGE_CACHE_STATS:
+            case LINK_IMAGE:
+            case IMAGE_STORE_STATS:
+                return ImageManager::handleImage(messageType, data);
+            case CONVERT_TO_UPPERCASE:
+                return TextManager::handleText(messageType, data);
+            case PING:
+                return "SUCCESS: PONG";
+            case STATS:
+                return StatsManager::handleStats(data);
+            case SEARCH_TEXT:
+                return TextSearchManager::handleSearch(data);
+            case REPORT:
+                return ReportManager::handleReport(data);
+            // VIEW_* requests are streamed by ViewManager and never reach this point
+            default:
+                return "ERROR: Unknown request type (" + to_string(messageType) + ")";
+            }
+        }
+        catch (const exception& e) {
+            return "ERROR: " + string(e.what());
+        }
+    }
+};
+
+// One buffer of a scatter-gather send
+struct IoSlice {
+    const char* data;
+    size_t length;
+};
+
+// Sends up to MAX_SEND_SLICES slices with a single writev-style call. Returns the number of
+// bytes sent, or -1 with errno (WSAGetLastError() on Windows) describing the failure.
+long long sendSlices(SOCKET socket, const IoSlice* slices, int count) {
+#ifdef _WIN32
+    WSABUF buffers[MAX_SEND_SLICES];
+    for (int i = 0; i < count; i++) {
+        buffers[i].buf = const_cast<char*>(slices[i].data);
+        buffers[i].len = static_cast<ULONG>(slices[i].length);
+    }
+    DWORD sent = 0;
+    if (WSASend(socket, buffers, count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) {
+        return -1;
+    }
+    return sent;
+#else
+    struct iovec vectors[MAX_SEND_SLICES];
+    for (int i = 0; i < count; i++) {
+        vectors[i].iov_base = const_cast<char*>(slices[i].data);
+        vectors[i].iov_len = slices[i].length;
+    }
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = vectors;
+    message.msg_iovlen = count;
+#ifdef MSG_NOSIGNAL
+    return sendmsg(socket, &message, MSG_NOSIGNAL);
+#else
+    return sendmsg(socket, &message, 0);
+#endif
+#endif
+}
+
+// The bytes of one response. Most replies are a single string. A listing reply also holds a
+// record snapshot and streams "N. record\n" for every record between its head and tail, so
+// sending it never copies the collection: the records go to the socket straight from the
+// store, and only the item numbers are written, into a small scratch buffer, as they are sent.
+class Reply {
+private:
+    string head;
+    RecordSnapshot records;
+    size_t endRecord = 0;
+    string tail;
+    size_t total = 0;
+    size_t sent = 0;
+    // Send position: bytes of head done, then record index and bytes of its line done, then tail
+    size_t headSent = 0;
+    size_t nextRecord = 0;
+    size_t recordSent = 0;
+    size_t tailSent = 0;
+    string scratch;
+    // Image replies: the bytes follow the head, from memory or straight from the file
+    shared_ptr<const string> body;
+    size_t bodySent = 0;
+    shared_ptr<ImageFile> file;
+    uint64_t fileSent = 0;
+
+    static constexpr const char* NEWLINE = "\n";
+
+    size_t itemLength(size_t position) const {
+        return DataFormatter::itemNumberLength(position + 1) + records[position].size() + 1;
+    }
+
+    static void addSlice(IoSlice* slices, int& count, const char* data, size_t length, size_t& skip) {
+        if (skip >= length) {
+            skip -= length;
+            return;
+        }
+        slices[count++] = { data + skip, length - skip };
+        skip = 0;
+    }
+
+public:
+    Reply() {}
+
+    explicit Reply(string bytes) : head(move(bytes)) {
+        total = head.size();
+    }
+
+    // head, then records begin .. end - 1 of the snapshot as numbered lines, then tail.
+    // Items are numbered by their position in the collection, starting at 1.
+    static Reply listing(string head, RecordSnapshot records, size_t begin, size_t end, string tail) {
+        Reply reply;
+        reply.head = move(head);
+        reply.tail = move(tail);
+        reply.total = reply.head.size() + reply.tail.size() + records.bytes(begin, end) + (end - begin)
+            + DataFormatter::itemNumbersLength(begin + 1, end - begin);
+        reply.records = move(records);
+        reply.nextRecord = begin;
+        reply.endRecord = end;
+        return reply;
+    }
+
+    // head followed by bytes shared with the image cache
+    static Reply withBody(string head, shared_ptr<const string> body) {
+        Reply reply(move(head));
+        reply.total += body->size();
+        reply.body = move(body);
+        return reply;
+    }
+
+    // head followed by the contents of an open file, sent with sendFile()
+    static Reply withFile(string head, shared_ptr<ImageFile> file) {
+        Reply reply(move(head));
+        reply.total += static_cast<size_t>(file->size());
+        reply.file = move(file);
+        return reply;
+    }
+
+    // Puts bytes (e.g. a frame header) in front of a reply that has not been sent yet
+    void prepend(const string& bytes) {
+        head.insert(0, bytes);
+        total += bytes.size();
+    }
+
+    size_t size() const {
+        return total;
+    }
+
+    // True for an ERROR_RESPONSE frame or a legacy "ERROR..." text reply
+    bool isError() const {
+        if (!head.empty() && static_cast<unsigned char>(head[0]) == FRAME_MAGIC && head.size() >= FRAME_HEADER_SIZE) {
+            return decodeFrameHeader(head.data()).type == ERROR_RESPONSE;
+        }
+        return head.compare(0, 5, "ERROR") == 0;
+    }
+
+    size_t remaining() const {
+        return total - sent;
+    }
+
+    bool done() const {
+        return sent == total;
+    }
+
+    // Appends slices for the unsent bytes to slices[count .. capacity) and advances count.
+    // Returns true if everything left was gathered. Slices stay valid until the next call.
+    bool gather(IoSlice* slices, int capacity, int& count) {
+        if (headSent < head.size()) {
+            if (count == capacity) return false;
+            slices[count++] = { head.data() + headSent, head.size() - headSent };
+        }
+        if (nextRecord < endRecord) {
+            size_t perCall = static_cast<size_t>(MAX_SEND_SLICES) / 3 + 1;
+            if (scratch.empty()) scratch.resize(perCall * 24);
+            size_t skip = recordSent;
+            size_t position = nextRecord;
+            for (size_t used = 0; position < endRecord && capacity - count >= 3 && used < perCall; position++, used++) {
+                char* number = &scratch[used * 24];
+                size_t numberLength = DataFormatter::formatItemNumber(position + 1, number);
+                const string& line = records[position];
+                addSlice(slices, count, number, numberLength, skip);
+                addSlice(slices, count, line.data(), line.size(), skip);
+                addSlice(slices, count, NEWLINE, 1, skip);
+            }
+            if (position < endRecord) return false;
+        }
+        if (body && bodySent < body->size()) {
+            if (count == capacity) return false;
+            slices[count++] = { body->data() + bodySent, body->size() - bodySent };
+        }
+        if (file && fileSent < file->size()) {
+            // File bytes cannot be gathered; they go out with sendFile() once all before them is sent
+            return false;
+        }
+        if (tailSent < tail.size()) {
+            if (count == capacity) return false;
+            slices[count++] = { tail.data() + tailSent, tail.size() - tailSent };
+        }
+        return true;
+    }
+
+    // Marks bytes as sent
+    void consume(size_t bytes) {
+        sent += bytes;
+        size_t take = min(bytes, head.size() - headSent);
+        headSent += take;
+        bytes -= take;
+        while (bytes > 0 && nextRecord < endRecord) {
+            size_t left = itemLength(nextRecord) - recordSent;
+            if (bytes < left) {
+                recordSent += bytes;
+                return;
+            }
+            bytes -= left;
+            recordSent = 0;
+            nextRecord++;
+        }
+        if (body) {
+            take = min(bytes, body->size() - bodySent);
+            bodySent += take;
+            bytes -= take;
+        }
+        if (file) {
+            take = static_cast<size_t>(min<uint64_t>(bytes, file->size() - fileSent));
+            fileSent += take;
+            bytes -= take;
+        }
+        tailSent += bytes;
+    }
+
+    // True when the next bytes to send come from the file
+    bool fileNext() const {
+        return file && fileSent < file->size() && headSent == head.size() && nextRecord == endRecord
+            && (!body || bodySent == body->size());
+    }
+
+    // Sends the next file bytes; the caller passes the result to consume() like sendSlices()
+    long long sendFile(SOCKET socket) const {
+        return file->sendTo(socket, fileSent, static_cast<size_t>(min<uint64_t>(file->size() - fileSent, MAX_SENDFILE_CHUNK)));
+    }
+};
+
+// Blocking send of a whole reply
+bool sendReply(SOCKET socket, Reply& reply) {
+    IoSlice slices[MAX_SEND_SLICES];
+    while (!reply.done()) {
+        long long sent;
+        if (reply.fileNext()) {
+            sent = reply.sendFile(socket);
+        }
+        else {
+            int count = 0;
+            reply.gather(slices, MAX_SEND_SLICES, count);
+            sent = sendSlices(socket, slices, count);
+        }
+        if (sent <= 0) {
+#ifndef _WIN32
+            if (sent == -1 && errno == EINTR) continue;
+#endif
+            return false;
+        }
+        reply.consume(static_cast<size_t>(sent));
+    }
+    return true;
+}
+
+// One complete request, either a binary frame or a legacy "type|data" text message
+struct Request {
+    bool framed = false;
+    FrameHeader header;
+    int messageType = 0;
+    string data;
+    string error;
+    shared_ptr<StreamedBody> body;  // UPLOAD_IMAGE / UPLOAD_PART body, streamed to disk instead of data
+};
+
+// Turns the byte stream of one connection into complete requests. Frames are reassembled
+// across partial reads; legacy text messages are passed through as before.
+class RequestAssembler : public FrameListener {
+private:
+    FrameParser parser;
+    Request pending;
+    bool oversized = false;
+    vector<Request> completed;
+
+public:
+    RequestAssembler() : parser(*this) {}
+
+    // Returns the requests completed by this chunk of input
+    vector<Request>& feed(const char* data, size_t length) {
+        completed.clear();
+        parser.feed(data, length);
+        return completed;
+    }
+
+    bool failed() const {
+        return parser.failed();
+    }
+
+    void onFrameBegin(const FrameHeader& header) override {
+        pending = Request();
+        pending.framed = true;
+        pending.header = header;
+        pending.messageType = header.type;
+        if (header.type == UPLOAD_IMAGE) {
+            oversized = header.payloadLength > MAX_IMAGE_BYTES;
+            if (!oversized) {
+                pending.body = make_shared<ImageUpload>();
+            }
+            return;
+        }
+        if (header.type == UPLOAD_PART) {
+            oversized = header.payloadLength > MAX_UPLOAD_PART + MAX_PART_HEADER + 1;
+            if (!oversized) {
+                pending.body = make_shared<PartUpload>(header.payloadLength);
+            }
+            return;
+        }
+        oversized = header.payloadLength > MAX_BUFFERED_PAYLOAD;
+        if (!oversized) {
+            // The header alone must not commit memory: a peer can declare 256 MB and send nothing
+            pending.data.reserve(static_cast<size_t>(min<uint64_t>(header.payloadLength, MAX_INITIAL_RESERVE)));
+        }
+    }
+
+    void onFramePayload(const FrameHeader&, const char* data, size_t length) override {
+        if (pending.body) {
+            pending.body->write(data, length);
+        }
+        else if (!oversized) {
+            pending.data.append(data, length);
+        }
+    }
+
+    void onFrameEnd(const FrameHeader& header) override {
+        if (oversized) {
+            pending.data.clear();
+            pending.error = "ERROR: Message too large (" + to_string(header.payloadLength) + " bytes)";
+        }
+        else if (pending.body && !pending.body->finish()) {
+            pending.error = pending.body->getError();
+            pending.body.reset();
+        }
+        completed.push_back(move(pending));
+    }
+
+    void onTextMessage(const char* data, size_t length) override {
+        Request request;
+        string message(data, length);
+        size_t pos = message.find('|');
+        if (pos == string::npos) {
+            request.error = "ERROR: Invalid message format. Expected: MessageType|Data";
+        }
+        else {
+            try {
+                request.messageType = stoi(message.substr(0, pos));
+                request.data = message.substr(pos + 1);
+            }
+            catch (const exception&) {
+                request.error = "ERROR: Invalid message type";
+            }
+        }
+        completed.push_back(move(request));
+    }
+
+    void onProtocolError(const string& reason) override {
+        Logger::log(LOG_WARN, "protocol_error", reason);
+    }
+};
+
+// Wraps a response in a frame when the request was framed; legacy requests get plain text
+string encodeResponse(const Request& request, const string& response) {
+    if (!request.framed) {
+        return response;
+    }
+    uint16_t type = DATA_RESPONSE;
+    if (response.compare(0, 5, "ERROR") == 0) {
+        type = ERROR_RESPONSE;
+    }
+    else if (response.compare(0, 7, "SUCCESS") == 0) {
+        type = SUCCESS_RESPONSE;
+    }
+    return encodeFrame(type, request.header.requestId, response);
+}
+
+// VIEW_* requests. The reply is a snapshot of the collection streamed by Reply, so a
+// listing costs the same small amount of memory whatever the size of the collection.
+//
+// A request with a payload asks for one page: "limit", "limit offset" or "limit cursor".
+// The cursor names the collection, the store generation and the position after the page, so
+// the next page starts right there instead of counting its way down from the first record.
+class ViewManager {
+private:
+    static bool viewSource(int messageType, string& filename, string& title) {
+        switch (messageType) {
+        case VIEW_STITCHED_DRESSES:
+            filename = "stitched_dresses.txt";
+            title = "STITCHED DRESSES";
+            return true;
+        case VIEW_UNSTITCHED_DRESSES:
+            filename = "unstitched_dresses.txt";
+            title = "UNSTITCHED DRESSES";
+            return true;
+        case VIEW_CUSTOMERS:
+            filename = "customers.txt";
+            title = "CUSTOMERS";
+            return true;
+        case VIEW_ORDERS:
+            filename = "orders.txt";
+            title = "ORDERS";
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Works out where the requested page starts; returns an error message, or "" on success
+    static string resolvePage(const string& data, const RecordSnapshot& records, int messageType, size_t& begin, size_t& limit) {
+        istringstream iss(data);
+        long long requested;
+        string position;
+        if (!(iss >> requested) || requested <= 0) {
+            return "ERROR: Invalid page request. Expected: limit [offset|cursor]";
+        }
+        limit = min(static_cast<size_t>(requested), MAX_VIEW_PAGE);
+        begin = 0;
+        if (!(iss >> position)) {
+            return "";
+        }
+        if (all_of(position.begin(), position.end(), ::isdigit)) {
+            try {
+                begin = static_cast<size_t>(stoull(position));
+            }
+            catch (const exception&) {
+                return "ERROR: Invalid page offset";
+            }
+        }
+        else {
+            int cursorType;
+            uint64_t generation;
+            if (!decodeCursor(position, cursorType, generation, begin) || cursorType != messageType) {
+                return "ERROR: Invalid cursor";
+            }
+            if (generation != records.generation()) {
+                return "ERROR: Cursor expired, the collection was reloaded; start the listing again";
+            }
+        }
+        if (begin > records.count()) {
+            return "ERROR: Offset " + to_string(begin) + " is past the end (" + to_string(records.count()) + " records)";
+        }
+        return "";
+    }
+
+public:
+    static bool isView(int messageType) {
+        string filename, title;
+        return viewSource(messageType, filename, title);
+    }
+
+    // Also used by FILTER, whose pages are positions in the same collections
+    static string encodeCursor(int messageType, uint64_t generation, size_t position) {
+        ostringstream oss;
+        oss << hex << messageType << "." << generation << "." << position;
+        return oss.str();
+    }
+
+    static bool decodeCursor(const string& cursor, int& messageType, uint64_t& generation, size_t& position) {
+        istringstream iss(cursor);
+        char dot1 = 0, dot2 = 0;
+        return static_cast<bool>(iss >> hex >> messageType >> dot1 >> generation >> dot2 >> position)
+            && dot1 == '.' && dot2 == '.' && iss.peek() == EOF;
+    }
+
+    static Reply handleView(const Request& request) {
+        string filename, title;
+        if (!viewSource(request.messageType, filename, title)) {
+            return Reply(encodeResponse(request, "ERROR: Unknown view operation"));
+        }
+        RecordSnapshot records = FileHandler::snapshot(filename);
+        bool paged = request.data.find_first_not_of(" \t\r\n") != string::npos;
+        size_t begin = 0, end = records.count();
+        if (paged) {
+            size_t limit;
+            string error = resolvePage(request.data, records, request.messageType, begin, limit);
+            if (!error.empty()) {
+                return Reply(encodeResponse(request, error));
+            }
+            end = min(records.count(), begin + limit);
+        }
+        if (records.count() == 0) {
+            return Reply(encodeResponse(request, DataFormatter::emptyListing(title)));
+        }
+        if (begin == end) {
+            return Reply(encodeResponse(request, "No more " + title));
+        }
+        string heading = title;
+        if (paged) {
+            heading += " " + to_string(begin + 1) + "-" + to_string(end) + " OF " + to_string(records.count());
+        }
+        string tail = DataFormatter::listingFooter();
+        bool more = end < records.count();
+        if (more) {
+            tail += VIEW_MORE_MARKER + encodeCursor(request.messageType, records.generation(), end) + "\n";
+        }
+        Reply reply = Reply::listing(DataFormatter::listingHeader(heading), move(records), begin, end, move(tail));
+        if (request.framed) {
+            FrameHeader header;
+            header.flags = more ? FRAME_FLAG_MORE : FRAME_FLAG_NONE;
+            header.type = DATA_RESPONSE;
+            header.requestId = request.header.requestId;
+            header.payloadLength = reply.size();
+            string frameHeader(FRAME_HEADER_SIZE, '\0');
+            encodeFrameHeader(header, &frameHeader[0]);
+            reply.prepend(frameHeader);
+        }
+        return reply;
+    }
+};
+
+// FILTER: "stitched|unstitched" followed by conditions, e.g. "stitched color=red
+// material=chiffon maxPrice=5000". color, material, brand and size take one value or several
+// separated by commas (any of them matches) and ignore case; minPrice/maxPrice and
+// minDiscounted/maxDiscounted bound the two prices, inclusive. The matching dresses are
+// listed in collection order and numbered by their place in the result, as VIEW numbers the
+// collection, so the numbers match the "first-last OF total" header. limit=N (default 100) per
+// reply; a page
+// with more after it ends with "MORE: <cursor>", and cursor=<cursor> asks for the next one.
+class FilterManager {
+private:
+    static const size_t DEFAULT_LIMIT = 100;
+
+    static vector<string> values(const string& text) {
+        vector<string> result;
+        istringstream iss(text);
+        string value;
+        while (getline(iss, value, ',')) {
+            for (char& c : value) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+            if (!value.empty()) result.push_back(value);
+        }
+        return result;
+    }
+
+    static bool parsePrice(const string& text, float& value) {
+        char* end = nullptr;
+        value = strtof(text.c_str(), &end);
+        return end != text.c_str() && *end == '\0' && !std::isnan(value);
+    }
+
+    static Reply respond(const Request& request, const string& text, bool more = false) {
+        if (!request.framed || !more) {
+            return Reply(encodeResponse(request, text));
+        }
+        return Reply(encodeFrame(DATA_RESPONSE, request.header.requestId, text, FRAME_FLAG_MORE));
+    }
+
+public:
+    static Reply handleFilter(const Request& request) {
+        istringstream iss(request.data);
+        string collection;
+        iss >> collection;
+        int viewType;
+        string filename, title;
+        if (collection == "stitched") {
+            viewType = VIEW_STITCHED_DRESSES;
+            filename = "stitched_dresses.txt";
+            title = "STITCHED DRESSES";
+        }
+        else if (collection == "unstitched") {
+            viewType = VIEW_UNSTITCHED_DRESSES;
+            filename = "unstitched_dresses.txt";
+            title = "UNSTITCHED DRESSES";
+        }
+        else {
+            return respond(request, "ERROR: Invalid filter. Expected: stitched|unstitched key=value ...");
+        }
+        DressIndex::Query query;
+        size_t limit = DEFAULT_LIMIT;
+        string cursor, conditions, term;
+        while (iss >> term) {
+            size_t equals = term.find('=');
+            if (equals == string::npos || equals == 0 || equals + 1 == term.size()) {
+                return respond(request, "ERROR: Invalid filter condition " + term);
+            }
+            string key = term.substr(0, equals), value = term.substr(equals + 1);
+            if (key == "cursor") {
+                cursor = value;
+                continue;
+            }
+            if (key == "limit") {
+                if (!all_of(value.begin(), value.end(), ::isdigit) || value.size() > 9 || stoul(value) == 0) {
+                    return respond(request, "ERROR: Invalid filter limit " + value);
+                }
+                limit = min(static_cast<size_t>(stoul(value)), MAX_VIEW_PAGE);
+                continue;
+            }
+            if (key == "color") query.colors = values(value);
+            else if (key == "material") query.materials = values(value);
+            else if (key == "brand") query.brands = values(value);
+            else if (key == "size") query.sizes = values(value);
+            else if (key == "minPrice" || key == "maxPrice" || key == "minDiscounted" || key == "maxDiscounted") {
+                float price;
+                if (!parsePrice(value, price)) {
+                    return respond(request, "ERROR: Invalid price in " + term);
+                }
+                if (key == "minPrice") query.minPrice = price;
+                else if (key == "maxPrice") query.maxPrice = price;
+                else if (key == "minDiscounted") query.minDiscounted = price;
+                else query.maxDiscounted = price;
+            }
+            else {
+                return respond(request, "ERROR: Unknown filter key " + key);
+            }
+            conditions += " " + term;
+        }
+        if (query.empty()) {
+            return respond(request, "ERROR: FILTER needs at least one condition; VIEW lists the whole collection");
+        }
+        RecordSnapshot records;
+        vector<uint32_t> matches;
+        if (!FileHandler::filterDresses(filename, query, records, matches)) {
+            return respond(request, "ERROR: " + title + " are not indexed");
+        }
+        size_t from = 0;
+        if (!cursor.empty()) {
+            int cursorType;
+            uint64_t generation;
+            if (!ViewManager::decodeCursor(cursor, cursorType, generation, from) || cursorType != viewType) {
+                return respond(request, "ERROR: Invalid cursor");
+            }
+            if (generation != records.generation()) {
+                return respond(request, "ERROR: Cursor expired, the collection was reloaded; start the filter again");
+            }
+        }
+        if (matches.empty()) {
+            return respond(request, "No " + title + " match" + conditions);
+        }
+        size_t begin = lower_bound(matches.begin(), matches.end(), from) - matches.begin();
+        if (begin == matches.size()) {
+            return respond(request, "No more " + title + " match" + conditions);
+        }
+        size_t end = min(matches.size(), begin + limit);
+        string text = DataFormatter::listingHeader(title + " WHERE" + conditions + ": " + to_string(begin + 1) + "-"
+            + to_string(end) + " OF " + to_string(matches.size()));
+        char number[24];
+        for (size_t i = begin; i < end; i++) {
+            text.append(number, DataFormatter::formatItemNumber(i + 1, number));
+            text += records[matches[i]];
+            text += '\n';
+        }
+        text += DataFormatter::listingFooter();
+        bool more = end < matches.size();
+        if (more) {
+            text += VIEW_MORE_MARKER + ViewManager::encodeCursor(viewType, records.generation(), matches[end - 1] + 1) + "\n";
+        }
+        return respond(request, text, more);
+    }
+};
+
+// GET_IMAGE: payload "name" or "name|etag". If the client's ETag still matches, the reply is
+// a short "not modified" line with FRAME_FLAG_NOT_MODIFIED. Otherwise the head
+// "SUCCESS: Image <name> size=<bytes> etag=<etag>\n" is followed by the image itself: small hot
+// images from ImageCache, everything else straight from the file with sendfile().
+// GET_THUMBNAIL answers the same way with one of the thumbnails ThumbnailPipeline made.
+class ImageDownloadManager {
+private:
+    static Reply imageReply(const Request& request, const string& label, const string& cacheKey, shared_ptr<ImageFile> image, const string& clientTag) {
+        if (clientTag == image->etag()) {
+            ImageCache::recordNotModified(image->size());
+            return Reply(encodeFrame(SUCCESS_RESPONSE, request.header.requestId, "SUCCESS: Not modified etag=" + clientTag, FRAME_FLAG_NOT_MODIFIED));
+        }
+        string head = "SUCCESS: Image " + label + " size=" + to_string(image->size()) + " etag=" + image->etag() + "\n";
+        shared_ptr<const string> cached = ImageCache::lookup(cacheKey, image->etag());
+        if (cached == nullptr && ImageCache::cacheable(image->size())) {
+            auto bytes = make_shared<string>();
+            if (image->read(*bytes)) {
+                ImageCache::insert(cacheKey, image->etag(), bytes);
+                cached = bytes;
+            }
+        }
+        Reply reply = cached != nullptr ? Reply::withBody(move(head), cached) : Reply::withFile(move(head), image);
+        FrameHeader header;
+        header.type = DATA_RESPONSE;
+        header.requestId = request.header.requestId;
+        header.payloadLength = reply.size();
+        string frameHeader(FRAME_HEADER_SIZE, '\0');
+        encodeFrameHeader(header, &frameHeader[0]);
+        reply.prepend(frameHeader);
+        return reply;
+    }
+
+public:
+    static Reply handleGetImage(const Request& request) {
+        if (!request.framed) {
+            return Reply(encodeResponse(request, "ERROR: GET_IMAGE needs a framed request"));
+        }
+        size_t pos = request.data.find('|');
+        string imageName = request.data.substr(0, pos);
+        string clientTag = pos == string::npos ? "" : request.data.substr(pos + 1);
+        if (!FileHandler::validImageName(imageName)) {
+            return Reply(encodeResponse(request, "ERROR: Invalid image name " + imageName));
+        }
+        shared_ptr<ImageFile> image = FileHandler::openImage(imageName);
+        if (image == nullptr) {
+            return Reply(encodeResponse(request, "ERROR: Image " + imageName + " not found"));
+        }
+        return imageReply(request, imageName, imageName, image, clientTag);
+    }
+
+    // GET_THUMBNAIL: "name|size" or "name|size|etag". Thumbnails are cached by content hash,
+    // so every name of the same image shares one cache entry.
+    static Reply handleGetThumbnail(const Request& request) {
+        if (!request.framed) {
+            return Reply(encodeResponse(request, "ERROR: GET_THUMBNAIL needs a framed request"));
+        }
+        size_t pos = request.data.find('|');
+        if (pos == string::npos) {
+            return Reply(encodeResponse(request, "ERROR: Invalid thumbnail format. Expected: name|size[|etag]"));
+        }
+        string imageName = request.data.substr(0, pos);
+        size_t tagPos = request.data.find('|', pos + 1);
+        string sizeText = request.data.substr(pos + 1, tagPos == string::npos ? string::npos : tagPos - pos - 1);
+        string clientTag = tagPos == string::npos ? "" : request.data.substr(tagPos + 1);
+        if (!FileHandler::validImageName(imageName)) {
+            return Reply(encodeResponse(request, "ERROR: Invalid image name " + imageName));
+        }
+        int size = 0;
+        for (int supported : THUMBNAIL_SIZES) {
+            if (sizeText == to_string(supported)) size = supported;
+        }
+        if (size == 0) {
+            string sizes;
+            for (int supported : THUMBNAIL_SIZES) sizes += (sizes.empty() ? "" : ", ") + to_string(supported);
+            return Reply(encodeResponse(request, "ERROR: Invalid thumbnail size " + sizeText + " (expected " + sizes + ")"));
+        }
+        string hash = FileHandler::imageHash(imageName);
+        if (hash.empty()) {
+            return Reply(encodeResponse(request, "ERROR: Image " + imageName + " not found"));
+        }
+        shared_ptr<ImageFile> thumbnail = FileHandler::openThumbnail(hash, size);
+        if (thumbnail == nullptr) {
+            string failure = ThumbnailPipeline::failure(hash);
+            if (!failure.empty()) {
+                return Reply(encodeResponse(request, "ERROR: No thumbnail for " + imageName + ": " + failure));
+            }
+            // Covers images stored before the pipeline existed and jobs dropped by a full queue
+            ThumbnailPipeline::schedule(imageName);
+            return Reply(encodeResponse(request, "ERROR: Thumbnail of " + imageName + " not ready, retry"));
+        }
+        string label = imageName + "@" + to_string(size);
+        return imageReply(request, label, ".thumbs/" + hash + "-" + to_string(size), thumbnail, clientTag);
+    }
+};
+
+// BATCH: the payload is a sequence of request frames, the reply one DATA_RESPONSE frame that
+// holds a response frame for each of them, in order and with its request id. Consecutive
+// inserts go to InsertManager together; everything else runs one by one as if sent alone.
+// Requests whose replies are streamed or paged (VIEW_*, FILTER, GET_IMAGE, ...) cannot be batched.
+class BatchManager {
+private:
+    static bool batchable(int type) {
+        return !ViewManager::isView(type) && type != FILTER && type != GET_IMAGE && type != GET_THUMBNAIL && type != UPLOAD_IMAGE
+            && type != UPLOAD_PART && type != BATCH;
+    }
+
+public:
+    static Reply handleBatch(const Request& request) {
+        if (!request.framed) {
+            return Reply(encodeResponse(request, "ERROR: BATCH needs a framed request"));
+        }
+        vector<Request> requests;
+        size_t pos = 0;
+        Request sub;
+        sub.framed = true;
+        while (requests.size() <= MAX_BATCH_REQUESTS && nextBatchFrame(request.data, pos, sub.header, sub.data)) {
+            sub.messageType = sub.header.type;
+            requests.push_back(sub);
+        }
+        if (requests.size() > MAX_BATCH_REQUESTS) {
+            return Reply(encodeResponse(request, "ERROR: Batch too large (at most " + to_string(MAX_BATCH_REQUESTS) + " requests)"));
+        }
+        if (pos != request.data.size()) {
+            return Reply(encodeResponse(request, "ERROR: Malformed batch at byte " + to_string(pos)));
+        }
+        bool atomic = (request.header.flags & FRAME_FLAG_ATOMIC) != 0;
+        if (atomic) {
+            for (const Request& part : requests) {
+                if (!InsertManager::isInsert(part.messageType)) {
+                    return Reply(encodeResponse(request, "ERROR: An atomic batch may only contain inserts (request type " + to_string(part.messageType) + ")"));
+                }
+            }
+        }
+        string responses;
+        for (size_t i = 0; i < requests.size();) {
+            if (InsertManager::isInsert(requests[i].messageType)) {
+                size_t end = i;
+                vector<pair<int, string>> inserts;
+                while (end < requests.size() && InsertManager::isInsert(requests[end].messageType)) {
+                    inserts.emplace_back(requests[end].messageType, move(requests[end].data));
+                    end++;
+                }
+                vector<string> replies = InsertManager::insertAll(inserts, atomic);
+                for (size_t k = 0; k < replies.size(); k++) responses += encodeResponse(requests[i + k], replies[k]);
+                i = end;
+                continue;
+            }
+            const Request& part = requests[i++];
+            if (!batchable(part.messageType)) {
+                responses += encodeResponse(part, "ERROR: Request type " + to_string(part.messageType) + " cannot be batched");
+                continue;
+            }
+            responses += encodeResponse(part, RequestProcessor::processRequest(part.messageType, part.data));
+        }
+        return Reply(encodeFrame(DATA_RESPONSE, request.header.requestId, responses));
+    }
+};
+
+// Runs one request and returns the bytes to send back
+Reply executeRequest(const Request& request) {
+    if (!request.error.empty()) {
+        return Reply(encodeResponse(request, request.error));
+    }
+    if (ViewManager::isView(request.messageType)) {
+        return ViewManager::handleView(request);
+    }
+    if (request.messageType == FILTER) {
+        return FilterManager::handleFilter(request);
+    }
+    if (request.messageType == GET_IMAGE) {
+        return ImageDownloadManager::handleGetImage(request);
+    }
+    if (request.messageType == GET_THUMBNAIL) {
+        return ImageDownloadManager::handleGetThumbnail(request);
+    }
+    if (request.messageType == BATCH) {
+        return BatchManager::handleBatch(request);
+    }
+    if (request.body) {
+        return Reply(encodeResponse(request, ImageManager::handleStreamed(request.messageType, *request.body)));
+    }
+    return Reply(encodeResponse(request, RequestProcessor::processRequest(request.messageType, request.data)));
+}
+
+// executeRequest, timed into the metrics of its message type and logged. On a worker the
+// clock was already read when the job was taken (or the job's previous request ended), so
+// only the end of the request costs a clock read.
+Reply serveRequest(const Request& request, const string& clientLabel) {
+    auto start = WorkerPool::currentJobStart();
+    bool onWorker = start != chrono::steady_clock::time_point();
+    if (!onWorker) start = chrono::steady_clock::now();
+    Reply reply = executeRequest(request);
+    auto end = chrono::steady_clock::now();
+    if (onWorker) WorkerPool::restartJobClock(end);
+    uint64_t nanos = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+    bool failed = reply.isError();
+    ServerMetrics::recordRequest(request.messageType, nanos, failed);
+    Logger::request(clientLabel, request.messageType, end, nanos, reply.size(), failed);
+    return reply;
+}
+
+Reply busyResponse(const Request& request) {
+    return Reply(encodeResponse(request, "ERROR: Server busy, please retry"));
+}
+
+void printServerBanner(const string& backend) {
+    cout << "=================================\n";
+    cout << "  BOUTIQUE MANAGEMENT SERVER SIDE  \n";
+    cout << "=================================\n";
+    cout << "Server started on port " << SERVER_PORT << " (" << backend << ")\n";
+    cout << "Waiting for client connections...\n";
+    cout << "=================================\n";
+}
+
+// Local HTTP endpoint for monitoring: GET /metrics answers the Prometheus text format and
+// GET /stats the STATS summary. It listens on 127.0.0.1 only and serves one short request
+// at a time on its own thread, so a scraper can never take a request worker.
+class AdminServer {
+private:
+    SOCKET listenSocket = INVALID_SOCKET;
+    thread worker;
+    atomic<bool> running{ false };
+
+    // Waits up to timeoutMillis for socket to become readable
+    static bool waitReadable(SOCKET socket, int timeoutMillis) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(socket, &readable);
+        struct timeval timeout;
+        timeout.tv_sec = timeoutMillis / 1000;
+        timeout.tv_usec = (timeoutMillis % 1000) * 1000;
+        return select(static_cast<int>(socket) + 1, &readable, nullptr, nullptr, &timeout) > 0;
+    }
+
+    static void serveClient(SOCKET client) {
+        string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == string::npos && request.size() < 8192 && waitReadable(client, 2000)) {
+            int received = recv(client, buffer, sizeof(buffer), 0);
+            if (received <= 0) break;
+            request.append(buffer, received);
+        }
+        string status = "200 OK";
+        string body;
+        if (request.compare(0, 13, "GET /metrics ") == 0) {
+            body = StatsManager::prometheus();
+        }
+        else if (request.compare(0, 11, "GET /stats ") == 0) {
+            body = StatsManager::summary();
+        }
+        else {
+            status = "404 Not Found";
+            body = "Try /metrics or /stats\n";
+        }
+        string response = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: "
+            + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        sendAll(client, response.data(), response.size());
+        closesocket(client);
+    }
+
+    void acceptLoop() {
+        while (running) {
+            if (!waitReadable(listenSocket, 500)) continue;
+            SOCKET client = accept(listenSocket, nullptr, nullptr);
+            if (client != INVALID_SOCKET) serveClient(client);
+        }
+    }
+
+public:
+    AdminServer() {}
+
+    ~AdminServer() {
+        stop();
+    }
+
+    AdminServer(const AdminServer&) = delete;
+    AdminServer& operator=(const AdminServer&) = delete;
+
+    bool start(int port) {
+#ifdef _WIN32
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            return false;
+        }
+#endif
+        listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listenSocket == INVALID_SOCKET) {
+            return false;
+        }
+        int optval = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&optval, sizeof(optval));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        if (bind(listenSocket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(listenSocket, 16) == SOCKET_ERROR) {
+            closesocket(listenSocket);
+            listenSocket = INVALID_SOCKET;
+            return false;
+        }
+        running = true;
+        worker = thread(&AdminServer::acceptLoop, this);
+        cout << "Metrics on http://127.0.0.1:" << port << "/metrics\n";
+        return true;
+    }
+
+    void stop() {
+        if (!running) return;
+        running = false;
+        if (worker.joinable()) worker.join();
+        closesocket(listenSocket);
+        listenSocket = INVALID_SOCKET;
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+};
+
+class TCPServer {
+private:
+    struct ClientThread {
+        thread worker;
+        shared_ptr<atomic<bool>> finished;
+    };
+
+    SOCKET serverSocket;
+    struct sockaddr_in serverAddr;
+    vector<ClientThread> clientThreads;
+    WorkerPool requestPool;
+    bool running;
+
+    void initializeSocket() {
+#ifdef _WIN32
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            cerr << "WSAStartup failed" << endl;
+            exit(1);
+        }
+#endif
+        serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (serverSocket == INVALID_SOCKET) {
+            cerr << "Socket creation failed" << endl;
+            exit(1);
+        }
+        int optval = 1;
+        setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&optval, sizeof(optval));
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = INADDR_ANY;
+        serverAddr.sin_port = htons(SERVER_PORT);
+        if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
+            cerr << "Bind failed on port " << SERVER_PORT << endl;
+            closesocket(serverSocket);
+            exit(1);
+        }
+        if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
+            cerr << "Listen failed" << endl;
+            closesocket(serverSocket);
+            exit(1);
+        }
+    }
+
+    void handleClient(SOCKET clientSocket, struct sockaddr_in clientAddr, shared_ptr<atomic<bool>> finished) {
+        char clientIP[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
+        int clientPort = ntohs(clientAddr.sin_port);
+        string clientLabel = string(clientIP) + ":" + to_string(clientPort);
+        Logger::log(LOG_INFO, "connected", "", clientLabel);
+        ServerMetrics::connectionOpened();
+
+        RequestAssembler assembler;
+        vector<char> buffer(BUFFER_SIZE);
+        while (running) {
+            int bytesReceived = recv(clientSocket, buffer.data(), BUFFER_SIZE, 0);
+            if (bytesReceived <= 0) {
+                Logger::log(LOG_INFO, "disconnected", "", clientLabel);
+                break;
+            }
+            ServerMetrics::recordBytesIn(bytesReceived);
+            // The requests completed by this read run as one worker job, one after another, so
+            // pipelined requests take effect in the order they were sent. submit() blocks while
+            // the queue is full, which stops this client being read.
+            auto batch = make_shared<vector<Request>>(move(assembler.feed(buffer.data(), bytesReceived)));
+            vector<Reply> replies;
+            if (!batch->empty()) {
+                auto served = make_shared<promise<vector<Reply>>>();
+                future<vector<Reply>> pending = served->get_future();
+                bool queued = requestPool.submit([batch, served, clientLabel]() {
+                    vector<Reply> out;
+                    for (const Request& request : *batch) out.push_back(serveRequest(request, clientLabel));
+                    served->set_value(move(out));
+                });
+                if (queued) {
+                    replies = pending.get();
+                }
+                else {
+                    for (const Request& request : *batch) replies.push_back(busyResponse(request));
+                }
+            }
+            for (Reply& reply : replies) {
+                if (!sendReply(clientSocket, reply)) {
+                    Logger::log(LOG_WARN, "send_failed", "Failed to send response", clientLabel);
+                }
+                else {
+                    ServerMetrics::recordBytesOut(reply.size());
+                }
+            }
+            if (assembler.failed()) {
+                Logger::log(LOG_WARN, "disconnected", "Closing connection after protocol error", clientLabel);
+                break;
+            }
+        }
+        closesocket(clientSocket);
+        ServerMetrics::connectionClosed();
+        *finished = true;
+    }
+
+    // Joins the threads of clients that have already disconnected
+    void reapFinishedThreads() {
+        auto done = remove_if(clientThreads.begin(), clientThreads.end(), [](ClientThread& client) {
+            if (!*client.finished) return false;
+            client.worker.join();
+            return true;
+        });
+        clientThreads.erase(done, clientThreads.end());
+    }
+
+public:
+    explicit TCPServer(unsigned workerCount)
+        : requestPool("requests", workerCount, REQUEST_QUEUE_CAPACITY), running(true) {
+        FileHandler::prepareImageDir();
+        UploadSessions::load();
+        FileHandler::loadStores();
+        initializeSocket();
+        printServerBanner("thread per connection, " + to_string(requestPool.threadCount()) + " workers");
+    }
+
+    ~TCPServer() {
+        running = false;
+        closesocket(serverSocket);
+        requestPool.shutdown();
+        for (auto& client : clientThreads) {
+            if (client.worker.joinable()) client.worker.join();
+        }
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+
+    void start() {
+        while (running) {
+            struct sockaddr_in clientAddr;
+            socklen_t clientAddrLen = sizeof(clientAddr);
+            SOCKET clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
+            if (clientSocket == INVALID_SOCKET) {
+                if (running) Logger::log(LOG_ERROR, "accept_failed", "Accept failed");
+                continue;
+            }
+            reapFinishedThreads();
+            auto finished = make_shared<atomic<bool>>(false);
+            clientThreads.push_back({ thread(&TCPServer::handleClient, this, clientSocket, clientAddr, finished), finished });
+        }
+    }
+};
+
+#ifdef __linux__
+// Linux backend: a fixed set of I/O threads, each running its own epoll loop over
+// non-blocking sockets. All threads wait on the listening socket (EPOLLEXCLUSIVE wakes
+// only one of them per connection), and a connection stays on the thread that accepted it,
+// so per-connection state is never shared between threads.
+//
+// Requests are executed on the shared worker pool. Workers hand finished replies back to
+// the owning I/O thread through a completion list and an eventfd. A connection's requests
+// run one at a time in the order they arrived: whatever it has queued goes to the pool as
+// one job that runs the requests in turn, and the next job is only submitted once every
+// reply of the last one is back. So a pipelined request sees the writes of the ones before
+// it, as it would if the client had waited for each reply. Different connections run in
+// parallel.
+class EpollServer {
+private:
+    static const size_t MAX_PENDING_OUTPUT = 4 * 1024 * 1024; // stop reading a client that is not draining its replies
+
+    struct Connection {
+        uint64_t id;
+        int fd;
+        string label;
+        RequestAssembler assembler;
+        deque<Reply> output;
+        size_t outputBytes = 0;      // unsent bytes across output
+        uint32_t events = 0;
+        uint64_t nextSequence = 0;   // assigned to the next request read
+        uint64_t nextToSend = 0;     // sequence of the next reply to append to output
+        map<uint64_t, Reply> finishedReplies;
+        deque<Request> backlog;      // parsed requests waiting for an in-flight slot
+        bool peerClosed = false;
+        bool closed = false;         // socket closed; freed once the current epoll batch is done
+    };
+
+    struct Completion {
+        uint64_t connectionId;
+        uint64_t sequence;
+        Reply reply;
+    };
+
+    struct IoThread {
+        int epollFd = -1;
+        int wakeFd = -1;
+        thread worker;
+        unordered_map<uint64_t, unique_ptr<Connection>> connections;
+        vector<char> readBuffer;
+        mutex completionMutex;
+        vector<Completion> completions;
+        uint64_t nextConnectionId = 1;
+        vector<uint64_t> closedConnections;   // freed after the epoll batch that closed them
+    };
+
+    int listenFd;
+    vector<unique_ptr<IoThread>> ioThreads;
+    WorkerPool requestPool;
+    atomic<bool> running;
+
+    static bool setNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+    }
+
+    // Lift the descriptor limit so thousands of clients can stay connected at once
+    static void raiseDescriptorLimit() {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+            cout << "File descriptor limit: " << limit.rlim_cur << "\n";
+        }
+    }
+
+    void initializeSocket() {
+        listenFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listenFd == -1) {
+            cerr << "Socket creation failed" << endl;
+            exit(1);
+        }
+        int optval = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        struct sockaddr_in serverAddr;
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = INADDR_ANY;
+        serverAddr.sin_port = htons(SERVER_PORT);
+        if (bind(listenFd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
+            cerr << "Bind failed on port " << SERVER_PORT << endl;
+            close(listenFd);
+            exit(1);
+        }
+        if (listen(listenFd, SOMAXCONN) == -1 || !setNonBlocking(listenFd)) {
+            cerr << "Listen failed" << endl;
+            close(listenFd);
+            exit(1);
+        }
+    }
+
+    static size_t inFlight(const Connection& conn) {
+        return static_cast<size_t>(conn.nextSequence - conn.nextToSend);
+    }
+
+    static size_t pendingOutput(const Connection& conn) {
+        return conn.outputBytes;
+    }
+
+    // Read only while the client has room for more queued requests and unsent replies
+    static bool wantsInput(const Connection& conn) {
+        return !conn.peerClosed && conn.backlog.size() < MAX_IN_FLIGHT_PER_CONNECTION && pendingOutput(conn) < MAX_PENDING_OUTPUT;
+    }
+
+    void updateEvents(IoThread& io, Connection& conn) {
+        uint32_t events = 0;
+        if (wantsInput(conn)) events |= EPOLLIN | EPOLLRDHUP;
+        if (pendingOutput(conn) > 0) events |= EPOLLOUT;
+        if (conn.events == events) return;
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = &conn;
+        epoll_ctl(io.epollFd, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.events = events;
+    }
+
+    // Later events in the same epoll batch may still point at conn, so it is only freed by
+    // freeClosedConnections() once the batch is done
+    void closeConnection(IoThread& io, Connection& conn) {
+        if (conn.closed) return;
+        Logger::log(LOG_INFO, "disconnected", "", conn.label);
+        ServerMetrics::connectionClosed();
+        epoll_ctl(io.epollFd, EPOLL_CTL_DEL, conn.fd, nullptr);
+        close(conn.fd);
+        conn.closed = true;
+        io.closedConnections.push_back(conn.id);
+    }
+
+    static void freeClosedConnections(IoThread& io) {
+        for (uint64_t id : io.closedConnections) io.connections.erase(id);
+        io.closedConnections.clear();
+    }
+
+    void acceptConnections(IoThread& io) {
+        while (true) {
+            struct sockaddr_in clientAddr;
+            socklen_t clientAddrLen = sizeof(clientAddr);
+            int fd = accept4(listenFd, (struct sockaddr*)&clientAddr, &clientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    Logger::log(LOG_ERROR, "accept_failed", string("Accept failed: ") + strerror(errno));
+                }
+                return;
+            }
+            int nodelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            char clientIP[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
+            auto conn = make_unique<Connection>();
+            conn->id = io.nextConnectionId++;
+            conn->fd = fd;
+            conn->label = string(clientIP) + ":" + to_string(ntohs(clientAddr.sin_port));
+            conn->events = EPOLLIN | EPOLLRDHUP;
+            struct epoll_event ev;
+            ev.events = conn->events;
+            ev.data.ptr = conn.get();
+            if (epoll_ctl(io.epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                close(fd);
+                continue;
+            }
+            Logger::log(LOG_INFO, "connected", "", conn->label);
+            ServerMetrics::connectionOpened();
+            uint64_t id = conn->id;
+            io.connections.emplace(id, move(conn));
+        }
+    }
+
+    // Called from worker threads. Only the first completion after a drain wakes the I/O
+    // thread; the ones behind it are picked up by the same drain.
+    void postCompletion(IoThread& io, uint64_t connectionId, uint64_t sequence, Reply reply) {
+        {
+            lock_guard<mutex> lock(io.completionMutex);
+            io.completions.push_back({ connectionId, sequence, move(reply) });
+            if (io.completions.size() > 1) return;
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(io.wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    // Moves replies that are next in line into the output queue
+    void releaseReplies(Connection& conn) {
+        auto it = conn.finishedReplies.begin();
+        while (it != conn.finishedReplies.end() && it->first == conn.nextToSend) {
+            if (!it->second.done()) {
+                conn.outputBytes += it->second.remaining();
+                conn.output.push_back(move(it->second));
+            }
+            it = conn.finishedReplies.erase(it);
+            conn.nextToSend++;
+        }
+    }
+
+    // Submits everything in the backlog as one job once the last job's replies are all back
+    void pumpBacklog(IoThread& io, Connection& conn) {
+        if (conn.backlog.empty() || inFlight(conn) > 0) return;
+        auto batch = make_shared<vector<Request>>(make_move_iterator(conn.backlog.begin()), make_move_iterator(conn.backlog.end()));
+        conn.backlog.clear();
+        uint64_t first = conn.nextSequence;
+        conn.nextSequence += batch->size();
+        IoThread* owner = &io;
+        uint64_t connectionId = conn.id;
+        string label = conn.label;
+        bool queued = requestPool.trySubmit([this, owner, connectionId, first, batch, label]() {
+            for (size_t i = 0; i < batch->size(); i++) {
+                postCompletion(*owner, connectionId, first + i, serveRequest((*batch)[i], label));
+            }
+        });
+        if (!queued) {
+            for (size_t i = 0; i < batch->size(); i++) conn.finishedReplies.emplace(first + i, busyResponse((*batch)[i]));
+            releaseReplies(conn);
+        }
+    }
+
+    // Marks bytes as sent, front reply first
+    static void consumeOutput(Connection& conn, size_t bytes) {
+        conn.outputBytes -= bytes;
+        while (bytes > 0) {
+            Reply& front = conn.output.front();
+            size_t take = min(bytes, front.remaining());
+            front.consume(take);
+            bytes -= take;
+            if (front.done()) conn.output.pop_front();
+        }
+    }
+
+    // Writes as much pending output as the socket takes; false if the connection is dead.
+    // Queued replies are gathered into one writev, so pipelined replies share a syscall.
+    bool flushOutput(IoThread& io, Connection& conn) {
+        IoSlice slices[MAX_SEND_SLICES];
+        while (!conn.output.empty()) {
+            int count = 0;
+            for (Reply& reply : conn.output) {
+                if (!reply.gather(slices, MAX_SEND_SLICES, count)) break;
+            }
+            ssize_t sent = count == 0 && conn.output.front().fileNext()
+                ? conn.output.front().sendFile(conn.fd) : sendSlices(conn.fd, slices, count);
+            if (sent > 0) {
+                ServerMetrics::recordBytesOut(static_cast<uint64_t>(sent));
+                consumeOutput(conn, static_cast<size_t>(sent));
+                continue;
+            }
+            if (sent == -1 && errno == EINTR) continue;
+            if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            return false;
+        }
+        // A client that has closed its side is done once every reply it asked for is out
+        if (conn.peerClosed && inFlight(conn) == 0 && conn.backlog.empty() && conn.output.empty()) {
+            return false;
+        }
+        updateEvents(io, conn);
+        return true;
+    }
+
+    // Reads until EAGAIN or until the client has too much in flight; false on a fatal error
+    bool readInput(IoThread& io, Connection& conn) {
+        while (wantsInput(conn)) {
+            ssize_t received = recv(conn.fd, io.readBuffer.data(), io.readBuffer.size(), 0);
+            if (received > 0) {
+                ServerMetrics::recordBytesIn(static_cast<uint64_t>(received));
+                for (Request& request : conn.assembler.feed(io.readBuffer.data(), received)) {
+                    conn.backlog.push_back(move(request));
+                }
+                pumpBacklog(io, conn);
+                if (conn.assembler.failed()) {
+                    Logger::log(LOG_WARN, "disconnected", "Closing connection after protocol error", conn.label);
+                    return false;
+                }
+                continue;
+            }
+            if (received == 0) {
+                conn.peerClosed = true;
+                return true;
+            }
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        return true;
+    }
+
+    void drainCompletions(IoThread& io) {
+        uint64_t counter;
+        ssize_t ignored = read(io.wakeFd, &counter, sizeof(counter));
+        (void)ignored;
+        vector<Completion> ready;
+        {
+            lock_guard<mutex> lock(io.completionMutex);
+            ready.swap(io.completions);
+        }
+        for (Completion& completion : ready) {
+            auto it = io.connections.find(completion.connectionId);
+            if (it == io.connections.end() || it->second->closed) {
+                continue; // client left before its reply was ready
+            }
+            Connection& conn = *it->second;
+            conn.finishedReplies.emplace(completion.sequence, move(completion.reply));
+            releaseReplies(conn);
+            pumpBacklog(io, conn);
+        }
+        for (Completion& completion : ready) {
+            auto it = io.connections.find(completion.connectionId);
+            if (it != io.connections.end() && !it->second->closed && !flushOutput(io, *it->second)) {
+                closeConnection(io, *it->second);
+            }
+        }
+    }
+
+    void runIoThread(IoThread& io) {
+        vector<struct epoll_event> events(256);
+        auto lastReport = chrono::steady_clock::now();
+        while (running) {
+            int ready = epoll_wait(io.epollFd, events.data(), static_cast<int>(events.size()), 500);
+            if (ready == -1) {
+                if (errno == EINTR) continue;
+                Logger::log(LOG_ERROR, "epoll_failed", string("epoll_wait failed: ") + strerror(errno));
+                break;
+            }
+            for (int i = 0; i < ready; i++) {
+                if (events[i].data.ptr == nullptr) {
+                    acceptConnections(io);
+                    continue;
+                }
+                if (events[i].data.ptr == &io) {
+                    drainCompletions(io);
+                    continue;
+                }
+                Connection& conn = *static_cast<Connection*>(events[i].data.ptr);
+                if (conn.closed) continue;
+                uint32_t flags = events[i].events;
+                bool alive = !(flags & EPOLLERR) && !(conn.peerClosed && (flags & EPOLLHUP));
+                if (alive && (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+                    alive = readInput(io, conn);
+                }
+                if (alive) {
+                    alive = flushOutput(io, conn);
+                }
+                if (!alive) {
+                    closeConnection(io, conn);
+                }
+            }
+            freeClosedConnections(io);
+            if (&io == ioThreads.front().get() && chrono::steady_clock::now() - lastReport > chrono::seconds(30)) {
+                Logger::log(LOG_INFO, "queue", requestPool.metricsReport());
+                lastReport = chrono::steady_clock::now();
+            }
+        }
+    }
+
+public:
+    EpollServer(unsigned threadCount, unsigned workerCount)
+        : listenFd(-1), requestPool("requests", workerCount, REQUEST_QUEUE_CAPACITY), running(true) {
+        FileHandler::prepareImageDir();
+        UploadSessions::load();
+        FileHandler::loadStores();
+        raiseDescriptorLimit();
+        initializeSocket();
+        if (threadCount == 0) threadCount = 1;
+        for (unsigned i = 0; i < threadCount; i++) {
+            auto io = make_unique<IoThread>();
+            io->epollFd = epoll_create1(EPOLL_CLOEXEC);
+            io->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            io->readBuffer.resize(64 * 1024);
+            struct epoll_event listenEvent;
+            listenEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+            listenEvent.data.ptr = nullptr;
+            struct epoll_event wakeEvent;
+            wakeEvent.events = EPOLLIN;
+            wakeEvent.data.ptr = io.get();
+            if (io->epollFd == -1 || io->wakeFd == -1
+                || epoll_ctl(io->epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent) == -1
+                || epoll_ctl(io->epollFd, EPOLL_CTL_ADD, io->wakeFd, &wakeEvent) == -1) {
+                cerr << "epoll setup failed: " << strerror(errno) << endl;
+                exit(1);
+            }
+            ioThreads.push_back(move(io));
+        }
+        printServerBanner("epoll, " + to_string(threadCount) + " I/O threads, " + to_string(requestPool.threadCount()) + " workers");
+    }
+
+    ~EpollServer() {
+        running = false;
+        requestPool.shutdown();
+        for (auto& io : ioThreads) {
+            if (io->worker.joinable()) io->worker.join();
+            for (auto& entry : io->connections) {
+                close(entry.second->fd);
+            }
+            close(io->wakeFd);
+            close(io->epollFd);
+        }
+        close(listenFd);
+    }
+
+    void start() {
+        for (auto& io : ioThreads) {
+            IoThread* ioThread = io.get();
+            io->worker = thread([this, ioThread]() { runIoThread(*ioThread); });
+        }
+        for (auto& io : ioThreads) {
+            io->worker.join();
+        }
+    }
+};
+#endif
+
+// Offline benchmarks, run with: TCP_BMServer --bench <name> [args]
+class Benchmarks {
+private:
+    using Clock = chrono::steady_clock;
+
+    static double elapsedMicros(Clock::time_point start) {
+        return chrono::duration<double, micro>(Clock::now() - start).count();
+    }
+
+    // The pre-RecordStore lookup: reopen the file and scan it line by line
+    static bool legacyScanForId(int id, const string& filename) {
+        ifstream file(filename);
+        string line;
+        while (getline(file, line)) {
+            if (!line.empty()) {
+                istringstream iss(line);
+                int existingId;
+                if (iss >> existingId && existingId == id) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    static int legacyCountLines(const string& filename) {
+        ifstream file(filename);
+        int count = 0;
+        string line;
+        while (getline(file, line)) {
+            if (!line.empty()) count++;
+        }
+        return count;
+    }
+
+public:
+    static void recordStore(const vector<int>& sizes) {
+        const string filename = "bench_unstitched_dresses.txt";
+        mt19937 rng(42);
+        cout << left << setw(10) << "records" << setw(16) << "path" << setw(16) << "load (ms)"
+            << setw(18) << "lookup (us/op)" << setw(16) << "count (us/op)" << "\n";
+        for (int n : sizes) {
+            {
+                ofstream out(filename, ios::trunc);
+                for (int id = 1; id <= n; id++) {
+                    out << id << " Dress_" << id << " " << (1000 + id % 9000) << ".00 Red Chiffon Brand_" << (id % 50)
+                        << " S M L " << (900 + id % 8000) << ".00 44in High Straight 3m\n";
+                }
+            }
+            uniform_int_distribution<int> pick(1, n);
+
+            // Old path: every lookup rescans the file. Keep the op count small at large sizes.
+            int legacyOps = max(3, 200000 / n);
+            auto start = Clock::now();
+            int found = 0;
+            for (int i = 0; i < legacyOps; i++) found += legacyScanForId(pick(rng), filename);
+            double legacyLookup = elapsedMicros(start) / legacyOps;
+            start = Clock::now();
+            int legacyCount = legacyCountLines(filename);
+            double legacyCountTime = elapsedMicros(start);
+            cout << setw(10) << n << setw(16) << "file scan" << setw(16) << "-" << setw(18) << fixed << setprecision(2)
+                << legacyLookup << setw(16) << legacyCountTime << "\n";
+
+            // New path: load once, then hash lookups
+            RecordStore recordStore(filename, 0);
+            start = Clock::now();
+            recordStore.load();
+            double loadMs = elapsedMicros(start) / 1000.0;
+            const int storeOps = 1000000;
+            start = Clock::now();
+            for (int i = 0; i < storeOps; i++) found += recordStore.contains(pick(rng));
+            double storeLookup = elapsedMicros(start) / storeOps;
+            start = Clock::now();
+            size_t storeCount = 0;
+            for (int i = 0; i < storeOps; i++) storeCount += recordStore.count();
+            double storeCountTime = elapsedMicros(start) / storeOps;
+            cout << setw(10) << n << setw(16) << "record store" << setw(16) << loadMs << setw(18) << setprecision(4)
+                << storeLookup << setw(16) << storeCountTime << "\n";
+            if (legacyCount != static_cast<int>(recordStore.count()) || storeCount == 0 || found == 0) {
+                cout << "MISMATCH: file scan counted " << legacyCount << ", store holds " << recordStore.count() << "\n";
+            }
+        }
+        fs::remove(filename);
+    }
+
+    // Read throughput on one collection as threads are added: a single global mutex
+    // (the old fileMutex) against the per-collection shared locks, each measured with and
+    // without a writer appending to a different collection at the same time.
+    static void lockContention(unsigned maxThreads) {
+        const string readFile = "bench_customers.txt";
+        const string writeFile = "bench_orders.txt";
+        const int records = 100000;
+        {
+            ofstream out(readFile, ios::trunc);
+            for (int id = 1; id <= records; id++) {
+                out << id << " Customer " << id << " 30 0300" << id << " Street City State Country\n";
+            }
+        }
+        fs::remove(writeFile);
+        RecordStore readStore(readFile, 0);
+        RecordStore writeStore(writeFile, 1);
+        readStore.load();
+        writeStore.load();
+        mutex globalMutex;
+        const auto duration = chrono::milliseconds(300);
+
+        auto measure = [&](unsigned readers, bool useGlobal, bool withWriter) {
+            atomic<bool> stop{ false };
+            atomic<uint64_t> reads{ 0 };
+            vector<thread> threads;
+            for (unsigned t = 0; t < readers; t++) {
+                threads.emplace_back([&, t]() {
+                    mt19937 rng(t + 1);
+                    uniform_int_distribution<int> pick(1, records);
+                    uint64_t local = 0;
+                    while (!stop.load(memory_order_relaxed)) {
+                        for (int i = 0; i < 64; i++) {
+                            if (useGlobal) {
+                                lock_guard<mutex> lock(globalMutex);
+                                local += readStore.contains(pick(rng));
+                            }
+                            else {
+                                shared_lock<MeteredSharedMutex> lock(readStore.getMutex());
+                                local += readStore.contains(pick(rng));
+                            }
+                        }
+                    }
+                    reads.fetch_add(local);
+                });
+            }
+            if (withWriter) {
+                threads.emplace_back([&]() {
+                    int nextId = static_cast<int>(writeStore.count()) + 1;
+                    while (!stop.load(memory_order_relaxed)) {
+                        if (useGlobal) {
+                            lock_guard<mutex> lock(globalMutex);
+                            writeStore.append(nextId, to_string(nextId) + " 1 1 S 1 100.00");
+                        }
+                        else {
+                            unique_lock<MeteredSharedMutex> lock(writeStore.getMutex());
+                            writeStore.append(nextId, to_string(nextId) + " 1 1 S 1 100.00");
+                        }
+                        nextId++;
+                    }
+                });
+            }
+            this_thread::sleep_for(duration);
+            stop = true;
+            for (auto& t : threads) t.join();
+            return reads.load() / chrono::duration<double>(duration).count() / 1e6;
+        };
+
+        cout << "Lookups on one collection, millions/sec (" << thread::hardware_concurrency() << " hardware threads)\n";
+        cout << left << setw(10) << "readers" << setw(16) << "global mutex" << setw(22) << "global + writer"
+            << setw(16) << "per-collection" << setw(22) << "per-collection + writer" << "\n";
+        for (unsigned readers = 1; readers <= maxThreads; readers *= 2) {
+            cout << setw(10) << readers << fixed << setprecision(2)
+                << setw(16) << measure(readers, true, false)
+                << setw(22) << measure(readers, true, true)
+                << setw(16) << measure(readers, false, false)
+                << setw(22) << measure(readers, false, true) << "\n";
+        }
+        fs::remove(readFile);
+        fs::remove(writeFile);
+    }
+
+    // PROCESS_ORDER throughput for each durability mode, with concurrent clients placing
+    // orders. Runs in a scratch directory so the real record files are untouched.
+    static void durability(unsigned clients, int ordersPerClient, int groupMillis) {
+        fs::path original = fs::current_path();
+        fs::path scratch = fs::temp_directory_path() / "boutique_wal_bench";
+        fs::remove_all(scratch);
+        fs::create_directories(scratch);
+        fs::current_path(scratch);
+        FileHandler::loadStores();
+        FileHandler::addRecord(1, "customers.txt", "1 Bench Customer 30 0300 Street City State Country");
+        FileHandler::addRecord(1, "stitched_dresses.txt", "1 Bench_Dress 1500.00 Red Silk Brand S M L 1200.00 a b c d");
+        atomic<int> nextOrderId{ 1 };
+
+        cout << clients << " clients x " << ordersPerClient << " orders\n";
+        cout << left << setw(14) << "mode" << setw(16) << "orders/sec" << "avg latency (us)\n";
+        for (DurabilityMode mode : { DurabilityMode::SYNC, DurabilityMode::GROUP, DurabilityMode::ASYNC }) {
+            FileHandler::configureDurability(mode, groupMillis);
+            atomic<int> failures{ 0 };
+            auto start = Clock::now();
+            vector<thread> threads;
+            for (unsigned c = 0; c < clients; c++) {
+                threads.emplace_back([&]() {
+                    for (int i = 0; i < ordersPerClient; i++) {
+                        string order = to_string(nextOrderId++) + " 1 1 S 1";
+                        if (OrderManager::handleOrder(PROCESS_ORDER, order).compare(0, 7, "SUCCESS") != 0) failures++;
+                    }
+                });
+            }
+            for (auto& t : threads) t.join();
+            double seconds = elapsedMicros(start) / 1e6;
+            double total = static_cast<double>(clients) * ordersPerClient;
+            string label = WriteAheadLog::modeName(mode) + (mode == DurabilityMode::SYNC ? "" : " " + to_string(groupMillis) + "ms");
+            cout << setw(14) << label << setw(16) << fixed << setprecision(0) << total / seconds
+                << setprecision(1) << seconds * 1e6 / ordersPerClient << "\n";
+            if (failures > 0) cout << "  " << failures << " orders failed\n";
+        }
+        FileHandler::configureDurability(DurabilityMode::SYNC, 0);
+        fs::current_path(original);
+        fs::remove_all(scratch);
+    }
+
+    // Size and scan speed of the text dress catalog against the binary columnar one. The
+    // scan sums actual prices and counts red dresses, once by tokenizing every line the
+    // way handleUnstitchedDress does and once straight from the mapped columns.
+    static void catalogFormat(int rows) {
+        const string textPath = "bench_catalog.txt";
+        const string binaryPath = "bench_catalog.bmcat";
+        const string roundTripPath = "bench_catalog_roundtrip.txt";
+        const char* colors[] = { "Red", "Blue", "Green", "Black", "White", "Maroon", "Pink", "Gold" };
+        const char* materials[] = { "Chiffon", "Lawn", "Silk", "Cotton", "Khaddar", "Organza" };
+        {
+            ofstream out(textPath, ios::binary | ios::trunc);
+            out << fixed << setprecision(2);
+            for (int id = 1; id <= rows; id++) {
+                out << id << " Dress_" << id << " " << float(1000 + id % 9000) << " " << colors[id % 8] << " "
+                    << materials[id % 6] << " Brand_" << (id % 40) << " S M L " << float(900 + id % 8000)
+                    << " 44in High Straight 3m\n";
+            }
+        }
+        string error;
+        auto start = Clock::now();
+        if (!CatalogFormat::textToBinary(textPath, binaryPath, error)) {
+            cout << "Conversion failed: " << error << "\n";
+            return;
+        }
+        double convertMs = elapsedMicros(start) / 1000.0;
+
+        start = Clock::now();
+        double textSum = 0;
+        size_t textRed = 0;
+        {
+            ifstream in(textPath);
+            string line;
+            while (getline(in, line)) {
+                istringstream iss(line);
+                int id;
+                string name, color, material, brand, size1, size2, size3, fabricWidth, dyeStability, fabricCutType, totalFabricLength;
+                float actualPrice, discountedPrice;
+                if (iss >> id >> name >> actualPrice >> color >> material >> brand >> size1 >> size2 >> size3 >> discountedPrice
+                    >> fabricWidth >> dyeStability >> fabricCutType >> totalFabricLength) {
+                    textSum += actualPrice;
+                    textRed += color == "Red";
+                }
+            }
+        }
+        double textMs = elapsedMicros(start) / 1000.0;
+
+        start = Clock::now();
+        CatalogView view;
+        if (!view.open(binaryPath, error)) {
+            cout << "Open failed: " << error << "\n";
+            return;
+        }
+        double binarySum = 0;
+        size_t binaryRed = 0;
+        const float* prices = view.actualPriceColumn();
+        for (size_t row = 0; row < view.rows(); row++) {
+            binarySum += prices[row];
+        }
+        // Colors have few distinct values, so their codes are one byte per row
+        uint32_t red = view.lookupCode(1, "Red");
+        if (view.column(1).codeWidth == 1) {
+            const uint8_t* colorCodes = static_cast<const uint8_t*>(view.codeColumn(1));
+            for (size_t row = 0; row < view.rows(); row++) binaryRed += red != 0 && colorCodes[row] == red;
+        }
+        else {
+            for (size_t row = 0; row < view.rows(); row++) binaryRed += red != 0 && view.code(1, row) == red;
+        }
+        double binaryMs = elapsedMicros(start) / 1000.0;
+
+        view.toText(roundTripPath, error);
+        bool identical = fs::file_size(roundTripPath) == fs::file_size(textPath);
+        if (identical) {
+            ifstream a(textPath, ios::binary), b(roundTripPath, ios::binary);
+            identical = equal(istreambuf_iterator<char>(a), istreambuf_iterator<char>(), istreambuf_iterator<char>(b));
+        }
+
+        cout << rows << " rows, converted in " << fixed << setprecision(1) << convertMs << " ms\n";
+        cout << left << setw(10) << "format" << setw(14) << "size (KB)" << setw(14) << "scan (ms)" << "rows/sec\n";
+        cout << setw(10) << "text" << setw(14) << fs::file_size(textPath) / 1024.0 << setw(14) << setprecision(2) << textMs
+            << setprecision(0) << rows / (textMs / 1000.0) << "\n";
+        cout << setw(10) << "binary" << setw(14) << setprecision(1) << fs::file_size(binaryPath) / 1024.0 << setw(14)
+            << setprecision(2) << binaryMs << setprecision(0) << rows / (binaryMs / 1000.0) << "\n";
+        cout << "Results match: " << (textRed == binaryRed && abs(textSum - binarySum) < 1e-3 * textSum ? "yes" : "NO")
+            << ", text round trip identical: " << (identical ? "yes" : "NO") << "\n";
+        view.close();
+        fs::remove(textPath);
+        fs::remove(binaryPath);
+        fs::remove(roundTripPath);
+    }
+
+    // The pre-Reply VIEW path: copy the store into one string, reparse it into a numbered
+    // listing, then copy that into a frame
+    static string legacyView(const RecordSnapshot& records, const string& title) {
+        string content;
+        for (size_t i = 0; i < records.count(); i++) {
+            content += records[i] + "\n";
+        }
+        string result = DataFormatter::listingHeader(title);
+        istringstream iss(content);
+        string line;
+        int count = 1;
+        while (getline(iss, line)) {
+            if (!line.empty()) {
+                result += to_string(count++) + ". " + line + "\n";
+            }
+        }
+        result += DataFormatter::listingFooter();
+        return encodeFrame(DATA_RESPONSE, 1, result);
+    }
+
+    static void viewReplies(const vector<int>& sizes) {
+#ifdef _WIN32
+        cout << "The view benchmark needs socketpair() and is not available on Windows\n";
+#else
+        const string filename = "bench_orders.txt";
+        cout << left << setw(10) << "records" << setw(12) << "path" << setw(14) << "reply (KB)" << setw(12) << "time (ms)" << "MB/s\n";
+        for (int records : sizes) {
+            {
+                ofstream out(filename, ios::trunc);
+                for (int id = 1; id <= records; id++) {
+                    out << id << " " << (id % 500) << " " << (id % 700) << " S 2 " << id * 3 << ".00\n";
+                }
+            }
+            RecordStore store(filename, 0);
+            store.load();
+            RecordSnapshot snapshot = store.snapshot();
+
+            int sockets[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+                cout << "socketpair failed\n";
+                return;
+            }
+            atomic<size_t> drained(0);
+            thread reader([&]() {
+                vector<char> buffer(1 << 20);
+                ssize_t received;
+                while ((received = recv(sockets[1], buffer.data(), buffer.size(), 0)) > 0) {
+                    drained += static_cast<size_t>(received);
+                }
+            });
+            auto waitDrained = [&](size_t bytes) {
+                while (drained.load() < bytes) this_thread::yield();
+            };
+
+            size_t expected = 0;
+            auto start = Clock::now();
+            {
+                string reply = legacyView(snapshot, "ORDERS");
+                sendAll(sockets[0], reply.data(), reply.size());
+                expected += reply.size();
+                waitDrained(expected);
+                double ms = elapsedMicros(start) / 1000.0;
+                // The store copy, the listing and the frame are all alive at once
+                size_t held = snapshot.bytes(0, snapshot.count()) + snapshot.count() + 2 * reply.size();
+                cout << setw(10) << records << setw(12) << "string" << fixed << setprecision(0) << setw(14) << held / 1024.0
+                    << setprecision(2) << setw(12) << ms << setprecision(0) << reply.size() / ms / 1000.0 << "\n";
+            }
+
+            start = Clock::now();
+            string head = DataFormatter::listingHeader("ORDERS");
+            Reply reply = Reply::listing(head, snapshot, 0, snapshot.count(), DataFormatter::listingFooter());
+            size_t size = reply.size();
+            sendReply(sockets[0], reply);
+            expected += size;
+            waitDrained(expected);
+            double ms = elapsedMicros(start) / 1000.0;
+            size_t held = head.size() + (MAX_SEND_SLICES / 3 + 1) * 24 + (snapshot.count() / RECORD_BLOCK_SIZE + 1) * sizeof(void*);
+            cout << setw(10) << records << setw(12) << "streamed" << setprecision(0) << setw(14) << held / 1024.0
+                << setprecision(2) << setw(12) << ms << setprecision(0) << size / ms / 1000.0 << "\n";
+
+            shutdown(sockets[0], SHUT_WR);
+            reader.join();
+            close(sockets[0]);
+            close(sockets[1]);
+        }
+        fs::remove(filename);
+#endif
+    }
+    // The original byte-at-a-time codec, kept as the reference for the base64 benchmark
+    static string legacyBase64Encode(const string& in) {
+        string out;
+        int val = 0, valb = -6;
+        for (unsigned char c : in) {
+            val = (val << 8) + c;
+            valb += 8;
+            while (valb >= 0) {
+                out.push_back("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[(val >> valb) & 0x3F]);
+                valb -= 6;
+            }
+        }
+        if (valb > -6) out.push_back("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[((val << 8) >> (valb + 8)) & 0x3F]);
+        while (out.size() % 4) out.push_back('=');
+        return out;
+    }
+
+    static string legacyBase64Decode(const string& in) {
+        string out;
+        vector<int> T(256, -1);
+        for (int i = 0; i < 64; i++) T["ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[i]] = i;
+        int val = 0, valb = -8;
+        for (unsigned char c : in) {
+            if (T[c] == -1) break;
+            val = (val << 6) + T[c];
+            valb += 6;
+            if (valb >= 0) {
+                out.push_back(char((val >> valb) & 0xFF));
+                valb -= 8;
+            }
+        }
+        return out;
+    }
+
+    // Runs every codec path over random and damaged inputs and compares with the legacy codec
+    static bool base64Correctness(const vector<Base64Path>& paths) {
+        mt19937 rng(7);
+        size_t cases = 0, failures = 0;
+        auto check = [&](const string& encoded) {
+            string expected = legacyBase64Decode(encoded);
+            for (Base64Path path : paths) {
+                cases++;
+                if (base64_decode(encoded, path) != expected) {
+                    failures++;
+                    if (failures <= 5) cout << "  decode mismatch (" << base64PathName(path) << ", " << encoded.size() << " chars)\n";
+                }
+            }
+        };
+        for (int round = 0; round < 4000; round++) {
+            size_t length = round < 300 ? round : rng() % 5000;
+            string data(length, '\0');
+            for (char& c : data) c = static_cast<char>(rng());
+            string expected = legacyBase64Encode(data);
+            for (Base64Path path : paths) {
+                cases++;
+                if (base64_encode(data, path) != expected) {
+                    failures++;
+                    if (failures <= 5) cout << "  encode mismatch (" << base64PathName(path) << ", " << length << " bytes)\n";
+                }
+            }
+            check(expected);
+            if (expected.empty()) continue;
+            // Decoding stops at the first character outside the alphabet, wherever it is
+            string damaged = expected;
+            damaged[rng() % damaged.size()] = "=\n -*\x80"[rng() % 6];
+            check(damaged);
+            check(expected.substr(0, rng() % expected.size()));
+        }
+        cout << "Correctness: " << cases << " cases against the legacy codec, " << failures << " mismatches\n";
+        return failures == 0;
+    }
+
+    static void base64Codec() {
+        vector<Base64Path> paths = { Base64Path::SCALAR };
+        if (base64PathSupported(Base64Path::SSE41)) paths.push_back(Base64Path::SSE41);
+        if (base64PathSupported(Base64Path::AVX2)) paths.push_back(Base64Path::AVX2);
+        cout << "Best path on this CPU: " << base64PathName(base64BestPath()) << "\n";
+        if (!base64Correctness(paths)) {
+            return;
+        }
+        mt19937 rng(11);
+        cout << left << setw(10) << "size" << setw(10) << "codec" << setw(16) << "encode (GB/s)" << "decode (GB/s)\n";
+        for (size_t size = 1024; size <= 64u * 1024 * 1024; size *= 4) {
+            string data(size, '\0');
+            for (char& c : data) c = static_cast<char>(rng());
+            string encoded = base64_encode(data);
+            // Enough repetitions to move at least 256 MB through each codec
+            int repeats = static_cast<int>(max<size_t>(1, (256u << 20) / size));
+            auto measure = [&](const function<size_t()>& run) {
+                volatile size_t sink = 0;
+                auto start = Clock::now();
+                for (int r = 0; r < repeats; r++) sink = sink + run();
+                double seconds = elapsedMicros(start) / 1e6;
+                return static_cast<double>(size) * repeats / seconds / 1e9;
+            };
+            string label = size >= 1024 * 1024 ? to_string(size >> 20) + " MB" : to_string(size >> 10) + " KB";
+            // The legacy codec is slow enough that a quarter of the repetitions gives a stable figure
+            int fullRepeats = repeats;
+            repeats = max(1, repeats / 4);
+            double legacyEncode = measure([&]() { return legacyBase64Encode(data).size(); });
+            double legacyDecode = measure([&]() { return legacyBase64Decode(encoded).size(); });
+            repeats = fullRepeats;
+            cout << setw(10) << label << setw(10) << "legacy" << fixed << setprecision(3) << setw(16) << legacyEncode << legacyDecode << "\n";
+            for (Base64Path path : paths) {
+                double encodeRate = measure([&]() { return base64_encode(data, path).size(); });
+                double decodeRate = measure([&]() { return base64_decode(encoded, path).size(); });
+                cout << setw(10) << label << setw(10) << base64PathName(path) << setw(16) << encodeRate << decodeRate << "\n";
+            }
+        }
+    }
+
+    // Bytes the image directory really occupies: every file once, however many names it has
+    static uint64_t imageDirBytes() {
+        set<pair<uint64_t, uint64_t>> seen;
+        uint64_t total = 0;
+        error_code ec;
+        for (const auto& entry : fs::recursive_directory_iterator(IMAGE_DIR, ec)) {
+            FileIdentity identity;
+            if (entry.is_regular_file(ec) && fileIdentity(entry.path().string(), identity)
+                && seen.insert(make_pair(identity.device, identity.file)).second) {
+                total += entry.file_size(ec);
+            }
+        }
+        return total;
+    }
+
+    // Uploads a corpus in which most images are re-uploads of the same product photos under
+    // new names: once the way images were stored before (every upload written to its own
+    // file), once through the content-addressed store, and once with the client asking
+    // LINK_IMAGE first so duplicates are never sent at all. Latency covers everything the
+    // server does for the upload, plus hashing on the client for the LINK_IMAGE case.
+    static void imageDedupe(int uploads, int distinct) {
+        fs::path original = fs::current_path();
+        fs::path scratch = fs::temp_directory_path() / "boutique_dedupe_bench";
+        fs::remove_all(scratch);
+        fs::create_directories(scratch);
+        fs::current_path(scratch);
+        mt19937 rng(14);
+        vector<string> corpus(distinct);
+        uint64_t corpusBytes = 0;
+        for (string& image : corpus) {
+            image.resize(64 * 1024 + rng() % (2 * 1024 * 1024));
+            for (char& c : image) c = static_cast<char>(rng());
+            corpusBytes += image.size();
+        }
+        vector<int> sequence(uploads);
+        for (int& pick : sequence) pick = static_cast<int>(rng() % distinct);
+        cout << uploads << " uploads of " << distinct << " distinct images (" << corpusBytes / (1024 * 1024) << " MB of distinct content)\n";
+        cout << left << setw(22) << "store" << setw(12) << "disk (MB)" << setw(12) << "sent (MB)" << setw(16) << "new avg (us)"
+            << setw(16) << "dup avg (us)" << "p99 (us)\n";
+
+        auto upload = [](const string& name, const string& data) {
+            ImageUpload body;
+            string prefix = name + "|";
+            body.write(prefix.data(), prefix.size());
+            body.write(data.data(), data.size());
+            return body.finish() && body.commit();
+        };
+        for (int mode = 0; mode < 3; mode++) {
+            fs::remove_all(IMAGE_DIR);
+            FileHandler::prepareImageDir();
+            vector<double> latencies;
+            double newMicros = 0, duplicateMicros = 0;
+            int newUploads = 0;
+            vector<bool> uploaded(distinct, false);
+            uint64_t sentBytes = 0;
+            int failures = 0;
+            for (int i = 0; i < uploads; i++) {
+                const string& data = corpus[sequence[i]];
+                string name = "photo_" + to_string(i) + ".jpg";
+                auto start = Clock::now();
+                bool ok = true;
+                if (mode == 0) {
+                    // Before: write, sync and rename every upload, duplicate or not
+                    string tempPath = IMAGE_DIR + ".upload-bench.tmp";
+                    FILE* file = fopen(tempPath.c_str(), "wb");
+                    ok = file != nullptr && fwrite(data.data(), 1, data.size(), file) == data.size() && syncFile(file);
+                    if (file != nullptr) fclose(file);
+                    error_code ec;
+                    fs::rename(tempPath, IMAGE_DIR + name, ec);
+                    sentBytes += data.size();
+                }
+                else if (mode == 1) {
+                    ok = upload(name, data);
+                    sentBytes += data.size();
+                }
+                else {
+                    uint64_t size = 0;
+                    if (!FileHandler::linkExistingImage(name, sha256Hex(data.data(), data.size()), size)) {
+                        ok = upload(name, data);
+                        sentBytes += data.size();
+                    }
+                }
+                double micros = elapsedMicros(start);
+                latencies.push_back(micros);
+                if (uploaded[sequence[i]]) {
+                    duplicateMicros += micros;
+                }
+                else {
+                    newMicros += micros;
+                    newUploads++;
+                    uploaded[sequence[i]] = true;
+                }
+                if (!ok) failures++;
+            }
+            sort(latencies.begin(), latencies.end());
+            int duplicateUploads = uploads - newUploads;
+            const char* labels[] = { "overwrite (before)", "content-addressed", "link probe + upload" };
+            cout << setw(22) << labels[mode] << fixed << setprecision(1) << setw(12) << imageDirBytes() / 1048576.0
+                << setw(12) << sentBytes / 1048576.0 << setprecision(0) << setw(16) << newMicros / max(1, newUploads)
+                << setw(16) << duplicateMicros / max(1, duplicateUploads) << latencies[latencies.size() * 99 / 100] << "\n";
+            if (failures > 0) cout << "  " << failures << " uploads failed\n";
+        }
+        cout << FileHandler::imageStoreStats() << "\n";
+        fs::current_path(original);
+        fs::remove_all(scratch);
+    }
+
+    // FILTER at catalog scale: index build on load, index upkeep per insert, and query time for
+    // a few query shapes through DressIndex against checking every record line by line
+    static void dressFilter(int dresses) {
+        const string filename = "bench_stitched_dresses.txt";
+        const char* colors[] = { "Red", "Maroon", "Black", "White", "Navy", "Green", "Pink", "Gold", "Silver", "Peach",
+            "Beige", "Teal", "Purple", "Mustard", "Grey", "Blue", "Orange", "Ivory", "Mint", "Rust" };
+        const char* materials[] = { "Chiffon", "Silk", "Cotton", "Lawn", "Velvet", "Organza", "Linen", "Georgette", "Satin", "Khaddar" };
+        const char* sizes[] = { "XS", "S", "M", "L", "XL", "XXL" };
+        mt19937 rng(7);
+        uniform_int_distribution<int> cents(50000, 2000000);
+        auto dressLine = [&](int id) {
+            float actual = cents(rng) / 100.0f;
+            float discounted = actual * (0.6f + (rng() % 40) / 100.0f);
+            ostringstream line;
+            line << id << " Dress_" << id << " " << fixed << setprecision(2) << actual << " " << colors[rng() % 20] << " "
+                << materials[rng() % 10] << " Brand_" << rng() % 50 << " " << sizes[rng() % 6] << " " << sizes[rng() % 6]
+                << " " << sizes[rng() % 6] << " " << discounted << " Formal Embroidered Regular Full";
+            return line.str();
+        };
+        {
+            ofstream out(filename, ios::trunc);
+            for (int id = 1; id <= dresses; id++) out << dressLine(id) << "\n";
+        }
+        RecordStore plain(filename, 0);
+        auto start = Clock::now();
+        plain.load();
+        double plainLoad = elapsedMicros(start) / 1000.0;
+        RecordStore indexed(filename, 0);
+        indexed.indexDresses();
+        start = Clock::now();
+        indexed.load();
+        double indexedLoad = elapsedMicros(start) / 1000.0;
+        cout << dresses << " dresses: load " << fixed << setprecision(1) << plainLoad << " ms, with indexes " << indexedLoad << " ms\n";
+
+        const int appends = 20000;
+        DressIndex grown;
+        RecordSnapshot records = indexed.snapshot();
+        for (size_t position = 0; position < records.count(); position++) grown.add(records[position]);
+        vector<string> added;
+        for (int i = 0; i < appends; i++) added.push_back(dressLine(dresses + 1 + i));
+        start = Clock::now();
+        for (const string& line : added) grown.add(line);
+        cout << "Index upkeep per ADD: " << setprecision(2) << elapsedMicros(start) / appends << " us\n\n";
+
+        // What answering without indexes costs: parse and test every record
+        auto scan = [&](const DressIndex::Query& query) {
+            size_t matched = 0;
+            auto anyOf = [](const vector<string>& wanted, string value) {
+                if (wanted.empty()) return true;
+                for (char& c : value) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+                return find(wanted.begin(), wanted.end(), value) != wanted.end();
+            };
+            for (size_t position = 0; position < records.count(); position++) {
+                istringstream iss(records[position]);
+                string id, name, color, material, brand, size1, size2, size3;
+                float actual, discounted;
+                if (!(iss >> id >> name >> actual >> color >> material >> brand >> size1 >> size2 >> size3 >> discounted)) continue;
+                bool sized = query.sizes.empty() || anyOf(query.sizes, size1) || anyOf(query.sizes, size2) || anyOf(query.sizes, size3);
+                if (anyOf(query.colors, color) && anyOf(query.materials, material) && anyOf(query.brands, brand) && sized
+                    && actual >= query.minPrice && actual <= query.maxPrice
+                    && discounted >= query.minDiscounted && discounted <= query.maxDiscounted) {
+                    matched++;
+                }
+            }
+            return matched;
+        };
+        struct Shape {
+            const char* label;
+            DressIndex::Query query;
+        };
+        vector<Shape> shapes(6);
+        shapes[0].label = "color=red";
+        shapes[0].query.colors = { "red" };
+        shapes[1].label = "color=red material=chiffon maxPrice=5000";
+        shapes[1].query.colors = { "red" };
+        shapes[1].query.materials = { "chiffon" };
+        shapes[1].query.maxPrice = 5000;
+        shapes[2].label = "brand=brand_7 size=xl,xxl color=navy";
+        shapes[2].query.brands = { "brand_7" };
+        shapes[2].query.sizes = { "xl", "xxl" };
+        shapes[2].query.colors = { "navy" };
+        shapes[3].label = "minPrice=1000 maxPrice=1010";
+        shapes[3].query.minPrice = 1000;
+        shapes[3].query.maxPrice = 1010;
+        shapes[4].label = "maxDiscounted=1000 material=silk";
+        shapes[4].query.maxDiscounted = 1000;
+        shapes[4].query.materials = { "silk" };
+        shapes[5].label = "minPrice=15000";
+        shapes[5].query.minPrice = 15000;
+        cout << left << setw(44) << "query" << setw(10) << "matches" << setw(16) << "index (us)" << "scan (ms)\n";
+        for (const Shape& shape : shapes) {
+            const int rounds = 50;
+            size_t matched = 0;
+            start = Clock::now();
+            for (int i = 0; i < rounds; i++) matched = indexed.dressIndex()->match(shape.query).size();
+            double indexMicros = elapsedMicros(start) / rounds;
+            start = Clock::now();
+            size_t scanned = scan(shape.query);
+            double scanMs = elapsedMicros(start) / 1000.0;
+            cout << setw(44) << shape.label << setw(10) << matched << setw(16) << setprecision(1) << indexMicros << scanMs << "\n";
+            if (scanned != matched) {
+                cout << "MISMATCH: scan found " << scanned << "\n";
+            }
+        }
+        fs::remove(filename);
+    }
+
+    // SEARCH_TEXT at catalog scale: load time with and without the customer text index, posting
+    // memory compressed and as plain positions, and query time for clean and misspelt queries
+    // against scoring every record. The top hits of both must agree.
+    static void textSearch(int customers) {
+        const string filename = "bench_customers.txt";
+        const char* firstNames[] = { "Ayesha", "Fatima", "Zainab", "Maryam", "Hira", "Sana", "Amna", "Mahnoor", "Iqra", "Sadia",
+            "Ali", "Ahmed", "Hassan", "Usman", "Bilal", "Hamza", "Omar", "Imran", "Kamran", "Faisal", "Nadia", "Rabia", "Saima",
+            "Farah", "Kiran", "Uzma", "Asma", "Bushra", "Noor", "Sidra", "Areeba", "Anum", "Javeria", "Mehwish", "Sobia", "Tahira" };
+        const char* lastNames[] = { "Khan", "Ahmed", "Malik", "Qureshi", "Siddiqui", "Butt", "Chaudhry", "Sheikh", "Raza", "Hussain",
+            "Iqbal", "Mirza", "Javed", "Anwar", "Aslam", "Baig", "Haider", "Abbasi", "Rana", "Awan", "Bhatti", "Naqvi", "Rizvi", "Zaidi" };
+        const char* streets[] = { "Gulberg", "Model_Town", "Clifton", "Defence", "Johar_Town", "Bahria_Town", "Saddar", "Cantt",
+            "Garden_Town", "Faisal_Town", "Wapda_Town", "Iqbal_Town", "Satellite_Town", "Blue_Area", "Township", "Shadman" };
+        const char* cities[] = { "Lahore", "Karachi", "Islamabad", "Rawalpindi", "Faisalabad", "Multan", "Peshawar", "Quetta",
+            "Sialkot", "Gujranwala", "Hyderabad", "Abbottabad" };
+        mt19937 rng(11);
+        {
+            ofstream out(filename, ios::trunc);
+            for (int id = 1; id <= customers; id++) {
+                out << id << " " << firstNames[rng() % 36] << "_" << lastNames[rng() % 24] << " " << 18 + rng() % 60 << " 03"
+                    << 100000000 + rng() % 900000000 << " House_" << 1 + rng() % 500 << "_" << streets[rng() % 16] << " "
+                    << cities[rng() % 12] << " Punjab Pakistan\n";
+            }
+        }
+        RecordStore plain(filename, 0);
+        auto start = Clock::now();
+        plain.load();
+        double plainLoad = elapsedMicros(start) / 1000.0;
+        RecordStore indexed(filename, 0);
+        indexed.indexText(&TextIndex::customerText);
+        start = Clock::now();
+        indexed.load();
+        double indexedLoad = elapsedMicros(start) / 1000.0;
+        size_t compressed, uncompressed;
+        indexed.textIndex()->memory(compressed, uncompressed);
+        cout << customers << " customers: load " << fixed << setprecision(1) << plainLoad << " ms, with text index " << indexedLoad
+            << " ms; postings " << compressed / 1048576.0 << " MB (" << uncompressed / 1048576.0 << " MB as 32-bit positions)\n\n";
+
+        RecordSnapshot records = indexed.snapshot();
+        const size_t limit = 10;
+        // Every record scored the way TextIndex ranks them
+        auto scan = [&](const string& query) {
+            vector<uint32_t> grams = TextIndex::trigrams(query);
+            size_t minimum = max<size_t>(1, (grams.size() + 2) / 3);
+            vector<TextIndex::Hit> hits;
+            for (size_t position = 0; position < records.count(); position++) {
+                vector<uint32_t> own = TextIndex::trigrams(TextIndex::customerText(records[position]));
+                size_t shared = 0;
+                for (uint32_t gram : grams) shared += binary_search(own.begin(), own.end(), gram);
+                if (shared >= minimum) {
+                    hits.push_back({ static_cast<uint32_t>(position), static_cast<uint16_t>(shared), static_cast<uint16_t>(own.size()) });
+                }
+            }
+            sort(hits.begin(), hits.end(), [](const TextIndex::Hit& a, const TextIndex::Hit& b) {
+                if (a.shared != b.shared) return a.shared > b.shared;
+                if (a.grams != b.grams) return a.grams < b.grams;
+                return a.position < b.position;
+            });
+            if (hits.size() > limit) hits.resize(limit);
+            return hits;
+        };
+        cout << left << setw(32) << "query" << setw(12) << "index (ms)" << setw(12) << "scan (ms)" << "best match\n";
+        for (const char* query : { "ayesha khan", "ayesha kahn", "mahnor siddiqui lahore", "faisal", "muhammad", "kamran rizvi gulberg karachi",
+                 "abotabad", "zainab" }) {
+            const int rounds = 20;
+            vector<TextIndex::Hit> hits;
+            start = Clock::now();
+            for (int i = 0; i < rounds; i++) hits = indexed.textIndex()->search(query, limit);
+            double indexMs = elapsedMicros(start) / 1000.0 / rounds;
+            start = Clock::now();
+            vector<TextIndex::Hit> scanned = scan(query);
+            double scanMs = elapsedMicros(start) / 1000.0;
+            string bestMatch = hits.empty() ? "-" : TextIndex::customerText(records[hits[0].position]);
+            cout << setw(32) << query << setw(12) << setprecision(2) << indexMs << setw(12) << setprecision(0) << scanMs
+                << bestMatch.substr(0, 40) << "\n";
+            bool same = hits.size() == scanned.size();
+            for (size_t i = 0; same && i < hits.size(); i++) {
+                same = hits[i].position == scanned[i].position && hits[i].shared == scanned[i].shared;
+            }
+            if (!same) {
+                cout << "MISMATCH: index and scan disagree on the top " << limit << "\n";
+            }
+        }
+        fs::remove(filename);
+    }
+
+    // Sales reports from the running order totals against a scan of orders.txt per report,
+    // the cost of keeping the totals (at load and per order), and the parallel rescan that
+    // verify and rebuild use, with its result checked against the running totals
+    static void salesReport(int orders) {
+        const string filename = "bench_orders.txt";
+        const int customers = max(1, orders / 10), dressesPerType = max(1, orders / 50);
+        mt19937 rng(13);
+        {
+            ofstream out(filename, ios::trunc);
+            for (int id = 1; id <= orders; id++) {
+                int quantity = 1 + rng() % 5;
+                out << id << " " << 1 + rng() % customers << " " << 1 + rng() % dressesPerType << " " << (rng() % 3 ? "S" : "U") << " "
+                    << quantity << " " << fixed << setprecision(2) << quantity * ((50000 + rng() % 1950000) / 100.0) << "\n";
+            }
+        }
+        RecordStore plain(filename, 0);
+        auto start = Clock::now();
+        plain.load();
+        double plainLoad = elapsedMicros(start) / 1000.0;
+        RecordStore aggregated(filename, 0);
+        aggregated.aggregateOrders();
+        start = Clock::now();
+        aggregated.load();
+        double aggregatedLoad = elapsedMicros(start) / 1000.0;
+        RecordSnapshot records = aggregated.snapshot();
+        OrderAggregates upkeep;
+        start = Clock::now();
+        for (size_t position = 0; position < records.count(); position++) upkeep.add(records[position]);
+        double perOrder = elapsedMicros(start) * 1000.0 / max<size_t>(1, records.count());
+        const OrderAggregates& sales = *aggregated.orderAggregates();
+        cout << orders << " orders, " << customers << " customers, " << 2 * dressesPerType << " dresses: load " << fixed
+            << setprecision(1) << plainLoad << " ms, with sales totals " << aggregatedLoad << " ms; " << perOrder
+            << " ns per order to keep the totals\n\n";
+
+        // What a report cost before the totals: read orders.txt and total every line by key
+        auto scan = [&](const function<int64_t(int, uint64_t)>& keyOf, size_t top, bool byUnits) {
+            unordered_map<int64_t, OrderAggregates::Totals> totals;
+            ifstream in(filename);
+            string line;
+            while (getline(in, line)) {
+                istringstream iss(line);
+                int id, customer, dress, quantity;
+                string type;
+                double price;
+                if (!(iss >> id >> customer >> dress >> type >> quantity >> price)) continue;
+                int64_t key = keyOf(customer, OrderAggregates::dressKey(type == "S" ? 'S' : 'U', dress));
+                if (key < 0) continue;
+                OrderAggregates::Totals& total = totals[key];
+                total.add({ 1, static_cast<uint64_t>(quantity), llround(price * 100) });
+            }
+            vector<pair<int64_t, int64_t>> ranked;
+            for (const auto& total : totals) {
+                ranked.push_back({ byUnits ? static_cast<int64_t>(total.second.units) : total.second.cents, total.first });
+            }
+            top = min(top, ranked.size());
+            partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(), OrderAggregates::Ranking<int64_t>());
+            ranked.resize(top);
+            return ranked;
+        };
+        auto indexed = [](const auto& ranking, size_t top) {
+            vector<pair<int64_t, int64_t>> ranked;
+            for (auto it = ranking.begin(); it != ranking.end() && ranked.size() < top; ++it) ranked.push_back({ it->first, it->second });
+            return ranked;
+        };
+        struct Report {
+            string name;
+            function<vector<pair<int64_t, int64_t>>()> fromTotals, fromScan;
+        };
+        uint64_t oneDress = OrderAggregates::dressKey('S', 1);
+        vector<Report> reports = {
+            { "summary", [&]() { return vector<pair<int64_t, int64_t>>{ { sales.all().cents, static_cast<int64_t>(sales.all().orders) } }; },
+              [&]() { return scan([](int, uint64_t) { return 0; }, 1, false); } },
+            { "types", [&]() { return vector<pair<int64_t, int64_t>>{ { sales.byType('S').cents, 'S' }, { sales.byType('U').cents, 'U' } }; },
+              [&]() { return scan([](int, uint64_t key) { return OrderAggregates::dressType(key); }, 2, false); } },
+            { "top-dresses 10", [&]() { return indexed(sales.dressesByRevenue(), 10); },
+              [&]() { return scan([](int, uint64_t key) { return static_cast<int64_t>(key); }, 10, false); } },
+            { "top-dresses 10 units", [&]() { return indexed(sales.dressesByUnits(), 10); },
+              [&]() { return scan([](int, uint64_t key) { return static_cast<int64_t>(key); }, 10, true); } },
+            { "top-customers 100", [&]() { return indexed(sales.customersByRevenue(), 100); },
+              [&]() { return scan([](int customer, uint64_t) { return customer; }, 100, false); } },
+            { "dress S 1", [&]() { return vector<pair<int64_t, int64_t>>{ { sales.dress('S', 1)->cents, static_cast<int64_t>(oneDress) } }; },
+              [&]() { return scan([&](int, uint64_t key) { return key == oneDress ? static_cast<int64_t>(key) : -1; }, 1, false); } },
+        };
+        cout << left << setw(24) << "report" << setw(16) << "totals (us)" << "scan (ms)\n";
+        for (const Report& report : reports) {
+            const int rounds = 1000;
+            vector<pair<int64_t, int64_t>> fromTotals;
+            start = Clock::now();
+            for (int i = 0; i < rounds; i++) fromTotals = report.fromTotals();
+            double totalsMicros = elapsedMicros(start) / rounds;
+            start = Clock::now();
+            vector<pair<int64_t, int64_t>> fromScan = report.fromScan();
+            double scanMs = elapsedMicros(start) / 1000.0;
+            // The summary scan keys every order to 0, so compare its revenue only
+            bool same = report.name == "summary" ? fromTotals[0].first == fromScan[0].first : fromTotals == fromScan;
+            cout << setw(24) << report.name << setw(16) << setprecision(2) << totalsMicros << setprecision(0) << scanMs
+                << (same ? "" : "   MISMATCH") << "\n";
+        }
+
+        cout << "\n" << left << setw(10) << "threads" << setw(14) << "rescan (ms)" << "matches running totals\n";
+        for (unsigned threads = 1; threads <= max(4u, thread::hardware_concurrency()); threads *= 2) {
+            start = Clock::now();
+            OrderAggregates rebuilt = OrderAggregates::rescan(records, records.count(), threads);
+            double rescanMs = elapsedMicros(start) / 1000.0;
+            cout << setw(10) << threads << setw(14) << setprecision(1) << rescanMs << (rebuilt == sales && rebuilt == upkeep ? "yes" : "NO")
+                << "\n";
+        }
+        fs::remove(filename);
+    }
+
+    // Cost of the telemetry on the request path, in nanoseconds per call, with every thread
+    // recording at once: the per-request timing and record, and a free storage lock taken
+    // through MeteredSharedMutex against a bare shared_mutex
+    static void metricsOverhead(unsigned maxThreads) {
+        const int calls = 2000000;
+        MeteredSharedMutex metered("bench");
+        shared_mutex bare;
+        auto perCall = [&](unsigned threads, const function<void(int, uint64_t&)>& body) {
+            vector<thread> workers;
+            atomic<uint64_t> sink{ 0 };
+            auto start = Clock::now();
+            for (unsigned t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    uint64_t local = t;
+                    for (int i = 0; i < calls; i++) body(i, local);
+                    sink.fetch_add(local);
+                });
+            }
+            for (auto& worker : workers) worker.join();
+            // Threads beyond the core count take turns, so only min(threads, cores) run at once
+            unsigned running = min(threads, max(1u, thread::hardware_concurrency()));
+            return elapsedMicros(start) * 1000.0 * running / (static_cast<double>(calls) * threads);
+        };
+        cout << "Telemetry cost, ns per call per thread (" << thread::hardware_concurrency() << " hardware threads)\n";
+        cout << left << setw(10) << "threads" << setw(16) << "record" << setw(22) << "timed request" << setw(20) << "metered lock" << "bare lock\n";
+        for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+            double record = perCall(threads, [](int i, uint64_t& local) {
+                ServerMetrics::recordRequest(SEARCH_CUSTOMER, 1000 + (i & 4095) * 97, false);
+                local += i;
+            });
+            // What serveRequest adds on a worker: one clock read and the record
+            auto jobStart = chrono::steady_clock::now();
+            double timed = perCall(threads, [&](int i, uint64_t& local) {
+                auto start = jobStart;
+                local += i;
+                uint64_t nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+                ServerMetrics::recordRequest(SEARCH_CUSTOMER, nanos, false);
+            });
+            double lockMetered = perCall(threads, [&](int i, uint64_t& local) {
+                shared_lock<MeteredSharedMutex> lock(metered);
+                local += i;
+            });
+            double lockBare = perCall(threads, [&](int i, uint64_t& local) {
+                shared_lock<shared_mutex> lock(bare);
+                local += i;
+            });
+            cout << setw(10) << threads << fixed << setprecision(1) << setw(16) << record << setw(22) << timed
+                << setw(20) << lockMetered << lockBare << "\n";
+        }
+    }
+
+    // Request-path cost of logging one request, in ns per request per thread: the old three
+    // cout lines ending in endl against one Logger::request record. Threads log in bursts of
+    // 256 with a pause after each, so the drain thread keeps up as it would at a real request
+    // rate; only the time spent in the logging calls is counted.
+    static void logging(unsigned maxThreads, int bursts) {
+        const int burst = 256;
+        fs::path scratch = fs::temp_directory_path() / "boutique_log_bench";
+        fs::remove_all(scratch);
+        fs::create_directories(scratch);
+        ofstream coutFile((scratch / "cout.txt").string());
+        if (!Logger::openFile((scratch / "async.jsonl").string())) {
+            cout << "Cannot open a log file in " << scratch << "\n";
+            return;
+        }
+        Logger::configure(LOG_INFO, 1);
+        auto perRequest = [&](unsigned threads, const function<void(const string&)>& logOne) {
+            vector<thread> workers;
+            atomic<uint64_t> loggingNanos{ 0 };
+            for (unsigned t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    string label = "127.0.0.1:" + to_string(50000 + t);
+                    uint64_t spent = 0;
+                    for (int b = 0; b < bursts; b++) {
+                        auto start = Clock::now();
+                        for (int i = 0; i < burst; i++) logOne(label);
+                        spent += chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+                        this_thread::sleep_for(chrono::milliseconds(5));
+                    }
+                    loggingNanos.fetch_add(spent);
+                });
+            }
+            for (auto& worker : workers) worker.join();
+            return loggingNanos.load() / (static_cast<double>(bursts) * burst * threads);
+        };
+        cout << bursts * burst << " requests per thread\n";
+        cout << left << setw(10) << "threads" << setw(20) << "cout + endl (ns)" << setw(20) << "async (ns)" << "dropped\n";
+        for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+            streambuf* original = cout.rdbuf(coutFile.rdbuf());
+            double synchronous = perRequest(threads, [](const string& label) {
+                cout << "[" << label << "] Request Type: " << SEARCH_CUSTOMER << endl;
+                cout << "[" << label << "] Response sent (" << 120 << " bytes)" << endl;
+                cout << "----------------------------\n";
+            });
+            cout.rdbuf(original);
+            auto end = chrono::steady_clock::now();
+            uint64_t droppedBefore = Logger::dropped();
+            double async = perRequest(threads, [end](const string& label) {
+                Logger::request(label, SEARCH_CUSTOMER, end, 12345, 120, false);
+            });
+            cout << setw(10) << threads << fixed << setprecision(1) << setw(20) << synchronous << setw(20) << async
+                << Logger::dropped() - droppedBefore << "\n";
+        }
+        Logger::flush();
+        fs::remove_all(scratch);
+    }
+
+    // Bulk insert of unstitched dresses through the request handlers, framing included:
+    // one ADD_UNSTITCHED_DRESS request per dress, then BATCH requests of batchSize dresses,
+    // plain and atomic. Durability is the server default (group commit), so every request
+    // waits for its log sync; network round trips come on top of the one-by-one figure.
+    static void batchInserts(int records, int batchSize) {
+        fs::path original = fs::current_path();
+        fs::path scratch = fs::temp_directory_path() / "boutique_batch_bench";
+        fs::remove_all(scratch);
+        fs::create_directories(scratch);
+        fs::current_path(scratch);
+        FileHandler::loadStores();
+        FileHandler::configureDurability(DurabilityMode::GROUP, 0);
+        auto dress = [](int id) {
+            return to_string(id) + " Lawn_Suit 4500.00 Blue Cotton Brand S M L 3999.00 44in Good Straight 3m";
+        };
+        auto request = [](int type, uint32_t requestId, string data, uint16_t flags) {
+            Request framed;
+            framed.framed = true;
+            framed.header.type = static_cast<uint16_t>(type);
+            framed.header.requestId = requestId;
+            framed.header.flags = flags;
+            framed.messageType = type;
+            framed.data = move(data);
+            return framed;
+        };
+        cout << records << " dresses, batches of " << batchSize << "\n";
+        cout << left << setw(20) << "mode" << setw(16) << "records/sec" << setw(20) << "avg request (us)" << "speedup\n";
+        int nextId = 1;
+        double baseline = 0;
+        for (int mode = 0; mode < 3; mode++) {
+            int failures = 0;
+            int requests = 0;
+            auto start = Clock::now();
+            if (mode == 0) {
+                for (int i = 0; i < records; i++, requests++) {
+                    Request add = request(ADD_UNSTITCHED_DRESS, i, dress(nextId++), 0);
+                    string reply = encodeResponse(add, RequestProcessor::processRequest(add.messageType, add.data));
+                    if (decodeFrameHeader(reply.data()).type != SUCCESS_RESPONSE) failures++;
+                }
+            }
+            else {
+                for (int i = 0; i < records; i += batchSize, requests++) {
+                    string payload;
+                    for (int k = i; k < min(records, i + batchSize); k++) payload += encodeFrame(ADD_UNSTITCHED_DRESS, k, dress(nextId++));
+                    Reply reply = BatchManager::handleBatch(request(BATCH, i, move(payload), mode == 2 ? FRAME_FLAG_ATOMIC : 0));
+                    if (reply.size() == 0) failures++;
+                }
+            }
+            double seconds = elapsedMicros(start) / 1e6;
+            double rate = records / seconds;
+            if (mode == 0) baseline = rate;
+            const char* labels[] = { "one per request", "BATCH", "BATCH atomic" };
+            cout << setw(20) << labels[mode] << fixed << setprecision(0) << setw(16) << rate << setprecision(1)
+                << setw(20) << seconds * 1e6 / requests << rate / baseline << "x\n";
+            if (failures > 0) cout << "  " << failures << " requests failed\n";
+        }
+        int stored = FileHandler::countLines("unstitched_dresses.txt");
+        if (stored != nextId - 1) cout << "  expected " << nextId - 1 << " dresses, found " << stored << "\n";
+        FileHandler::configureDurability(DurabilityMode::SYNC, 0);
+        fs::current_path(original);
+        fs::remove_all(scratch);
+    }
+
+    // Photo-like test image: smooth gradients and soft shapes with sensor noise on top, so
+    // neither the resampler nor the codec sees a trivially regular input
+    static Image syntheticPhoto(int width, int height, uint32_t seed) {
+        mt19937 rng(seed);
+        Image image;
+        image.width = width;
+        image.height = height;
+        image.pixels.resize(static_cast<size_t>(width) * height * 4);
+        float cx = static_cast<float>(rng() % width), cy = static_cast<float>(rng() % height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                uint8_t* pixel = &image.pixels[(static_cast<size_t>(y) * width + x) * 4];
+                float distance = sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy)) / width;
+                int noise = static_cast<int>(rng() % 17) - 8;
+                pixel[0] = static_cast<uint8_t>(max(0, min(255, 255 * x / width + noise)));
+                pixel[1] = static_cast<uint8_t>(max(0, min(255, 255 * y / height + noise)));
+                pixel[2] = static_cast<uint8_t>(max(0, min(255, static_cast<int>(255 * (1.0f - distance)) + noise)));
+                pixel[3] = 255;
+            }
+        }
+        return image;
+    }
+
+    // The work ThumbnailPipeline does per image: decode the upload, then resize and encode
+    // every thumbnail size. Reported per core, once for each resampling path on one thread,
+    // then with the best path on every core.
+    static void thumbnails(int images, int width, int height) {
+        vector<string> uploads;
+        for (int i = 0; i < 4; i++) uploads.push_back(encodeBmp(syntheticPhoto(width, height, 15 + i)));
+        cout << images << " images of " << width << "x" << height << " (" << uploads[0].size() / (1024 * 1024) << " MB BMP), thumbnails";
+        for (int size : THUMBNAIL_SIZES) cout << " " << size;
+        cout << "\nBest path on this CPU: " << resizePathName(resizeBestPath()) << "\n";
+
+        vector<ResizePath> paths = { ResizePath::SCALAR };
+        if (resizePathSupported(ResizePath::SSE2)) paths.push_back(ResizePath::SSE2);
+        if (resizePathSupported(ResizePath::AVX2)) paths.push_back(ResizePath::AVX2);
+        // Every path must produce the same pixels as the scalar one, to within rounding
+        Image reference;
+        string error;
+        decodeImage(uploads[0].data(), uploads[0].size(), reference, error);
+        Image expected = resizeImage(reference, 512, 512 * height / width, ResizePath::SCALAR);
+        for (ResizePath path : paths) {
+            Image resized = resizeImage(reference, 512, 512 * height / width, path);
+            for (size_t i = 0; i < resized.pixels.size(); i++) {
+                if (abs(resized.pixels[i] - expected.pixels[i]) > 1) {
+                    cout << resizePathName(path) << " differs from scalar at byte " << i << "\n";
+                    return;
+                }
+            }
+        }
+
+        double decodeMicros = 0, resizeMicros = 0;
+        size_t thumbnailBytes = 0;
+        auto process = [&](int index, ResizePath path, bool timeSteps) {
+            const string& upload = uploads[index % uploads.size()];
+            auto start = Clock::now();
+            Image image;
+            string decodeError;
+            decodeImage(upload.data(), upload.size(), image, decodeError);
+            if (timeSteps) decodeMicros += elapsedMicros(start);
+            size_t bytes = 0;
+            for (const string& thumbnail : ThumbnailPipeline::render(image, path)) bytes += thumbnail.size();
+            if (timeSteps) resizeMicros += elapsedMicros(start);
+            return bytes;
+        };
+        cout << left << setw(12) << "path" << setw(10) << "threads" << setw(14) << "decode (ms)" << setw(22) << "resize+encode (ms)"
+            << setw(16) << "images/sec" << "images/sec/core\n";
+        for (ResizePath path : paths) {
+            decodeMicros = resizeMicros = 0;
+            auto start = Clock::now();
+            for (int i = 0; i < images; i++) thumbnailBytes += process(i, path, true);
+            double seconds = elapsedMicros(start) / 1e6;
+            cout << setw(12) << resizePathName(path) << setw(10) << 1 << fixed << setprecision(2) << setw(14) << decodeMicros / images / 1000
+                << setw(22) << (resizeMicros - decodeMicros) / images / 1000 << setprecision(1) << setw(16) << images / seconds << images / seconds << "\n";
+        }
+
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        atomic<int> next(0);
+        vector<thread> workers;
+        auto start = Clock::now();
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&]() {
+                for (int i = next++; i < images * static_cast<int>(threads); i = next++) process(i, resizeBestPath(), false);
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        double seconds = elapsedMicros(start) / 1e6;
+        double rate = images * threads / seconds;
+        cout << setw(12) << resizePathName(resizeBestPath()) << setw(10) << threads << setw(14) << "-" << setw(22) << "-"
+            << setw(16) << rate << rate / threads << "\n";
+        if (thumbnailBytes == 0) cout << "no thumbnails produced\n";
+    }
+};
+
+int main(int argc, char* argv[]) {
+#ifndef _WIN32
+    // A client that resets mid-reply must fail that send, not end the server. sendfile() has
+    // no MSG_NOSIGNAL, so this covers every backend and every send path.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    if (argc >= 3 && string(argv[1]) == "--bench") {
+        string name = argv[2];
+        if (name == "store") {
+            vector<int> sizes;
+            for (int i = 3; i < argc; i++) sizes.push_back(stoi(argv[i]));
+            if (sizes.empty()) sizes = { 10000, 100000, 1000000 };
+            Benchmarks::recordStore(sizes);
+            return 0;
+        }
+        if (name == "locks") {
+            unsigned maxThreads = argc >= 4 ? static_cast<unsigned>(stoul(argv[3])) : max(1u, thread::hardware_concurrency()) * 2;
+            Benchmarks::lockContention(maxThreads);
+            return 0;
+        }
+        if (name == "wal") {
+            unsigned clients = argc >= 4 ? static_cast<unsigned>(stoul(argv[3])) : 16;
+            int orders = argc >= 5 ? stoi(argv[4]) : 500;
+            int groupMillis = argc >= 6 ? stoi(argv[5]) : 0;
+            Benchmarks::durability(clients, orders, groupMillis);
+            return 0;
+        }
+        if (name == "catalog") {
+            Benchmarks::catalogFormat(argc >= 4 ? stoi(argv[3]) : 1000000);
+            return 0;
+        }
+        if (name == "dedupe") {
+            Benchmarks::imageDedupe(argc >= 4 ? stoi(argv[3]) : 400, argc >= 5 ? stoi(argv[4]) : 100);
+            return 0;
+        }
+        if (name == "metrics") {
+            Benchmarks::metricsOverhead(argc >= 4 ? static_cast<unsigned>(stoul(argv[3])) : max(1u, thread::hardware_concurrency()));
+            return 0;
+        }
+        if (name == "logging") {
+            Benchmarks::logging(argc >= 4 ? static_cast<unsigned>(stoul(argv[3])) : max(1u, thread::hardware_concurrency()),
+                argc >= 5 ? stoi(argv[4]) : 200);
+            return 0;
+        }
+        if (name == "batch") {
+            Benchmarks::batchInserts(argc >= 4 ? stoi(argv[3]) : 20000, argc >= 5 ? stoi(argv[4]) : 500);
+            return 0;
+        }
+        if (name == "thumbnails") {
+            Benchmarks::thumbnails(argc >= 4 ? stoi(argv[3]) : 20, argc >= 5 ? stoi(argv[4]) : 3000, argc >= 6 ? stoi(argv[5]) : 2000);
+            return 0;
+        }
+        if (name == "filter") {
+            Benchmarks::dressFilter(argc >= 4 ? stoi(argv[3]) : 1000000);
+            return 0;
+        }
+        if (name == "textsearch") {
+            Benchmarks::textSearch(argc >= 4 ? stoi(argv[3]) : 1000000);
+            return 0;
+        }
+        if (name == "report") {
+            Benchmarks::salesReport(argc >= 4 ? stoi(argv[3]) : 1000000);
+            return 0;
+        }
+        if (name == "base64") {
+            Benchmarks::base64Codec();
+            return 0;
+        }
+        if (name == "view") {
+            vector<int> sizes;
+            for (int i = 3; i < argc; i++) sizes.push_back(stoi(argv[i]));
+            if (sizes.empty()) sizes = { 100000, 1000000 };
+            Benchmarks::viewReplies(sizes);
+            return 0;
+        }
+        cerr << "Unknown benchmark: " << name << endl;
+        return 1;
+    }
+    if (argc == 5 && string(argv[1]) == "--convert-catalog") {
+        string direction = argv[2], error;
+        bool ok = false;
+        if (direction == "to-binary") {
+            ok = CatalogFormat::textToBinary(argv[3], argv[4], error);
+        }
+        else if (direction == "to-text") {
+            CatalogView view;
+            ok = view.open(argv[3], error) && view.toText(argv[4], error);
+        }
+        else {
+            error = "expected to-binary or to-text";
+        }
+        if (!ok) {
+            cerr << "Catalog conversion failed: " << error << endl;
+            return 1;
+        }
+        cout << "Wrote " << argv[4] << endl;
+        return 0;
+    }
+    string backend = "threads";
+    unsigned ioThreads = max(1u, min(4u, thread::hardware_concurrency()));
+    unsigned workerThreads = max(1u, thread::hardware_concurrency());
+    DurabilityMode durability = DurabilityMode::GROUP;
+    int groupMillis = 0;
+    int adminPort = DEFAULT_ADMIN_PORT;
+    LogLevel logLevel = LOG_INFO;
+    uint64_t logSample = 1;
+#ifdef __linux__
+    backend = "epoll";
+#endif
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--backend" && i + 1 < argc) {
+            backend = argv[++i];
+        }
+        else if (arg == "--io-threads" && i + 1 < argc) {
+            ioThreads = static_cast<unsigned>(stoul(argv[++i]));
+        }
+        else if (arg == "--workers" && i + 1 < argc) {
+            workerThreads = static_cast<unsigned>(stoul(argv[++i]));
+        }
+        else if (arg == "--durability" && i + 1 < argc) {
+            if (!WriteAheadLog::parseMode(argv[++i], durability)) {
+                cerr << "Unknown durability mode " << argv[i] << " (expected sync, group or async)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--group-commit-ms" && i + 1 < argc) {
+            groupMillis = stoi(argv[++i]);
+        }
+        else if (arg == "--image-cache-mb" && i + 1 < argc) {
+            ImageCache::configure(static_cast<size_t>(stoull(argv[++i])) * 1024 * 1024);
+        }
+        else if (arg == "--thumbnail-threads" && i + 1 < argc) {
+            ThumbnailPipeline::configure(static_cast<unsigned>(stoul(argv[++i])));
+        }
+        else if (arg == "--admin-port" && i + 1 < argc) {
+            adminPort = stoi(argv[++i]);
+        }
+        else if (arg == "--log-level" && i + 1 < argc) {
+            if (!Logger::parseLevel(argv[++i], logLevel)) {
+                cerr << "Unknown log level " << argv[i] << " (expected debug, info, warn, error or off)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--log-sample" && i + 1 < argc) {
+            logSample = stoull(argv[++i]);
+        }
+        else if (arg == "--log-file" && i + 1 < argc) {
+            if (!Logger::openFile(argv[++i])) {
+                cerr << "Cannot open log file " << argv[i] << endl;
+                return 1;
+            }
+        }
+    }
+    Logger::configure(logLevel, logSample);
+    FileHandler::configureDurability(durability, groupMillis);
+    AdminServer admin;
+    if (adminPort > 0 && !admin.start(adminPort)) {
+        cerr << "Admin port " << adminPort << " unavailable; metrics only through STATS" << endl;
+    }
+    try {
+#ifdef __linux__
+        if (backend == "epoll") {
+            EpollServer server(ioThreads, workerThreads);
+            server.start();
+            return 0;
+        }
+#endif
+        TCPServer server(workerThreads);
         server.start();
     }
     catch (const exception& e) {